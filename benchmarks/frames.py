@@ -0,0 +1,114 @@
+"""Benchmark of the received frames decoding and handling.
+
+Frames of a broadcast OTA to a fleet, statuses and cumulative chunk acks,
+are handled one at a time like the gateway used to hand them over, then
+queued to the frame dispatcher that hands them over in batches.
+
+    python benchmarks/frames.py --devices 100 --frames 50000
+"""
+
+import argparse
+import time
+from unittest.mock import patch
+
+from dotbot_utils.protocol import Packet
+from marilib.mari_protocol import Header
+
+from swarmit.testbed.adapter import FrameDispatcher
+from swarmit.testbed.controller import (
+    Chunk,
+    Controller,
+    ControllerSettings,
+    OtaSession,
+    TransferDataStatus,
+)
+from swarmit.testbed.protocol import (
+    PayloadOTAChunksAck,
+    PayloadStatus,
+    StatusType,
+)
+from swarmit.tests.utils import MarilibSerialAdapterMock
+
+CHUNK_COUNT = 1024  # chunks of a 192kB image
+
+
+def _frames(devices: int, count: int) -> list[tuple[Header, bytes]]:
+    """Return count frames, a status every 8 cumulative acks per device."""
+    frames = []
+    for index in range(count):
+        address = index % devices + 1
+        round_ = index // devices
+        if round_ % 9 == 8:
+            payload = PayloadStatus(
+                status=StatusType.Programming, battery=2900
+            )
+        else:
+            base = min(round_ * 8, CHUNK_COUNT)
+            payload = PayloadOTAChunksAck(
+                base=base, count=1, bitmap=bytes([0xFF])
+            )
+        frames.append(
+            (
+                Header(source=address),
+                Packet.from_payload(payload).to_bytes(),
+            )
+        )
+    return frames
+
+
+def _controller(devices: int) -> Controller:
+    with patch(
+        "swarmit.testbed.adapter.MarilibSerialAdapter",
+        MarilibSerialAdapterMock,
+    ):
+        controller = Controller(ControllerSettings(adapter_wait_timeout=0))
+    addrs = [f"{address:08X}" for address in range(1, devices + 1)]
+    session = OtaSession(id=1, devices=addrs, broadcast=True)
+    session.transfer_data = {
+        addr: TransferDataStatus(
+            chunks=[Chunk(index=f"{i:03d}") for i in range(CHUNK_COUNT)]
+        )
+        for addr in addrs
+    }
+    controller.ota_sessions[session.id] = session
+    return controller
+
+
+def _run(name: str, devices: int, frames: list, handle):
+    controller = _controller(devices)
+    start = time.perf_counter()
+    handle(controller, frames)
+    elapsed = time.perf_counter() - start
+    controller.terminate()
+    print(
+        f"{name:<10} {len(frames) / elapsed:>10.0f} frames/s "
+        f"({elapsed * 1000:.0f} ms)"
+    )
+
+
+def _one_at_a_time(controller: Controller, frames: list):
+    for header, payload in frames:
+        controller.on_frames_received([(header, Packet.from_bytes(payload))])
+
+
+def _batched(controller: Controller, frames: list):
+    dispatcher = FrameDispatcher(controller.on_frames_received)
+    for header, payload in frames:
+        dispatcher.put(header, payload)
+    dispatcher.flush()
+    dispatcher.close()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--devices", type=int, default=100)
+    parser.add_argument("--frames", type=int, default=50000)
+    args = parser.parse_args()
+    frames = _frames(args.devices, args.frames)
+    print(f"{args.frames} frames from {args.devices} devices")
+    _run("per frame", args.devices, frames, _one_at_a_time)
+    _run("batched", args.devices, frames, _batched)
+
+
+if __name__ == "__main__":
+    main()
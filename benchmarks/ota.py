@@ -0,0 +1,348 @@
+"""Benchmark of the OTA transfers over a simulated Mari network.
+
+The simulated gateway replaces the Mari adapter of the controller. Time is
+divided in slots, each slotframe starts with the downlink slots of the
+gateway, followed by one uplink slot per device. The gateway sends one frame
+per downlink slot, a device sends one frame per slotframe. Each link loses
+frames at its own rate, uplink frames reach the controller after the gateway
+latency. The devices are the simulated nodes of the tests.
+
+    python benchmarks/ota.py --devices 1,10,50 --loss 0.05 --fec-group 16
+"""
+
+import argparse
+import collections
+import dataclasses
+import heapq
+import itertools
+import math
+import random
+import threading
+import time
+from unittest.mock import patch
+
+from dotbot_utils.protocol import Packet, Payload
+from marilib.mari_protocol import MARI_BROADCAST_ADDRESS, Frame, Header
+from marilib.model import EdgeEvent
+from marilib.protocol import PacketType
+
+from swarmit.testbed.adapter import FrameDispatcher, GatewayAdapterBase
+from swarmit.testbed.controller import (
+    OTA_ACK_INTERVAL_DEFAULT,
+    OTA_ACK_TIMEOUT_DEFAULT,
+    OTA_WINDOW_SIZE_DEFAULT,
+    STATUS_HEARTBEAT,
+    Controller,
+    ControllerSettings,
+)
+from swarmit.testbed.protocol import PayloadType
+from swarmit.tests.utils import SwarmitNode
+
+
+@dataclasses.dataclass
+class RadioModel:
+    """Timing and losses of the simulated network."""
+
+    slot_duration: float = 0.001  # s
+    downlink_slots: int = 10  # per slotframe
+    loss: float = 0.0  # average frame loss rate of a link
+    latency: float = 0.005  # s, from the gateway to the controller
+    seed: int = 1
+
+
+@dataclasses.dataclass
+class RadioStats:
+    """Frames carried by the simulated network."""
+
+    downlink_frames: int = 0
+    uplink_frames: int = 0
+    lost_frames: int = 0
+    chunk_frames: int = 0
+    chunk_retries: int = 0
+
+
+class SimulatedGateway(GatewayAdapterBase):
+    """Gateway sending and receiving in the TDMA slots of the devices."""
+
+    def __init__(self, radio: RadioModel, addresses: list[int]):
+        self.radio = radio
+        self.stats = RadioStats()
+        self._random = random.Random(radio.seed)
+        # Each link loses frames at a rate between 0 and twice the average
+        self._loss = {
+            address: min(1.0, self._random.uniform(0, 2 * radio.loss))
+            for address in addresses
+        }
+        self._uplink_slot = {
+            address: radio.downlink_slots + index
+            for index, address in enumerate(addresses)
+        }
+        self._slotframe = (
+            radio.downlink_slots + len(addresses)
+        ) * radio.slot_duration
+        self._start = time.time()
+        self._downlink_slot = 0  # next free downlink slot
+        self._chunks_sent = set()
+        self._uplink = {address: collections.deque() for address in addresses}
+        self._uplink_at = {}  # address -> time of its next uplink slot
+        self._uplink_used = {}  # address -> time of its latest uplink
+        self._deliveries = []  # (time, order, header, payload)
+        self._order = itertools.count()
+        self._lock = threading.Condition()
+        self._stop_event = threading.Event()
+        self.nodes: dict[int, SwarmitNode] = {}
+        self._thread = threading.Thread(target=self._uplink_loop, daemon=True)
+
+    def init(self, on_frames_received: callable):
+        self.dispatcher = FrameDispatcher(on_frames_received)
+        self._thread.start()
+
+    def close(self):
+        self._stop_event.set()
+        with self._lock:
+            self._lock.notify_all()
+        self._thread.join()
+        for node in self.nodes.values():
+            node.stop()
+        self.dispatcher.close()
+
+    def _slot_time(self, slotframe: int, slot: int) -> float:
+        return (
+            self._start
+            + slotframe * self._slotframe
+            + slot * self.radio.slot_duration
+        )
+
+    def _lost(self, address: int) -> bool:
+        return self._random.random() < self._loss[address]
+
+    def send_payload(self, destination: int, payload: Payload):
+        """Send the frame in the next downlink slot, waiting for it."""
+        slotframe, slot = divmod(
+            self._downlink_slot, self.radio.downlink_slots
+        )
+        at = self._slot_time(slotframe, slot)
+        now = time.time()
+        if at < now:
+            # The slot passed while the gateway was idle, the next downlink
+            # slot from now
+            slotframe, elapsed = divmod(now - self._start, self._slotframe)
+            slotframe = int(slotframe)
+            slot = math.ceil(elapsed / self.radio.slot_duration)
+            if slot >= self.radio.downlink_slots:
+                slotframe, slot = slotframe + 1, 0
+            at = self._slot_time(slotframe, slot)
+        self._downlink_slot = (
+            slotframe * self.radio.downlink_slots + slot + 1
+        )
+        time.sleep(max(0, at - time.time()))
+        data = Packet.from_payload(payload).to_bytes()
+        self.stats.downlink_frames += 1
+        if data[0] == PayloadType.SWARMIT_OTA_CHUNK:
+            self.stats.chunk_frames += 1
+            key = (destination, payload.session, payload.index)
+            if key in self._chunks_sent:
+                self.stats.chunk_retries += 1
+            self._chunks_sent.add(key)
+        frame = Frame(
+            header=Header(
+                destination=destination, source=0, type_=PacketType.DATA
+            ),
+            payload=data,
+        )
+        for address, node in self.nodes.items():
+            if destination not in (address, MARI_BROADCAST_ADDRESS):
+                continue
+            if self._lost(address):
+                self.stats.lost_frames += 1
+                continue
+            node.handle_frame(frame)
+
+    def handle_data_received(self, data: bytes):
+        """Queue a frame sent by a node until its uplink slot."""
+        if data[0] != EdgeEvent.NODE_DATA:
+            return
+        frame = Frame().from_bytes(data[1:])
+        address = frame.header.source
+        with self._lock:
+            if not self._uplink[address]:
+                self._uplink_at[address] = self._next_uplink(
+                    address,
+                    max(time.time(), self._uplink_used.get(address, 0)),
+                )
+            self._uplink[address].append(frame)
+            self._lock.notify_all()
+
+    def _next_uplink(self, address: int, after: float) -> float:
+        """Return the time of the first uplink slot of a device after."""
+        slotframe = int((after - self._start) // self._slotframe)
+        at = self._slot_time(slotframe, self._uplink_slot[address])
+        if at <= after:
+            at = self._slot_time(slotframe + 1, self._uplink_slot[address])
+        return at
+
+    def _uplink_loop(self):
+        while not self._stop_event.is_set():
+            with self._lock:
+                now = time.time()
+                due = [
+                    (self._uplink_at[address], address)
+                    for address, frames in self._uplink.items()
+                    if frames
+                ]
+                events = [at for at, _ in due]
+                if self._deliveries:
+                    events.append(self._deliveries[0][0])
+                if not events:
+                    self._lock.wait()
+                    continue
+                wake_at = min(events)
+                if wake_at > now:
+                    self._lock.wait(wake_at - now)
+                    continue
+                for at, address in due:
+                    if at > now:
+                        continue
+                    frame = self._uplink[address].popleft()
+                    self._uplink_used[address] = at
+                    if self._uplink[address]:
+                        self._uplink_at[address] = self._next_uplink(
+                            address, at
+                        )
+                    self.stats.uplink_frames += 1
+                    if self._lost(address):
+                        self.stats.lost_frames += 1
+                        continue
+                    heapq.heappush(
+                        self._deliveries,
+                        (
+                            at + self.radio.latency,
+                            next(self._order),
+                            frame.header,
+                            frame.payload,
+                        ),
+                    )
+                while self._deliveries and self._deliveries[0][0] <= now:
+                    _, _, header, payload = heapq.heappop(self._deliveries)
+                    self.dispatcher.put(header, payload)
+
+
+@dataclasses.dataclass
+class BenchmarkResult:
+    """Results of one OTA transfer."""
+
+    devices: int
+    success: int
+    image_size: int
+    duration: float  # s, from the OTA start to the end of the transfer
+    stats: RadioStats
+    airtime: float  # s
+
+
+def run(
+    devices: int,
+    radio: RadioModel,
+    settings: ControllerSettings,
+    image_size: int,
+    unicast: bool = False,
+) -> BenchmarkResult:
+    """Start an OTA of a random image to the devices and transfer it."""
+    addresses = list(range(1, devices + 1))
+    gateway = SimulatedGateway(radio, addresses)
+    settings = dataclasses.replace(
+        settings,
+        devices=[f"{address:08X}" for address in addresses] if unicast else [],
+    )
+    with (
+        patch(
+            "swarmit.testbed.controller.MarilibEdgeAdapter",
+            lambda *args, **kwargs: gateway,
+        ),
+        # statuses of all the devices are received within a slotframe
+        patch(
+            "swarmit.testbed.controller.COMMAND_TIMEOUT",
+            3 * gateway._slotframe + radio.latency,
+        ),
+    ):
+        controller = Controller(settings)
+        for address in addresses:
+            gateway.nodes[address] = SwarmitNode(
+                adapter=gateway,
+                address=address,
+                update_interval=STATUS_HEARTBEAT,
+                cumulative_ack=True,
+            )
+        image = random.Random(radio.seed).randbytes(image_size)
+        start = time.time()
+        ota_data = controller.start_ota(image)
+        result = controller.transfer(image, ota_data["acked"])
+        duration = time.time() - start
+    controller.terminate()
+    stats = gateway.stats
+    return BenchmarkResult(
+        devices=devices,
+        success=sum(status.success for status in result.values()),
+        image_size=image_size,
+        duration=duration,
+        stats=stats,
+        airtime=(stats.downlink_frames + stats.uplink_frames)
+        * radio.slot_duration,
+    )
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--devices", default="1,10,50", help="comma separated fleet sizes"
+    )
+    parser.add_argument("--image-size", type=int, default=16384)
+    parser.add_argument("--unicast", action="store_true")
+    parser.add_argument("--slot-ms", type=float, default=1.0)
+    parser.add_argument("--downlink-slots", type=int, default=10)
+    parser.add_argument("--loss", type=float, default=0.0)
+    parser.add_argument("--latency-ms", type=float, default=5.0)
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--chunk-size", type=int, default=192)
+    parser.add_argument(
+        "--window-size", type=int, default=OTA_WINDOW_SIZE_DEFAULT
+    )
+    parser.add_argument(
+        "--ack-interval", type=int, default=OTA_ACK_INTERVAL_DEFAULT
+    )
+    parser.add_argument(
+        "--ota-timeout", type=float, default=OTA_ACK_TIMEOUT_DEFAULT
+    )
+    parser.add_argument("--fec-group", type=int, default=0)
+    args = parser.parse_args()
+    radio = RadioModel(
+        slot_duration=args.slot_ms / 1000,
+        downlink_slots=args.downlink_slots,
+        loss=args.loss,
+        latency=args.latency_ms / 1000,
+        seed=args.seed,
+    )
+    settings = ControllerSettings(
+        adapter_wait_timeout=0,
+        ota_chunk_size=args.chunk_size,
+        ota_window_size=args.window_size,
+        ota_ack_interval=args.ack_interval,
+        ota_timeout=args.ota_timeout,
+        ota_fec_group=args.fec_group,
+    )
+    print(
+        f"{'devices':>7} {'ok':>4} {'B/s':>8} {'retries':>7} "
+        f"{'lost':>6} {'airtime':>8} {'wall':>7}"
+    )
+    for devices in [int(value) for value in args.devices.split(",")]:
+        result = run(devices, radio, settings, args.image_size, args.unicast)
+        print(
+            f"{result.devices:>7} {result.success:>4} "
+            f"{result.image_size / result.duration:>8.0f} "
+            f"{result.stats.chunk_retries:>7} "
+            f"{result.stats.lost_frames:>6} "
+            f"{result.airtime:>7.2f}s {result.duration:>6.2f}s"
+        )
+
+
+if __name__ == "__main__":
+    main()
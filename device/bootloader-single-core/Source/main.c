@@ -14,8 +14,12 @@
 #include <nrf.h>
 
 #include "battery.h"
+#include "crc32.h"
+#include "event.h"
 #include "nvmc.h"
+#include "ota.h"
 #include "protocol.h"
+#include "status.h"
 #include "mari.h"
 
 // DotBot-firmware includes
@@ -33,45 +37,69 @@
 #include "mari.h"
 
 
-#define SWARMIT_BASE_ADDRESS        (0x10000)
-#define SWRMT_OTA_SHA256_LENGTH     (32U)
+#define SWARMIT_CONFIG_ADDRESS      (0x100000 - FLASH_PAGE_SIZE)    ///< Last flash page, keeps the network config
+#define SWARMIT_CONFIG_MAGIC_VALUE  (0x5753524D) // "SWRM"
+#define OTA_CHUNK_QUEUE_SIZE        (8U)    ///< Maximum number of OTA chunks received but not yet written to flash
+#define BOOTLOADER_REQ_QUEUE_SIZE   (4U)    ///< Maximum number of gateway requests pending
 
 #define BATTERY_UPDATE_DELAY        (1000U)
+#define IDLE_UPDATE_DELAY_MS        (10000U) ///< Battery update period in idle mode
 #define POSITION_UPDATE_DELAY_MS    (500U) ///< 100ms delay between each position update
 
+#define OTA_ACK_FLUSH_DELAY_MS      (100U) ///< Maximum delay before acknowledging the chunks received
+
 #define NETCORE_MAIN_TIMER          (0)
+#define SCHEDULE_CHANNEL            (1)     ///< Timer channel polling the ASN of a scheduled start or stop
+#define SCHEDULE_CHECK_PERIOD_US    (100U)  ///< Period at which the ASN of a scheduled start or stop is checked during its last slot
+#define SCHEDULE_SLOT_MIN_US        (1000U)  ///< Lower bound of the Mari slot duration, the wake up before a scheduled ASN is never late
+#define SCHEDULE_SLOTS_MAX          (1000000U)  ///< Slots waited at most at once, the delay fits the timer
+#define STATUS_CHECK_PERIOD_US      (250000UL)  ///< Period at which status changes are looked for
+#define IDLE_CHECK_PERIOD_US        (1000000UL)    ///< Period at which status changes are looked for in idle mode
 
 // Important: select a Network ID according to the specific deployment you are making,
 // see the registry at https://crystalfree.atlassian.net/wiki/spaces/Mari/pages/3324903426/Registry+of+Mari+Network+IDs
 #define SWARMIT_MARI_NET_ID         (0x12AA)
+#define SWARMIT_DEFAULT_SCHEDULE_ID (SWRMT_SCHEDULE_HUGE)
+
+typedef enum {
+    BOOTLOADER_EVENT_REQUEST,               ///< Request or metrics probe received from the gateway, events are listed by decreasing priority
+    BOOTLOADER_EVENT_OTA_START,             ///< OTA start request accepted
+    BOOTLOADER_EVENT_OTA_MANIFEST,          ///< Page manifest received
+    BOOTLOADER_EVENT_OTA_CHUNK,             ///< OTA chunks queued by the radio callback
+    BOOTLOADER_EVENT_OTA_FINALIZE,          ///< OTA finalize request received
+    BOOTLOADER_EVENT_OTA_ACK_FLUSH,         ///< Pending OTA ack delay elapsed
+    BOOTLOADER_EVENT_STATUS,                ///< Status check period elapsed or status requested
+    BOOTLOADER_EVENT_LOG,                   ///< Log data to notify
+    BOOTLOADER_EVENT_BATTERY_UPDATE,        ///< Battery sampling period elapsed
+    BOOTLOADER_EVENT_OTA_INSTALL,           ///< Verified image to copy to the active slot, one page at a time
+    BOOTLOADER_EVENT_FLASH_ERASE,           ///< Pages of the download slot to erase ahead of the chunks, one slice at a time
+    BOOTLOADER_EVENT_COUNT,
+} bootloader_event_t;
 
 typedef struct {
     uint8_t         notification_buffer[255];
-    uint32_t        base_addr;
-    bool            ota_start_request;
-    bool            ota_require_erase;
-    bool            ota_chunk_request;
     bool            start_application;
-    bool            battery_update;
-    bool            req_received;
-    bool            log_received;
-    bool            send_status;
-    uint8_t         req_buffer[255];
-    crypto_sha256_ctx_t sha256_ctx;
-    uint8_t         expected_hash[SWRMT_OTA_SHA256_LENGTH];
-    uint8_t         computed_hash[SWRMT_OTA_SHA256_LENGTH];
+    uint8_t         req_buffers[BOOTLOADER_REQ_QUEUE_SIZE][UINT8_MAX];  ///< Requests received from the gateway, one per BOOTLOADER_EVENT_REQUEST
+    uint32_t        req_head;                   ///< Number of requests received, only written by the radio callback
+    uint32_t        req_tail;                   ///< Number of requests handled, only written by the main loop
     uint64_t        device_id;
-    int32_t         last_chunk_acked;
     uint32_t        metrics_rx_counter;
     uint32_t        metrics_tx_counter;
-    bool            metrics_received;
+    uint32_t        last_tx_time;               ///< Time of the latest frame sent to the gateway
+    uint8_t         schedule_id;                ///< Index of the Mari schedule in _schedules
+    uint32_t        groups;                     ///< Bitmap of the groups this device belongs to
+    swrmt_image_pkt_t image;                    ///< Image in the active slot, answered to the image requests
+    uint64_t        scheduled_asn;              ///< ASN of the latest scheduled start or stop
+    uint8_t         scheduled_type;             ///< SWRMT_MSG_START or SWRMT_MSG_STOP
+    volatile bool   scheduled_pending;          ///< The scheduled start or stop waits for its ASN
 } bootloader_app_data_t;
 
-/// DotBot protocol LH2 computed location
-typedef struct __attribute__((packed)) {
-    uint32_t x;  ///< X coordinate in mm
-    uint32_t y;  ///< Y coordinate in mm
-} position_2d_t;
+typedef struct {
+    uint32_t magic;         // to detect if config is valid
+    uint32_t net_id;        // Mari network ID, not configurable yet
+    uint32_t schedule_id;   // Mari schedule, one of swrmt_schedule_id_t
+    uint32_t groups;        // Bitmap of the device groups
+} swarmit_config_t;
 
 typedef struct __attribute__((packed)) {
     uint8_t length;             ///< Length of the pdu in bytes
@@ -83,13 +111,14 @@ typedef struct __attribute__((packed)) {
     uint8_t data[INT8_MAX];
 } log_data_t;
 
-typedef struct __attribute__((packed)) {
-    uint32_t image_size;
-    uint32_t chunk_count;
-    uint32_t chunk_index;
-    uint32_t chunk_size;
-    int32_t  last_chunk_acked;
-    uint8_t chunk[INT8_MAX + 1];
+typedef struct {
+    ota_params_t params;                                ///< Parameters of the latest OTA start
+    uint8_t  session;                                   ///< OTA session of the latest OTA start, 0 before the first one
+    uint32_t chunk_head;                                ///< Number of chunks queued, only written from the radio callback
+    uint32_t chunk_tail;                                ///< Number of chunks processed, only written from the main loop
+    swrmt_ota_chunk_pkt_t chunks[OTA_CHUNK_QUEUE_SIZE]; ///< Chunks waiting to be written to flash
+    uint8_t  image_sha[SWRMT_OTA_SHA256_LENGTH];        ///< SHA256 of the complete image, given at finalize
+    swrmt_ota_manifest_pkt_t manifest;                  ///< Page CRCs of the image, given before the chunks
 } ota_data_t;
 
 typedef struct {
@@ -106,8 +135,43 @@ static const gpio_t _status_led = { .port = 1, .pin = 5 };  // TODO: use board s
 
 static bootloader_app_data_t _bootloader_vars = { 0 };
 static swarmit_data_t _swarmit_vars = { 0 };
+
+static void _handle_request(void);
+static void _handle_ota_start(void);
+static void _handle_ota_manifest(void);
+static void _handle_ota_chunk(void);
+static void _handle_ota_finalize(void);
+static void _handle_ota_ack_flush(void);
+static void _handle_status(void);
+static void _handle_log(void);
+static void _handle_battery_update(void);
+static void _handle_ota_install(void);
+static void _handle_flash_erase(void);
+
+static event_t _events[BOOTLOADER_EVENT_COUNT] = {
+    [BOOTLOADER_EVENT_REQUEST]              = { .handler = _handle_request },
+    [BOOTLOADER_EVENT_OTA_START]            = { .handler = _handle_ota_start },
+    [BOOTLOADER_EVENT_OTA_MANIFEST]         = { .handler = _handle_ota_manifest },
+    [BOOTLOADER_EVENT_OTA_CHUNK]            = { .handler = _handle_ota_chunk },
+    [BOOTLOADER_EVENT_OTA_FINALIZE]         = { .handler = _handle_ota_finalize },
+    [BOOTLOADER_EVENT_OTA_ACK_FLUSH]        = { .handler = _handle_ota_ack_flush },
+    [BOOTLOADER_EVENT_STATUS]               = { .handler = _handle_status },
+    [BOOTLOADER_EVENT_LOG]                  = { .handler = _handle_log },
+    [BOOTLOADER_EVENT_BATTERY_UPDATE]       = { .handler = _handle_battery_update },
+    [BOOTLOADER_EVENT_OTA_INSTALL]          = { .handler = _handle_ota_install },
+    [BOOTLOADER_EVENT_FLASH_ERASE]          = { .handler = _handle_flash_erase },
+};
 extern schedule_t schedule_minuscule, schedule_tiny, schedule_small, schedule_huge, schedule_only_beacons, schedule_only_beacons_optimized_scan;
 
+static schedule_t *const _schedules[SWRMT_SCHEDULE_COUNT] = {
+    [SWRMT_SCHEDULE_MINUSCULE]                      = &schedule_minuscule,
+    [SWRMT_SCHEDULE_TINY]                           = &schedule_tiny,
+    [SWRMT_SCHEDULE_SMALL]                          = &schedule_small,
+    [SWRMT_SCHEDULE_HUGE]                           = &schedule_huge,
+    [SWRMT_SCHEDULE_ONLY_BEACONS]                   = &schedule_only_beacons,
+    [SWRMT_SCHEDULE_ONLY_BEACONS_OPTIMIZED_SCAN]    = &schedule_only_beacons_optimized_scan,
+};
+
 typedef void (*reset_handler_t)(void);
 
 typedef struct {
@@ -131,25 +195,160 @@ static void setup_watchdog(void) {
     NRF_WDT->TASKS_START = WDT_TASKS_START_TASKS_START_Trigger << WDT_TASKS_START_TASKS_START_Pos;
 }
 
+static void _scheduled_run(void) {
+    // The status may have changed since the request, e.g. with an OTA started meanwhile
+    _bootloader_vars.scheduled_pending = false;
+    uint8_t status = _swarmit_vars.status;
+    if (_bootloader_vars.scheduled_type == SWRMT_MSG_START) {
+        if (status == SWRMT_APPLICATION_READY) {
+            NVIC_SystemReset();
+        }
+    } else if (status == SWRMT_APPLICATION_RUNNING || status == SWRMT_APPLICATION_PROGRAMMING) {
+        setup_watchdog();
+    }
+}
+
+static void _scheduled_check(void) {
+    // Runs in the timer interrupt, the slots start at the same time on all the devices of the network
+    if (!_bootloader_vars.scheduled_pending) {
+        return;
+    }
+    uint64_t asn = mr_mac_get_asn();
+    if (asn < _bootloader_vars.scheduled_asn) {
+        // The slots left are waited at their shortest duration, the timer fires a few times before the ASN, then
+        // polls its last slot
+        uint64_t slots = _bootloader_vars.scheduled_asn - asn - 1;
+        if (slots > SCHEDULE_SLOTS_MAX) {
+            slots = SCHEDULE_SLOTS_MAX;
+        }
+        uint32_t delay_us = slots ? (uint32_t)slots * SCHEDULE_SLOT_MIN_US : SCHEDULE_CHECK_PERIOD_US;
+        mr_timer_hf_set_oneshot_us(NETCORE_MAIN_TIMER, SCHEDULE_CHANNEL, delay_us, _scheduled_check);
+        return;
+    }
+    _scheduled_run();
+}
+
+static void _schedule(uint8_t type, const uint8_t *data) {
+    const swrmt_start_stop_pkt_t *pkt = (const swrmt_start_stop_pkt_t *)data;
+    // The gateway repeats the request until the ASN, it must only be run once
+    if (pkt->asn && pkt->asn == _bootloader_vars.scheduled_asn && type == _bootloader_vars.scheduled_type) {
+        return;
+    }
+    _bootloader_vars.scheduled_asn = pkt->asn;
+    _bootloader_vars.scheduled_type = type;
+    _bootloader_vars.scheduled_pending = true;
+    if (pkt->asn <= mr_mac_get_asn()) {
+        _scheduled_run();
+        return;
+    }
+    printf("%s scheduled at ASN %llu\n", type == SWRMT_MSG_START ? "Start" : "Stop", pkt->asn);
+    _scheduled_check();
+}
+
+static uint8_t _schedule_id(void) {
+    const swarmit_config_t *cfg = (const swarmit_config_t *)SWARMIT_CONFIG_ADDRESS;
+
+    if (cfg->magic != SWARMIT_CONFIG_MAGIC_VALUE || cfg->schedule_id >= SWRMT_SCHEDULE_COUNT) {
+        return SWARMIT_DEFAULT_SCHEDULE_ID;
+    }
+    return (uint8_t)cfg->schedule_id;
+}
+
+static uint32_t _groups(void) {
+    const swarmit_config_t *cfg = (const swarmit_config_t *)SWARMIT_CONFIG_ADDRESS;
+
+    if (cfg->magic != SWARMIT_CONFIG_MAGIC_VALUE || cfg->groups == UINT32_MAX) {
+        return 0;
+    }
+    return cfg->groups & ((1U << SWRMT_GROUP_COUNT) - 1);
+}
+
+static void _config_write(void) {
+    const swarmit_config_t config = {
+        .magic          = SWARMIT_CONFIG_MAGIC_VALUE,
+        .net_id         = SWARMIT_MARI_NET_ID,
+        .schedule_id    = _bootloader_vars.schedule_id,
+        .groups         = _bootloader_vars.groups,
+    };
+    nvmc_page_erase(SWARMIT_CONFIG_ADDRESS / FLASH_PAGE_SIZE);
+    nvmc_write((const uint32_t *)SWARMIT_CONFIG_ADDRESS, &config, sizeof(swarmit_config_t));
+}
+
 static void _read_battery(void) {
-    _bootloader_vars.battery_update = true;
+    event_post(&_events[BOOTLOADER_EVENT_BATTERY_UPDATE]);
 }
 
 static void _send_status(void) {
-    _bootloader_vars.send_status = true;
+    event_post(&_events[BOOTLOADER_EVENT_STATUS]);
+}
+
+static void _tx_payload(uint8_t *payload, uint8_t length) {
+    // Any frame received by the gateway shows the device is alive, it delays the next heartbeat
+    _bootloader_vars.last_tx_time = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+    mari_node_tx_payload(payload, length);
+}
+
+static void _flush_ota_ack(void) {
+    event_post(&_events[BOOTLOADER_EVENT_OTA_ACK_FLUSH]);
+}
+
+void ota_platform_send(const uint8_t *buffer, uint8_t length) {
+    // Like the other notifications, a frame sent while the device is not connected is lost, the controller
+    // sends its OTA requests and chunks again until they are acknowledged
+    _tx_payload((uint8_t *)buffer, length);
+}
+
+void ota_platform_hash(crypto_sha256_ctx_t *ctx, const uint8_t *data, uint32_t length) {
+    crypto_sha256_update(ctx, data, length);
+}
+
+void ota_platform_image(uint32_t size, const uint8_t *sha) {
+    _bootloader_vars.image.size = size;
+    memcpy(_bootloader_vars.image.sha, sha, SWRMT_OTA_SHA256_LENGTH);
 }
 
 static void _handle_packet(uint64_t dst_address, uint8_t *packet, uint8_t length) {
-    memcpy(_bootloader_vars.req_buffer, packet, length);
-    uint8_t *ptr = _bootloader_vars.req_buffer;
-    uint8_t packet_type = (uint8_t)*ptr++;
-    if ((packet_type >= SWRMT_MSG_STATUS) && (packet_type <= SWRMT_MSG_OTA_CHUNK)) {
-        _bootloader_vars.req_received = true;
+    uint8_t packet_type = length ? packet[0] : 0;
+    if (packet_type == SWRMT_MSG_GROUP) {
+        // Group packets are broadcast, the ones for a group of this device are handled as if they were unicast
+        const swrmt_group_pkt_t *group = (const swrmt_group_pkt_t *)&packet[1];
+        if (length < 1 + sizeof(swrmt_group_pkt_t) || group->length > length - 1 - sizeof(swrmt_group_pkt_t)) {
+            return;
+        }
+        if (group->group >= SWRMT_GROUP_COUNT || !(_bootloader_vars.groups & (1U << group->group))) {
+            return;
+        }
+        _handle_packet(_bootloader_vars.device_id, (uint8_t *)group->packet, group->length);
+        return;
+    }
+    if (packet_type == SWRMT_MSG_OTA_CHUNK) {
+        // Chunks are queued so that the next ones can be received while the previous ones are written to flash
+        if (_swarmit_vars.ota.chunk_head - _swarmit_vars.ota.chunk_tail >= OTA_CHUNK_QUEUE_SIZE || length - 1 > sizeof(swrmt_ota_chunk_pkt_t)) {
+            return;
+        }
+        // Chunks of another session are broadcast to other devices
+        if (length < 2 || ((const swrmt_ota_chunk_pkt_t *)&packet[1])->session != _swarmit_vars.ota.session) {
+            return;
+        }
+        memcpy(&_swarmit_vars.ota.chunks[_swarmit_vars.ota.chunk_head % OTA_CHUNK_QUEUE_SIZE], packet + 1, length - 1);
+        _swarmit_vars.ota.chunk_head++;
+        event_post(&_events[BOOTLOADER_EVENT_OTA_CHUNK]);
         return;
     }
 
-    if (length == sizeof(mr_metrics_payload_t) && packet_type == MARI_PAYLOAD_TYPE_METRICS_PROBE) {
-        _bootloader_vars.metrics_received = true;
+    bool is_request = ((packet_type >= SWRMT_MSG_STATUS) && (packet_type <= SWRMT_MSG_OTA_START)) || packet_type == SWRMT_MSG_OTA_FINALIZE || packet_type == SWRMT_MSG_OTA_MANIFEST || packet_type == SWRMT_MSG_IDLE || packet_type == SWRMT_MSG_SCHEDULE || packet_type == SWRMT_MSG_GROUP_SET || packet_type == SWRMT_MSG_IMAGE;
+    bool is_metrics = length == sizeof(mr_metrics_payload_t) && packet_type == MARI_PAYLOAD_TYPE_METRICS_PROBE;
+    if (is_request || is_metrics) {
+        // Drop the request while the pending ones are not handled, the gateway retries
+        if (_bootloader_vars.req_head - _bootloader_vars.req_tail >= BOOTLOADER_REQ_QUEUE_SIZE) {
+            return;
+        }
+        // Fields missing in the shorter requests of older gateways read as 0
+        uint8_t *buffer = _bootloader_vars.req_buffers[_bootloader_vars.req_head % BOOTLOADER_REQ_QUEUE_SIZE];
+        memcpy(buffer, packet, length);
+        memset(buffer + length, 0, UINT8_MAX - length);
+        _bootloader_vars.req_head++;
+        event_post(&_events[BOOTLOADER_EVENT_REQUEST]);
         return;
     }
 
@@ -173,6 +372,9 @@ static void mari_event_callback(mr_event_t event, mr_event_data_t event_data) {
         case MARI_CONNECTED: {
             uint64_t gateway_id = event_data.data.gateway_info.gateway_id;
             printf("Connected to gateway %016llX\n", gateway_id);
+            // The gateway may not know this device yet
+            status_request();
+            event_post(&_events[BOOTLOADER_EVENT_STATUS]);
             break;
         }
         case MARI_DISCONNECTED: {
@@ -188,6 +390,297 @@ static void mari_event_callback(mr_event_t event, mr_event_data_t event_data) {
     }
 }
 
+static void _handle_request(void) {
+    // Requests are handled in the order they were received, one per event
+    uint8_t *buffer = _bootloader_vars.req_buffers[_bootloader_vars.req_tail % BOOTLOADER_REQ_QUEUE_SIZE];
+    if (buffer[0] == MARI_PAYLOAD_TYPE_METRICS_PROBE) {
+        mr_metrics_payload_t *metrics_payload = (mr_metrics_payload_t *)buffer;
+        // update metrics probe
+        metrics_payload->node_rx_count        = ++_bootloader_vars.metrics_rx_counter;
+        metrics_payload->node_rx_asn          = mr_mac_get_asn();
+        metrics_payload->node_tx_count        = ++_bootloader_vars.metrics_tx_counter;
+        metrics_payload->node_tx_enqueued_asn = mr_mac_get_asn();
+        metrics_payload->rssi_at_node         = mr_radio_rssi();
+
+        // send metrics probe to gateway
+        _tx_payload((uint8_t *)metrics_payload, sizeof(mr_metrics_payload_t));
+        _bootloader_vars.req_tail++;
+        return;
+    }
+
+    swrmt_request_t *req = (swrmt_request_t *)buffer;
+    switch (req->type) {
+        case SWRMT_MSG_STATUS:
+            status_request();
+            event_post(&_events[BOOTLOADER_EVENT_STATUS]);
+            break;
+        case SWRMT_MSG_SCHEDULE:
+        {
+            const swrmt_schedule_pkt_t *pkt = (const swrmt_schedule_pkt_t *)req->data;
+            if (pkt->schedule_id >= SWRMT_SCHEDULE_COUNT) {
+                printf("Invalid schedule %u\n", pkt->schedule_id);
+                break;
+            }
+            if (_swarmit_vars.status != SWRMT_APPLICATION_READY && _swarmit_vars.status != SWRMT_APPLICATION_IDLE) {
+                break;
+            }
+            if (pkt->schedule_id == _bootloader_vars.schedule_id) {
+                break;
+            }
+            printf("Switching to schedule %u\n", pkt->schedule_id);
+            _bootloader_vars.schedule_id = pkt->schedule_id;
+            _config_write();
+            // The node joins again once the gateway uses the same schedule
+            mari_init(MARI_NODE, SWARMIT_MARI_NET_ID, _schedules[_bootloader_vars.schedule_id], &mari_event_callback);
+        } break;
+        case SWRMT_MSG_GROUP_SET:
+        {
+            const swrmt_group_set_pkt_t *pkt = (const swrmt_group_set_pkt_t *)req->data;
+            uint32_t groups = pkt->groups & ((1U << SWRMT_GROUP_COUNT) - 1);
+            if (groups == _bootloader_vars.groups) {
+                break;
+            }
+            printf("Groups set to %08X\n", groups);
+            _bootloader_vars.groups = groups;
+            _config_write();
+            // The gateway learns the new groups from the status
+            status_request();
+            event_post(&_events[BOOTLOADER_EVENT_STATUS]);
+        } break;
+        case SWRMT_MSG_IMAGE:
+        {
+            // The gateway skips the devices already running the image it flashes
+            size_t length = 0;
+            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_IMAGE;
+            memcpy(&_bootloader_vars.notification_buffer[length], &_bootloader_vars.image, sizeof(swrmt_image_pkt_t));
+            length += sizeof(swrmt_image_pkt_t);
+            _tx_payload(_bootloader_vars.notification_buffer, length);
+        } break;
+        case SWRMT_MSG_IDLE:
+        {
+            const swrmt_idle_pkt_t *pkt = (const swrmt_idle_pkt_t *)req->data;
+            if (_swarmit_vars.status != (pkt->enable ? SWRMT_APPLICATION_READY : SWRMT_APPLICATION_IDLE)) {
+                break;
+            }
+            puts(pkt->enable ? "Idle request received" : "Wake up request received");
+            _swarmit_vars.status = pkt->enable ? SWRMT_APPLICATION_IDLE : SWRMT_APPLICATION_READY;
+            // The LED stays off in idle mode
+            db_gpio_clear(&_status_led);
+            db_timer_set_periodic_ms(1, 1, pkt->enable ? IDLE_UPDATE_DELAY_MS : BATTERY_UPDATE_DELAY, &_read_battery);
+            mr_timer_hf_set_periodic_us(NETCORE_MAIN_TIMER, 0, pkt->enable ? IDLE_CHECK_PERIOD_US : STATUS_CHECK_PERIOD_US, _send_status);
+            event_post(&_events[BOOTLOADER_EVENT_STATUS]);
+        } break;
+        case SWRMT_MSG_START:
+            if (_swarmit_vars.status != SWRMT_APPLICATION_READY) {
+                break;
+            }
+            puts("Start request received");
+            _schedule(SWRMT_MSG_START, req->data);
+            break;
+        case SWRMT_MSG_STOP:
+            // A stop before the ASN of a scheduled start cancels it
+            if (_bootloader_vars.scheduled_pending && _bootloader_vars.scheduled_type == SWRMT_MSG_START) {
+                _bootloader_vars.scheduled_pending = false;
+                // A start sent again for the same ASN is run
+                _bootloader_vars.scheduled_asn = 0;
+                puts("Scheduled start cancelled");
+                break;
+            }
+            if (_swarmit_vars.status != SWRMT_APPLICATION_RUNNING && _swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING) {
+                break;
+            }
+            puts("Stop request received");
+            _schedule(SWRMT_MSG_STOP, req->data);
+            break;
+        case SWRMT_MSG_OTA_START:
+        {
+            if (_swarmit_vars.status != SWRMT_APPLICATION_READY && _swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING) {
+                break;
+            }
+            const swrmt_ota_start_pkt_t *pkt = (const swrmt_ota_start_pkt_t *)req->data;
+            // Chunks are written to flash by words
+            if (pkt->chunk_size < SWRMT_OTA_CHUNK_SIZE_MIN || pkt->chunk_size > SWRMT_OTA_CHUNK_SIZE || pkt->chunk_size % sizeof(uint32_t)) {
+                printf("Invalid chunk size %u\n", pkt->chunk_size);
+                break;
+            }
+            if (pkt->fec_group > SWRMT_OTA_FEC_GROUP_MAX) {
+                printf("Invalid FEC group %u\n", pkt->fec_group);
+                break;
+            }
+            _swarmit_vars.status = SWRMT_APPLICATION_PROGRAMMING;
+            // The latest start wins, the device leaves the session it was part of
+            _swarmit_vars.ota.session = pkt->session;
+            // Erase the corresponding flash pages.
+            _swarmit_vars.ota.params.image_size = pkt->image_size;
+            _swarmit_vars.ota.params.chunk_count = pkt->chunk_count;
+            _swarmit_vars.ota.params.chunk_size = pkt->chunk_size;
+            _swarmit_vars.ota.params.ack_interval = pkt->ack_interval;
+            _swarmit_vars.ota.params.mode = pkt->mode;
+            _swarmit_vars.ota.params.fec_group = pkt->fec_group;
+            _swarmit_vars.ota.params.output_size = pkt->output_size;
+            _swarmit_vars.ota.params.base_size = pkt->base_size;
+            memcpy(_swarmit_vars.ota.params.base_sha, pkt->base_sha, sizeof(_swarmit_vars.ota.params.base_sha));
+            printf("OTA Start request received (size: %u, chunks: %u)\n", _swarmit_vars.ota.params.image_size, _swarmit_vars.ota.params.chunk_count);
+            event_post(&_events[BOOTLOADER_EVENT_OTA_START]);
+        } break;
+        case SWRMT_MSG_OTA_MANIFEST:
+        {
+            if (_swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING) {
+                break;
+            }
+            const swrmt_ota_manifest_pkt_t *pkt = (const swrmt_ota_manifest_pkt_t *)req->data;
+            if (pkt->session != _swarmit_vars.ota.session) {
+                break;
+            }
+            if (pkt->count > sizeof(pkt->crc) || pkt->count % sizeof(uint32_t)) {
+                printf("Invalid manifest size %u\n", pkt->count);
+                break;
+            }
+            memcpy(&_swarmit_vars.ota.manifest, pkt, sizeof(swrmt_ota_manifest_pkt_t));
+            event_post(&_events[BOOTLOADER_EVENT_OTA_MANIFEST]);
+        } break;
+        case SWRMT_MSG_OTA_FINALIZE:
+        {
+            if (_swarmit_vars.status != SWRMT_APPLICATION_READY && _swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING) {
+                break;
+            }
+            const swrmt_ota_finalize_pkt_t *pkt = (const swrmt_ota_finalize_pkt_t *)req->data;
+            if (pkt->session != _swarmit_vars.ota.session) {
+                break;
+            }
+            memcpy(_swarmit_vars.ota.image_sha, pkt->sha, SWRMT_OTA_SHA256_LENGTH);
+            puts("OTA finalize request received");
+            event_post(&_events[BOOTLOADER_EVENT_OTA_FINALIZE]);
+        } break;
+        default:
+            break;
+    }
+    _bootloader_vars.req_tail++;
+}
+
+static void _handle_ota_start(void) {
+    // Discard chunks still pending from a previous transfer
+    _swarmit_vars.ota.chunk_tail = _swarmit_vars.ota.chunk_head;
+    if (!ota_start(&_swarmit_vars.ota.params)) {
+        _swarmit_vars.status = SWRMT_APPLICATION_READY;
+    }
+}
+
+static void _handle_ota_manifest(void) {
+    ota_manifest(&_swarmit_vars.ota.manifest);
+    // Kept chunks are processed like received ones, the image may already be complete
+    event_post(&_events[BOOTLOADER_EVENT_OTA_CHUNK]);
+}
+
+static void _handle_ota_chunk(void) {
+
+    // Process all chunks queued by the radio callback
+    const ota_params_t *params = &_swarmit_vars.ota.params;
+    while (_swarmit_vars.ota.chunk_tail != _swarmit_vars.ota.chunk_head) {
+        const swrmt_ota_chunk_pkt_t *pkt = &_swarmit_vars.ota.chunks[_swarmit_vars.ota.chunk_tail % OTA_CHUNK_QUEUE_SIZE];
+        uint32_t index = pkt->index;
+        bool valid = true;
+
+        if (_swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING && _swarmit_vars.status != SWRMT_APPLICATION_READY) {
+            valid = false;
+        }
+
+        // Check chunk index and size are valid, the repair chunks of each group follow the image chunks
+        bool repair = params->fec_group && index >= params->chunk_count;
+        if (valid && ((!repair && (index >= params->chunk_count || index >= OTA_CHUNKS_MAX)) || pkt->chunk_size > params->chunk_size)) {
+            printf("Invalid chunk %u\n", index);
+            valid = false;
+        }
+
+        // Transmission errors are caught by the CRC, the whole image is verified with its SHA256 at finalize
+        if (valid && crc32(pkt->chunk, pkt->chunk_size) != pkt->crc) {
+            printf("Invalid CRC for chunk %u\n", index);
+            valid = false;
+        }
+
+        if (valid) {
+            ota_chunk_received(index, pkt->chunk, pkt->chunk_size);
+        }
+        _swarmit_vars.ota.chunk_tail++;
+    }
+
+    // Set back to ready state once all chunks are written
+    if (ota_chunks_processed()) {
+        _swarmit_vars.status = SWRMT_APPLICATION_READY;
+    }
+
+    // The chunks written may have queued the erase of the next pages
+    event_post(&_events[BOOTLOADER_EVENT_FLASH_ERASE]);
+}
+
+static void _handle_ota_finalize(void) {
+    // The device is only ready again once installed, the starts are refused meanwhile. Set before the ack is
+    // sent, the statuses following the ack are programming until the image is installed
+    uint8_t status = _swarmit_vars.status;
+    _swarmit_vars.status = SWRMT_APPLICATION_PROGRAMMING;
+    if (ota_finalize(_swarmit_vars.ota.image_sha)) {
+        event_post(&_events[BOOTLOADER_EVENT_OTA_INSTALL]);
+    } else if (!ota_install_pending()) {
+        _swarmit_vars.status = status;
+    }
+}
+
+static void _handle_ota_ack_flush(void) {
+    ota_ack_flush();
+}
+
+static void _handle_status(void) {
+    // The nRF52840DK has no LH2 receiver, the position is always 0
+    const status_telemetry_t status = {
+        .device_type    = _swarmit_vars.device_type,
+        .status         = _swarmit_vars.status,
+        .battery_level  = _swarmit_vars.battery_level,
+        .groups         = _bootloader_vars.groups,
+    };
+    size_t length = status_check(_bootloader_vars.notification_buffer, &status, mr_timer_hf_now(NETCORE_MAIN_TIMER), _bootloader_vars.last_tx_time);
+    if (length) {
+        _tx_payload(_bootloader_vars.notification_buffer, length);
+    }
+}
+
+static void _handle_log(void) {
+    // Notify log data
+    size_t length = 0;
+    _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_LOG_EVENT;
+    uint32_t timestamp = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+    memcpy(_bootloader_vars.notification_buffer + length, &timestamp, sizeof(uint32_t));
+    length += sizeof(uint32_t);
+    memcpy(_bootloader_vars.notification_buffer + length, (void *)&_swarmit_vars.log, _swarmit_vars.log.length + 1);
+    length += _swarmit_vars.log.length + 1;
+    _tx_payload(_bootloader_vars.notification_buffer, length);
+}
+
+static void _handle_battery_update(void) {
+    if (_swarmit_vars.status != SWRMT_APPLICATION_IDLE) {
+        db_gpio_toggle(&_status_led);
+    }
+    _swarmit_vars.battery_level = battery_level_read();
+}
+
+static void _handle_ota_install(void) {
+    // One page per event, requests received meanwhile are handled in between
+    if (!ota_install_pending()) {
+        return;
+    }
+    if (!ota_install_step()) {
+        event_post(&_events[BOOTLOADER_EVENT_OTA_INSTALL]);
+        return;
+    }
+    _swarmit_vars.status = SWRMT_APPLICATION_READY;
+}
+
+static void _handle_flash_erase(void) {
+    // Each slice stalls the CPU for a few ms only, events posted meanwhile are handled in between
+    if (!nvmc_page_erase_step()) {
+        event_post(&_events[BOOTLOADER_EVENT_FLASH_ERASE]);
+    }
+}
+
 int main(void) {
     _bootloader_vars.device_id = db_device_id();
 
@@ -198,11 +691,18 @@ int main(void) {
     _swarmit_vars.device_type = SWRMT_DEVICE_TYPE_UNKNOWN;
 #endif
 
-    mari_init(MARI_NODE, SWARMIT_MARI_NET_ID, &schedule_huge, &mari_event_callback);
+    _bootloader_vars.schedule_id = _schedule_id();
+    _bootloader_vars.groups = _groups();
+    mari_init(MARI_NODE, SWARMIT_MARI_NET_ID, _schedules[_bootloader_vars.schedule_id], &mari_event_callback);
 
     battery_level_init();
     _swarmit_vars.battery_level = battery_level_read();
 
+    // Finish installing the image committed before the reset, the active slot is then complete
+    if (ota_install_pending()) {
+        ota_install();
+    }
+
     // Check reset reason and switch to user image if reset was not triggered by any wdt timeout
     uint32_t resetreas = NRF_POWER->RESETREAS;
     NRF_POWER->RESETREAS = NRF_POWER->RESETREAS;
@@ -230,194 +730,26 @@ int main(void) {
         while (1) {}
     }
 
-    _bootloader_vars.base_addr = SWARMIT_BASE_ADDRESS;
-    _bootloader_vars.ota_require_erase = true;
+    ota_image_check();
 
     // Status LED
     db_gpio_init(&_status_led, DB_GPIO_OUT);
     // Periodic Timer and Lighthouse initialization
     db_timer_init(1);
     db_timer_set_periodic_ms(1, 1, BATTERY_UPDATE_DELAY, &_read_battery);
+    db_timer_set_periodic_ms(1, 2, OTA_ACK_FLUSH_DELAY_MS, &_flush_ota_ack);
 
     // Configure timer used for timestamping events
     mr_timer_hf_init(NETCORE_MAIN_TIMER);
-    mr_timer_hf_set_periodic_us(NETCORE_MAIN_TIMER, 0, 1000000UL, _send_status);
+    mr_timer_hf_set_periodic_us(NETCORE_MAIN_TIMER, 0, STATUS_CHECK_PERIOD_US, _send_status);
 
     // Experiment is ready
     _swarmit_vars.status = SWRMT_APPLICATION_READY;
 
     while (1) {
-        __WFE();
-
-        if (_bootloader_vars.send_status) {
-            _bootloader_vars.send_status = false;
-            size_t length = 0;
-            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_STATUS;
-            _bootloader_vars.notification_buffer[length++] = _swarmit_vars.device_type;
-            _bootloader_vars.notification_buffer[length++] = _swarmit_vars.status;
-            memcpy(&_bootloader_vars.notification_buffer[length], (void *)&_swarmit_vars.battery_level, sizeof(uint16_t));
-            length += sizeof(uint16_t);
-            position_2d_t position = { 0 };
-            memcpy(&_bootloader_vars.notification_buffer[length], (void *)&position, sizeof(position_2d_t));
-            length += sizeof(position_2d_t);
-            mari_node_tx_payload(_bootloader_vars.notification_buffer, length);
-        }
-
-        if (_bootloader_vars.req_received) {
-            _bootloader_vars.req_received = false;
-            swrmt_request_t *req = (swrmt_request_t *)_bootloader_vars.req_buffer;
-            switch (req->type) {
-                case SWRMT_MSG_START:
-                    if (_swarmit_vars.status != SWRMT_APPLICATION_READY) {
-                        break;
-                    }
-                    puts("Start request received");
-                    NVIC_SystemReset();
-                    break;
-                case SWRMT_MSG_STOP:
-                    if (_swarmit_vars.status != SWRMT_APPLICATION_RUNNING && _swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING) {
-                        break;
-                    }
-                    puts("Stop request received");
-                    setup_watchdog();
-                    break;
-                case SWRMT_MSG_OTA_START:
-                {
-                    if (_swarmit_vars.status != SWRMT_APPLICATION_READY && _swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING) {
-                        break;
-                    }
-                    _swarmit_vars.ota.last_chunk_acked = -1;
-                    _swarmit_vars.status = SWRMT_APPLICATION_PROGRAMMING;
-                    const swrmt_ota_start_pkt_t *pkt = (const swrmt_ota_start_pkt_t *)req->data;
-                    // Erase the corresponding flash pages.
-                    _swarmit_vars.ota.image_size = pkt->image_size;
-                    _swarmit_vars.ota.chunk_count = pkt->chunk_count;
-                    printf("OTA Start request received (size: %u, chunks: %u)\n", _swarmit_vars.ota.image_size, _swarmit_vars.ota.chunk_count);
-                    _bootloader_vars.ota_start_request = true;
-                } break;
-                case SWRMT_MSG_OTA_CHUNK:
-                {
-                    if (_swarmit_vars.status != SWRMT_APPLICATION_PROGRAMMING && _swarmit_vars.status != SWRMT_APPLICATION_READY) {
-                        break;
-                    }
-
-                    const swrmt_ota_chunk_pkt_t *pkt = (const swrmt_ota_chunk_pkt_t *)req->data;
-                    _swarmit_vars.ota.chunk_index = pkt->index;
-
-                    // Check chunk index is valid
-                    if (_swarmit_vars.ota.chunk_index >= _swarmit_vars.ota.chunk_count) {
-                        printf("Invalid chunk index %u\n", _swarmit_vars.ota.chunk_index);
-                        break;
-                    }
-
-                    // Only check for matching sha if chunk was not already acked
-                    if (_swarmit_vars.ota.last_chunk_acked != (int32_t)_swarmit_vars.ota.chunk_index) {
-                        printf("Verify SHA for chunk %u: ", _swarmit_vars.ota.chunk_index);
-                        _swarmit_vars.ota.chunk_size = pkt->chunk_size;
-                        memcpy((uint8_t *)_swarmit_vars.ota.chunk, pkt->chunk, pkt->chunk_size);
-
-                        // Copy expected hash
-                        memcpy(_bootloader_vars.expected_hash, pkt->sha, SWRMT_OTA_SHA256_LENGTH);
-
-                        // Compute and compare the chunk hash with the received one
-                        crypto_sha256_init(&_bootloader_vars.sha256_ctx);
-                        crypto_sha256_update(&_bootloader_vars.sha256_ctx, (const uint8_t *)_swarmit_vars.ota.chunk, _swarmit_vars.ota.chunk_size);
-                        crypto_sha256(&_bootloader_vars.sha256_ctx, _bootloader_vars.computed_hash);
-
-                        if (memcmp(_bootloader_vars.computed_hash, _bootloader_vars.expected_hash, 8) != 0) {
-                            puts("Failed");
-                            break;
-                        }
-                        puts("OK");
-                    }
-                    printf("Process OTA chunk request (index: %u, size: %u)\n", _swarmit_vars.ota.chunk_index, _swarmit_vars.ota.chunk_size);
-                    _bootloader_vars.ota_chunk_request = true;
-                } break;
-                default:
-                    break;
-            }
-        }
-
-        if (_bootloader_vars.metrics_received) {
-            _bootloader_vars.metrics_received = false;
-            mr_metrics_payload_t *metrics_payload = (mr_metrics_payload_t *)_bootloader_vars.req_buffer;
-            // update metrics probe
-            metrics_payload->node_rx_count        = ++_bootloader_vars.metrics_rx_counter;
-            metrics_payload->node_rx_asn          = mr_mac_get_asn();
-            metrics_payload->node_tx_count        = ++_bootloader_vars.metrics_tx_counter;
-            metrics_payload->node_tx_enqueued_asn = mr_mac_get_asn();
-            metrics_payload->rssi_at_node         = mr_radio_rssi();
-
-            // send metrics probe to gateway
-            mari_node_tx_payload((uint8_t *)metrics_payload, sizeof(mr_metrics_payload_t));
-        }
-
-        if (_bootloader_vars.log_received) {
-            _bootloader_vars.log_received = false;
-            // Notify log data
-            size_t length = 0;
-            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_LOG_EVENT;
-            uint32_t timestamp = mr_timer_hf_now(NETCORE_MAIN_TIMER);
-            memcpy(_bootloader_vars.notification_buffer + length, &timestamp, sizeof(uint32_t));
-            length += sizeof(uint32_t);
-            memcpy(_bootloader_vars.notification_buffer + length, (void *)&_swarmit_vars.log, _swarmit_vars.log.length + 1);
-            length += _swarmit_vars.log.length + 1;
-            mari_node_tx_payload(_bootloader_vars.notification_buffer, length);
-        }
-
-        if (_bootloader_vars.ota_start_request) {
-            _bootloader_vars.ota_start_request = false;
-
-            if (_bootloader_vars.ota_require_erase) {
-                // Erase non secure flash
-                uint32_t pages_count = (_swarmit_vars.ota.image_size / FLASH_PAGE_SIZE) + (_swarmit_vars.ota.image_size % FLASH_PAGE_SIZE != 0);
-                printf("Pages to erase: %u\n", pages_count);
-                for (uint32_t page = 0; page < pages_count; page++) {
-                    uint32_t addr = _bootloader_vars.base_addr + page * FLASH_PAGE_SIZE;
-                    printf("Erasing page %u at %p\n", page + 16, (uint32_t *)addr);
-                    nvmc_page_erase(page + 16);
-                }
-                printf("Erasing done\n");
-                _bootloader_vars.ota_require_erase = false;
-            }
-
-            // Notify erase is done
-            size_t length = 0;
-            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_OTA_START_ACK;
-            while (!mari_node_is_connected()) {}
-            mari_node_tx_payload(_bootloader_vars.notification_buffer, length);
-        }
-
-        if (_bootloader_vars.ota_chunk_request) {
-            _bootloader_vars.ota_chunk_request = false;
-
-            if (_swarmit_vars.ota.last_chunk_acked != (int32_t)_swarmit_vars.ota.chunk_index) {
-                // Write chunk to flash
-                uint32_t addr = _bootloader_vars.base_addr + _swarmit_vars.ota.chunk_index * SWRMT_OTA_CHUNK_SIZE;
-                printf("Writing chunk %d/%d at address %p\n", _swarmit_vars.ota.chunk_index, _swarmit_vars.ota.chunk_count - 1, (uint32_t *)addr);
-                nvmc_write((uint32_t *)addr, (void *)_swarmit_vars.ota.chunk, _swarmit_vars.ota.chunk_size);
-                _bootloader_vars.ota_require_erase = true;
-            }
-
-            // Notify chunk has been written
-            size_t length = 0;
-            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_OTA_CHUNK_ACK;
-            memcpy(_bootloader_vars.notification_buffer + length, (void *)&_swarmit_vars.ota.chunk_index, sizeof(uint32_t));
-            length += sizeof(uint32_t);
-            _swarmit_vars.ota.last_chunk_acked = _swarmit_vars.ota.chunk_index;
-            while (!mari_node_is_connected()) {}
-            mari_node_tx_payload(_bootloader_vars.notification_buffer, length);
-
-            // If last chunk, finalize computed hash, set back to ready state
-            if (_swarmit_vars.ota.chunk_index == _swarmit_vars.ota.chunk_count - 1) {
-                _swarmit_vars.status = SWRMT_APPLICATION_READY;
-            }
-        }
-
-        if (_bootloader_vars.battery_update) {
-            db_gpio_toggle(&_status_led);
-            _swarmit_vars.battery_level = battery_level_read();
-            _bootloader_vars.battery_update = false;
+        // Sleep only once all the posted events are handled, the most urgent first
+        if (!event_dispatch(_events, BOOTLOADER_EVENT_COUNT)) {
+            __WFE();
         }
     }
 }
@@ -9,16 +9,60 @@
  * @copyright Anon, 2023
  */
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 #include <nrf.h>
 #include "nvmc.h"
 
+//=========================== defines ==========================================
+
+#define NVMC_PAGE_NONE  (UINT32_MAX)    ///< Queued erase cancelled by nvmc_page_erase
+
+typedef struct {
+    uint32_t pages[NVMC_ERASE_QUEUE_SIZE];  ///< Pages to erase in the background
+    uint32_t head;                          ///< Number of erases queued
+    uint32_t tail;                          ///< Number of erases done
+    uint32_t slices;                        ///< Slices of the oldest queued erase already run
+} nvmc_vars_t;
+
+//=========================== variables ========================================
+
+static nvmc_vars_t _nvmc_vars = { 0 };
+
+//=========================== private ==========================================
+
+static void _erase_slice(uint32_t page) {
+    NRF_NVMC->ERASEPAGEPARTIALCFG = NVMC_PARTIAL_ERASE_MS;
+    NRF_NVMC->CONFIG = (NVMC_CONFIG_WEN_Een << NVMC_CONFIG_WEN_Pos);
+    NRF_NVMC->ERASEPAGEPARTIAL = page * FLASH_PAGE_SIZE;
+    while (!NRF_NVMC->READY) {}
+    NRF_NVMC->CONFIG = (NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos);
+}
+
 //=========================== public ==========================================
 
 void nvmc_page_erase(uint32_t page) {
 
+    // A queued erase already started only needs its remaining slices
+    for (uint32_t i = _nvmc_vars.tail; i != _nvmc_vars.head; i++) {
+        uint32_t *queued = &_nvmc_vars.pages[i % NVMC_ERASE_QUEUE_SIZE];
+        if (*queued != page) {
+            continue;
+        }
+        if (i == _nvmc_vars.tail && _nvmc_vars.slices) {
+            while (_nvmc_vars.slices < NVMC_PARTIAL_ERASE_COUNT) {
+                _erase_slice(page);
+                _nvmc_vars.slices++;
+            }
+            _nvmc_vars.slices = 0;
+            _nvmc_vars.tail++;
+            return;
+        }
+        *queued = NVMC_PAGE_NONE;
+    }
+
     const uint32_t *addr = (const uint32_t *)(page * FLASH_PAGE_SIZE);
 
     NRF_NVMC->CONFIG = (NVMC_CONFIG_WEN_Een << NVMC_CONFIG_WEN_Pos);
@@ -33,8 +77,51 @@ void nvmc_write(const uint32_t *addr, const void *data, size_t len) {
 
     NRF_NVMC->CONFIG = (NVMC_CONFIG_WEN_Wen << NVMC_CONFIG_WEN_Pos);
     for (uint32_t i = 0; i < (len >> 2); i++) {
+        // The write buffer takes the next word while the previous ones are programmed
+        while (!NRF_NVMC->READYNEXT) {}
         *dest_addr++ = data_addr[i];
     }
+    while (!NRF_NVMC->READY) {}
 
     NRF_NVMC->CONFIG = (NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos);
 }
+
+bool nvmc_page_erase_post(uint32_t page) {
+    if (_nvmc_vars.head - _nvmc_vars.tail == NVMC_ERASE_QUEUE_SIZE) {
+        return false;
+    }
+    _nvmc_vars.pages[_nvmc_vars.head % NVMC_ERASE_QUEUE_SIZE] = page;
+    _nvmc_vars.head++;
+    return true;
+}
+
+bool nvmc_page_erase_step(void) {
+    while (_nvmc_vars.tail != _nvmc_vars.head) {
+        uint32_t page = _nvmc_vars.pages[_nvmc_vars.tail % NVMC_ERASE_QUEUE_SIZE];
+        if (page == NVMC_PAGE_NONE) {
+            _nvmc_vars.tail++;
+            continue;
+        }
+        _erase_slice(page);
+        if (++_nvmc_vars.slices == NVMC_PARTIAL_ERASE_COUNT) {
+            _nvmc_vars.slices = 0;
+            _nvmc_vars.tail++;
+        }
+        break;
+    }
+    return _nvmc_vars.tail == _nvmc_vars.head;
+}
+
+void nvmc_page_erase_cancel(void) {
+    _nvmc_vars.tail = _nvmc_vars.head;
+    _nvmc_vars.slices = 0;
+}
+
+bool nvmc_page_erase_queued(uint32_t page) {
+    for (uint32_t i = _nvmc_vars.tail; i != _nvmc_vars.head; i++) {
+        if (_nvmc_vars.pages[i % NVMC_ERASE_QUEUE_SIZE] == page) {
+            return true;
+        }
+    }
+    return false;
+}
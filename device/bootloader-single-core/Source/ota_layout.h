@@ -0,0 +1,26 @@
+#ifndef __OTA_LAYOUT_H
+#define __OTA_LAYOUT_H
+
+/**
+ * @defgroup    drv_ota_layout  OTA flash layout
+ * @ingroup     drv
+ * @brief       Flash slots of the nRF52840, included by the OTA engine
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include "nvmc.h"
+
+//=========================== defines ==========================================
+
+#define SWARMIT_BASE_ADDRESS        (0x10000)  ///< Active slot, images are linked to run there
+#define SWARMIT_BOOT_RECORD_ADDRESS (0x100000 - 2 * FLASH_PAGE_SIZE)    ///< Below the network config page, describes the image waiting to be installed
+#define SWARMIT_SLOT_SIZE           (((SWARMIT_BOOT_RECORD_ADDRESS - SWARMIT_BASE_ADDRESS) / 2) & ~(FLASH_PAGE_SIZE - 1))
+#define SWARMIT_DOWNLOAD_ADDRESS    (SWARMIT_BASE_ADDRESS + SWARMIT_SLOT_SIZE)  ///< Inactive slot, OTA images are received there
+#define SWARMIT_IMAGE_MAX_SIZE      (SWARMIT_SLOT_SIZE)
+
+#endif // __OTA_LAYOUT_H
@@ -24,28 +24,116 @@
 #define GATEWAY_ADDRESS   0x0000000000000000UL  ///< Gateway address
 
 #define SWRMT_PREAMBLE_LENGTH       (8U)
-#define SWRMT_OTA_CHUNK_SIZE        (128U)
+#define SWRMT_OTA_CHUNK_SIZE        (192U)      ///< Maximum size of an OTA chunk, the actual size is given at OTA start
+#define SWRMT_OTA_CHUNK_SIZE_MIN    (64U)       ///< Minimum size of an OTA chunk
+#define SWRMT_OTA_SHA256_LENGTH     (32U)
+#define SWRMT_OTA_ACK_BITMAP_SIZE   (16U)       ///< Size in bytes of the received chunks bitmap sent in OTA acks
+#define SWRMT_OTA_MANIFEST_PAGES_MAX (32U)      ///< Maximum number of pages described by an OTA manifest packet
+#define SWRMT_OTA_FEC_GROUP_MAX     (32U)       ///< Maximum number of chunks protected by the same repair chunks
+#define SWRMT_OTA_FEC_REPAIRS_MAX   (8U)        ///< Maximum number of repair chunks of a group, their indexes follow the chunks
+#define SWRMT_LOG_RECORD_FORMATTED  (0x80U)     ///< Set in a log record length when it contains a format string address and its arguments
+#define SWRMT_GROUP_COUNT           (31U)       ///< Number of device groups, a bitmap with all the bits set is an erased one
+#define SWRMT_OTA_LZ_MATCH_FLAG     (0x80)      ///< Set in a compressed stream token followed by a back reference
+#define SWRMT_OTA_LZ_MIN_MATCH      (3U)        ///< Length of a back reference whose token length bits are 0
+#define SWRMT_OTA_LZ_WINDOW_SIZE    (4096U)     ///< Maximum distance of a back reference
 
 typedef struct __attribute__((packed)) {
+    uint8_t  session;                           ///< OTA session, devices ignore the packets of the other sessions
     uint32_t image_size;                        ///< User image size in bytes
     uint32_t chunk_count;
+    uint8_t  chunk_size;                        ///< Size of all chunks but the last one, multiple of 4
+    uint8_t  ack_interval;                      ///< Number of chunks received between two OTA acks
+    uint8_t  mode;                              ///< Content of the chunks, see swrmt_ota_mode_t
+    uint32_t output_size;                       ///< Size of the image once the chunks are processed
+    uint32_t base_size;                         ///< Size of the installed image a delta applies to
+    uint8_t  base_sha[8];                       ///< First bytes of the SHA256 of the installed image
+    uint8_t  fec_group;                         ///< Chunks protected by each group of repair chunks, 0 without repair chunks
 } swrmt_ota_start_pkt_t;
 
 typedef struct __attribute__((packed)) {
+    uint8_t  session;                           ///< OTA session, devices ignore the packets of the other sessions
     uint32_t index;                             ///< Index of the chunk
     uint8_t  chunk_size;                        ///< Size of the chunk
-    uint8_t  sha[8];
+    uint32_t crc;                               ///< CRC32 of the chunk
     uint8_t  chunk[SWRMT_OTA_CHUNK_SIZE];       ///< Bytes array of the firmware chunk
 } swrmt_ota_chunk_pkt_t;
 
+typedef struct __attribute__((packed)) {
+    uint8_t  session;                           ///< OTA session, devices ignore the packets of the other sessions
+    uint8_t  sha[SWRMT_OTA_SHA256_LENGTH];      ///< SHA256 of the complete image
+} swrmt_ota_finalize_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  session;                           ///< OTA session, devices ignore the packets of the other sessions
+    uint16_t first_page;                        ///< Index of the first page described, from the start of the image
+    uint8_t  count;                             ///< Size of the crc array in bytes, 4 per page described
+    uint32_t crc[SWRMT_OTA_MANIFEST_PAGES_MAX]; ///< CRC32 of the image bytes in each page
+} swrmt_ota_manifest_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  enable;                            ///< 1 parks a ready device in idle mode, 0 wakes it up
+} swrmt_idle_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint64_t asn;                               ///< ASN at which the start or stop happens, 0 on reception
+} swrmt_start_stop_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  schedule_id;                       ///< Mari schedule used from now on, one of swrmt_schedule_id_t
+} swrmt_schedule_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  group;                             ///< Group the packet is addressed to, below SWRMT_GROUP_COUNT
+    uint8_t  length;                            ///< Length of the packet
+    uint8_t  packet[];                          ///< Packet handled as if it was addressed to each device of the group
+} swrmt_group_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t groups;                            ///< Bitmap of the groups the device belongs to
+} swrmt_group_set_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t size;                              ///< Size of the installed image, 0 when not installed by an OTA
+    uint8_t  sha[SWRMT_OTA_SHA256_LENGTH];      ///< SHA256 of the installed image
+} swrmt_image_pkt_t;
+
+typedef enum {
+    SWRMT_OTA_MODE_RAW = 0,                     ///< Chunks contain the image
+    SWRMT_OTA_MODE_DELTA = 1,                   ///< Chunks contain a patch to apply to the installed image
+    SWRMT_OTA_MODE_COMPRESSED = 2,              ///< Chunks contain the compressed image
+} swrmt_ota_mode_t;
+
+typedef enum {
+    SWRMT_OTA_DELTA_OP_COPY = 0,                ///< Copy bytes from the installed image
+    SWRMT_OTA_DELTA_OP_DATA = 1,                ///< Bytes following the operation
+} swrmt_ota_delta_op_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  type;                              ///< Operation type, see swrmt_ota_delta_op_type_t
+    uint16_t length;                            ///< Number of bytes produced by the operation
+    uint32_t source;                            ///< Offset of the copied bytes in the installed image
+} swrmt_ota_delta_op_t;
+
 typedef enum {
     SWRMT_APPLICATION_READY = 0,
     SWRMT_APPLICATION_RUNNING,
     SWRMT_APPLICATION_STOPPING,
     SWRMT_APPLICATION_RESETTING,
     SWRMT_APPLICATION_PROGRAMMING,
+    SWRMT_APPLICATION_IDLE,
 } swrmt_application_status_t;
 
+/// Mari schedules a device can be switched to, the gateway must use the same one
+typedef enum {
+    SWRMT_SCHEDULE_MINUSCULE = 0,
+    SWRMT_SCHEDULE_TINY,
+    SWRMT_SCHEDULE_SMALL,
+    SWRMT_SCHEDULE_HUGE,
+    SWRMT_SCHEDULE_ONLY_BEACONS,
+    SWRMT_SCHEDULE_ONLY_BEACONS_OPTIMIZED_SCAN,
+    SWRMT_SCHEDULE_COUNT,
+} swrmt_schedule_id_t;
+
 typedef enum {
     SWRMT_MSG_STATUS = 0x80,
     SWRMT_MSG_START = 0x81,
@@ -57,6 +145,22 @@ typedef enum {
     SWRMT_MSG_OTA_CHUNK_ACK = 0x87,
     SWRMT_MSG_GPIO_EVENT = 0x88,
     SWRMT_MSG_LOG_EVENT = 0x89,
+    SWRMT_MSG_OTA_CHUNKS_ACK = 0x8A,
+    SWRMT_MSG_OTA_FINALIZE = 0x8B,
+    SWRMT_MSG_OTA_FINALIZE_ACK = 0x8C,
+    SWRMT_MSG_OTA_MANIFEST = 0x8D,
+    SWRMT_MSG_OTA_MANIFEST_ACK = 0x8E,
+    SWRMT_MSG_LOG_BATCH = 0x8F,
+    SWRMT_MSG_POSITION_STREAM = 0x90,
+    SWRMT_MSG_POSITION_BATCH = 0x91,
+    SWRMT_MSG_IDLE = 0x92,
+    SWRMT_MSG_SCHEDULE = 0x93,
+    SWRMT_MSG_GROUP = 0x94,
+    SWRMT_MSG_GROUP_SET = 0x95,
+    SWRMT_MSG_IMAGE = 0x98,
+    SWRMT_MSG_UPLOAD = 0x99,
+    SWRMT_MSG_UPLOAD_REQUEST = 0x9A,
+    SWRMT_MSG_UPLOAD_CHUNK = 0x9B,
 } swrmt_message_type_t;
 
 /// Application type
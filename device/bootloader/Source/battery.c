@@ -1,9 +1,30 @@
 #include <stdio.h>
 
+#include <nrf.h>
+
 #include "battery.h"
 
 #include "saadc.h"
 
+typedef struct {
+    int16_t     samples[BATTERY_SAMPLE_COUNT];  ///< Written by EasyDMA, one sample per trigger
+    uint16_t    level_mv;                       ///< Latest battery level
+} battery_vars_t;
+
+static battery_vars_t _battery_vars = { 0 };
+
+static uint16_t _to_mv(int32_t sum, uint32_t count) {
+    // 12-bit conversions, the full scale is 3.6V with the 1/6 gain and the internal 0.6V reference
+    if (sum < 0) {
+        sum = 0;
+    }
+    uint32_t voltage_mv = ((uint32_t)sum * 3600) / (4095 * count);
+    if (voltage_mv > BATTERY_LEVEL_MAX_MV) {
+        voltage_mv = BATTERY_LEVEL_MAX_MV;
+    }
+    return (uint16_t)voltage_mv;
+}
+
 void battery_level_init(void) {
     db_saadc_init(DB_SAADC_RESOLUTION_12BIT);
 }
@@ -11,9 +32,70 @@ void battery_level_init(void) {
 uint16_t battery_level_read(void) {
     uint16_t value_12b = 0;
     db_saadc_read(ROBOT_BATTERY_LEVEL_PIN, &value_12b);
-    uint16_t voltage_mv = (uint16_t)(((float)value_12b / 4095) * 3600);
-    if (voltage_mv > BATTERY_LEVEL_MAX_MV) {
-        voltage_mv = BATTERY_LEVEL_MAX_MV;
+    _battery_vars.level_mv = _to_mv(value_12b, 1);
+    return _battery_vars.level_mv;
+}
+
+void battery_level_start(void) {
+    if (!_battery_vars.level_mv) {
+        battery_level_read();
+    }
+
+    NRF_SAADC_S->ENABLE     = (SAADC_ENABLE_ENABLE_Disabled << SAADC_ENABLE_ENABLE_Pos);
+    NRF_SAADC_S->RESOLUTION = (SAADC_RESOLUTION_VAL_12bit << SAADC_RESOLUTION_VAL_Pos);
+    NRF_SAADC_S->OVERSAMPLE = (SAADC_OVERSAMPLE_OVERSAMPLE_Bypass << SAADC_OVERSAMPLE_OVERSAMPLE_Pos);
+    NRF_SAADC_S->SAMPLERATE = (SAADC_SAMPLERATE_MODE_Task << SAADC_SAMPLERATE_MODE_Pos);
+    for (uint8_t channel = 1; channel < SAADC_CH_NUM; channel++) {
+        NRF_SAADC_S->CH[channel].PSELP = (SAADC_CH_PSELP_PSELP_NC << SAADC_CH_PSELP_PSELP_Pos);
+    }
+    NRF_SAADC_S->CH[0].PSELP  = (ROBOT_BATTERY_LEVEL_PIN << SAADC_CH_PSELP_PSELP_Pos);
+    NRF_SAADC_S->CH[0].PSELN  = (SAADC_CH_PSELN_PSELN_NC << SAADC_CH_PSELN_PSELN_Pos);
+    NRF_SAADC_S->CH[0].CONFIG = (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos |
+                                 SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos |
+                                 SAADC_CH_CONFIG_TACQ_10us << SAADC_CH_CONFIG_TACQ_Pos |
+                                 SAADC_CH_CONFIG_MODE_SE << SAADC_CH_CONFIG_MODE_Pos);
+    NRF_SAADC_S->RESULT.PTR    = (uint32_t)_battery_vars.samples;
+    NRF_SAADC_S->RESULT.MAXCNT = BATTERY_SAMPLE_COUNT;
+    NRF_SAADC_S->INTENCLR      = 0xFFFFFFFF;
+    NRF_SAADC_S->EVENTS_END    = 0;
+
+    // Samples are triggered by the caller event, a full buffer restarts the sampling in the same buffer
+    NRF_SAADC_S->SUBSCRIBE_SAMPLE = (SAADC_SUBSCRIBE_SAMPLE_EN_Enabled << SAADC_SUBSCRIBE_SAMPLE_EN_Pos | BATTERY_DPPI_CHANNEL_SAMPLE);
+    NRF_SAADC_S->PUBLISH_END      = (SAADC_PUBLISH_END_EN_Enabled << SAADC_PUBLISH_END_EN_Pos | BATTERY_DPPI_CHANNEL_START);
+    NRF_SAADC_S->SUBSCRIBE_START  = (SAADC_SUBSCRIBE_START_EN_Enabled << SAADC_SUBSCRIBE_START_EN_Pos | BATTERY_DPPI_CHANNEL_START);
+    NRF_DPPIC_S->CHENSET = (1 << BATTERY_DPPI_CHANNEL_SAMPLE | 1 << BATTERY_DPPI_CHANNEL_START);
+
+    NRF_SAADC_S->ENABLE      = (SAADC_ENABLE_ENABLE_Enabled << SAADC_ENABLE_ENABLE_Pos);
+    NRF_SAADC_S->TASKS_START = 1;
+}
+
+void battery_level_stop(void) {
+    NRF_DPPIC_S->CHENCLR = (1 << BATTERY_DPPI_CHANNEL_SAMPLE | 1 << BATTERY_DPPI_CHANNEL_START);
+    NRF_SAADC_S->SUBSCRIBE_SAMPLE = 0;
+    NRF_SAADC_S->SUBSCRIBE_START  = 0;
+    NRF_SAADC_S->PUBLISH_END      = 0;
+
+    // Keep the level given by the samples already taken
+    battery_level_get();
+
+    NRF_SAADC_S->EVENTS_STOPPED = 0;
+    NRF_SAADC_S->TASKS_STOP     = 1;
+    while (!NRF_SAADC_S->EVENTS_STOPPED) {}
+    NRF_SAADC_S->EVENTS_STOPPED = 0;
+    NRF_SAADC_S->ENABLE         = (SAADC_ENABLE_ENABLE_Disabled << SAADC_ENABLE_ENABLE_Pos);
+}
+
+uint16_t battery_level_get(void) {
+    // The end event is never cleared once the buffer is full, the buffer then only contains samples
+    if (!NRF_SAADC_S->EVENTS_END) {
+        return _battery_vars.level_mv;
+    }
+
+    // Samples are written while they are summed, a sample from the previous buffer fill is as valid
+    int32_t sum = 0;
+    for (uint8_t index = 0; index < BATTERY_SAMPLE_COUNT; index++) {
+        sum += _battery_vars.samples[index];
     }
-    return voltage_mv;
+    _battery_vars.level_mv = _to_mv(sum, BATTERY_SAMPLE_COUNT);
+    return _battery_vars.level_mv;
 }
@@ -24,8 +24,36 @@
 
 #define BATTERY_LEVEL_MAX_MV        (3000)
 
+#define BATTERY_SAMPLE_COUNT        (10U)   ///< Samples averaged by the background sampling
+#define BATTERY_DPPI_CHANNEL_SAMPLE (1U)    ///< DPPI channel triggering a background sample, published by the caller
+#define BATTERY_DPPI_CHANNEL_START  (2U)    ///< DPPI channel restarting the sampling when the buffer is full
+
 void battery_level_init(void);
 
+/**
+ * @brief Read the battery level with a blocking conversion
+ *
+ * @return battery level in mV
+ */
 uint16_t battery_level_read(void);
 
+/**
+ * @brief Start the background sampling, one sample is taken at each event published on BATTERY_DPPI_CHANNEL_SAMPLE
+ *
+ * Samples are written by EasyDMA to a buffer of BATTERY_SAMPLE_COUNT samples, refilled without CPU wakeup.
+ */
+void battery_level_start(void);
+
+/**
+ * @brief Stop the background sampling, before another use of the SAADC
+ */
+void battery_level_stop(void);
+
+/**
+ * @brief Average of the latest background samples, never waits for a conversion
+ *
+ * @return battery level in mV, the latest blocking reading until the first buffer is full
+ */
+uint16_t battery_level_get(void);
+
 #endif // __BATTERY_H
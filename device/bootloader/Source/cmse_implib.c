@@ -3,10 +3,12 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <arm_cmse.h>
 #include <nrf.h>
 
 #include "battery.h"
 #include "cmse_implib.h"
+#include "crc32.h"
 #include "device.h"
 #include "ipc.h"
 #include "localization.h"
@@ -15,42 +17,72 @@
 #include "lh2.h"
 #include "saadc.h"
 
-static __attribute__((aligned(4))) uint8_t _tx_data_buffer[UINT8_MAX];
-static __attribute__((aligned(4))) uint32_t _localization_data_available = 0;
-
 extern volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_shared_data;
 
 __attribute__((cmse_nonsecure_entry)) void swarmit_keep_alive(void) {
+    // Battery level and position are updated from the secure TIMER2 interrupt
     NRF_WDT0_S->RR[0] = WDT_RR_RR_Reload << WDT_RR_RR_Pos;
-    ipc_shared_data.battery_level = battery_level_read();
-    if (_localization_data_available) {
-        position_2d_t position;
-        if (!localization_get_position(&position)) {
-            return;
-        }
-        mutex_lock();
-        memcpy((void *)&ipc_shared_data.current_position, &position, sizeof(position_2d_t));
-        mutex_unlock();
-    }
 }
 
-__attribute__((cmse_nonsecure_entry)) void swarmit_send_data_packet(const uint8_t *packet, uint8_t length) {
-    size_t pos = 0;
-    _tx_data_buffer[pos++] = PACKET_DATA;
-    _tx_data_buffer[pos++] = length;
-    memcpy(_tx_data_buffer + pos, &packet, length);
-    pos += length;
-    mari_node_tx(_tx_data_buffer, pos);
+static bool _is_non_secure(const void *data, size_t length, int access) {
+    // The whole range must be accessible to the non secure caller, as seen from the SPU and its MPU
+    return cmse_check_address_range((void *)data, length, CMSE_NONSECURE | access) != NULL;
 }
 
-__attribute__((cmse_nonsecure_entry)) void swarmit_send_raw_data(const uint8_t *packet, uint8_t length) {
-    mari_node_tx(packet, length);
+__attribute__((cmse_nonsecure_entry)) bool swarmit_send_data_packet(const uint8_t *packet, uint8_t length) {
+    const swarmit_segment_t segment = { .data = packet, .length = length };
+    return swarmit_send_data_segments(&segment, 1);
+}
+
+__attribute__((cmse_nonsecure_entry)) bool swarmit_send_data_segments(const swarmit_segment_t *segments, size_t count) {
+    if (count > SWARMIT_SEGMENTS_MAX || (count && !_is_non_secure(segments, count * sizeof(swarmit_segment_t), CMSE_MPU_READ))) {
+        return false;
+    }
+
+    // The descriptors are read once, the user image could change them once checked
+    uint8_t header[2] = { PACKET_DATA, 0 };
+    mari_segment_t packet[SWARMIT_SEGMENTS_MAX + 1] = { { .data = header, .length = sizeof(header) } };
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        packet[i + 1].data = segments[i].data;
+        packet[i + 1].length = segments[i].length;
+        if (packet[i + 1].length && !_is_non_secure(packet[i + 1].data, packet[i + 1].length, CMSE_MPU_READ)) {
+            // Ensure the segment is not in secure space
+            return false;
+        }
+        length += packet[i + 1].length;
+    }
+    if (length > UINT8_MAX - sizeof(header)) {
+        return false;
+    }
+    header[1] = length;
+    return mari_node_tx_segments(packet, count + 1);
+}
+
+__attribute__((cmse_nonsecure_entry)) bool swarmit_send_raw_data(const uint8_t *packet, uint8_t length) {
+    if (!_is_non_secure(packet, length, CMSE_MPU_READ)) {
+        // Ensure the packet is not in secure space
+        return false;
+    }
+    return mari_node_tx(packet, length);
 }
 
 __attribute__((cmse_nonsecure_entry)) void swarmit_ipc_isr(ipc_isr_cb_t cb) {
     if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_RADIO_RX]) {
         NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_RADIO_RX] = 0;
-        cb((const uint8_t *)ipc_shared_data.rx_pdu.buffer, ipc_shared_data.rx_pdu.length);
+        // Deliver all the PDUs queued since the last call, the slot is released once the callback returns
+        while (ipc_shared_data.rx.tail != ipc_shared_data.rx.head) {
+            __DMB();
+            volatile ipc_radio_pdu_t *pdu = &ipc_shared_data.rx.pdus[ipc_shared_data.rx.tail % IPC_RX_QUEUE_SIZE];
+            cb((const uint8_t *)pdu->buffer, pdu->length);
+            __DMB();
+            ipc_shared_data.rx.tail++;
+        }
+        // The network core times the delivery of traced PDUs
+        if (ipc_shared_data.rx_trace) {
+            ipc_shared_data.rx_trace = false;
+            NRF_IPC_S->TASKS_SEND[IPC_CHAN_RADIO_RX_DONE] = 1;
+        }
     }
 }
 
@@ -62,37 +94,108 @@ __attribute__((cmse_nonsecure_entry)) void swarmit_read_rng(uint8_t *value) {
     rng_read(value);
 }
 
+__attribute__((cmse_nonsecure_entry)) void swarmit_read_rng_buffer(uint8_t *buffer, size_t length) {
+    if (!_is_non_secure(buffer, length, CMSE_MPU_READWRITE)) {
+        // Ensure the buffer is not in secure space
+        return;
+    }
+    rng_read_buffer(buffer, length);
+}
+
 __attribute__((cmse_nonsecure_entry)) uint64_t swarmit_read_device_id(void) {
     return db_device_id();
 }
 
+static void _queue_log(const uint8_t *data, size_t length, uint8_t flags) {
+    mutex_lock(IPC_MUTEX_LOG);
+    if (ipc_shared_data.log.head - ipc_shared_data.log.tail >= IPC_LOG_QUEUE_SIZE) {
+        // The network core reports the number of records lost with the next batch
+        ipc_shared_data.log.dropped++;
+        mutex_unlock(IPC_MUTEX_LOG);
+        return;
+    }
+    // The slot is owned by the application core until the head index is incremented
+    volatile ipc_log_data_t *record = &ipc_shared_data.log.records[ipc_shared_data.log.head % IPC_LOG_QUEUE_SIZE];
+    record->length = length | flags;
+    memcpy((void *)record->data, data, length);
+    __DMB();
+    ipc_shared_data.log.head++;
+    mutex_unlock(IPC_MUTEX_LOG);
+    NRF_IPC_S->TASKS_SEND[IPC_CHAN_LOG_EVENT] = 1;
+}
+
 __attribute__((cmse_nonsecure_entry)) void swarmit_log_data(uint8_t *data, size_t length) {
     if (length > INT8_MAX) {
         // Ensure length fits in the log data buffer in shared RAM
         return;
     }
 
-    if ((data > (uint8_t *)0x20000000 && data < (uint8_t *)0x20008000) || (data > (uint8_t *)0x00000000 && data < (uint8_t *)0x0000ff00)) {
+    if (!_is_non_secure(data, length, CMSE_MPU_READ)) {
         // Ensure data address is not in secure space
         return;
     }
 
-    mutex_lock();
-    ipc_shared_data.log.length = length;
-    memcpy((void *)ipc_shared_data.log.data, data, length);
-    mutex_unlock();
-    NRF_IPC_S->TASKS_SEND[IPC_CHAN_LOG_EVENT] = 1;
+    _queue_log(data, length, 0);
+}
+
+__attribute__((cmse_nonsecure_entry)) void swarmit_log_format(uint32_t format, const uint32_t *args, size_t count) {
+    uint32_t record[INT8_MAX / sizeof(uint32_t)];
+    if (count >= sizeof(record) / sizeof(uint32_t)) {
+        // Ensure the format address and the arguments fit in a log record
+        return;
+    }
+
+    if (count && !_is_non_secure(args, count * sizeof(uint32_t), CMSE_MPU_READ)) {
+        // Ensure the arguments are not in secure space
+        return;
+    }
+
+    // The controller formats the record with the string found at this address in the user image ELF
+    record[0] = format;
+    memcpy(&record[1], args, count * sizeof(uint32_t));
+    _queue_log((const uint8_t *)record, (count + 1) * sizeof(uint32_t), SWRMT_LOG_RECORD_FORMATTED);
+}
+
+__attribute__((cmse_nonsecure_entry)) bool swarmit_upload(const uint8_t *data, size_t length) {
+    if ((uint32_t)data < IPC_UPLOAD_RAM_START || (uint32_t)data > IPC_UPLOAD_RAM_END || length > IPC_UPLOAD_RAM_END - (uint32_t)data) {
+        // Ensure the region is in the non secure RAM, the network core reads it from there
+        return false;
+    }
+
+    // The size is written last, the network core never sends a region being replaced
+    ipc_shared_data.upload.size = 0;
+    __DMB();
+    ipc_shared_data.upload.session = (ipc_shared_data.upload.session == UINT8_MAX) ? 1 : ipc_shared_data.upload.session + 1;
+    ipc_shared_data.upload.address = (uint32_t)data;
+    ipc_shared_data.upload.crc = crc32(data, length);
+    __DMB();
+    ipc_shared_data.upload.size = length;
+    return true;
 }
 
 __attribute__((cmse_nonsecure_entry)) void swarmit_get_battery_level(uint16_t *battery) {
-    *battery = ipc_shared_data.battery_level;
+    ipc_telemetry_t telemetry;
+    ipc_telemetry_read(&telemetry);
+    *battery = telemetry.battery_level;
 }
 
 __attribute__((cmse_nonsecure_entry)) void swarmit_localization_get_position(position_2d_t *position) {
-    mutex_lock();
-    position->x = ipc_shared_data.current_position.x;
-    position->y = ipc_shared_data.current_position.y;
-    mutex_unlock();
+    // Never blocks, even when called while the position is being updated
+    ipc_telemetry_t telemetry;
+    ipc_telemetry_read(&telemetry);
+    position->x = telemetry.position.x;
+    position->y = telemetry.position.y;
+}
+
+__attribute__((cmse_nonsecure_entry)) void swarmit_localization_get_velocity(velocity_2d_t *velocity) {
+    // Estimated at the latest snapshot update, zero when the position is unknown
+    NVIC_DisableIRQ(TIMER2_IRQn);
+    bool valid = localization_get_velocity(velocity);
+    NVIC_EnableIRQ(TIMER2_IRQn);
+    if (!valid) {
+        velocity->x = 0;
+        velocity->y = 0;
+    }
 }
 
 __attribute__((cmse_nonsecure_entry)) void swarmit_localization_handle_isr(void) {
@@ -100,7 +203,10 @@ __attribute__((cmse_nonsecure_entry)) void swarmit_localization_handle_isr(void)
         // Clear the Interrupt flag
         NRF_SPIM4_S->EVENTS_END = 0;
         db_lh2_handle_isr();
-        _localization_data_available = localization_process_data();
+        if (localization_process_data()) {
+            // The estimate is updated from the secure timer interrupt, it preempts non secure interrupts
+            NVIC_SetPendingIRQ(TIMER2_IRQn);
+        }
     }
 }
 
@@ -108,5 +214,8 @@ __attribute__((cmse_nonsecure_entry)) void swarmit_saadc_read(uint8_t channel, u
     if (channel != DB_SAADC_INPUT_VDDH && !(channel <= DB_SAADC_INPUT_VDD) && !(channel >= DB_SAADC_INPUT_AIN0)) {
         return;
     }
-    return db_saadc_read(channel, value);
+    // The battery sampling restarts with the configuration it needs
+    battery_level_stop();
+    db_saadc_read(channel, value);
+    battery_level_start();
 }
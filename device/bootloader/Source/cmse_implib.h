@@ -13,25 +13,44 @@
  * @}
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
 #include "localization.h"
 
+#define SWARMIT_SEGMENTS_MAX    (4U)    ///< Maximum number of segments of a data packet
+
+typedef struct {
+    const uint8_t   *data;      ///< Start of the segment, in non secure memory
+    uint8_t         length;     ///< Number of bytes in the segment
+} swarmit_segment_t;
+
 typedef void (*ipc_isr_cb_t)(const uint8_t *, size_t) __attribute__((cmse_nonsecure_call));
 
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_keep_alive(void);
-__attribute__((cmse_nonsecure_entry, aligned)) void swarmit_send_data_packet(const uint8_t *packet, uint8_t length);
-__attribute__((cmse_nonsecure_entry, aligned)) void swarmit_send_raw_data(const uint8_t *packet, uint8_t length);
+__attribute__((cmse_nonsecure_entry, aligned)) bool swarmit_send_data_packet(const uint8_t *packet, uint8_t length);
+// Data packet made of segments, they don't need to be contiguous and are copied once to the radio queue. Returns
+// false when the TX queue is full, the packet is too long or a segment is not in non secure memory
+__attribute__((cmse_nonsecure_entry, aligned)) bool swarmit_send_data_segments(const swarmit_segment_t *segments, size_t count);
+__attribute__((cmse_nonsecure_entry, aligned)) bool swarmit_send_raw_data(const uint8_t *packet, uint8_t length);
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_ipc_isr(ipc_isr_cb_t cb);
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_init_rng(void);
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_read_rng(uint8_t *value);
+__attribute__((cmse_nonsecure_entry, aligned)) void swarmit_read_rng_buffer(uint8_t *buffer, size_t length);
 __attribute__((cmse_nonsecure_entry, aligned)) uint64_t swarmit_read_device_id(void);
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_log_data(uint8_t *data, size_t length);
+__attribute__((cmse_nonsecure_entry, aligned)) void swarmit_log_format(uint32_t format, const uint32_t *args, size_t count);
+
+// Region of the non secure RAM the gateway retrieves, it must not change until uploaded, even once the experiment
+// is stopped. A new region replaces the previous one, returns false when the region is not in the non secure RAM
+__attribute__((cmse_nonsecure_entry, aligned)) bool swarmit_upload(const uint8_t *data, size_t length);
+
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_get_battery_level(uint16_t *battery);
 
 // Lighthouse 2 functions exposed to user image
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_localization_get_position(position_2d_t *position);
+__attribute__((cmse_nonsecure_entry, aligned)) void swarmit_localization_get_velocity(velocity_2d_t *velocity);
 __attribute__((cmse_nonsecure_entry, aligned)) void swarmit_localization_handle_isr(void);
 
 // SAADC functions
@@ -1,33 +1,88 @@
 #include <nrf.h>
+#include <string.h>
 #include "ipc.h"
+#include "profile.h"
 
 /**
  * @brief Variable in RAM containing the shared data structure
  */
 volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_shared_data;
 
-/**
- * @brief Lock the mutex, blocks until the mutex is locked
- */
-void mutex_lock(void) {
-    while (NRF_MUTEX_NS->MUTEX[0]) {}
+void mutex_lock(ipc_mutex_t mutex) {
+    uint32_t start = profile_start();
+    while (NRF_MUTEX_NS->MUTEX[mutex]) {}
+    profile_add(SWRMT_PROFILE_MUTEX_WAIT, start);
 }
 
-/**
- * @brief Unlock the mutex, has no effect if the mutex is already unlocked
- */
-void mutex_unlock(void) {
-    NRF_MUTEX_NS->MUTEX[0] = 0;
+void mutex_unlock(ipc_mutex_t mutex) {
+    NRF_MUTEX_NS->MUTEX[mutex] = 0;
 }
 
-void ipc_network_call(ipc_req_t req) {
-    if (req != IPC_REQ_NONE) {
-        ipc_shared_data.req                 = req;
-        NRF_IPC_S->TASKS_SEND[IPC_CHAN_REQ] = 1;
+void ipc_telemetry_read(ipc_telemetry_t *telemetry) {
+    // The writer updates the copies one after the other, the sequence parity gives the one not being written
+    uint32_t seq;
+    do {
+        seq = ipc_shared_data.telemetry_seq;
+        __DMB();
+        memcpy(telemetry, (const void *)&ipc_shared_data.telemetry[seq & 1], sizeof(ipc_telemetry_t));
+        __DMB();
+    } while (seq != ipc_shared_data.telemetry_seq);
+}
+
+static void _ipc_telemetry_write(const ipc_telemetry_t *telemetry) {
+    for (uint8_t copy = 0; copy < 2; copy++) {
+        ipc_shared_data.telemetry_seq++;
+        __DMB();
+        memcpy((void *)&ipc_shared_data.telemetry[copy], telemetry, sizeof(ipc_telemetry_t));
+        __DMB();
+    }
+}
+
+void ipc_telemetry_set_battery_level(uint16_t battery_level) {
+    ipc_telemetry_t telemetry;
+    memcpy(&telemetry, (const void *)&ipc_shared_data.telemetry[0], sizeof(ipc_telemetry_t));
+    telemetry.battery_level = battery_level;
+    _ipc_telemetry_write(&telemetry);
+}
+
+void ipc_telemetry_set_position(const position_2d_t *position) {
+    ipc_telemetry_t telemetry;
+    memcpy(&telemetry, (const void *)&ipc_shared_data.telemetry[0], sizeof(ipc_telemetry_t));
+    telemetry.position = *position;
+    _ipc_telemetry_write(&telemetry);
+    if (ipc_shared_data.position_stream_period) {
+        // The network core timestamps the position when signaled
+        NRF_IPC_S->TASKS_SEND[IPC_CHAN_POSITION] = 1;
     }
-    while (!ipc_shared_data.net_ack) {}
-    ipc_shared_data.net_ack = false;
-};
+}
+
+uint32_t ipc_network_post(ipc_req_t req, uint8_t length) {
+    // Wait for a free descriptor, the network core is notified in case the pending ones were only posted
+    if (ipc_shared_data.req.head - ipc_shared_data.req.tail >= IPC_REQ_QUEUE_SIZE) {
+        ipc_network_ring();
+        while (ipc_shared_data.req.head - ipc_shared_data.req.tail >= IPC_REQ_QUEUE_SIZE) {}
+    }
+    volatile ipc_req_desc_t *desc = &ipc_shared_data.req.descs[ipc_shared_data.req.head % IPC_REQ_QUEUE_SIZE];
+    desc->req = req;
+    desc->length = length;
+    __DMB();
+    return ++ipc_shared_data.req.head;
+}
+
+void ipc_network_ring(void) {
+    NRF_IPC_S->TASKS_SEND[IPC_CHAN_REQ] = 1;
+}
+
+void ipc_network_wait(uint32_t id) {
+    while ((int32_t)(ipc_shared_data.req.tail - id) < 0) {}
+    __DMB();
+}
+
+void ipc_network_call(ipc_req_t req) {
+    uint32_t id = ipc_network_post(req, 0);
+    ipc_network_ring();
+    ipc_network_wait(id);
+}
 
 void release_network_core(void) {
     // Do nothing if network core is already started and ready
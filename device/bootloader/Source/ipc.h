@@ -21,23 +21,42 @@
 
 #define IPC_IRQ_PRIORITY (1)
 
+#define IPC_OTA_CHUNK_QUEUE_SIZE    (8U)    ///< Maximum number of OTA chunks pending between the cores
+#define IPC_RX_QUEUE_SIZE           (8U)    ///< Maximum number of radio PDUs pending for the user image
+#define IPC_TX_QUEUE_SIZE           (4U)    ///< Maximum number of radio PDUs pending for the network core
+#define IPC_REQ_QUEUE_SIZE          (8U)    ///< Maximum number of requests pending for the network core
+#define IPC_RNG_BUFFER_SIZE         (32U)   ///< Maximum number of random bytes read by a single request
+#define IPC_LOG_QUEUE_SIZE          (8U)    ///< Maximum number of log records pending for the network core
+#define IPC_UPLOAD_RAM_START        (0x20008000UL)  ///< Start of the non secure RAM, where the regions offered for upload are
+#define IPC_UPLOAD_RAM_END          (0x20068000UL)  ///< End of the non secure RAM given to the user image
+
 typedef enum {
     IPC_REQ_NONE,        ///< Sorry, but nothing
     IPC_MARI_INIT_REQ,
-    IPC_MARI_NODE_TX_REQ,
     IPC_RNG_INIT_REQ,                ///< Request for rng init
     IPC_RNG_READ_REQ,                ///< Request for rng read
 } ipc_req_t;
 
+typedef enum {
+    IPC_MUTEX_OTA               = 0,    ///< Hardware mutex protecting the OTA parameters, manifest and image hash
+    IPC_MUTEX_LOG               = 1,    ///< Hardware mutex serializing the writers of the log queue
+} ipc_mutex_t;
+
 typedef enum {
     IPC_CHAN_REQ                = 0,    ///< Channel used for request events
     IPC_CHAN_RADIO_RX           = 1,    ///< Channel used for radio RX events
     IPC_CHAN_APPLICATION_START  = 2,    ///< Channel used for starting the application
     IPC_CHAN_APPLICATION_STOP   = 3,    ///< Channel used for stopping the application
     IPC_CHAN_APPLICATION_RESET  = 4,    ///< Channel used for resetting the application
-    IPC_CHAN_LOG_EVENT          = 5,    ///< Channel used for logging events
+    IPC_CHAN_LOG_EVENT          = 5,    ///< Channel used for signaling log records queued for the gateway
     IPC_CHAN_OTA_START          = 6,    ///< Channel used for starting an OTA process
-    IPC_CHAN_OTA_CHUNK          = 7,    ///< Channel used for writing a non secure image chunk
+    IPC_CHAN_OTA_CHUNK          = 7,    ///< Channel used for signaling non secure image chunks queued in the shared slots
+    IPC_CHAN_OTA_FINALIZE       = 8,    ///< Channel used for verifying the image received
+    IPC_CHAN_OTA_MANIFEST       = 9,    ///< Channel used for comparing the image pages with the installed ones
+    IPC_CHAN_RADIO_TX           = 10,   ///< Channel used for signaling radio PDUs queued for transmission
+    IPC_CHAN_POSITION           = 11,   ///< Channel used for signaling a new position while it is streamed
+    IPC_CHAN_IDLE               = 12,   ///< Channel used for entering or leaving the idle mode
+    IPC_CHAN_RADIO_RX_DONE      = 13,   ///< Channel used for signaling the delivery of a traced radio PDU to the user image
 } ipc_channels_t;
 
 typedef struct __attribute__((packed)) {
@@ -46,46 +65,158 @@ typedef struct __attribute__((packed)) {
 } ipc_log_data_t;
 
 typedef struct __attribute__((packed)) {
-    uint32_t image_size;
-    uint32_t chunk_count;
-    uint32_t chunk_index;
-    uint32_t chunk_size;
-    int32_t  last_chunk_acked;
-    uint8_t chunk[INT8_MAX + 1];
+    uint32_t        head;                           ///< Number of records queued, only written by the application core
+    uint32_t        tail;                           ///< Number of records sent, only written by the network core
+    uint32_t        dropped;                        ///< Number of records dropped because the queue was full
+    ipc_log_data_t  records[IPC_LOG_QUEUE_SIZE];    ///< Records waiting to be sent, timestamped by the network core
+} ipc_log_queue_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t index;                 ///< Index of the chunk in the image
+    uint32_t size;                  ///< Size of the chunk in bytes
+    uint8_t  data[SWRMT_OTA_CHUNK_SIZE];    ///< Chunk data
+} ipc_ota_chunk_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t        image_size;
+    uint32_t        chunk_count;
+    uint32_t        chunk_size;                         ///< Size of all chunks but the last one
+    uint32_t        ack_interval;                       ///< Number of chunks received between two OTA acks
+    uint32_t        mode;                               ///< Content of the chunks, see swrmt_ota_mode_t
+    uint32_t        fec_group;                          ///< Chunks protected by each group of repair chunks, 0 without repair chunks
+    uint32_t        output_size;                        ///< Size of the image once the chunks are processed
+    uint32_t        base_size;                          ///< Size of the installed image a delta applies to
+    uint8_t         base_sha[8];                        ///< First bytes of the SHA256 of the installed image
+    uint8_t         image_sha[SWRMT_OTA_SHA256_LENGTH]; ///< SHA256 of the complete image, given at finalize
+    swrmt_ota_manifest_pkt_t manifest;                  ///< Page CRCs of the image, given before the chunks
+    uint32_t        chunk_head;                         ///< Number of chunks queued, only written by the network core
+    uint32_t        chunk_tail;                         ///< Number of chunks processed, only written by the application core
+    ipc_ota_chunk_t chunks[IPC_OTA_CHUNK_QUEUE_SIZE];   ///< Chunks waiting to be written to flash
 } ipc_ota_data_t;
 
 typedef struct {
-    uint8_t value;  ///< Byte containing the random value read
+    uint8_t value[IPC_RNG_BUFFER_SIZE]; ///< Random bytes read by the latest IPC_RNG_READ_REQ
 } ipc_rng_data_t;
 
+typedef struct __attribute__((packed)) {
+    ipc_req_t   req;                            ///< Type of the request
+    uint8_t     length;                         ///< Number of bytes requested, used by IPC_RNG_READ_REQ
+} ipc_req_desc_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t        head;                       ///< Number of requests posted, only written by the application core
+    uint32_t        tail;                       ///< Number of requests completed, only written by the network core
+    ipc_req_desc_t  descs[IPC_REQ_QUEUE_SIZE];  ///< Requests waiting to be processed by the network core
+} ipc_req_queue_t;
+
 typedef struct __attribute__((packed)) {
     uint8_t length;             ///< Length of the pdu in bytes
     uint8_t buffer[UINT8_MAX];  ///< Buffer containing the pdu data
 } ipc_radio_pdu_t;
 
+typedef struct __attribute__((packed)) {
+    uint32_t        head;                       ///< Number of PDUs queued, only written by the network core
+    uint32_t        tail;                       ///< Number of PDUs delivered, only written by the application core
+    ipc_radio_pdu_t pdus[IPC_RX_QUEUE_SIZE];    ///< PDUs waiting to be delivered to the user image
+} ipc_rx_queue_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t        head;                       ///< Number of PDUs queued, only written by the application core
+    uint32_t        tail;                       ///< Number of PDUs sent, only written by the network core
+    ipc_radio_pdu_t pdus[IPC_TX_QUEUE_SIZE];    ///< PDUs waiting to be sent over the radio
+} ipc_tx_queue_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t                battery_level;      ///< Battery level in mV
+    position_2d_t           position;           ///< Current 2D position
+} ipc_telemetry_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t                size;               ///< Size of the installed image, 0 when not installed by an OTA
+    uint8_t                 sha[SWRMT_OTA_SHA256_LENGTH];   ///< SHA256 of the installed image
+} ipc_image_data_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t                 session;            ///< Incremented at each region offered by the user image, 0 before the first one
+    uint32_t                address;            ///< Address of the region, in the non secure RAM of the application core
+    uint32_t                size;               ///< Size of the region, 0 when there is nothing to upload, written last
+    uint32_t                crc;                ///< CRC32 of the region
+} ipc_upload_data_t;
+
 typedef struct __attribute__((packed,aligned(8))) {
     bool                    net_ready;          ///< Network core is ready
-    bool                    net_ack;            ///< Network core acked the latest request
-    ipc_req_t               req;                ///< IPC network request
+    ipc_req_queue_t         req;                ///< IPC network requests queue
     uint8_t                 status;             ///< Experiment status
-    uint16_t                battery_level;      ///< Battery level in mV
     swrmt_device_type_t     device_type;        ///< Device type
-    ipc_log_data_t          log;                ///< Log data
+    ipc_log_queue_t         log;                ///< Log records queue
     ipc_rng_data_t          rng;                ///< Rng shared data
     ipc_ota_data_t          ota;                ///< OTA data
     position_2d_t           target_position;    ///< Target 2D position
-    position_2d_t           current_position;   ///< Current 2D position
-    ipc_radio_pdu_t         tx_pdu;             ///< TX PDU
-    ipc_radio_pdu_t         rx_pdu;             ///< RX PDU
+    uint32_t                telemetry_seq;      ///< Number of telemetry updates started, selects the copy to read
+    ipc_telemetry_t         telemetry[2];       ///< Telemetry copies, one is always consistent while the other is written
+    uint16_t                position_stream_period; ///< Position streaming period in ms, 0 when disabled, only written by the network core
+    ipc_tx_queue_t          tx;                 ///< TX PDUs queue
+    ipc_rx_queue_t          rx;                 ///< RX PDUs queue
+    swrmt_profile_counter_t profile[SWRMT_PROFILE_APP_COUNT];   ///< Cycles spent in the application core profiled sections, only written by the application core
+    bool                    rx_trace;           ///< A traced PDU is queued, set by the network core, cleared by the application core once delivered
+    ipc_image_data_t        image;              ///< Image in the active slot, only written by the application core
+    ipc_upload_data_t       upload;             ///< Region offered for upload by the user image, only written by the application core
 } ipc_shared_data_t;
 
-void mutex_lock(void);
+/**
+ * @brief Lock a mutex, blocks until the mutex is locked
+ */
+void mutex_lock(ipc_mutex_t mutex);
+
+/**
+ * @brief Unlock a mutex, has no effect if the mutex is already unlocked
+ */
+void mutex_unlock(ipc_mutex_t mutex);
+
+/**
+ * @brief Read a consistent copy of the battery level and position, never waits for the writer
+ *
+ * @param[out] telemetry address of the output copy
+ */
+void ipc_telemetry_read(ipc_telemetry_t *telemetry);
 
 /**
- * @brief Unlock the mutex, has no effect if the mutex is already unlocked
+ * @brief Update the battery level shared with the network core, only called from the application core
  */
-void mutex_unlock(void);
+void ipc_telemetry_set_battery_level(uint16_t battery_level);
 
+/**
+ * @brief Update the position shared with the network core, only called from the application core
+ */
+void ipc_telemetry_set_position(const position_2d_t *position);
+
+/**
+ * @brief Queue a request for the network core, without notifying it
+ *
+ * @param[in] req    type of the request
+ * @param[in] length number of bytes requested
+ *
+ * @return identifier to pass to ipc_network_wait
+ */
+uint32_t ipc_network_post(ipc_req_t req, uint8_t length);
+
+/**
+ * @brief Notify the network core that requests are queued, all of them are processed in one wakeup
+ */
+void ipc_network_ring(void);
+
+/**
+ * @brief Wait until the network core has processed a request and all the ones posted before it
+ *
+ * @param[in] id identifier returned by ipc_network_post
+ */
+void ipc_network_wait(uint32_t id);
+
+/**
+ * @brief Post a request, notify the network core and wait for the request to be processed
+ *
+ * @param[in] req    type of the request
+ */
 void ipc_network_call(ipc_req_t req);
 
 void release_network_core(void);
@@ -1,31 +1,150 @@
+#include <nrf.h>
 #include <stdio.h>
 #include <string.h>
-#include <math.h>
 
 #include "board_config.h"
 #include "lh2.h"
 #include "localization.h"
 #include "lh2_calibration.h"
+#include "profile.h"
 
-#define VALID_POSITION_DISTANCE_THRESHOLD_MM 500.0f  ///< Maximum distance in mm between two consecutive position measurements for the position to be considered valid
+#define VALID_POSITION_COORDINATE_MAX_MM    (100000)  ///< Maximum value of a valid coordinate in mm
+
+#define LOCALIZATION_MEASUREMENT_NOISE_MM   (20.0f)   ///< Standard deviation of a position computed from a single base station
+#define LOCALIZATION_ACCELERATION_NOISE     (1000.0f) ///< Standard deviation of the acceleration in mm/s², how fast the velocity may change
+#define LOCALIZATION_VELOCITY_INIT          (500.0f)  ///< Standard deviation of the velocity in mm/s when the filter starts
+#define LOCALIZATION_OUTLIER_GATE           (13.8f)   ///< Chi-square value of 2 degrees of freedom exceeded by 0.1% of the consistent measurements
+#define LOCALIZATION_OUTLIERS_MAX           (5U)      ///< Consecutive outliers after which the filter restarts from the measurement
+#define LOCALIZATION_TIMEOUT_MS             (1000U)   ///< Time without any accepted measurement after which no estimate is given
+
+// Printing takes longer than computing a position, only debug builds log from the LH2 processing
+#if defined(LOCALIZATION_DEBUG)
+#define LOCALIZATION_LOG(...) printf(__VA_ARGS__)
+#else
+#define LOCALIZATION_LOG(...)
+#endif
+
+/// Constant velocity model of one axis
+typedef struct {
+    float   position;               ///< Estimated position in mm
+    float   velocity;               ///< Estimated velocity in mm/s
+    float   covariance[2][2];       ///< Covariance of the position and velocity errors
+} localization_axis_t;
 
 typedef struct {
     db_lh2_t                lh2;
     double                  coordinates[2];
-    position_2d_t           position;
-    position_2d_t           previous_position;
+    localization_axis_t     axes[2];        ///< Filter state of the x and y axes
+    bool                    initialized;    ///< The filter state is set from a measurement
+    bool                    suspended;      ///< The LH2 sweeps are not received
+    uint32_t                predicted_at;   ///< Cycle count of the latest prediction
+    uint32_t                measured_at;    ///< Cycle count of the latest accepted measurement
+    uint8_t                 outliers;       ///< Consecutive measurements rejected
+#if defined(LOCALIZATION_BENCHMARK)
+    localization_benchmark_t benchmark;
+#endif
 } localization_data_t;
 
 static __attribute__((aligned(4))) localization_data_t _localization_data = { 0 };
 
-float _distance(position_2d_t *reference, position_2d_t *current) {
-    float dx = ((float)current->x - (float)reference->x);
-    float dy = ((float)current->y - (float)reference->y);
-    return sqrtf(powf(dx, 2) + powf(dy, 2));
+static uint32_t _cycles_per_ms(void) {
+    // The DWT counts core cycles, the core runs at 128MHz or 64MHz
+    bool div1 = (NRF_CLOCK->HFCLKCTRL & CLOCK_HFCLKCTRL_HCLK_Msk) == (CLOCK_HFCLKCTRL_HCLK_Div1 << CLOCK_HFCLKCTRL_HCLK_Pos);
+    return div1 ? 128000 : 64000;
 }
 
+static void _filter_reset(const float measurement[2], uint32_t now) {
+    for (uint8_t axis = 0; axis < 2; axis++) {
+        localization_axis_t *state = &_localization_data.axes[axis];
+        state->position = measurement[axis];
+        state->velocity = 0;
+        state->covariance[0][0] = LOCALIZATION_MEASUREMENT_NOISE_MM * LOCALIZATION_MEASUREMENT_NOISE_MM;
+        state->covariance[0][1] = 0;
+        state->covariance[1][0] = 0;
+        state->covariance[1][1] = LOCALIZATION_VELOCITY_INIT * LOCALIZATION_VELOCITY_INIT;
+    }
+    _localization_data.initialized = true;
+    _localization_data.outliers = 0;
+    _localization_data.predicted_at = now;
+    _localization_data.measured_at = now;
+}
+
+static void _filter_predict(uint32_t now) {
+    float dt = (float)(now - _localization_data.predicted_at) / (_cycles_per_ms() * 1000.0f);
+    float q = LOCALIZATION_ACCELERATION_NOISE * LOCALIZATION_ACCELERATION_NOISE;
+    _localization_data.predicted_at = now;
+    for (uint8_t axis = 0; axis < 2; axis++) {
+        localization_axis_t *state = &_localization_data.axes[axis];
+        float (*p)[2] = state->covariance;
+        state->position += state->velocity * dt;
+        // P = F.P.F' + Q, with the noise of a random acceleration held during dt
+        float p00 = p[0][0] + dt * (p[0][1] + p[1][0]) + dt * dt * p[1][1] + q * dt * dt * dt * dt / 4;
+        float p01 = p[0][1] + dt * p[1][1] + q * dt * dt * dt / 2;
+        p[0][0] = p00;
+        p[0][1] = p01;
+        p[1][0] = p01;
+        p[1][1] += q * dt * dt;
+    }
+}
+
+static bool _filter_update(const float measurement[2], uint32_t now) {
+    // The normalized innovation squared of a consistent measurement follows a chi-square distribution with 2
+    // degrees of freedom, the gate widens by itself as the uncertainty grows between measurements
+    float r = LOCALIZATION_MEASUREMENT_NOISE_MM * LOCALIZATION_MEASUREMENT_NOISE_MM;
+    float innovation[2];
+    float variance[2];
+    float nis = 0;
+    for (uint8_t axis = 0; axis < 2; axis++) {
+        innovation[axis] = measurement[axis] - _localization_data.axes[axis].position;
+        variance[axis] = _localization_data.axes[axis].covariance[0][0] + r;
+        nis += innovation[axis] * innovation[axis] / variance[axis];
+    }
+    if (nis > LOCALIZATION_OUTLIER_GATE) {
+        // Consistent outliers mean the estimate is lost, the robot may have been moved by hand
+        if (++_localization_data.outliers >= LOCALIZATION_OUTLIERS_MAX) {
+            _filter_reset(measurement, now);
+            return true;
+        }
+        return false;
+    }
+
+    _localization_data.outliers = 0;
+    _localization_data.measured_at = now;
+    for (uint8_t axis = 0; axis < 2; axis++) {
+        localization_axis_t *state = &_localization_data.axes[axis];
+        float (*p)[2] = state->covariance;
+        float k0 = p[0][0] / variance[axis];
+        float k1 = p[1][0] / variance[axis];
+        state->position += k0 * innovation[axis];
+        state->velocity += k1 * innovation[axis];
+        // P = (I - K.H).P
+        float p00 = p[0][0];
+        float p01 = p[0][1];
+        p[0][0] -= k0 * p00;
+        p[0][1] -= k0 * p01;
+        p[1][0] -= k1 * p00;
+        p[1][1] -= k1 * p01;
+    }
+    return true;
+}
+
+#if defined(LOCALIZATION_BENCHMARK)
+static void _benchmark_add(localization_cycles_t *cycles, uint32_t start) {
+    uint32_t elapsed = DWT->CYCCNT - start;
+    cycles->count++;
+    cycles->total += elapsed;
+    if (elapsed > cycles->max) {
+        cycles->max = elapsed;
+    }
+}
+#endif
+
 void localization_init(void) {
     puts("Initialize localization");
+    // The cycle counter times the filter predictions
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
     db_lh2_init(&_localization_data.lh2, &db_lh2_d, &db_lh2_e);
     db_lh2_start();
 
@@ -45,60 +164,121 @@ void localization_init(void) {
 
 }
 
+void localization_suspend(void) {
+    if (_localization_data.suspended) {
+        return;
+    }
+    _localization_data.suspended = true;
+    db_lh2_stop();
+}
+
+void localization_resume(void) {
+    if (!_localization_data.suspended) {
+        return;
+    }
+    // The device may have been moved while suspended, the next measurement restarts the filter
+    _localization_data.initialized = false;
+    _localization_data.suspended = false;
+    db_lh2_start();
+}
+
 bool localization_process_data(void) {
+    if (_localization_data.suspended) {
+        return false;
+    }
+    uint32_t profiled_at = profile_start();
+#if defined(LOCALIZATION_BENCHMARK)
+    uint32_t start = DWT->CYCCNT;
+#endif
     db_lh2_process_location(&_localization_data.lh2);
+    bool available = false;
     for (uint8_t lh_index = 0; lh_index < LH2_BASESTATION_COUNT; lh_index++) {
         if (_localization_data.lh2.data_ready[0][lh_index] == DB_LH2_PROCESSED_DATA_AVAILABLE && _localization_data.lh2.data_ready[1][lh_index] == DB_LH2_PROCESSED_DATA_AVAILABLE) {
-            return true;
+            available = true;
+            break;
         }
     }
-    return false;
+#if defined(LOCALIZATION_BENCHMARK)
+    _benchmark_add(&_localization_data.benchmark.process_data, start);
+#endif
+    profile_add(SWRMT_PROFILE_LOCALIZATION, profiled_at);
+    return available;
 }
 
-bool localization_get_position(position_2d_t *position) {
-    if (LH2_CALIBRATION_IS_VALID) {
-        db_lh2_stop();
-        for (uint8_t lh_index = 0; lh_index < LH2_BASESTATION_COUNT; lh_index++) {
-            if (_localization_data.lh2.data_ready[0][lh_index] == DB_LH2_PROCESSED_DATA_AVAILABLE && _localization_data.lh2.data_ready[1][lh_index] == DB_LH2_PROCESSED_DATA_AVAILABLE) {
-                db_lh2_calculate_position(_localization_data.lh2.locations[0][lh_index].lfsr_counts, _localization_data.lh2.locations[1][lh_index].lfsr_counts, lh_index, _localization_data.coordinates);
-                _localization_data.lh2.data_ready[0][lh_index] = DB_LH2_NO_NEW_DATA;
-                _localization_data.lh2.data_ready[1][lh_index] = DB_LH2_NO_NEW_DATA;
-                break;
-            }
+static void _measure(uint32_t now) {
+    // Every base station with a new sweep gives a measurement, each one refines the estimate
+    for (uint8_t lh_index = 0; lh_index < LH2_BASESTATION_COUNT; lh_index++) {
+        if (_localization_data.lh2.data_ready[0][lh_index] != DB_LH2_PROCESSED_DATA_AVAILABLE || _localization_data.lh2.data_ready[1][lh_index] != DB_LH2_PROCESSED_DATA_AVAILABLE) {
+            continue;
         }
-        db_lh2_start();
+        db_lh2_calculate_position(_localization_data.lh2.locations[0][lh_index].lfsr_counts, _localization_data.lh2.locations[1][lh_index].lfsr_counts, lh_index, _localization_data.coordinates);
+        _localization_data.lh2.data_ready[0][lh_index] = DB_LH2_NO_NEW_DATA;
+        _localization_data.lh2.data_ready[1][lh_index] = DB_LH2_NO_NEW_DATA;
 
-        if (_localization_data.coordinates[0] < 0 || _localization_data.coordinates[0] > 100000 || _localization_data.coordinates[1] < 0 || _localization_data.coordinates[1] > 100000) {
-            printf("Invalid position (%u,%u)\n", _localization_data.position.x, _localization_data.position.y);
-            return false;
+        // The comparisons also reject NaN values
+        double x = _localization_data.coordinates[0];
+        double y = _localization_data.coordinates[1];
+        if (!(x >= 0 && x <= VALID_POSITION_COORDINATE_MAX_MM && y >= 0 && y <= VALID_POSITION_COORDINATE_MAX_MM)) {
+            LOCALIZATION_LOG("Invalid coordinates from LH%u\n", lh_index);
+            continue;
         }
 
-        _localization_data.position.x = (uint32_t)_localization_data.coordinates[0];
-        _localization_data.position.y = (uint32_t)_localization_data.coordinates[1];
-
-        if (_localization_data.previous_position.x == 0 && _localization_data.previous_position.y == 0) {
-            _localization_data.previous_position.x = _localization_data.position.x;
-            _localization_data.previous_position.y = _localization_data.position.y;
+        float measurement[2] = { (float)x, (float)y };
+        if (!_localization_data.initialized) {
+            _filter_reset(measurement, now);
+        } else if (!_filter_update(measurement, now)) {
+            LOCALIZATION_LOG("Outlier (%u,%u) from LH%u\n", (uint32_t)x, (uint32_t)y, lh_index);
         }
+    }
+}
 
-        float distance = _distance((position_2d_t *)&_localization_data.previous_position, (position_2d_t *)&_localization_data.position);
-        if (distance > VALID_POSITION_DISTANCE_THRESHOLD_MM) {
-            printf("Distance (%f) from (%u,%u) to (%u,%u) is too high\n",
-                    distance,
-                   _localization_data.previous_position.x,
-                   _localization_data.previous_position.y,
-                   _localization_data.position.x,
-                   _localization_data.position.y);
-            return false;
-        }
+static uint32_t _to_mm(float value) {
+    return (value > 0) ? (uint32_t)value : 0;
+}
 
-        _localization_data.previous_position.x = _localization_data.position.x;
-        _localization_data.previous_position.y = _localization_data.position.y;
-        position->x = _localization_data.position.x;
-        position->y = _localization_data.position.y;
-        printf("Position (%u,%u)\n", position->x, position->y);
-        return true;
+bool localization_get_position(position_2d_t *position) {
+    if (!LH2_CALIBRATION_IS_VALID || _localization_data.suspended) {
+        return false;
+    }
+
+#if defined(LOCALIZATION_BENCHMARK)
+    uint32_t start = DWT->CYCCNT;
+#endif
+    uint32_t now = DWT->CYCCNT;
+    if (_localization_data.initialized && now - _localization_data.measured_at > LOCALIZATION_TIMEOUT_MS * _cycles_per_ms()) {
+        // The prediction drifts without measurements, the next one restarts the filter
+        _localization_data.initialized = false;
+    }
+    if (_localization_data.initialized) {
+        _filter_predict(now);
+    }
+    db_lh2_stop();
+    _measure(now);
+    db_lh2_start();
+#if defined(LOCALIZATION_BENCHMARK)
+    _benchmark_add(&_localization_data.benchmark.get_position, start);
+#endif
+
+    if (!_localization_data.initialized) {
+        return false;
     }
+    position->x = _to_mm(_localization_data.axes[0].position);
+    position->y = _to_mm(_localization_data.axes[1].position);
+    LOCALIZATION_LOG("Position (%u,%u)\n", position->x, position->y);
+    return true;
+}
 
-    return false;
+bool localization_get_velocity(velocity_2d_t *velocity) {
+    if (!_localization_data.initialized) {
+        return false;
+    }
+    velocity->x = (int32_t)_localization_data.axes[0].velocity;
+    velocity->y = (int32_t)_localization_data.axes[1].velocity;
+    return true;
 }
+
+#if defined(LOCALIZATION_BENCHMARK)
+void localization_benchmark_read(localization_benchmark_t *benchmark) {
+    *benchmark = _localization_data.benchmark;
+}
+#endif
@@ -22,15 +22,71 @@ typedef struct __attribute__((packed)) {
     uint32_t y;  ///< Y coordinate in mm
 } position_2d_t;
 
+/// Velocity estimated from the LH2 positions
+typedef struct __attribute__((packed)) {
+    int32_t x;  ///< X velocity in mm/s
+    int32_t y;  ///< Y velocity in mm/s
+} velocity_2d_t;
+
 typedef struct __attribute__((packed)) {
     uint8_t basestation_index;        ///< which LH basestation is this homography for?
     int32_t homography_matrix[3][3];  ///< homography matrix, each element multiplied by 1e3
 } localization_homography_t;
 
+/// Cycles spent in a localization function, measured with the DWT cycle counter
+typedef struct {
+    uint32_t count;                   ///< Number of calls measured
+    uint32_t total;                   ///< Cycles spent in all the calls, wraps around
+    uint32_t max;                     ///< Cycles spent in the longest call
+} localization_cycles_t;
+
+typedef struct {
+    localization_cycles_t process_data;   ///< Sweep decoding, run from the SPIM interrupt
+    localization_cycles_t get_position;   ///< Position computation and validation
+} localization_benchmark_t;
+
 void localization_init(void);
 
+/**
+ * @brief Stop receiving the LH2 sweeps, no position is estimated until localization_resume is called
+ */
+void localization_suspend(void);
+
+/**
+ * @brief Receive the LH2 sweeps again, the estimate restarts from the next measurement
+ */
+void localization_resume(void);
+
 bool localization_process_data(void);
 
+/**
+ * @brief Update the position estimate with the sweeps received since the previous call
+ *
+ * The estimate is predicted to the time of the call, so positions are given at the rate of the calls even between
+ * sweeps. Every base station with a new sweep refines it, outliers are rejected.
+ *
+ * @param[out] position address of the estimated position
+ *
+ * @return false when no measurement was accepted for too long
+ */
 bool localization_get_position(position_2d_t *position);
 
+/**
+ * @brief Read the velocity estimated at the latest localization_get_position call
+ *
+ * @param[out] velocity address of the estimated velocity
+ *
+ * @return false when no position is estimated
+ */
+bool localization_get_velocity(velocity_2d_t *velocity);
+
+#if defined(LOCALIZATION_BENCHMARK)
+/**
+ * @brief Read the cycles spent in the localization functions since boot, only built with LOCALIZATION_BENCHMARK
+ *
+ * @param[out] benchmark address of the output copy
+ */
+void localization_benchmark_read(localization_benchmark_t *benchmark);
+#endif
+
 #endif // __LOCALIZATION_H
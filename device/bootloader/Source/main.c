@@ -16,10 +16,15 @@
 #include <nrf.h>
 
 #include "battery.h"
+#include "event.h"
 #include "ipc.h"
 #include "nvmc.h"
+#include "ota.h"
 #include "protocol.h"
+#include "profile.h"
 #include "mari.h"
+#include "sha256.h"
+#include "snapshot.h"
 #include "tz.h"
 
 // DotBot-firmware includes
@@ -28,25 +33,39 @@
 #include "localization.h"
 #include "timer.h"
 
-#define SWARMIT_BASE_ADDRESS        (0x10000)
-
 #define BATTERY_UPDATE_DELAY        (1000U)
 #define POSITION_UPDATE_DELAY_MS    (100U) ///< 100ms delay between each position update
+#define IDLE_UPDATE_DELAY_MS        (10000U) ///< Battery and position update period in idle mode
+#define LH2_BENCHMARK_PERIOD        (100U) ///< Number of positions computed between two cycle counts printed
 
 #define BATTERY_VOLTAGE_WARNING     (1500)
 
+#define BOOTLOADER_TIMER_RTC        (NRF_RTC1_S)    ///< RTC behind the db_timer instance used by the bootloader
+#define BOOTLOADER_TIMER_IRQ        (RTC1_IRQn)
+
+#define OTA_ACK_FLUSH_DELAY_MS      (100U) ///< Maximum delay before acknowledging the chunks received
+
 extern volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_shared_data;
 
+typedef enum {
+    BOOTLOADER_EVENT_OTA_START,             ///< OTA start request forwarded by the network core, events are listed by decreasing priority
+    BOOTLOADER_EVENT_OTA_MANIFEST,          ///< Page manifest forwarded by the network core
+    BOOTLOADER_EVENT_OTA_CHUNK,             ///< OTA chunks queued by the network core
+    BOOTLOADER_EVENT_OTA_FINALIZE,          ///< OTA finalize request forwarded by the network core
+    BOOTLOADER_EVENT_OTA_ACK_FLUSH,         ///< Pending OTA ack delay elapsed
+    BOOTLOADER_EVENT_START_APPLICATION,     ///< Start request forwarded by the network core
+    BOOTLOADER_EVENT_IDLE,                  ///< Idle mode entered or left, on request of the gateway
+    BOOTLOADER_EVENT_BATTERY_UPDATE,        ///< Battery sampling period elapsed
+    BOOTLOADER_EVENT_OTA_INSTALL,           ///< Verified image to copy to the active slot, one page at a time
+    BOOTLOADER_EVENT_FLASH_ERASE,           ///< Pages of the download slot to erase ahead of the chunks, one slice at a time
+    BOOTLOADER_EVENT_COUNT,
+} bootloader_event_t;
+
 typedef struct {
-    uint8_t         notification_buffer[255]  __attribute__((aligned));
-    uint32_t        base_addr;
-    bool            ota_start_request;
-    bool            ota_require_erase;
-    bool            ota_chunk_request;
-    bool            start_application;
     position_2d_t   last_position;
     bool            position_update;
-    bool            battery_update;
+    uint32_t        snapshot_ticks;             ///< Snapshot timer periods elapsed since the last battery update
+    bool            idle;                       ///< LH2 and LEDs are off, the battery is sampled less often
 } bootloader_app_data_t;
 
 static const gpio_t _status_red_led = { .port = DB_RGB_LED_PWM_RED_PORT, .pin = DB_RGB_LED_PWM_RED_PIN };
@@ -54,6 +73,30 @@ static const gpio_t _status_green_led = { .port = DB_RGB_LED_PWM_GREEN_PORT, .pi
 
 static bootloader_app_data_t _bootloader_vars = { 0 };
 
+static void _handle_ota_start(void);
+static void _handle_ota_manifest(void);
+static void _handle_ota_chunk(void);
+static void _handle_ota_finalize(void);
+static void _handle_ota_ack_flush(void);
+static void _handle_start_application(void);
+static void _handle_idle(void);
+static void _handle_battery_update(void);
+static void _handle_ota_install(void);
+static void _handle_flash_erase(void);
+
+static event_t _events[BOOTLOADER_EVENT_COUNT] = {
+    [BOOTLOADER_EVENT_OTA_START]            = { .handler = _handle_ota_start },
+    [BOOTLOADER_EVENT_OTA_MANIFEST]         = { .handler = _handle_ota_manifest },
+    [BOOTLOADER_EVENT_OTA_CHUNK]            = { .handler = _handle_ota_chunk },
+    [BOOTLOADER_EVENT_OTA_FINALIZE]         = { .handler = _handle_ota_finalize },
+    [BOOTLOADER_EVENT_OTA_ACK_FLUSH]        = { .handler = _handle_ota_ack_flush },
+    [BOOTLOADER_EVENT_START_APPLICATION]    = { .handler = _handle_start_application },
+    [BOOTLOADER_EVENT_IDLE]                 = { .handler = _handle_idle },
+    [BOOTLOADER_EVENT_BATTERY_UPDATE]       = { .handler = _handle_battery_update },
+    [BOOTLOADER_EVENT_OTA_INSTALL]          = { .handler = _handle_ota_install },
+    [BOOTLOADER_EVENT_FLASH_ERASE]          = { .handler = _handle_flash_erase },
+};
+
 typedef void (*reset_handler_t)(void) __attribute__((cmse_nonsecure_call));
 
 typedef struct {
@@ -216,12 +259,241 @@ static void setup_ns_user(void) {
     __ISB(); // Flush and refill pipeline with updated permissions
 }
 
+static void _set_sampling_period(uint32_t update_delay_ms) {
+    // BATTERY_SAMPLE_COUNT samples per battery update period
+    NRF_TIMER2_S->CC[0] = (update_delay_ms / BATTERY_SAMPLE_COUNT) * 1000;
+}
+
+static void setup_sampling_timer(void) {
+    // TIMER2 stays secure, it triggers the battery samples and, while the user image runs, the snapshot updates
+    NRF_TIMER2_S->TASKS_CLEAR = 1;
+    NRF_TIMER2_S->PRESCALER   = 4;  // Run TIMER at 1MHz
+    NRF_TIMER2_S->BITMODE     = (TIMER_BITMODE_BITMODE_32Bit << TIMER_BITMODE_BITMODE_Pos);
+    _set_sampling_period(BATTERY_UPDATE_DELAY);
+    NRF_TIMER2_S->SHORTS      = (TIMER_SHORTS_COMPARE0_CLEAR_Enabled << TIMER_SHORTS_COMPARE0_CLEAR_Pos);
+    NRF_TIMER2_S->PUBLISH_COMPARE[0] = (TIMER_PUBLISH_COMPARE_EN_Enabled << TIMER_PUBLISH_COMPARE_EN_Pos | BATTERY_DPPI_CHANNEL_SAMPLE);
+    NRF_TIMER2_S->TASKS_START = 1;
+}
+
+static void _release_timer(void) {
+    // The user image finds the RTC as after a reset, its interrupt goes to the non secure world with it
+    NVIC_DisableIRQ(BOOTLOADER_TIMER_IRQ);
+    BOOTLOADER_TIMER_RTC->TASKS_STOP = 1;
+    BOOTLOADER_TIMER_RTC->INTENCLR = 0xFFFFFFFF;
+    BOOTLOADER_TIMER_RTC->EVTENCLR = 0xFFFFFFFF;
+    for (uint8_t channel = 0; channel < RTC1_CC_NUM; channel++) {
+        BOOTLOADER_TIMER_RTC->EVENTS_COMPARE[channel] = 0;
+    }
+    BOOTLOADER_TIMER_RTC->EVENTS_OVRFLW = 0;
+    BOOTLOADER_TIMER_RTC->EVENTS_TICK = 0;
+    BOOTLOADER_TIMER_RTC->TASKS_CLEAR = 1;
+    NVIC_ClearPendingIRQ(BOOTLOADER_TIMER_IRQ);
+}
+
+static void _start_user_image(void) {
+    // Experiment is running, PDUs left from a previous run are discarded, so is the region it offered for upload
+    ipc_shared_data.rx.tail = ipc_shared_data.rx.head;
+    ipc_shared_data.upload.size = 0;
+    ipc_shared_data.status = SWRMT_APPLICATION_RUNNING;
+
+    // Initialize watchdog and non secure access
+    setup_ns_user();
+    setup_watchdog0();
+    snapshot_init();
+    snapshot_set_battery_level(battery_level_get());
+    NRF_TIMER2_S->INTENSET = (TIMER_INTENSET_COMPARE0_Enabled << TIMER_INTENSET_COMPARE0_Pos);
+    NVIC_EnableIRQ(TIMER2_IRQn);
+    NVIC_SetTargetState(IPC_IRQn);    // Used for radio RX
+    NVIC_SetTargetState(SPIM4_IRQn);  // Used for LH2 localization
+
+    // Set the vector table address prior to jumping to image
+    SCB_NS->VTOR = (uint32_t)table;
+    __TZ_set_MSP_NS(table->msp);
+    __TZ_set_CONTROL_NS(0);
+
+    // Flush and refill pipeline
+    __ISB();
+
+    // Jump to non secure image
+    reset_handler_t reset_handler_ns = (reset_handler_t)(cmse_nsfptr_create(table->reset_handler));
+    reset_handler_ns();
+
+    while (1) {}
+}
+
 static void _update_position(void) {
     _bootloader_vars.position_update = true;
 }
 
+#if defined(LOCALIZATION_BENCHMARK)
+static void _print_localization_benchmark(void) {
+    localization_benchmark_t benchmark;
+    localization_benchmark_read(&benchmark);
+    if (benchmark.get_position.count % LH2_BENCHMARK_PERIOD) {
+        return;
+    }
+    printf("LH2 process: %u calls, %u cycles avg, %u max\n",
+           benchmark.process_data.count, benchmark.process_data.total / benchmark.process_data.count, benchmark.process_data.max);
+    printf("LH2 position: %u calls, %u cycles avg, %u max\n",
+           benchmark.get_position.count, benchmark.get_position.total / benchmark.get_position.count, benchmark.get_position.max);
+}
+#endif
+
 static void _read_battery(void) {
-    _bootloader_vars.battery_update = true;
+    event_post(&_events[BOOTLOADER_EVENT_BATTERY_UPDATE]);
+}
+
+static void _flush_ota_ack(void) {
+    event_post(&_events[BOOTLOADER_EVENT_OTA_ACK_FLUSH]);
+}
+
+void ota_platform_send(const uint8_t *buffer, uint8_t length) {
+    mari_node_tx(buffer, length);
+}
+
+void ota_platform_hash(crypto_sha256_ctx_t *ctx, const uint8_t *data, uint32_t length) {
+    uint32_t start = profile_start();
+    crypto_sha256_update(ctx, data, length);
+    profile_add(SWRMT_PROFILE_OTA_HASH, start);
+}
+
+void ota_platform_image(uint32_t size, const uint8_t *sha) {
+    // The network core answers the image requests
+    mutex_lock(IPC_MUTEX_OTA);
+    ipc_shared_data.image.size = size;
+    memcpy((uint8_t *)ipc_shared_data.image.sha, sha, SWRMT_OTA_SHA256_LENGTH);
+    mutex_unlock(IPC_MUTEX_OTA);
+}
+
+static void _handle_ota_start(void) {
+    ota_params_t params = {
+        .image_size     = ipc_shared_data.ota.image_size,
+        .chunk_count    = ipc_shared_data.ota.chunk_count,
+        .chunk_size     = ipc_shared_data.ota.chunk_size,
+        .ack_interval   = ipc_shared_data.ota.ack_interval,
+        .mode           = ipc_shared_data.ota.mode,
+        .fec_group      = ipc_shared_data.ota.fec_group,
+        .output_size    = ipc_shared_data.ota.output_size,
+        .base_size      = ipc_shared_data.ota.base_size,
+    };
+    memcpy(params.base_sha, (const uint8_t *)ipc_shared_data.ota.base_sha, sizeof(params.base_sha));
+    if (!ota_start(&params)) {
+        ipc_shared_data.status = SWRMT_APPLICATION_READY;
+    }
+}
+
+static void _handle_ota_manifest(void) {
+    swrmt_ota_manifest_pkt_t manifest;
+    memcpy(&manifest, (const void *)&ipc_shared_data.ota.manifest, sizeof(swrmt_ota_manifest_pkt_t));
+    ota_manifest(&manifest);
+    // Kept chunks are processed like received ones, the image may already be complete
+    event_post(&_events[BOOTLOADER_EVENT_OTA_CHUNK]);
+}
+
+static void _handle_ota_chunk(void) {
+    // Process all chunks queued by the network core
+    while (ipc_shared_data.ota.chunk_tail != ipc_shared_data.ota.chunk_head) {
+        __DMB();
+        volatile ipc_ota_chunk_t *chunk = &ipc_shared_data.ota.chunks[ipc_shared_data.ota.chunk_tail % IPC_OTA_CHUNK_QUEUE_SIZE];
+        ota_chunk_received(chunk->index, (const uint8_t *)chunk->data, chunk->size);
+        __DMB();
+        ipc_shared_data.ota.chunk_tail++;
+    }
+
+    // Set back to ready state once all chunks are written
+    if (ota_chunks_processed()) {
+        ipc_shared_data.status = SWRMT_APPLICATION_READY;
+    }
+
+    // The chunks written may have queued the erase of the next pages
+    event_post(&_events[BOOTLOADER_EVENT_FLASH_ERASE]);
+}
+
+static void _handle_ota_finalize(void) {
+    // The device is only ready again once installed, the network core refuses the starts meanwhile. Set before
+    // the ack is sent, the statuses following the ack are programming until the image is installed
+    uint8_t status = ipc_shared_data.status;
+    ipc_shared_data.status = SWRMT_APPLICATION_PROGRAMMING;
+    if (ota_finalize((const uint8_t *)ipc_shared_data.ota.image_sha)) {
+        event_post(&_events[BOOTLOADER_EVENT_OTA_INSTALL]);
+    } else if (!ota_install_pending()) {
+        ipc_shared_data.status = status;
+    }
+}
+
+static void _handle_ota_ack_flush(void) {
+    ota_ack_flush();
+}
+
+static void _handle_start_application(void) {
+    // Warm start: the network core keeps its Mari connection and the LH2 state is kept, only the resources
+    // of the bootloader loop are released before the jump
+    if (ota_install_pending()) {
+        // Only requested once ready, the image is then installed
+        return;
+    }
+    _release_timer();
+    db_gpio_clear(&_status_red_led);
+    db_gpio_clear(&_status_green_led);
+    _start_user_image();
+}
+
+static void _handle_idle(void) {
+    bool idle = ipc_shared_data.status == SWRMT_APPLICATION_IDLE;
+    if (idle == _bootloader_vars.idle) {
+        return;
+    }
+    _bootloader_vars.idle = idle;
+
+    // The battery is still sampled in the background, BATTERY_SAMPLE_COUNT samples per update period
+    uint32_t update_delay_ms = idle ? IDLE_UPDATE_DELAY_MS : BATTERY_UPDATE_DELAY;
+    _set_sampling_period(update_delay_ms);
+    NRF_TIMER2_S->TASKS_CLEAR = 1;
+    db_timer_set_periodic_ms(1, 1, idle ? IDLE_UPDATE_DELAY_MS : POSITION_UPDATE_DELAY_MS, &_update_position);
+    db_timer_set_periodic_ms(1, 2, update_delay_ms, &_read_battery);
+
+    if (idle) {
+        localization_suspend();
+        db_gpio_clear(&_status_red_led);
+        db_gpio_clear(&_status_green_led);
+    } else {
+        localization_resume();
+    }
+}
+
+static void _handle_battery_update(void) {
+    uint16_t battery_level = battery_level_get();
+    ipc_telemetry_set_battery_level(battery_level);
+    if (_bootloader_vars.idle) {
+        // The LEDs stay off in idle mode
+        return;
+    }
+    if (battery_level > BATTERY_VOLTAGE_WARNING) {
+        db_gpio_clear(&_status_red_led);
+        db_gpio_toggle(&_status_green_led);
+    } else {
+        db_gpio_toggle(&_status_red_led);
+        db_gpio_clear(&_status_green_led);
+    }
+}
+
+static void _handle_ota_install(void) {
+    // One page per event, requests received meanwhile are handled in between
+    if (!ota_install_pending()) {
+        return;
+    }
+    if (!ota_install_step()) {
+        event_post(&_events[BOOTLOADER_EVENT_OTA_INSTALL]);
+        return;
+    }
+    ipc_shared_data.status = SWRMT_APPLICATION_READY;
+}
+
+static void _handle_flash_erase(void) {
+    // Each slice stalls the CPU for a few ms only, events posted meanwhile are handled in between
+    if (!nvmc_page_erase_step()) {
+        event_post(&_events[BOOTLOADER_EVENT_FLASH_ERASE]);
+    }
 }
 
 int main(void) {
@@ -244,17 +516,26 @@ int main(void) {
                             1 << IPC_CHAN_RADIO_RX |
                             1 << IPC_CHAN_OTA_START |
                             1 << IPC_CHAN_OTA_CHUNK |
-                            1 << IPC_CHAN_APPLICATION_START
+                            1 << IPC_CHAN_OTA_FINALIZE |
+                            1 << IPC_CHAN_OTA_MANIFEST |
+                            1 << IPC_CHAN_APPLICATION_START |
+                            1 << IPC_CHAN_IDLE
                             //1 << IPC_CHAN_APPLICATION_RESET
                         );
     NRF_IPC_S->SEND_CNF[IPC_CHAN_REQ]                   = 1 << IPC_CHAN_REQ;
     NRF_IPC_S->SEND_CNF[IPC_CHAN_LOG_EVENT]             = 1 << IPC_CHAN_LOG_EVENT;
+    NRF_IPC_S->SEND_CNF[IPC_CHAN_RADIO_TX]              = 1 << IPC_CHAN_RADIO_TX;
+    NRF_IPC_S->SEND_CNF[IPC_CHAN_POSITION]              = 1 << IPC_CHAN_POSITION;
+    NRF_IPC_S->SEND_CNF[IPC_CHAN_RADIO_RX_DONE]         = 1 << IPC_CHAN_RADIO_RX_DONE;
+    NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_IDLE]               = 1 << IPC_CHAN_IDLE;
     NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_RADIO_RX]           = 1 << IPC_CHAN_RADIO_RX;
     NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_APPLICATION_START]  = 1 << IPC_CHAN_APPLICATION_START;
     NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_APPLICATION_STOP]   = 1 << IPC_CHAN_APPLICATION_STOP;
     //NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_APPLICATION_RESET]  = 1 << IPC_CHAN_APPLICATION_RESET;
     NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_OTA_START]          = 1 << IPC_CHAN_OTA_START;
     NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_OTA_CHUNK]          = 1 << IPC_CHAN_OTA_CHUNK;
+    NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_OTA_FINALIZE]       = 1 << IPC_CHAN_OTA_FINALIZE;
+    NRF_IPC_S->RECEIVE_CNF[IPC_CHAN_OTA_MANIFEST]       = 1 << IPC_CHAN_OTA_MANIFEST;
     NVIC_EnableIRQ(IPC_IRQn);
     NVIC_ClearPendingIRQ(IPC_IRQn);
     NVIC_SetPriority(IPC_IRQn, IPC_IRQ_PRIORITY);
@@ -275,50 +556,47 @@ int main(void) {
     ipc_shared_data.device_type = SWRMT_DEVICE_TYPE_UNKNOWN;
 #endif
 
+    // The profiling counters are cleared before the network core can send them
+    profile_init();
+
     // Start the network core
     release_network_core();
 
     mari_init();
 
+    // The battery is sampled in the background, BATTERY_SAMPLE_COUNT samples are averaged
     battery_level_init();
-    ipc_shared_data.battery_level = battery_level_read();
+    battery_level_start();
+    ipc_telemetry_set_battery_level(battery_level_get());
+    setup_sampling_timer();
 
     NVIC_ClearTargetState(SPIM4_IRQn);
     NVIC_ClearTargetState(IPC_IRQn);
     localization_init();
 
+    // Finish installing the image committed before the reset, the active slot is then complete
+    if (ota_install_pending()) {
+        ota_install();
+    }
+
     // Check reset reason and switch to user image if reset was not triggered by any wdt timeout
     uint32_t resetreas = NRF_RESET_S->RESETREAS;
     NRF_RESET_S->RESETREAS = NRF_RESET_S->RESETREAS;
 
+    if (!resetreas) {
+        // The RAM content is random after a power on reset, nothing was offered for upload
+        memset((void *)&ipc_shared_data.upload, 0, sizeof(ipc_upload_data_t));
+    } else if (ipc_shared_data.upload.size) {
+        // The network core keeps reading the region offered by the stopped user image
+        tz_configure_ram_non_secure(4, 48);
+    }
+
      //Boot user image after soft system reset
     if (resetreas & RESET_RESETREAS_SREQ_Detected << RESET_RESETREAS_SREQ_Pos) {
-        // Experiment is running
-        ipc_shared_data.status = SWRMT_APPLICATION_RUNNING;
-
-        // Initialize watchdog and non secure access
-        setup_ns_user();
-        setup_watchdog0();
-        NVIC_SetTargetState(IPC_IRQn);    // Used for radio RX
-        NVIC_SetTargetState(SPIM4_IRQn);  // Used for LH2 localization
-
-        // Set the vector table address prior to jumping to image
-        SCB_NS->VTOR = (uint32_t)table;
-        __TZ_set_MSP_NS(table->msp);
-        __TZ_set_CONTROL_NS(0);
-
-        // Flush and refill pipeline
-        __ISB();
-
-        // Jump to non secure image
-        reset_handler_t reset_handler_ns = (reset_handler_t)(cmse_nsfptr_create(table->reset_handler));
-        reset_handler_ns();
-
-        while (1) {}
+        _start_user_image();
     }
 
-    _bootloader_vars.base_addr = SWARMIT_BASE_ADDRESS;
-    _bootloader_vars.ota_require_erase = true;
+    ota_image_check();
 
     // Status LEDs
     db_gpio_init(&_status_red_led, DB_GPIO_OUT);
@@ -328,92 +606,34 @@ int main(void) {
     db_timer_init(1);
     db_timer_set_periodic_ms(1, 1, POSITION_UPDATE_DELAY_MS, &_update_position);
     db_timer_set_periodic_ms(1, 2, BATTERY_UPDATE_DELAY, &_read_battery);
+    db_timer_set_periodic_ms(1, 3, OTA_ACK_FLUSH_DELAY_MS, &_flush_ota_ack);
 
     // Experiment is ready
     ipc_shared_data.status = SWRMT_APPLICATION_READY;
 
     while (1) {
-        __WFE();
-
-        if (_bootloader_vars.ota_start_request) {
-            _bootloader_vars.ota_start_request = false;
-
-            if (_bootloader_vars.ota_require_erase) {
-                // Erase non secure flash
-                uint32_t pages_count = (ipc_shared_data.ota.image_size / FLASH_PAGE_SIZE) + (ipc_shared_data.ota.image_size % FLASH_PAGE_SIZE != 0);
-                printf("Pages to erase: %u\n", pages_count);
-                for (uint32_t page = 0; page < pages_count; page++) {
-                    uint32_t addr = _bootloader_vars.base_addr + page * FLASH_PAGE_SIZE;
-                    printf("Erasing page %u at %p\n", page + 16, (uint32_t *)addr);
-                    nvmc_page_erase(page + 16);
-                }
-                printf("Erasing done\n");
-                _bootloader_vars.ota_require_erase = false;
-            }
-
-            // Notify erase is done
-            size_t length = 0;
-            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_OTA_START_ACK;
-            mari_node_tx(_bootloader_vars.notification_buffer, length);
-        }
-
-        if (_bootloader_vars.ota_chunk_request) {
-            _bootloader_vars.ota_chunk_request = false;
+        // Handle the most urgent posted event, if any
+        bool handled = event_dispatch(_events, BOOTLOADER_EVENT_COUNT);
 
-            if (ipc_shared_data.ota.last_chunk_acked != (int32_t)ipc_shared_data.ota.chunk_index) {
-                // Write chunk to flash
-                uint32_t addr = _bootloader_vars.base_addr + ipc_shared_data.ota.chunk_index * SWRMT_OTA_CHUNK_SIZE;
-                printf("Writing chunk %d/%d at address %p\n", ipc_shared_data.ota.chunk_index, ipc_shared_data.ota.chunk_count - 1, (uint32_t *)addr);
-                nvmc_write((uint32_t *)addr, (void *)ipc_shared_data.ota.chunk, ipc_shared_data.ota.chunk_size);
-                _bootloader_vars.ota_require_erase = true;
-            }
-
-            // Notify chunk has been written
-            size_t length = 0;
-            _bootloader_vars.notification_buffer[length++] = SWRMT_MSG_OTA_CHUNK_ACK;
-            memcpy(_bootloader_vars.notification_buffer + length, (void *)&ipc_shared_data.ota.chunk_index, sizeof(uint32_t));
-            length += sizeof(uint32_t);
-            ipc_shared_data.ota.last_chunk_acked = ipc_shared_data.ota.chunk_index;
-            mari_node_tx(_bootloader_vars.notification_buffer, length);
-
-            // If last chunk, finalize computed hash, set back to ready state
-            if (ipc_shared_data.ota.chunk_index == ipc_shared_data.ota.chunk_count - 1) {
-                ipc_shared_data.status = SWRMT_APPLICATION_READY;
-            }
-        }
-
-        if (_bootloader_vars.start_application) {
-            NVIC_SystemReset();
-        }
-
-        if (_bootloader_vars.battery_update) {
-            _bootloader_vars.battery_update = false;
-            uint16_t battery_level = battery_level_read();
-            ipc_shared_data.battery_level = battery_level;
-            if (battery_level > BATTERY_VOLTAGE_WARNING) {
-                db_gpio_clear(&_status_red_led);
-                db_gpio_toggle(&_status_green_led);
-            } else {
-                db_gpio_toggle(&_status_red_led);
-                db_gpio_clear(&_status_green_led);
-            }
-        }
-
-        // Process available lighthouse data
+        // Process available lighthouse data, the estimate is updated at the timer rate even between sweeps,
+        // and at every sweep while positions are streamed
         bool data_available = localization_process_data();
-        if (_bootloader_vars.position_update && data_available) {
+        bool position_update = _bootloader_vars.position_update || (ipc_shared_data.position_stream_period && data_available);
+        if (position_update) {
             position_2d_t position = { 0 };
             bool valid_position = localization_get_position(&position);
             if (valid_position) {
-                mutex_lock();
-                ipc_shared_data.current_position.x = position.x;
-                ipc_shared_data.current_position.y = position.y;
-                mutex_unlock();
-                printf("Position (%u,%u)\n", position.x, position.y);
-            } else {
-                printf("Invalid position (%u,%u)\n", position.x, position.y);
+                ipc_telemetry_set_position(&position);
             }
             _bootloader_vars.position_update = false;
+#if defined(LOCALIZATION_BENCHMARK)
+            _print_localization_benchmark();
+#endif
+        }
+
+        // Sleep only once all the posted events are handled
+        if (!handled) {
+            __WFE();
         }
     }
 }
@@ -424,16 +644,54 @@ void IPC_IRQHandler(void) {
 
     if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_START]) {
         NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_START] = 0;
-        _bootloader_vars.ota_start_request = true;
+        event_post(&_events[BOOTLOADER_EVENT_OTA_START]);
     }
 
     if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_CHUNK]) {
         NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_CHUNK] = 0;
-        _bootloader_vars.ota_chunk_request = true;
+        event_post(&_events[BOOTLOADER_EVENT_OTA_CHUNK]);
+    }
+
+    if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_FINALIZE]) {
+        NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_FINALIZE] = 0;
+        event_post(&_events[BOOTLOADER_EVENT_OTA_FINALIZE]);
+    }
+
+    if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_MANIFEST]) {
+        NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_OTA_MANIFEST] = 0;
+        event_post(&_events[BOOTLOADER_EVENT_OTA_MANIFEST]);
     }
 
     if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_APPLICATION_START]) {
         NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_APPLICATION_START] = 0;
-        _bootloader_vars.start_application = true;
+        event_post(&_events[BOOTLOADER_EVENT_START_APPLICATION]);
+    }
+
+    if (NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_IDLE]) {
+        NRF_IPC_S->EVENTS_RECEIVE[IPC_CHAN_IDLE] = 0;
+        event_post(&_events[BOOTLOADER_EVENT_IDLE]);
+    }
+}
+
+void TIMER2_IRQHandler(void) {
+    // Only enabled while the user image runs, also pended by the LH2 interrupt when a sweep is decoded
+    if (NRF_TIMER2_S->EVENTS_COMPARE[0]) {
+        NRF_TIMER2_S->EVENTS_COMPARE[0] = 0;
+        // The timer period is the battery sampling period, the battery level is refreshed once per update period
+        if (++_bootloader_vars.snapshot_ticks >= BATTERY_SAMPLE_COUNT) {
+            _bootloader_vars.snapshot_ticks = 0;
+            uint16_t battery_level = battery_level_get();
+            ipc_telemetry_set_battery_level(battery_level);
+            snapshot_set_battery_level(battery_level);
+        }
+    }
+
+    // The estimate is only updated from this interrupt, it is predicted between sweeps
+    position_2d_t position;
+    velocity_2d_t velocity;
+    bool valid = localization_get_position(&position) && localization_get_velocity(&velocity);
+    if (valid) {
+        ipc_telemetry_set_position(&position);
     }
+    snapshot_set_position(&position, &velocity, valid);
 }
@@ -33,8 +33,31 @@ void mari_init(void) {
     ipc_network_call(IPC_MARI_INIT_REQ);
 }
 
-void mari_node_tx(const uint8_t *packet, uint8_t length) {
-    ipc_shared_data.tx_pdu.length = length;
-    memcpy((void *)ipc_shared_data.tx_pdu.buffer, packet, length);
-    ipc_network_call(IPC_MARI_NODE_TX_REQ);
+bool mari_node_tx(const uint8_t *packet, uint8_t length) {
+    const mari_segment_t segment = { .data = packet, .length = length };
+    return mari_node_tx_segments(&segment, 1);
+}
+
+bool mari_node_tx_segments(const mari_segment_t *segments, size_t count) {
+    size_t length = 0;
+    for (size_t i = 0; i < count; i++) {
+        length += segments[i].length;
+    }
+    // Don't wait for the network core, the caller decides what to do with a packet that doesn't fit
+    if (length > UINT8_MAX || ipc_shared_data.tx.head - ipc_shared_data.tx.tail >= IPC_TX_QUEUE_SIZE) {
+        return false;
+    }
+
+    // The slot is owned by the application core until the head index is incremented
+    volatile ipc_radio_pdu_t *pdu = &ipc_shared_data.tx.pdus[ipc_shared_data.tx.head % IPC_TX_QUEUE_SIZE];
+    pdu->length = length;
+    size_t pos = 0;
+    for (size_t i = 0; i < count; i++) {
+        memcpy((void *)&pdu->buffer[pos], segments[i].data, segments[i].length);
+        pos += segments[i].length;
+    }
+    __DMB();
+    ipc_shared_data.tx.head++;
+    NRF_IPC_S->TASKS_SEND[IPC_CHAN_RADIO_TX] = 1;
+    return true;
 }
@@ -13,9 +13,18 @@
  * @}
  */
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <nrf.h>
 
+//=========================== definitions ======================================
+
+typedef struct {
+    const uint8_t   *data;      ///< Start of the segment
+    uint8_t         length;     ///< Number of bytes in the segment
+} mari_segment_t;
+
 //=========================== prototypes =======================================
 
 /**
@@ -24,12 +33,23 @@
 void mari_init(void);
 
 /**
- * @brief Queues a single node packet to send through mari
+ * @brief Queues a single node packet to send through mari, without waiting for the network core
  *
  * @param[in] packet pointer to the array of data to send over the radio
  * @param[in] length Number of bytes to send
  *
+ * @return true if the packet is queued, false if the TX queue is full
+ */
+bool mari_node_tx(const uint8_t *packet, uint8_t length);
+
+/**
+ * @brief Queues a single node packet made of several segments, each segment is copied once, straight to the TX queue
+ *
+ * @param[in] segments  segments of the packet, in order
+ * @param[in] count     number of segments
+ *
+ * @return true if the packet is queued, false if the TX queue is full or the packet is longer than a PDU
  */
-void mari_node_tx(const uint8_t *packet, uint8_t length);
+bool mari_node_tx_segments(const mari_segment_t *segments, size_t count);
 
 #endif
@@ -0,0 +1,62 @@
+/**
+ * @file
+ * @ingroup bsp_profile
+ *
+ * @brief  nrf5340-app-specific definition of the "profile" bsp module.
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+#include <nrf.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ipc.h"
+#include "profile.h"
+
+//========================== variables =========================================
+
+extern volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_shared_data;
+
+static bool _profile_enabled = false;
+
+//=========================== public ===========================================
+
+void profile_init(void) {
+    for (uint8_t section = 0; section < SWRMT_PROFILE_APP_COUNT; section++) {
+        volatile swrmt_profile_counter_t *counter = &ipc_shared_data.profile[section];
+        counter->count = 0;
+        counter->min = UINT32_MAX;
+        counter->max = 0;
+        counter->total = 0;
+    }
+#if SWARMIT_PROFILING
+    // The cycle counter is optional, the counters stay empty without it. It is shared with the localization
+    // timestamps, so it is never reset
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    _profile_enabled = !(DWT->CTRL & DWT_CTRL_NOCYCCNT_Msk);
+    if (_profile_enabled) {
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+#endif
+}
+
+#if SWARMIT_PROFILING
+void profile_add(swrmt_profile_section_t section, uint32_t start) {
+    if (!_profile_enabled) {
+        return;
+    }
+    // The network core may read a counter while it is updated, a dump can then mix two consecutive runs
+    uint32_t elapsed = DWT->CYCCNT - start;
+    volatile swrmt_profile_counter_t *counter = &ipc_shared_data.profile[section];
+    counter->count++;
+    counter->total += elapsed;
+    if (elapsed < counter->min) {
+        counter->min = elapsed;
+    }
+    if (elapsed > counter->max) {
+        counter->max = elapsed;
+    }
+}
+#endif
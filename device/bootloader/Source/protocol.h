@@ -24,7 +24,17 @@
 #define GATEWAY_ADDRESS   0x0000000000000000UL  ///< Gateway address
 
 #define SWRMT_PREAMBLE_LENGTH       (8U)
-#define SWRMT_OTA_CHUNK_SIZE        (128U)
+#define SWRMT_OTA_CHUNK_SIZE        (192U)      ///< Maximum size of an OTA chunk, the actual size is given at OTA start
+#define SWRMT_OTA_CHUNK_SIZE_MIN    (64U)       ///< Minimum size of an OTA chunk
+#define SWRMT_OTA_SHA256_LENGTH     (32U)
+#define SWRMT_OTA_ACK_BITMAP_SIZE   (16U)       ///< Size in bytes of the received chunks bitmap sent in OTA acks
+#define SWRMT_OTA_MANIFEST_PAGES_MAX (32U)      ///< Maximum number of pages described by an OTA manifest packet
+#define SWRMT_OTA_FEC_GROUP_MAX     (32U)       ///< Maximum number of chunks protected by the same repair chunks
+#define SWRMT_OTA_FEC_REPAIRS_MAX   (8U)        ///< Maximum number of repair chunks of a group, their indexes follow the chunks
+#define SWRMT_LOG_RECORD_FORMATTED  (0x80U)     ///< Set in a log record length when it contains a format string address and its arguments
+#define SWRMT_OTA_LZ_MATCH_FLAG     (0x80)      ///< Set in a compressed stream token followed by a back reference
+#define SWRMT_OTA_LZ_MIN_MATCH      (3U)        ///< Length of a back reference whose token length bits are 0
+#define SWRMT_OTA_LZ_WINDOW_SIZE    (4096U)     ///< Maximum distance of a back reference
 
 typedef struct __attribute__((packed)) {
     uint32_t index;                             ///< Index of the chunk
@@ -32,12 +42,42 @@ typedef struct __attribute__((packed)) {
     uint8_t  chunk[SWRMT_OTA_CHUNK_SIZE];       ///< Bytes array of the firmware chunk
 } swrmt_ota_chunk_pkt_t;
 
+typedef struct __attribute__((packed)) {
+    uint8_t  session;                           ///< OTA session, devices ignore the packets of the other sessions
+    uint8_t  sha[SWRMT_OTA_SHA256_LENGTH];      ///< SHA256 of the complete image
+} swrmt_ota_finalize_pkt_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  session;                           ///< OTA session, devices ignore the packets of the other sessions
+    uint16_t first_page;                        ///< Index of the first page described, from the start of the image
+    uint8_t  count;                             ///< Size of the crc array in bytes, 4 per page described
+    uint32_t crc[SWRMT_OTA_MANIFEST_PAGES_MAX]; ///< CRC32 of the image bytes in each page
+} swrmt_ota_manifest_pkt_t;
+
+typedef enum {
+    SWRMT_OTA_MODE_RAW = 0,                     ///< Chunks contain the image
+    SWRMT_OTA_MODE_DELTA = 1,                   ///< Chunks contain a patch to apply to the installed image
+    SWRMT_OTA_MODE_COMPRESSED = 2,              ///< Chunks contain the compressed image
+} swrmt_ota_mode_t;
+
+typedef enum {
+    SWRMT_OTA_DELTA_OP_COPY = 0,                ///< Copy bytes from the installed image
+    SWRMT_OTA_DELTA_OP_DATA = 1,                ///< Bytes following the operation
+} swrmt_ota_delta_op_type_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t  type;                              ///< Operation type, see swrmt_ota_delta_op_type_t
+    uint16_t length;                            ///< Number of bytes produced by the operation
+    uint32_t source;                            ///< Offset of the copied bytes in the installed image
+} swrmt_ota_delta_op_t;
+
 typedef enum {
     SWRMT_APPLICATION_READY = 0,
     SWRMT_APPLICATION_RUNNING,
     SWRMT_APPLICATION_STOPPING,
     SWRMT_APPLICATION_RESETTING,
     SWRMT_APPLICATION_PROGRAMMING,
+    SWRMT_APPLICATION_IDLE,
 } swrmt_application_status_t;
 
 typedef enum {
@@ -51,8 +91,45 @@ typedef enum {
     SWRMT_MSG_OTA_CHUNK_ACK = 0x87,
     SWRMT_MSG_GPIO_EVENT = 0x88,
     SWRMT_MSG_LOG_EVENT = 0x89,
+    SWRMT_MSG_OTA_CHUNKS_ACK = 0x8A,
+    SWRMT_MSG_OTA_FINALIZE = 0x8B,
+    SWRMT_MSG_OTA_FINALIZE_ACK = 0x8C,
+    SWRMT_MSG_OTA_MANIFEST = 0x8D,
+    SWRMT_MSG_OTA_MANIFEST_ACK = 0x8E,
+    SWRMT_MSG_LOG_BATCH = 0x8F,
+    SWRMT_MSG_POSITION_STREAM = 0x90,
+    SWRMT_MSG_POSITION_BATCH = 0x91,
+    SWRMT_MSG_IDLE = 0x92,
+    SWRMT_MSG_SCHEDULE = 0x93,
+    SWRMT_MSG_GROUP = 0x94,
+    SWRMT_MSG_GROUP_SET = 0x95,
+    SWRMT_MSG_PROFILE = 0x96,
+    SWRMT_MSG_TRACE = 0x97,
+    SWRMT_MSG_IMAGE = 0x98,
+    SWRMT_MSG_UPLOAD = 0x99,
+    SWRMT_MSG_UPLOAD_REQUEST = 0x9A,
+    SWRMT_MSG_UPLOAD_CHUNK = 0x9B,
 } swrmt_message_type_t;
 
+/// Sections timed with the cycle counter, the application core ones first
+typedef enum {
+    SWRMT_PROFILE_OTA_HASH = 0,                 ///< SHA256 update of the OTA image bytes, application core
+    SWRMT_PROFILE_PAGE_ERASE,                   ///< Flash page erase, application core
+    SWRMT_PROFILE_LOCALIZATION,                 ///< LH2 sweeps processing in localization_process_data, application core
+    SWRMT_PROFILE_MUTEX_WAIT,                   ///< Hardware mutex spin in mutex_lock, application core
+    SWRMT_PROFILE_APP_COUNT,
+    SWRMT_PROFILE_CHUNK_CHECK = SWRMT_PROFILE_APP_COUNT,    ///< Copy and CRC32 of a received OTA chunk, network core
+    SWRMT_PROFILE_NET_MUTEX_WAIT,               ///< Hardware mutex spin in mutex_lock, network core
+    SWRMT_PROFILE_COUNT,
+} swrmt_profile_section_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t count;                             ///< Number of runs of the section since boot
+    uint32_t min;                               ///< Fewest cycles of a run, UINT32_MAX before the first one
+    uint32_t max;                               ///< Most cycles of a run
+    uint64_t total;                             ///< Cycles of all the runs, the average is total / count
+} swrmt_profile_counter_t;
+
 /// Application type
 typedef enum {
     DotBot        = 0,  ///< DotBot application
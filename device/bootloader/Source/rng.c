@@ -11,6 +11,7 @@
 #include <nrf.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "ipc.h"
 #include "rng.h"
@@ -22,10 +23,23 @@ extern volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_s
 //=========================== public ===========================================
 
 void rng_init(void) {
-    ipc_network_call(IPC_RNG_INIT_REQ);
+    // Requests are processed in order, reads posted later wait for the init
+    ipc_network_post(IPC_RNG_INIT_REQ, 0);
+    ipc_network_ring();
 }
 
 void rng_read(uint8_t *value) {
-    ipc_network_call(IPC_RNG_READ_REQ);
-    *value = ipc_shared_data.rng.value;
+    rng_read_buffer(value, 1);
+}
+
+void rng_read_buffer(uint8_t *buffer, size_t length) {
+    while (length) {
+        uint8_t count = (length < IPC_RNG_BUFFER_SIZE) ? length : IPC_RNG_BUFFER_SIZE;
+        uint32_t id = ipc_network_post(IPC_RNG_READ_REQ, count);
+        ipc_network_ring();
+        ipc_network_wait(id);
+        memcpy(buffer, (const void *)ipc_shared_data.rng.value, count);
+        buffer += count;
+        length -= count;
+    }
 }
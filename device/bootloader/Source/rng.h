@@ -13,6 +13,7 @@
  * @}
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 //=========================== defines ==========================================
@@ -31,4 +32,12 @@ void rng_init(void);
  */
 void rng_read(uint8_t *value);
 
+/**
+ * @brief Read random bytes, with one network core request per IPC_RNG_BUFFER_SIZE bytes
+ *
+ * @param[out] buffer address of the output buffer
+ * @param[in]  length number of bytes to read
+ */
+void rng_read_buffer(uint8_t *buffer, size_t length);
+
 #endif
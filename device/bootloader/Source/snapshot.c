@@ -0,0 +1,60 @@
+/**
+ * @file
+ * @ingroup bsp_snapshot
+ *
+ * @brief  nrf5340-app-specific definition of the "snapshot" bsp module.
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+#include <nrf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+//========================== variables =========================================
+
+static volatile swarmit_snapshot_t *const _snapshot = (volatile swarmit_snapshot_t *)SWARMIT_SNAPSHOT_ADDRESS;
+
+//=========================== private ==========================================
+
+static void _update_begin(void) {
+    _snapshot->seq++;
+    __DMB();
+}
+
+static void _update_end(void) {
+    __DMB();
+    _snapshot->seq++;
+}
+
+//=========================== public ===========================================
+
+void snapshot_init(void) {
+    memset((void *)_snapshot, 0, sizeof(swarmit_snapshot_t));
+}
+
+void snapshot_set_battery_level(uint16_t battery_level) {
+    _update_begin();
+    _snapshot->battery_level = battery_level;
+    _update_end();
+}
+
+void snapshot_set_position(const position_2d_t *position, const velocity_2d_t *velocity, bool valid) {
+    _update_begin();
+    if (valid) {
+        _snapshot->position.x = position->x;
+        _snapshot->position.y = position->y;
+        _snapshot->velocity.x = velocity->x;
+        _snapshot->velocity.y = velocity->y;
+    } else {
+        // The last position is kept, the velocity is unknown
+        _snapshot->velocity.x = 0;
+        _snapshot->velocity.y = 0;
+    }
+    _snapshot->position_valid = valid;
+    _update_end();
+}
@@ -0,0 +1,61 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+/**
+ * @defgroup    bsp_snapshot    Telemetry snapshot
+ * @ingroup     bsp
+ * @brief       Telemetry shared with the user image without secure gateway call
+ *
+ * The snapshot is placed at the beginning of the non secure RAM, below the RAM used by user images. It is only
+ * written by the secure side, from the TIMER2 interrupt, and read by the user image with a sequence counter: the
+ * counter is odd while an update is in progress. The layout must match sample/Source/swarmit_snapshot.h.
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "localization.h"
+
+//=========================== defines ==========================================
+
+#define SWARMIT_SNAPSHOT_ADDRESS    (0x20008000UL)  ///< First non secure RAM region
+
+typedef struct {
+    uint32_t        seq;                ///< Number of updates started and completed, odd while updating
+    position_2d_t   position;           ///< Latest estimated position
+    velocity_2d_t   velocity;           ///< Latest estimated velocity, zero when the position is unknown
+    uint16_t        battery_level;      ///< Battery level in mV
+    uint8_t         position_valid;     ///< 1 when the position is estimated
+    uint8_t         reserved;
+} swarmit_snapshot_t;
+
+//=========================== prototypes =======================================
+
+/**
+ * @brief Clear the snapshot, before the user image is started
+ */
+void snapshot_init(void);
+
+/**
+ * @brief Publish a new battery level
+ *
+ * @param[in] battery_level battery level in mV
+ */
+void snapshot_set_battery_level(uint16_t battery_level);
+
+/**
+ * @brief Publish a new position estimate
+ *
+ * @param[in] position  estimated position, ignored when not valid
+ * @param[in] velocity  estimated velocity, ignored when not valid
+ * @param[in] valid     false when no position is estimated
+ */
+void snapshot_set_position(const position_2d_t *position, const velocity_2d_t *velocity, bool valid);
+
+#endif
@@ -0,0 +1,37 @@
+/**
+ * @file
+ * @ingroup drv_crc32
+ *
+ * @brief  Implementation of the CRC32 computation
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crc32.h"
+
+//=========================== variables ========================================
+
+// A nibble table keeps the flash footprint small while being much faster than bitwise
+static const uint32_t _crc32_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+    0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+    0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+};
+
+//=========================== public ===========================================
+
+uint32_t crc32(const uint8_t *data, size_t length) {
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ _crc32_table[crc & 0x0F];
+        crc = (crc >> 4) ^ _crc32_table[crc & 0x0F];
+    }
+    return ~crc;
+}
@@ -0,0 +1,23 @@
+#ifndef __CRC32_H
+#define __CRC32_H
+
+/**
+ * @defgroup    drv_crc32   CRC32 computation
+ * @ingroup     drv
+ * @brief       IEEE 802.3 CRC32, same as zlib.crc32 in Python
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+//=========================== public ===========================================
+
+uint32_t crc32(const uint8_t *data, size_t length);
+
+#endif // __CRC32_H
@@ -0,0 +1,39 @@
+/**
+ * @file
+ * @ingroup drv_event
+ *
+ * @brief  Implementation of the event dispatcher.
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+#include <nrf.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+
+//=========================== public ===========================================
+
+void event_post(event_t *event) {
+    // An interrupt of higher priority can post the same event in between
+    uint32_t posted;
+    do {
+        posted = __LDREXW(&event->posted);
+    } while (__STREXW(posted + 1, &event->posted));
+
+    // Wake up the main loop even if it is about to enter __WFE
+    __SEV();
+}
+
+bool event_dispatch(event_t *events, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (events[i].posted != events[i].handled) {
+            events[i].handled++;
+            events[i].handler();
+            return true;
+        }
+    }
+    return false;
+}
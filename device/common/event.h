@@ -0,0 +1,54 @@
+#ifndef __EVENT_H
+#define __EVENT_H
+
+/**
+ * @defgroup    drv_event   Event dispatcher
+ * @ingroup     drv
+ * @brief       Counted events handled by priority from the main loop
+ *
+ * Events are posted from interrupt handlers and callbacks, and handled one at a time from the main loop.
+ * After each handler, the dispatcher starts again from the highest priority event, so latency critical work
+ * never waits behind more than one bulk handler. An event posted several times before being handled runs its
+ * handler as many times.
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+//=========================== defines ==========================================
+
+typedef void (*event_handler_t)(void);
+
+typedef struct {
+    event_handler_t     handler;    ///< Function called once per posted event
+    volatile uint32_t   posted;     ///< Number of times the event was posted
+    uint32_t            handled;    ///< Number of times the handler was called, only written by event_dispatch
+} event_t;
+
+//=========================== public ===========================================
+
+/**
+ * @brief Post an event, can be called from any interrupt priority
+ *
+ * @param[in] event pointer to the event
+ */
+void event_post(event_t *event);
+
+/**
+ * @brief Call the handler of the highest priority pending event
+ *
+ * @param[in] events table of events, ordered from the highest to the lowest priority
+ * @param[in] count  number of events in the table
+ *
+ * @return true if a handler was called, false if no event is pending
+ */
+bool event_dispatch(event_t *events, size_t count);
+
+#endif // __EVENT_H
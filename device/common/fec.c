@@ -0,0 +1,138 @@
+/**
+ * @file
+ * @ingroup drv_fec
+ *
+ * @brief  Implementation of the GF(256) arithmetic of the OTA repair chunks
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fec.h"
+
+//=========================== defines ==========================================
+
+#define FEC_POLYNOMIAL              (0x11D) ///< x^8 + x^4 + x^3 + x^2 + 1
+
+typedef struct {
+    bool    ready;                  ///< The tables are computed
+    uint8_t exp[2 * 255];           ///< Powers of 2, twice so that products need no modulo
+    uint8_t log[256];               ///< Logarithms in base 2, log[0] is not used
+} fec_vars_t;
+
+//=========================== variables ========================================
+
+static fec_vars_t _fec_vars = { 0 };
+
+//=========================== private ==========================================
+
+static void _fec_init(void) {
+    // The tables are only needed by the transfers with repair chunks, they are computed in RAM on first use
+    uint32_t value = 1;
+    for (uint32_t power = 0; power < 255; power++) {
+        _fec_vars.exp[power] = value;
+        _fec_vars.exp[power + 255] = value;
+        _fec_vars.log[value] = power;
+        value <<= 1;
+        if (value & 0x100) {
+            value ^= FEC_POLYNOMIAL;
+        }
+    }
+    _fec_vars.ready = true;
+}
+
+static uint8_t _fec_mul(uint8_t a, uint8_t b) {
+    if (!a || !b) {
+        return 0;
+    }
+    return _fec_vars.exp[_fec_vars.log[a] + _fec_vars.log[b]];
+}
+
+static uint8_t _fec_inv(uint8_t a) {
+    return _fec_vars.exp[255 - _fec_vars.log[a]];
+}
+
+static void _fec_scale(uint8_t *row, uint8_t coef, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        row[i] = _fec_mul(row[i], coef);
+    }
+}
+
+static void _fec_swap(uint8_t *a, uint8_t *b, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        uint8_t value = a[i];
+        a[i] = b[i];
+        b[i] = value;
+    }
+}
+
+//=========================== public ===========================================
+
+uint8_t fec_coefficient(uint8_t repair, uint8_t chunk) {
+    if (!_fec_vars.ready) {
+        _fec_init();
+    }
+    // The repairs and the chunks are the two disjoint sets of elements of the Cauchy matrix
+    return _fec_inv((0x80 | repair) ^ chunk);
+}
+
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t length) {
+    if (!coef) {
+        return;
+    }
+    if (!_fec_vars.ready) {
+        _fec_init();
+    }
+    uint32_t log_coef = _fec_vars.log[coef];
+    for (size_t i = 0; i < length; i++) {
+        if (src[i]) {
+            dst[i] ^= _fec_vars.exp[_fec_vars.log[src[i]] + log_coef];
+        }
+    }
+}
+
+bool fec_invert(uint8_t *matrix, size_t size) {
+    if (size > FEC_MATRIX_SIZE_MAX) {
+        return false;
+    }
+    if (!_fec_vars.ready) {
+        _fec_init();
+    }
+
+    // Gauss-Jordan elimination, the operations on the rows of the matrix are applied to the identity
+    uint8_t work[FEC_MATRIX_SIZE_MAX * FEC_MATRIX_SIZE_MAX];
+    uint8_t inverse[FEC_MATRIX_SIZE_MAX * FEC_MATRIX_SIZE_MAX] = { 0 };
+    memcpy(work, matrix, size * size);
+    for (size_t i = 0; i < size; i++) {
+        inverse[i * size + i] = 1;
+    }
+    for (size_t column = 0; column < size; column++) {
+        size_t pivot = column;
+        while (pivot < size && !work[pivot * size + column]) {
+            pivot++;
+        }
+        if (pivot == size) {
+            return false;
+        }
+        _fec_swap(&work[pivot * size], &work[column * size], size);
+        _fec_swap(&inverse[pivot * size], &inverse[column * size], size);
+        uint8_t scale = _fec_inv(work[column * size + column]);
+        _fec_scale(&work[column * size], scale, size);
+        _fec_scale(&inverse[column * size], scale, size);
+        for (size_t row = 0; row < size; row++) {
+            uint8_t factor = work[row * size + column];
+            if (row != column && factor) {
+                fec_mul_add(&work[row * size], &work[column * size], factor, size);
+                fec_mul_add(&inverse[row * size], &inverse[column * size], factor, size);
+            }
+        }
+    }
+    memcpy(matrix, inverse, size * size);
+    return true;
+}
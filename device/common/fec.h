@@ -0,0 +1,59 @@
+#ifndef __FEC_H
+#define __FEC_H
+
+/**
+ * @defgroup    drv_fec     OTA erasure code
+ * @ingroup     drv
+ * @brief       GF(256) arithmetic of the OTA repair chunks, same as swarmit.testbed.fec in Python
+ *
+ * Each repair chunk of a group is a linear combination of the chunks of the group, with the coefficients of a
+ * Cauchy matrix: any n repair chunks of a group recover any n of its chunks.
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+//=========================== defines ==========================================
+
+#define FEC_MATRIX_SIZE_MAX         (8U)    ///< Largest matrix inverted, one row per repair chunk used
+
+//=========================== public ===========================================
+
+/**
+ * @brief   Return the coefficient of a chunk of a group in one of its repair chunks
+ *
+ * @param[in]   repair      Number of the repair chunk in the group, below 0x80
+ * @param[in]   chunk       Number of the chunk in the group, below 0x80
+ *
+ * @return                  Coefficient of the chunk
+ */
+uint8_t fec_coefficient(uint8_t repair, uint8_t chunk);
+
+/**
+ * @brief   Add the product of a buffer by a coefficient to another buffer
+ *
+ * @param[in,out]   dst     Buffer the product is added to
+ * @param[in]       src     Buffer multiplied by the coefficient
+ * @param[in]       coef    Coefficient
+ * @param[in]       length  Length of the buffers in bytes
+ */
+void fec_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coef, size_t length);
+
+/**
+ * @brief   Invert a square matrix in place
+ *
+ * @param[in,out]   matrix  Matrix stored by rows
+ * @param[in]       size    Number of rows of the matrix, at most FEC_MATRIX_SIZE_MAX
+ *
+ * @return                  false when the matrix is not invertible, it is then left unchanged
+ */
+bool fec_invert(uint8_t *matrix, size_t size);
+
+#endif // __FEC_H
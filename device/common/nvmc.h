@@ -0,0 +1,48 @@
+#ifndef __NVMC_H
+#define __NVMC_H
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+//=========================== defines ==========================================
+
+#define FLASH_PAGE_SIZE 4096
+#define FLASH_OFFSET 0x0
+
+#define NVMC_ERASE_QUEUE_SIZE       (4U)    ///< Maximum number of page erases waiting to run in the background
+#define NVMC_PARTIAL_ERASE_MS       (10U)   ///< Duration of each slice of a background page erase
+#define NVMC_PARTIAL_ERASE_COUNT    (9U)    ///< Slices adding up to the duration of a page erase
+
+//=========================== public ===========================================
+
+void nvmc_page_erase(uint32_t page);
+void nvmc_write(const uint32_t *addr, const void *input, size_t len);
+
+/**
+ * @brief   Queue a page erase, run in slices by nvmc_page_erase_step so the CPU is never stalled for a whole erase
+ *
+ * A page queued and later erased with nvmc_page_erase only gets its remaining slices.
+ *
+ * @return  false when the queue is full, the page is then erased when first written
+ */
+bool nvmc_page_erase_post(uint32_t page);
+
+/**
+ * @brief   Run the next slice of the queued page erases
+ *
+ * @return  true once no erase is queued
+ */
+bool nvmc_page_erase_step(void);
+
+/**
+ * @brief   Drop the queued page erases, a page partially erased must be erased again before being written
+ */
+void nvmc_page_erase_cancel(void);
+
+/**
+ * @brief   Tell whether the erase of a page is queued or running, an erase posted and no longer queued is done
+ */
+bool nvmc_page_erase_queued(uint32_t page);
+
+#endif
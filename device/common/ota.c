@@ -0,0 +1,797 @@
+/**
+ * @file
+ * @ingroup drv_ota
+ *
+ * @brief  Implementation of the OTA engine shared by the bootloaders
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32.h"
+#include "fec.h"
+#include "nvmc.h"
+#include "ota.h"
+
+//=========================== defines ==========================================
+
+#define SWARMIT_BOOT_RECORD_MAGIC       (0x53574150) // "SWAP"
+#define SWARMIT_BOOT_RECORD_INSTALLED   (0x00000000)    ///< Written over the erased installed word once the image is copied
+#define OTA_OUTPUT_BUFFER_SIZE          (256U) ///< Decompressed bytes buffered before being written to flash, power of 2
+
+typedef struct {
+    uint32_t image_size;    ///< Size of the verified image in the download slot
+    uint32_t image_crc;     ///< CRC32 of the image, tells whether the active slot was written by other means since
+    uint8_t  image_sha[SWRMT_OTA_SHA256_LENGTH];    ///< SHA256 of the image
+    uint32_t magic;         ///< SWARMIT_BOOT_RECORD_MAGIC, written after the fields above so that a record is either complete or absent
+    uint32_t installed;     ///< SWARMIT_BOOT_RECORD_INSTALLED once the image is copied to the active slot, erased before
+} swarmit_boot_record_t;
+
+typedef struct {
+    ota_params_t    params;                     ///< Parameters of the current transfer
+    uint8_t         notification_buffer[255]  __attribute__((aligned));
+    uint32_t        base_addr;                  ///< Address of the first chunk, the chunks are staged there
+    uint32_t        chunks_written[OTA_CHUNKS_MAX / 32];    ///< Bitmap of the chunks already written to flash
+    uint32_t        chunks_written_count;
+    uint32_t        chunks_contiguous;          ///< All chunks before this index are written
+    uint32_t        chunks_since_ack;           ///< Number of chunks processed since the last OTA ack
+    bool            ack_required;               ///< A chunk was received again, its ack was lost
+    uint32_t        page[FLASH_PAGE_SIZE / sizeof(uint32_t)];   ///< Flash page being filled with OTA chunks
+    uint32_t        page_addr;                  ///< Address of the buffered flash page, 0 if none
+    bool            page_dirty;                 ///< The buffered page contains chunks not yet written to flash
+    uint32_t        pages_erased[(OTA_PAGES_MAX + 31) / 32];    ///< Bitmap of the pages erased or kept since OTA start
+    uint32_t        pages_erasing[(OTA_PAGES_MAX + 31) / 32];   ///< Bitmap of the pages whose erase was queued in the background
+    bool            complete;                   ///< All chunks of the current transfer are written
+    uint32_t        hashed_size;                ///< Bytes of the image already added to the image hash
+    bool            hash_final;                 ///< The image hash is computed
+    bool            verified;                   ///< The image hash matches the one given at finalize
+    uint32_t        input_pos;                  ///< Bytes of the compressed stream already decoded
+    uint32_t        output_pos;                 ///< Bytes of the image already decompressed
+    uint32_t        output[OTA_OUTPUT_BUFFER_SIZE / sizeof(uint32_t)];  ///< Decompressed bytes not yet written to flash
+    bool            stream_error;               ///< The compressed stream is invalid
+    uint32_t        install_page;               ///< Next page of the download slot to copy to the active slot
+    bool            install_erasing;            ///< The active slot page at install_page is being erased
+    uint8_t         repairs[SWRMT_OTA_FEC_REPAIRS_MAX][SWRMT_OTA_CHUNK_SIZE];  ///< Repair chunks received for the group being recovered
+    uint32_t        repairs_group;              ///< Group of the buffered repair chunks
+    uint32_t        repairs_received;           ///< Bitmap of the buffered repair chunks
+    crypto_sha256_ctx_t sha256_ctx;
+    uint8_t         computed_hash[SWRMT_OTA_SHA256_LENGTH];
+} ota_vars_t;
+
+//=========================== variables ========================================
+
+static ota_vars_t _ota_vars = { 0 };
+
+//=========================== private ==========================================
+
+static bool _ota_chunk_written(uint32_t index) {
+    return _ota_vars.chunks_written[index / 32] & (1U << (index % 32));
+}
+
+static void _ota_flush_page(void) {
+    if (!_ota_vars.page_dirty) {
+        return;
+    }
+
+    // Only program the words that differ from flash, the others are already written or still erased
+    const uint32_t *flash = (const uint32_t *)_ota_vars.page_addr;
+    uint32_t word = 0;
+    while (word < FLASH_PAGE_SIZE / sizeof(uint32_t)) {
+        if (flash[word] == _ota_vars.page[word]) {
+            word++;
+            continue;
+        }
+        uint32_t start = word;
+        while (word < FLASH_PAGE_SIZE / sizeof(uint32_t) && flash[word] != _ota_vars.page[word]) {
+            word++;
+        }
+        nvmc_write(&flash[start], &_ota_vars.page[start], (word - start) * sizeof(uint32_t));
+    }
+    _ota_vars.page_dirty = false;
+}
+
+static void _ota_erase_ahead(uint32_t page_addr, uint32_t end) {
+    // The next page is erased in the background while the chunks of this one are received
+    uint32_t page = (page_addr - SWARMIT_DOWNLOAD_ADDRESS) / FLASH_PAGE_SIZE;
+    if (page_addr >= end || page >= OTA_PAGES_MAX || ((_ota_vars.pages_erased[page / 32] | _ota_vars.pages_erasing[page / 32]) & (1U << (page % 32)))) {
+        return;
+    }
+    if (nvmc_page_erase_post(page_addr / FLASH_PAGE_SIZE)) {
+        _ota_vars.pages_erasing[page / 32] |= (1U << (page % 32));
+    }
+}
+
+static void _ota_erase_page(uint32_t page_addr) {
+    // A page already erased in the background is not erased again, one still queued only gets its remaining slices
+    uint32_t page = (page_addr - SWARMIT_DOWNLOAD_ADDRESS) / FLASH_PAGE_SIZE;
+    if (page < OTA_PAGES_MAX && (_ota_vars.pages_erasing[page / 32] & (1U << (page % 32)))) {
+        _ota_vars.pages_erasing[page / 32] &= ~(1U << (page % 32));
+        if (!nvmc_page_erase_queued(page_addr / FLASH_PAGE_SIZE)) {
+            return;
+        }
+    }
+    nvmc_page_erase(page_addr / FLASH_PAGE_SIZE);
+}
+
+static void _ota_erase_cancel(void) {
+    // The pages of the dropped erases are erased again before being written
+    nvmc_page_erase_cancel();
+    memset(_ota_vars.pages_erasing, 0, sizeof(_ota_vars.pages_erasing));
+}
+
+static void _ota_write_chunk(uint32_t index, const uint8_t *data, uint32_t size) {
+    uint32_t addr = _ota_vars.base_addr + index * _ota_vars.params.chunk_size;
+    if (addr + size > SWARMIT_DOWNLOAD_ADDRESS + SWARMIT_SLOT_SIZE) {
+        return;
+    }
+    printf("Writing chunk %d/%d at address %p\n", index, _ota_vars.params.chunk_count - 1, (uint32_t *)addr);
+
+    // A chunk can span two flash pages
+    while (size) {
+        uint32_t page_addr = addr & ~(FLASH_PAGE_SIZE - 1);
+        uint32_t offset = addr - page_addr;
+        uint32_t length = (size < FLASH_PAGE_SIZE - offset) ? size : FLASH_PAGE_SIZE - offset;
+        if (page_addr != _ota_vars.page_addr) {
+            _ota_flush_page();
+            uint32_t page = (page_addr - SWARMIT_DOWNLOAD_ADDRESS) / FLASH_PAGE_SIZE;
+            if (_ota_vars.pages_erased[page / 32] & (1U << (page % 32))) {
+                // Reload the chunks already flushed to this page, or its content kept from a previous image
+                memcpy(_ota_vars.page, (const void *)page_addr, FLASH_PAGE_SIZE);
+            } else {
+                _ota_erase_page(page_addr);
+                _ota_vars.pages_erased[page / 32] |= (1U << (page % 32));
+                memset(_ota_vars.page, 0xFF, FLASH_PAGE_SIZE);
+                _ota_erase_ahead(page_addr + FLASH_PAGE_SIZE, _ota_vars.base_addr + _ota_vars.params.image_size);
+            }
+            _ota_vars.page_addr = page_addr;
+        }
+        memcpy((uint8_t *)_ota_vars.page + offset, data, length);
+        _ota_vars.page_dirty = true;
+        if (offset + length == FLASH_PAGE_SIZE) {
+            _ota_flush_page();
+        }
+        addr += length;
+        data += length;
+        size -= length;
+    }
+}
+
+static void _ota_hash(const uint8_t *data, uint32_t length) {
+    ota_platform_hash(&_ota_vars.sha256_ctx, data, length);
+}
+
+static void _ota_hash_image(uint32_t addr, uint32_t length) {
+    // Bytes of the buffered page are hashed from RAM, they may not be written to flash yet
+    while (length) {
+        uint32_t page_addr = addr & ~(FLASH_PAGE_SIZE - 1);
+        uint32_t size = FLASH_PAGE_SIZE - (addr - page_addr);
+        if (size > length) {
+            size = length;
+        }
+        const uint8_t *data = (const uint8_t *)addr;
+        if (page_addr == _ota_vars.page_addr) {
+            data = (const uint8_t *)_ota_vars.page + (addr - page_addr);
+        }
+        _ota_hash(data, size);
+        _ota_vars.hashed_size += size;
+        addr += size;
+        length -= size;
+    }
+}
+
+static uint32_t _ota_staging_addr(void) {
+    // Chunks that must be processed before reaching their final place are stored at the end of the download slot
+    if (_ota_vars.params.image_size > SWARMIT_SLOT_SIZE) {
+        return SWARMIT_DOWNLOAD_ADDRESS;
+    }
+    return (SWARMIT_DOWNLOAD_ADDRESS + SWARMIT_SLOT_SIZE - _ota_vars.params.image_size) & ~(FLASH_PAGE_SIZE - 1);
+}
+
+static bool _ota_delta_check_base(void) {
+    // The patch is stored above the rebuilt image, in the download slot
+    uint32_t patch_addr = _ota_staging_addr();
+    if (SWARMIT_DOWNLOAD_ADDRESS + _ota_vars.params.output_size > patch_addr ||
+        _ota_vars.params.base_size > SWARMIT_SLOT_SIZE) {
+        printf("Delta patch doesn't fit in flash\n");
+        return false;
+    }
+
+    crypto_sha256_init(&_ota_vars.sha256_ctx);
+    _ota_hash((const uint8_t *)SWARMIT_BASE_ADDRESS, _ota_vars.params.base_size);
+    crypto_sha256(&_ota_vars.sha256_ctx, _ota_vars.computed_hash);
+    if (memcmp(_ota_vars.computed_hash, _ota_vars.params.base_sha, sizeof(_ota_vars.params.base_sha)) != 0) {
+        printf("Installed image doesn't match the delta base\n");
+        return false;
+    }
+
+    _ota_vars.base_addr = patch_addr;
+    return true;
+}
+
+static void _ota_delta_apply(void) {
+    // Rebuild the image page by page in the download slot, copies read the installed image
+    const uint8_t *patch = (const uint8_t *)_ota_vars.base_addr;
+    uint32_t patch_size = _ota_vars.params.image_size;
+    uint32_t output_size = _ota_vars.params.output_size;
+    uint32_t pos = 0;
+    uint32_t written = 0;
+    uint32_t page_start = 0;
+    memset(_ota_vars.page, 0xFF, FLASH_PAGE_SIZE);
+
+    while (pos + sizeof(swrmt_ota_delta_op_t) <= patch_size && written < output_size) {
+        swrmt_ota_delta_op_t op;
+        memcpy(&op, patch + pos, sizeof(swrmt_ota_delta_op_t));
+        pos += sizeof(swrmt_ota_delta_op_t);
+
+        const uint8_t *data;
+        if (op.type == SWRMT_OTA_DELTA_OP_COPY && op.source + op.length <= _ota_vars.params.base_size) {
+            data = (const uint8_t *)(SWARMIT_BASE_ADDRESS + op.source);
+        } else if (op.type == SWRMT_OTA_DELTA_OP_DATA && pos + op.length <= patch_size) {
+            data = patch + pos;
+            pos += op.length;
+        } else {
+            printf("Invalid delta operation at offset %d\n", pos - sizeof(swrmt_ota_delta_op_t));
+            return;
+        }
+
+        // Operations never cross a page boundary
+        if (op.length > output_size - written || (written - page_start) + op.length > FLASH_PAGE_SIZE) {
+            printf("Invalid delta operation length %d\n", op.length);
+            return;
+        }
+        memcpy((uint8_t *)_ota_vars.page + (written - page_start), data, op.length);
+        written += op.length;
+
+        if (written - page_start == FLASH_PAGE_SIZE || written == output_size) {
+            _ota_vars.page_addr = SWARMIT_DOWNLOAD_ADDRESS + page_start;
+            _ota_vars.page_dirty = true;
+            _ota_hash_image(_ota_vars.page_addr, written - page_start);
+            _ota_erase_page(_ota_vars.page_addr);
+            _ota_flush_page();
+            memset(_ota_vars.page, 0xFF, FLASH_PAGE_SIZE);
+            page_start += FLASH_PAGE_SIZE;
+        }
+    }
+    _ota_vars.page_addr = 0;
+    printf("Delta applied, %d bytes rebuilt\n", written);
+}
+
+static bool _ota_compressed_check_size(void) {
+    // The image is decompressed at the start of the download slot while the compressed stream is stored above it
+    uint32_t stream_addr = _ota_staging_addr();
+    if (SWARMIT_DOWNLOAD_ADDRESS + _ota_vars.params.output_size > stream_addr) {
+        printf("Compressed image doesn't fit in flash\n");
+        return false;
+    }
+    _ota_vars.input_pos = 0;
+    _ota_vars.output_pos = 0;
+    _ota_vars.stream_error = false;
+    _ota_vars.base_addr = stream_addr;
+    return true;
+}
+
+static uint8_t _ota_staged_byte(uint32_t offset) {
+    // The end of the stream can still be in the page buffer
+    uint32_t addr = _ota_vars.base_addr + offset;
+    if (_ota_vars.page_addr && (addr & ~(FLASH_PAGE_SIZE - 1)) == _ota_vars.page_addr) {
+        return ((const uint8_t *)_ota_vars.page)[addr - _ota_vars.page_addr];
+    }
+    return *(const uint8_t *)addr;
+}
+
+static uint8_t _ota_output_byte_at(uint32_t offset) {
+    // Bytes not yet flushed are still in the output buffer
+    if (offset >= (_ota_vars.output_pos & ~(OTA_OUTPUT_BUFFER_SIZE - 1))) {
+        return ((const uint8_t *)_ota_vars.output)[offset % OTA_OUTPUT_BUFFER_SIZE];
+    }
+    return *(const uint8_t *)(SWARMIT_DOWNLOAD_ADDRESS + offset);
+}
+
+static void _ota_output_flush(void) {
+    uint32_t length = _ota_vars.output_pos % OTA_OUTPUT_BUFFER_SIZE;
+    if (length == 0) {
+        length = OTA_OUTPUT_BUFFER_SIZE;
+    }
+    uint32_t start = _ota_vars.output_pos - length;
+    if (start % FLASH_PAGE_SIZE == 0) {
+        _ota_erase_page(SWARMIT_DOWNLOAD_ADDRESS + start);
+        _ota_erase_ahead(SWARMIT_DOWNLOAD_ADDRESS + start + FLASH_PAGE_SIZE, SWARMIT_DOWNLOAD_ADDRESS + _ota_vars.params.output_size);
+    }
+    uint8_t *buffer = (uint8_t *)_ota_vars.output;
+    _ota_hash(buffer, length);
+    _ota_vars.hashed_size += length;
+    // Flash is written by words, pad the last one
+    while (length % sizeof(uint32_t)) {
+        buffer[length++] = 0xFF;
+    }
+    nvmc_write((uint32_t *)(SWARMIT_DOWNLOAD_ADDRESS + start), _ota_vars.output, length);
+}
+
+static void _ota_output_byte(uint8_t byte) {
+    ((uint8_t *)_ota_vars.output)[_ota_vars.output_pos % OTA_OUTPUT_BUFFER_SIZE] = byte;
+    _ota_vars.output_pos++;
+    if (_ota_vars.output_pos % OTA_OUTPUT_BUFFER_SIZE == 0) {
+        _ota_output_flush();
+    }
+}
+
+static void _ota_decompress(uint32_t available) {
+    // Only decode tokens whose bytes are all received, the others are decoded with the next chunks
+    while (!_ota_vars.stream_error && _ota_vars.input_pos < available) {
+        uint8_t token = _ota_staged_byte(_ota_vars.input_pos);
+        uint32_t token_size;
+        uint32_t length;
+        if (token & SWRMT_OTA_LZ_MATCH_FLAG) {
+            token_size = 1 + sizeof(uint16_t);
+            length = (token & ~SWRMT_OTA_LZ_MATCH_FLAG) + SWRMT_OTA_LZ_MIN_MATCH;
+        } else {
+            length = token + 1;
+            token_size = 1 + length;
+        }
+        if (_ota_vars.input_pos + token_size > available) {
+            break;
+        }
+        if (_ota_vars.output_pos + length > _ota_vars.params.output_size) {
+            _ota_vars.stream_error = true;
+            break;
+        }
+
+        if (token & SWRMT_OTA_LZ_MATCH_FLAG) {
+            uint32_t distance = _ota_staged_byte(_ota_vars.input_pos + 1) | (_ota_staged_byte(_ota_vars.input_pos + 2) << 8);
+            if (distance == 0 || distance > _ota_vars.output_pos || distance > SWRMT_OTA_LZ_WINDOW_SIZE) {
+                _ota_vars.stream_error = true;
+                break;
+            }
+            // Back references can overlap the bytes they produce
+            for (uint32_t i = 0; i < length; i++) {
+                _ota_output_byte(_ota_output_byte_at(_ota_vars.output_pos - distance));
+            }
+        } else {
+            for (uint32_t i = 0; i < length; i++) {
+                _ota_output_byte(_ota_staged_byte(_ota_vars.input_pos + 1 + i));
+            }
+        }
+        _ota_vars.input_pos += token_size;
+    }
+    if (_ota_vars.stream_error) {
+        printf("Invalid compressed stream at offset %d\n", _ota_vars.input_pos);
+    }
+}
+
+static void _ota_decompress_end(void) {
+    _ota_decompress(_ota_vars.params.image_size);
+    if (_ota_vars.stream_error) {
+        return;
+    }
+    if (_ota_vars.output_pos % OTA_OUTPUT_BUFFER_SIZE) {
+        _ota_output_flush();
+    }
+    if (_ota_vars.output_pos != _ota_vars.params.output_size) {
+        printf("Compressed stream produced %d bytes instead of %d\n", _ota_vars.output_pos, _ota_vars.params.output_size);
+        return;
+    }
+    printf("Image decompressed, %d bytes written\n", _ota_vars.output_pos);
+}
+
+static void _ota_commit(void) {
+    // From now on the image received replaces the installed one, even if the device resets before it's copied
+    swarmit_boot_record_t record = {
+        .image_size = _ota_vars.params.output_size,
+        .image_crc  = crc32((const uint8_t *)SWARMIT_DOWNLOAD_ADDRESS, _ota_vars.params.output_size),
+        .magic      = SWARMIT_BOOT_RECORD_MAGIC,
+        .installed  = UINT32_MAX,
+    };
+    memcpy(record.image_sha, _ota_vars.computed_hash, SWRMT_OTA_SHA256_LENGTH);
+    nvmc_page_erase(SWARMIT_BOOT_RECORD_ADDRESS / FLASH_PAGE_SIZE);
+    nvmc_write((const uint32_t *)SWARMIT_BOOT_RECORD_ADDRESS, &record, sizeof(swarmit_boot_record_t));
+    _ota_vars.install_page = 0;
+}
+
+static bool _ota_page_kept(uint32_t page) {
+    return _ota_vars.pages_erased[page / 32] & (1U << (page % 32));
+}
+
+static void _send_ota_ack(void) {
+    // All chunks before base are written, the bitmap gives the state of the next ones
+    uint32_t base = _ota_vars.chunks_contiguous;
+    size_t length = 0;
+    _ota_vars.notification_buffer[length++] = SWRMT_MSG_OTA_CHUNKS_ACK;
+    memcpy(_ota_vars.notification_buffer + length, &base, sizeof(uint32_t));
+    length += sizeof(uint32_t);
+    _ota_vars.notification_buffer[length++] = SWRMT_OTA_ACK_BITMAP_SIZE;
+    uint8_t *bitmap = _ota_vars.notification_buffer + length;
+    memset(bitmap, 0, SWRMT_OTA_ACK_BITMAP_SIZE);
+    for (uint32_t bit = 0; bit < SWRMT_OTA_ACK_BITMAP_SIZE * 8; bit++) {
+        uint32_t index = base + bit;
+        if (index >= _ota_vars.params.chunk_count || index >= OTA_CHUNKS_MAX) {
+            break;
+        }
+        if (_ota_chunk_written(index)) {
+            bitmap[bit / 8] |= (1U << (bit % 8));
+        }
+    }
+    length += SWRMT_OTA_ACK_BITMAP_SIZE;
+    _ota_vars.chunks_since_ack = 0;
+    ota_platform_send(_ota_vars.notification_buffer, length);
+}
+
+static void _ota_chunk_done(uint32_t index) {
+    _ota_vars.chunks_written[index / 32] |= (1U << (index % 32));
+    _ota_vars.chunks_written_count++;
+    while (_ota_vars.chunks_contiguous < _ota_vars.params.chunk_count && _ota_chunk_written(_ota_vars.chunks_contiguous)) {
+        _ota_vars.chunks_contiguous++;
+    }
+}
+
+static uint32_t _ota_chunk_size(uint32_t index) {
+    // Only the last chunk is shorter
+    uint32_t offset = index * _ota_vars.params.chunk_size;
+    uint32_t size = _ota_vars.params.chunk_size;
+    if (offset + size > _ota_vars.params.image_size) {
+        size = _ota_vars.params.image_size - offset;
+    }
+    return size;
+}
+
+static void _ota_fec_repair(uint32_t repair_index, const uint8_t *data, uint32_t size) {
+    uint32_t group_size = _ota_vars.params.fec_group;
+    uint32_t chunk_size = _ota_vars.params.chunk_size;
+    uint32_t group = repair_index / SWRMT_OTA_FEC_REPAIRS_MAX;
+    uint32_t repair = repair_index % SWRMT_OTA_FEC_REPAIRS_MAX;
+    uint32_t first = group * group_size;
+    if (!group_size || group_size > SWRMT_OTA_FEC_GROUP_MAX || first >= _ota_vars.params.chunk_count || size > chunk_size) {
+        return;
+    }
+    uint32_t count = _ota_vars.params.chunk_count - first;
+    if (count > group_size) {
+        count = group_size;
+    }
+
+    // Only the repair chunks of one group are buffered, the controller sends them together
+    if (group != _ota_vars.repairs_group) {
+        _ota_vars.repairs_group = group;
+        _ota_vars.repairs_received = 0;
+    }
+    memcpy(_ota_vars.repairs[repair], data, size);
+    memset(_ota_vars.repairs[repair] + size, 0, chunk_size - size);
+    _ota_vars.repairs_received |= (1U << repair);
+
+    // Each repair chunk recovers one missing chunk
+    uint8_t missing[SWRMT_OTA_FEC_REPAIRS_MAX];
+    uint8_t rows[SWRMT_OTA_FEC_REPAIRS_MAX];
+    uint32_t missing_count = 0;
+    uint32_t row_count = 0;
+    for (uint32_t chunk = 0; chunk < count; chunk++) {
+        if (!_ota_chunk_written(first + chunk)) {
+            if (missing_count == SWRMT_OTA_FEC_REPAIRS_MAX) {
+                return;
+            }
+            missing[missing_count++] = chunk;
+        }
+    }
+    for (uint32_t row = 0; row < SWRMT_OTA_FEC_REPAIRS_MAX && row_count < missing_count; row++) {
+        if (_ota_vars.repairs_received & (1U << row)) {
+            rows[row_count++] = row;
+        }
+    }
+    if (!missing_count || row_count < missing_count) {
+        return;
+    }
+
+    // Remove the received chunks from the repair chunks, read back from flash or from the page buffer, only the
+    // products of the missing chunks are left
+    uint8_t buffer[SWRMT_OTA_CHUNK_SIZE];
+    for (uint32_t chunk = 0; chunk < count; chunk++) {
+        uint32_t index = first + chunk;
+        if (!_ota_chunk_written(index)) {
+            continue;
+        }
+        uint32_t chunk_length = _ota_chunk_size(index);
+        for (uint32_t i = 0; i < chunk_length; i++) {
+            buffer[i] = _ota_staged_byte(index * chunk_size + i);
+        }
+        memset(buffer + chunk_length, 0, chunk_size - chunk_length);
+        for (uint32_t row = 0; row < row_count; row++) {
+            fec_mul_add(_ota_vars.repairs[rows[row]], buffer, fec_coefficient(rows[row], chunk), chunk_size);
+        }
+    }
+
+    // Solve for the missing chunks
+    uint8_t matrix[SWRMT_OTA_FEC_REPAIRS_MAX * SWRMT_OTA_FEC_REPAIRS_MAX];
+    for (uint32_t row = 0; row < row_count; row++) {
+        for (uint32_t column = 0; column < missing_count; column++) {
+            matrix[row * missing_count + column] = fec_coefficient(rows[row], missing[column]);
+        }
+    }
+    _ota_vars.repairs_received = 0;
+    if (!fec_invert(matrix, missing_count)) {
+        return;
+    }
+    for (uint32_t column = 0; column < missing_count; column++) {
+        uint32_t index = first + missing[column];
+        memset(buffer, 0, chunk_size);
+        for (uint32_t row = 0; row < row_count; row++) {
+            fec_mul_add(buffer, _ota_vars.repairs[rows[row]], matrix[column * missing_count + row], chunk_size);
+        }
+        _ota_write_chunk(index, buffer, _ota_chunk_size(index));
+        _ota_chunk_done(index);
+    }
+    printf("Recovered %u chunks of group %u\n", missing_count, group);
+}
+
+//=========================== public ===========================================
+
+bool ota_start(const ota_params_t *params) {
+    // Erases queued by the previous transfer target pages the new one may keep
+    _ota_erase_cancel();
+
+    // The download slot is reused, the image committed by the previous transfer is installed first
+    if (ota_install_pending()) {
+        ota_install();
+    }
+    memcpy(&_ota_vars.params, params, sizeof(ota_params_t));
+
+    // Drop the page buffered from a previous transfer
+    _ota_vars.page_addr = 0;
+    _ota_vars.page_dirty = false;
+
+    // Pages are erased in the background ahead of the chunks, or just before the first chunk targeting them is written
+    memset(_ota_vars.pages_erased, 0, sizeof(_ota_vars.pages_erased));
+    memset(_ota_vars.chunks_written, 0, sizeof(_ota_vars.chunks_written));
+    _ota_vars.chunks_written_count = 0;
+    _ota_vars.chunks_contiguous = 0;
+    _ota_vars.chunks_since_ack = 0;
+    _ota_vars.ack_required = false;
+    _ota_vars.complete = false;
+    _ota_vars.hashed_size = 0;
+    _ota_vars.hash_final = false;
+    _ota_vars.verified = false;
+    _ota_vars.repairs_received = 0;
+
+    // Delta and compressed chunks are staged at the end of the download slot before being processed
+    _ota_vars.base_addr = SWARMIT_DOWNLOAD_ADDRESS;
+    bool accepted = _ota_vars.params.output_size <= SWARMIT_IMAGE_MAX_SIZE;
+    if (!accepted) {
+        printf("Image doesn't fit in a slot\n");
+    } else if (_ota_vars.params.mode == SWRMT_OTA_MODE_DELTA) {
+        accepted = _ota_delta_check_base();
+    } else if (_ota_vars.params.mode == SWRMT_OTA_MODE_COMPRESSED) {
+        accepted = _ota_compressed_check_size();
+    }
+    if (!accepted) {
+        // No ack, the controller falls back to the raw image
+        return false;
+    }
+    crypto_sha256_init(&_ota_vars.sha256_ctx);
+
+    // Notify the device is ready to receive chunks
+    size_t length = 0;
+    _ota_vars.notification_buffer[length++] = SWRMT_MSG_OTA_START_ACK;
+    ota_platform_send(_ota_vars.notification_buffer, length);
+    return true;
+}
+
+void ota_manifest(const swrmt_ota_manifest_pkt_t *manifest) {
+    // Pages already matching the image are kept, chunks only covering kept pages are not needed
+    _ota_erase_cancel();
+    uint32_t first_page = manifest->first_page;
+    uint32_t count = manifest->count / sizeof(uint32_t);
+    uint8_t differs[SWRMT_OTA_MANIFEST_PAGES_MAX / 8] = { 0 };
+    for (uint32_t i = 0; i < count && i < SWRMT_OTA_MANIFEST_PAGES_MAX; i++) {
+        uint32_t page = first_page + i;
+        uint32_t offset = page * FLASH_PAGE_SIZE;
+        if (_ota_vars.params.mode != SWRMT_OTA_MODE_RAW || page >= OTA_PAGES_MAX || offset >= _ota_vars.params.image_size) {
+            differs[i / 8] |= (1U << (i % 8));
+            continue;
+        }
+        uint32_t length = _ota_vars.params.image_size - offset;
+        if (length > FLASH_PAGE_SIZE) {
+            length = FLASH_PAGE_SIZE;
+        }
+        // The download slot still holds the previous image received, otherwise the page is copied from the installed one
+        const uint8_t *download = (const uint8_t *)(SWARMIT_DOWNLOAD_ADDRESS + offset);
+        const uint8_t *installed = (const uint8_t *)(SWARMIT_BASE_ADDRESS + offset);
+        bool kept = crc32(download, length) == manifest->crc[i];
+        if (!kept && !_ota_page_kept(page) && crc32(installed, length) == manifest->crc[i]) {
+            nvmc_page_erase((uint32_t)download / FLASH_PAGE_SIZE);
+            nvmc_write((const uint32_t *)download, installed, FLASH_PAGE_SIZE);
+            kept = true;
+        }
+        if (kept) {
+            // Chunks later written to this page reload it instead of erasing it
+            _ota_vars.pages_erased[page / 32] |= (1U << (page % 32));
+        } else {
+            differs[i / 8] |= (1U << (i % 8));
+        }
+    }
+
+    // A chunk spanning two pages is checked again with the manifest describing the second one
+    if (count && _ota_vars.params.mode == SWRMT_OTA_MODE_RAW) {
+        uint32_t first_chunk = first_page * FLASH_PAGE_SIZE / _ota_vars.params.chunk_size;
+        uint32_t last_chunk = ((first_page + count) * FLASH_PAGE_SIZE - 1) / _ota_vars.params.chunk_size;
+        for (uint32_t index = first_chunk; index <= last_chunk && index < _ota_vars.params.chunk_count && index < OTA_CHUNKS_MAX; index++) {
+            if (_ota_chunk_written(index)) {
+                continue;
+            }
+            uint32_t start = index * _ota_vars.params.chunk_size;
+            uint32_t end = start + _ota_vars.params.chunk_size;
+            if (end > _ota_vars.params.image_size) {
+                end = _ota_vars.params.image_size;
+            }
+            bool kept = true;
+            for (uint32_t page = start / FLASH_PAGE_SIZE; page <= (end - 1) / FLASH_PAGE_SIZE; page++) {
+                kept = kept && page < OTA_PAGES_MAX && _ota_page_kept(page);
+            }
+            if (kept) {
+                _ota_vars.chunks_written[index / 32] |= (1U << (index % 32));
+                _ota_vars.chunks_written_count++;
+            }
+        }
+        while (_ota_vars.chunks_contiguous < _ota_vars.params.chunk_count && _ota_chunk_written(_ota_vars.chunks_contiguous)) {
+            _ota_vars.chunks_contiguous++;
+        }
+    }
+
+    size_t length = 0;
+    _ota_vars.notification_buffer[length++] = SWRMT_MSG_OTA_MANIFEST_ACK;
+    memcpy(_ota_vars.notification_buffer + length, &first_page, sizeof(uint16_t));
+    length += sizeof(uint16_t);
+    _ota_vars.notification_buffer[length++] = count;
+    memcpy(_ota_vars.notification_buffer + length, differs, sizeof(differs));
+    length += sizeof(differs);
+    ota_platform_send(_ota_vars.notification_buffer, length);
+}
+
+void ota_chunk_received(uint32_t index, const uint8_t *data, uint32_t size) {
+    if (index >= _ota_vars.params.chunk_count) {
+        // Repair chunks are not acked, the chunks they recover are
+        _ota_fec_repair(index - _ota_vars.params.chunk_count, data, size);
+    } else if (index < OTA_CHUNKS_MAX && !_ota_chunk_written(index)) {
+        _ota_write_chunk(index, data, size);
+        _ota_chunk_done(index);
+    } else {
+        // A chunk received again means its ack was lost, answer without waiting
+        _ota_vars.ack_required = true;
+    }
+    _ota_vars.chunks_since_ack++;
+}
+
+bool ota_chunks_processed(void) {
+    // Hash the part of the image received without gap
+    if (_ota_vars.params.mode == SWRMT_OTA_MODE_RAW) {
+        uint32_t contiguous_size = _ota_vars.chunks_contiguous * _ota_vars.params.chunk_size;
+        if (contiguous_size > _ota_vars.params.image_size) {
+            contiguous_size = _ota_vars.params.image_size;
+        }
+        if (contiguous_size > _ota_vars.hashed_size) {
+            _ota_hash_image(SWARMIT_DOWNLOAD_ADDRESS + _ota_vars.hashed_size, contiguous_size - _ota_vars.hashed_size);
+        }
+    }
+
+    // Decompress the part of the stream received without gap
+    if (_ota_vars.params.mode == SWRMT_OTA_MODE_COMPRESSED && _ota_vars.chunks_written_count < _ota_vars.params.chunk_count) {
+        _ota_decompress(_ota_vars.chunks_contiguous * _ota_vars.params.chunk_size);
+    }
+
+    // The last page is not necessarily full
+    if (_ota_vars.chunks_written_count == _ota_vars.params.chunk_count) {
+        _ota_flush_page();
+    }
+
+    // Acknowledge every ack_interval chunks and when the image is complete
+    if (_ota_vars.chunks_since_ack >= _ota_vars.params.ack_interval || _ota_vars.chunks_written_count == _ota_vars.params.chunk_count) {
+        _ota_vars.ack_required = true;
+    }
+    if (_ota_vars.ack_required) {
+        _send_ota_ack();
+    }
+
+    // If all chunks are written, apply the patch if any, the image is then ready to be verified
+    if (_ota_vars.chunks_written_count != _ota_vars.params.chunk_count || _ota_vars.complete) {
+        return false;
+    }
+    _ota_vars.complete = true;
+    if (_ota_vars.params.mode == SWRMT_OTA_MODE_DELTA) {
+        _ota_delta_apply();
+    } else if (_ota_vars.params.mode == SWRMT_OTA_MODE_COMPRESSED) {
+        _ota_decompress_end();
+    }
+    return true;
+}
+
+void ota_ack_flush(void) {
+    // Acknowledge the chunks received since the last ack when the transfer stalls
+    if (_ota_vars.chunks_since_ack > 0) {
+        _send_ota_ack();
+    }
+}
+
+bool ota_finalize(const uint8_t *sha) {
+    // The digest is computed once, when all the image was hashed
+    bool committed = false;
+    if (_ota_vars.complete && !_ota_vars.hash_final) {
+        _ota_vars.hash_final = true;
+        crypto_sha256(&_ota_vars.sha256_ctx, _ota_vars.computed_hash);
+        _ota_vars.verified = _ota_vars.hashed_size == _ota_vars.params.output_size && memcmp(_ota_vars.computed_hash, sha, SWRMT_OTA_SHA256_LENGTH) == 0;
+        if (_ota_vars.verified) {
+            _ota_commit();
+            committed = true;
+        } else {
+            // The image that doesn't match is never installed, the active slot is left as is
+            puts("Image verification failed");
+        }
+    }
+
+    size_t length = 0;
+    _ota_vars.notification_buffer[length++] = SWRMT_MSG_OTA_FINALIZE_ACK;
+    _ota_vars.notification_buffer[length++] = _ota_vars.verified;
+    if (_ota_vars.hash_final) {
+        memcpy(_ota_vars.notification_buffer + length, _ota_vars.computed_hash, SWRMT_OTA_SHA256_LENGTH);
+    } else {
+        memset(_ota_vars.notification_buffer + length, 0, SWRMT_OTA_SHA256_LENGTH);
+    }
+    length += SWRMT_OTA_SHA256_LENGTH;
+    ota_platform_send(_ota_vars.notification_buffer, length);
+    return committed;
+}
+
+bool ota_install_pending(void) {
+    const swarmit_boot_record_t *record = (const swarmit_boot_record_t *)SWARMIT_BOOT_RECORD_ADDRESS;
+    return record->magic == SWARMIT_BOOT_RECORD_MAGIC && record->installed != SWARMIT_BOOT_RECORD_INSTALLED && record->image_size <= SWARMIT_SLOT_SIZE;
+}
+
+bool ota_install_step(void) {
+    // Copy the next page of the download slot to the active slot, returns true once the image is installed
+    const swarmit_boot_record_t *record = (const swarmit_boot_record_t *)SWARMIT_BOOT_RECORD_ADDRESS;
+    uint32_t offset = _ota_vars.install_page * FLASH_PAGE_SIZE;
+    if (offset < record->image_size) {
+        const uint32_t *source = (const uint32_t *)(SWARMIT_DOWNLOAD_ADDRESS + offset);
+        const uint32_t *destination = (const uint32_t *)(SWARMIT_BASE_ADDRESS + offset);
+        // Pages already copied before a reset, or unchanged, are not written again
+        if (memcmp(destination, source, FLASH_PAGE_SIZE) != 0) {
+            // The page is erased one slice per step
+            if (!_ota_vars.install_erasing) {
+                _ota_vars.install_erasing = nvmc_page_erase_post((uint32_t)destination / FLASH_PAGE_SIZE);
+            }
+            if (!_ota_vars.install_erasing) {
+                nvmc_page_erase((uint32_t)destination / FLASH_PAGE_SIZE);
+            } else if (!nvmc_page_erase_step()) {
+                return false;
+            }
+            nvmc_write(destination, source, FLASH_PAGE_SIZE);
+        }
+        _ota_vars.install_erasing = false;
+        _ota_vars.install_page++;
+        return false;
+    }
+    const uint32_t installed = SWARMIT_BOOT_RECORD_INSTALLED;
+    nvmc_write(&record->installed, &installed, sizeof(uint32_t));
+    printf("Image installed, %u bytes\n", record->image_size);
+    ota_image_check();
+    return true;
+}
+
+void ota_install(void) {
+    _ota_vars.install_page = 0;
+    while (!ota_install_step()) {}
+}
+
+void ota_image_check(void) {
+    // The image requests are answered with the image installed by the latest OTA, if still there
+    static const uint8_t unknown_sha[SWRMT_OTA_SHA256_LENGTH] = { 0 };
+    const swarmit_boot_record_t *record = (const swarmit_boot_record_t *)SWARMIT_BOOT_RECORD_ADDRESS;
+    bool known = record->magic == SWARMIT_BOOT_RECORD_MAGIC && record->installed == SWARMIT_BOOT_RECORD_INSTALLED &&
+                 record->image_size <= SWARMIT_SLOT_SIZE && crc32((const uint8_t *)SWARMIT_BASE_ADDRESS, record->image_size) == record->image_crc;
+    if (known) {
+        ota_platform_image(record->image_size, record->image_sha);
+    } else {
+        ota_platform_image(0, unknown_sha);
+    }
+}
@@ -0,0 +1,147 @@
+#ifndef __OTA_H
+#define __OTA_H
+
+/**
+ * @defgroup    drv_ota     OTA engine
+ * @ingroup     drv
+ * @brief       Reception, verification and installation of the images sent over the air
+ *
+ * The engine buffers the chunks by flash page, erases the pages lazily, keeps the pages already matching the
+ * image, applies the deltas, decompresses the images, recovers the lost chunks from the repair chunks, verifies
+ * the image SHA256 and copies it from the download slot to the active slot. It is shared by the bootloaders,
+ * each of them gives its flash layout in ota_layout.h and implements the platform functions below.
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "ota_layout.h"
+#include "protocol.h"
+#include "sha256.h"
+
+//=========================== defines ==========================================
+
+#define OTA_PAGES_MAX               (SWARMIT_IMAGE_MAX_SIZE / FLASH_PAGE_SIZE)
+#define OTA_CHUNKS_MAX              (SWARMIT_IMAGE_MAX_SIZE / SWRMT_OTA_CHUNK_SIZE_MIN)
+
+typedef struct {
+    uint32_t image_size;                        ///< Size of the chunks stream
+    uint32_t chunk_count;
+    uint32_t chunk_size;                        ///< Size of all chunks but the last one
+    uint32_t ack_interval;                      ///< Number of chunks received between two OTA acks
+    uint32_t mode;                              ///< Content of the chunks, see swrmt_ota_mode_t
+    uint32_t fec_group;                         ///< Chunks protected by each group of repair chunks, 0 without repair chunks
+    uint32_t output_size;                       ///< Size of the image once the chunks are processed
+    uint32_t base_size;                         ///< Size of the installed image a delta applies to
+    uint8_t  base_sha[8];                       ///< First bytes of the SHA256 of the installed image
+} ota_params_t;
+
+//=========================== public ===========================================
+
+/**
+ * @brief   Start a transfer, the image committed by the previous one is installed first
+ *
+ * The OTA start ack is sent when the transfer is accepted.
+ *
+ * @param[in]   params      Parameters given by the OTA start request
+ *
+ * @return                  false when the image doesn't fit or the delta doesn't apply to the installed image
+ */
+bool ota_start(const ota_params_t *params);
+
+/**
+ * @brief   Keep the pages already matching the image and answer with the chunks still needed
+ *
+ * @param[in]   manifest    Page CRCs of the image
+ */
+void ota_manifest(const swrmt_ota_manifest_pkt_t *manifest);
+
+/**
+ * @brief   Write a chunk, or a repair chunk when its index follows the image chunks
+ *
+ * The chunk is only processed further by ota_chunks_processed, called once the queued chunks are received.
+ *
+ * @param[in]   index       Index of the chunk
+ * @param[in]   data        Chunk data, already checked by its CRC
+ * @param[in]   size        Size of the chunk in bytes
+ */
+void ota_chunk_received(uint32_t index, const uint8_t *data, uint32_t size);
+
+/**
+ * @brief   Hash or decompress the chunks received without gap and acknowledge them when needed
+ *
+ * @return                  true when the last chunk of the transfer was just processed
+ */
+bool ota_chunks_processed(void);
+
+/**
+ * @brief   Acknowledge the chunks received since the last ack, if any
+ */
+void ota_ack_flush(void);
+
+/**
+ * @brief   Verify the image and answer with the digest computed, the verified image is committed
+ *
+ * @param[in]   sha         SHA256 of the complete image
+ *
+ * @return                  true when the image was committed by this call, it must then be installed
+ */
+bool ota_finalize(const uint8_t *sha);
+
+/**
+ * @brief   Tell whether a committed image waits to be copied to the active slot
+ */
+bool ota_install_pending(void);
+
+/**
+ * @brief   Copy the next page of the committed image to the active slot
+ *
+ * @return                  true once the image is installed
+ */
+bool ota_install_step(void);
+
+/**
+ * @brief   Copy all the committed image to the active slot
+ */
+void ota_install(void);
+
+/**
+ * @brief   Publish the image installed by the latest OTA with ota_platform_image, if still in the active slot
+ */
+void ota_image_check(void);
+
+//=========================== platform =========================================
+
+/**
+ * @brief   Send a notification to the gateway, implemented by each bootloader
+ *
+ * @param[in]   buffer      Notification
+ * @param[in]   length      Length of the notification in bytes
+ */
+void ota_platform_send(const uint8_t *buffer, uint8_t length);
+
+/**
+ * @brief   Add bytes to the image digest, implemented by each bootloader
+ *
+ * @param[in]   ctx         Digest context
+ * @param[in]   data        Bytes to hash
+ * @param[in]   length      Number of bytes
+ */
+void ota_platform_hash(crypto_sha256_ctx_t *ctx, const uint8_t *data, uint32_t length);
+
+/**
+ * @brief   Make the installed image known to the image requests, implemented by each bootloader
+ *
+ * @param[in]   size        Size of the installed image, 0 when not installed by an OTA
+ * @param[in]   sha         SHA256 of the installed image, zeros when not installed by an OTA
+ */
+void ota_platform_image(uint32_t size, const uint8_t *sha);
+
+#endif // __OTA_H
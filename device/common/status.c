@@ -0,0 +1,91 @@
+/**
+ * @file
+ * @ingroup drv_status
+ *
+ * @brief  Implementation of the status notifications
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "protocol.h"
+#include "status.h"
+
+//=========================== defines ==========================================
+
+typedef struct {
+    volatile bool   requested;              ///< The status is sent at the next check whatever changed
+    bool            sent;                   ///< A status notification was already written
+    status_telemetry_t last;                ///< Status in the latest status notification
+    uint32_t        checked_at;             ///< Time of the latest status check
+    uint32_t        idle_us;                ///< Idle time not yet counted in idle_time
+    uint32_t        idle_time;              ///< Time spent in idle mode since boot, in s
+} status_vars_t;
+
+//=========================== variables ========================================
+
+static status_vars_t _status_vars = { 0 };
+
+//=========================== private ==========================================
+
+static bool _exceeds(uint32_t value, uint32_t reference, uint32_t threshold) {
+    return ((value > reference) ? value - reference : reference - value) >= threshold;
+}
+
+//=========================== public ===========================================
+
+void status_request(void) {
+    _status_vars.requested = true;
+}
+
+size_t status_check(uint8_t *buffer, const status_telemetry_t *telemetry, uint32_t now, uint32_t last_tx_time) {
+    uint8_t status = telemetry->status;
+
+    // The time is counted at each check, the timer wraps around every 71 minutes
+    if (status == SWRMT_APPLICATION_IDLE && _status_vars.last.status == SWRMT_APPLICATION_IDLE) {
+        _status_vars.idle_us += now - _status_vars.checked_at;
+        _status_vars.idle_time += _status_vars.idle_us / 1000000UL;
+        _status_vars.idle_us %= 1000000UL;
+    }
+    _status_vars.checked_at = now;
+
+    // Notify the gateway only when the status changes significantly or when nothing was sent for a heartbeat period
+    bool changed = _status_vars.requested || status != _status_vars.last.status;
+    if (status != SWRMT_APPLICATION_PROGRAMMING) {
+        // Battery and position updates wait for the end of an OTA, the acks already show the device is alive
+        changed |= _exceeds(telemetry->battery_level, _status_vars.last.battery_level, STATUS_BATTERY_THRESHOLD);
+    }
+    if (status != SWRMT_APPLICATION_PROGRAMMING && status != SWRMT_APPLICATION_IDLE) {
+        // The position is not updated in idle mode
+        changed |= _exceeds(telemetry->x, _status_vars.last.x, STATUS_POSITION_THRESHOLD);
+        changed |= _exceeds(telemetry->y, _status_vars.last.y, STATUS_POSITION_THRESHOLD);
+    }
+    uint32_t heartbeat = (status == SWRMT_APPLICATION_IDLE) ? STATUS_IDLE_HEARTBEAT_US : STATUS_HEARTBEAT_US;
+    if (!changed && now - last_tx_time < heartbeat) {
+        return 0;
+    }
+    _status_vars.requested = false;
+    memcpy(&_status_vars.last, telemetry, sizeof(status_telemetry_t));
+
+    size_t length = 0;
+    buffer[length++] = SWRMT_MSG_STATUS;
+    buffer[length++] = telemetry->device_type;
+    buffer[length++] = status;
+    memcpy(&buffer[length], &telemetry->battery_level, sizeof(uint16_t));
+    length += sizeof(uint16_t);
+    memcpy(&buffer[length], &telemetry->x, sizeof(uint32_t));
+    length += sizeof(uint32_t);
+    memcpy(&buffer[length], &telemetry->y, sizeof(uint32_t));
+    length += sizeof(uint32_t);
+    memcpy(&buffer[length], &_status_vars.idle_time, sizeof(uint32_t));
+    length += sizeof(uint32_t);
+    memcpy(&buffer[length], &telemetry->groups, sizeof(uint32_t));
+    length += sizeof(uint32_t);
+    return length;
+}
@@ -0,0 +1,59 @@
+#ifndef __STATUS_H
+#define __STATUS_H
+
+/**
+ * @defgroup    drv_status  Status notifications
+ * @ingroup     drv
+ * @brief       Status notifications sent to the gateway by the devices
+ *
+ * The status is checked periodically, it is only notified when it changes significantly or when nothing was sent
+ * to the gateway for a heartbeat period. The time spent in idle mode is counted at each check. Shared by the
+ * network core and the single core bootloader.
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+//=========================== defines ==========================================
+
+#define STATUS_HEARTBEAT_US         (5000000UL) ///< Maximum time without any frame sent to the gateway
+#define STATUS_IDLE_HEARTBEAT_US    (30000000UL)    ///< Maximum time without any frame sent in idle mode
+#define STATUS_BATTERY_THRESHOLD    (50U)   ///< Battery level change in mV notified to the gateway
+#define STATUS_POSITION_THRESHOLD   (50U)   ///< Position change in mm notified to the gateway
+
+typedef struct {
+    uint8_t     device_type;                ///< Device type, see swrmt_device_type_t
+    uint8_t     status;                     ///< Experiment status
+    uint16_t    battery_level;              ///< Battery level in mV
+    uint32_t    x;                          ///< X coordinate of the LH2 position in mm
+    uint32_t    y;                          ///< Y coordinate of the LH2 position in mm
+    uint32_t    groups;                     ///< Bitmap of the groups the device belongs to
+} status_telemetry_t;
+
+//=========================== public ===========================================
+
+/**
+ * @brief   Send the status at the next check whatever changed, can be called from interrupts
+ */
+void status_request(void);
+
+/**
+ * @brief   Check the status and write its notification when it must be sent
+ *
+ * @param[out]  buffer          Notification, 19 bytes long at least
+ * @param[in]   telemetry       Current status of the device
+ * @param[in]   now             Current time in us
+ * @param[in]   last_tx_time    Time of the latest frame sent to the gateway in us
+ *
+ * @return                      Length of the notification, 0 when there is nothing to notify
+ */
+size_t status_check(uint8_t *buffer, const status_telemetry_t *telemetry, uint32_t now, uint32_t last_tx_time);
+
+#endif // __STATUS_H
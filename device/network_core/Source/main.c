@@ -9,14 +9,18 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <nrf.h>
 // Include BSP headers
+#include "crc32.h"
+#include "event.h"
 #include "ipc.h"
+#include "profile.h"
 #include "protocol.h"
 #include "rng.h"
-#include "sha256.h"
+#include "status.h"
 
 // Mira includes
 #include "mr_timer_hf.h"
@@ -26,61 +30,283 @@
 #include "mari.h"
 
 #define NETCORE_MAIN_TIMER                  (0)
+#define NETCORE_SCHEDULE_CHANNEL            (1)     ///< Timer channel polling the ASN of a scheduled start or stop
 
 #define SWARMIT_NET_CONFIG_START_ADDRESS    (0x0103f800) // start of the last page (2KB) of the flash (0x01000000 + 0x00040000 - 0x800)
 #define SWARMIT_CONFIG_MAGIC_VALUE          (0x5753524D) // "SWRM"
 // Important: select a Network ID according to the specific deployment you are making,
 // see the registry at https://crystalfree.atlassian.net/wiki/spaces/Mari/pages/3324903426/Registry+of+Mari+Network+IDs
 #define SWARMIT_DEFAULT_NET_ID              (0x12AA)
+#define SWARMIT_DEFAULT_SCHEDULE_ID         (SWRMT_SCHEDULE_TINY)
+#define NETCORE_REQ_QUEUE_SIZE              (4U)    ///< Maximum number of gateway requests pending
+#define NETCORE_LOG_BATCH_SIZE              (200U)  ///< Maximum size of a log batch frame, the size of an OTA chunk frame
+#define NETCORE_POSITION_QUEUE_SIZE         (32U)   ///< Maximum number of streamed positions waiting to be sent
+#define NETCORE_POSITION_BATCH_MAX          (16U)   ///< Maximum number of positions in a frame, fits in NETCORE_LOG_BATCH_SIZE
+#define NETCORE_STATUS_CHECK_PERIOD_US      (250000UL)  ///< Period at which status changes are looked for
+#define NETCORE_IDLE_CHECK_PERIOD_US        (1000000UL) ///< Period at which status changes are looked for in idle mode
+#define NETCORE_SCHEDULE_CHECK_PERIOD_US    (100U)  ///< Period at which the ASN of a scheduled start or stop is checked during its last slot
+#define NETCORE_SCHEDULE_SLOT_MIN_US        (1000U)  ///< Lower bound of the Mari slot duration, the wake up before a scheduled ASN is never late
+#define NETCORE_SCHEDULE_SLOTS_MAX          (1000000U)  ///< Slots waited at most at once, the delay fits the timer
 
 //=========================== variables =========================================
 
+typedef enum {
+    NETCORE_EVENT_RADIO_RX,         ///< PDUs queued for the user image, events are listed by decreasing priority
+    NETCORE_EVENT_OTA_CHUNK,        ///< OTA chunks queued for the application core
+    NETCORE_EVENT_IPC_REQ,          ///< Requests posted by the application core
+    NETCORE_EVENT_RADIO_TX,         ///< PDUs queued for transmission by the application core
+    NETCORE_EVENT_POSITION,         ///< Streamed positions ready to be sent
+    NETCORE_EVENT_REQUEST,          ///< Request or metrics probe received from the gateway
+    NETCORE_EVENT_STATUS,           ///< Status check period elapsed or status requested
+    NETCORE_EVENT_LOG,              ///< Log records queued by the application core
+    NETCORE_EVENT_TRACE,            ///< Traced packet handled, its timestamps are sent back
+    NETCORE_EVENT_COUNT,
+} netcore_event_t;
+
+typedef struct __attribute__((packed)) {
+    uint32_t        timestamp;      ///< Time at which the position was signaled
+    position_2d_t   position;       ///< Position computed by the application core
+} netcore_position_sample_t;
+
 typedef struct {
-    bool        req_received;
-    bool        data_received;
-    bool        send_status;
-    uint8_t     req_buffer[255];
+    uint8_t     req_buffers[NETCORE_REQ_QUEUE_SIZE][UINT8_MAX];  ///< Requests received from the gateway, one per NETCORE_EVENT_REQUEST
+    uint32_t    req_head;                                        ///< Number of requests received, only written by the radio callback
+    uint32_t    req_tail;                                        ///< Number of requests handled, only written by the main loop
     uint8_t     notification_buffer[255];
-    ipc_req_t   ipc_req;
-    bool        ipc_log_received;
     uint8_t     gpio_event_idx;
-    crypto_sha256_ctx_t sha256_ctx;
-    uint8_t     expected_hash[SWRMT_OTA_SHA256_LENGTH];
-    uint8_t     computed_hash[SWRMT_OTA_SHA256_LENGTH];
     uint64_t    device_id;
     uint16_t    mari_net_id;
-    int32_t     last_chunk_acked;
+    uint8_t     mari_schedule_id;                               ///< Index of the Mari schedule in _schedules
+    uint32_t    groups;                                         ///< Bitmap of the groups this device belongs to
+    uint8_t     ota_session;                                    ///< OTA session of the latest OTA start, 0 before the first one
     uint32_t    metrics_rx_counter;
     uint32_t    metrics_tx_counter;
-    bool        metrics_received;
+    uint32_t    log_timestamps[IPC_LOG_QUEUE_SIZE];             ///< Time at which each queued log record was signaled
+    uint32_t    log_stamped;                                    ///< Number of log records timestamped, only written by the IPC interrupt
+    uint32_t    log_dropped;                                    ///< Number of dropped log records already reported
+    uint32_t    last_tx_time;                                   ///< Time of the latest frame sent to the gateway
+    netcore_position_sample_t position_samples[NETCORE_POSITION_QUEUE_SIZE];  ///< Streamed positions waiting to be sent
+    uint32_t    position_head;                                  ///< Number of positions sampled, only written by the IPC interrupt
+    uint32_t    position_tail;                                  ///< Number of positions sent, only written by the main loop
+    uint32_t    position_time;                                  ///< Time of the latest position sampled
+    uint8_t     position_batch;                                 ///< Number of positions sent in each frame
+    swrmt_trace_pkt_t trace;                                    ///< Timestamps of the latest traced packet, a new one replaces it
+    bool        trace_ipc;                                      ///< The traced packet waits for the user image
+    uint64_t    scheduled_asn;                                  ///< ASN of the latest scheduled start or stop
+    uint8_t     scheduled_type;                                 ///< SWRMT_MSG_START or SWRMT_MSG_STOP
+    volatile bool scheduled_pending;                            ///< The scheduled start or stop waits for its ASN
 } swrmt_app_data_t;
 
 typedef struct {
     uint32_t magic;      // to detect if config is valid
     uint32_t net_id;     // Mari network ID
+    uint32_t schedule_id;   // Mari schedule, one of swrmt_schedule_id_t, erased in configs written before it existed
+    uint32_t groups;        // Bitmap of the device groups, erased in configs written before it existed
 } swarmit_config_t;
 
 static swrmt_app_data_t _app_vars = { 0 };
 extern schedule_t schedule_minuscule, schedule_tiny, schedule_small, schedule_huge, schedule_only_beacons, schedule_only_beacons_optimized_scan;
 
+static schedule_t *const _schedules[SWRMT_SCHEDULE_COUNT] = {
+    [SWRMT_SCHEDULE_MINUSCULE]                      = &schedule_minuscule,
+    [SWRMT_SCHEDULE_TINY]                           = &schedule_tiny,
+    [SWRMT_SCHEDULE_SMALL]                          = &schedule_small,
+    [SWRMT_SCHEDULE_HUGE]                           = &schedule_huge,
+    [SWRMT_SCHEDULE_ONLY_BEACONS]                   = &schedule_only_beacons,
+    [SWRMT_SCHEDULE_ONLY_BEACONS_OPTIMIZED_SCAN]    = &schedule_only_beacons_optimized_scan,
+};
+
 volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_shared_data;
 
+static void _handle_radio_rx(void);
+static void _handle_ota_chunk(void);
+static void _handle_ipc_requests(void);
+static void _handle_radio_tx(void);
+static void _handle_position(void);
+static void _handle_request(void);
+static void _handle_status(void);
+static void _handle_log(void);
+static void _handle_trace(void);
+
+static event_t _events[NETCORE_EVENT_COUNT] = {
+    [NETCORE_EVENT_RADIO_RX]    = { .handler = _handle_radio_rx },
+    [NETCORE_EVENT_OTA_CHUNK]   = { .handler = _handle_ota_chunk },
+    [NETCORE_EVENT_IPC_REQ]     = { .handler = _handle_ipc_requests },
+    [NETCORE_EVENT_RADIO_TX]    = { .handler = _handle_radio_tx },
+    [NETCORE_EVENT_POSITION]    = { .handler = _handle_position },
+    [NETCORE_EVENT_REQUEST]     = { .handler = _handle_request },
+    [NETCORE_EVENT_STATUS]      = { .handler = _handle_status },
+    [NETCORE_EVENT_LOG]         = { .handler = _handle_log },
+    [NETCORE_EVENT_TRACE]       = { .handler = _handle_trace },
+};
+
 //=========================== functions =========================================
 
+static void _queue_ota_chunk(const uint8_t *data, uint8_t length) {
+    if (ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING && ipc_shared_data.status != SWRMT_APPLICATION_READY) {
+        return;
+    }
+
+    const swrmt_ota_chunk_pkt_t *pkt = (const swrmt_ota_chunk_pkt_t *)data;
+    if (length < offsetof(swrmt_ota_chunk_pkt_t, chunk) || length - offsetof(swrmt_ota_chunk_pkt_t, chunk) < pkt->chunk_size) {
+        return;
+    }
+
+    // Chunks of another session are broadcast to other devices
+    if (pkt->session != _app_vars.ota_session) {
+        return;
+    }
+
+    // Check chunk index is valid, the repair chunks of each group follow the image chunks
+    uint32_t index_count = ipc_shared_data.ota.chunk_count;
+    if (ipc_shared_data.ota.fec_group) {
+        index_count += (ipc_shared_data.ota.chunk_count + ipc_shared_data.ota.fec_group - 1) / ipc_shared_data.ota.fec_group * SWRMT_OTA_FEC_REPAIRS_MAX;
+    }
+    if (pkt->index >= index_count) {
+        printf("Invalid chunk index %u\n", pkt->index);
+        return;
+    }
+
+    if (pkt->chunk_size > ipc_shared_data.ota.chunk_size) {
+        printf("Invalid chunk size %u\n", pkt->chunk_size);
+        return;
+    }
+
+    // Drop the chunk if the application core has not processed the pending ones yet, it will be sent again
+    if (ipc_shared_data.ota.chunk_head - ipc_shared_data.ota.chunk_tail >= IPC_OTA_CHUNK_QUEUE_SIZE) {
+        printf("OTA chunk queue full, dropping chunk %u\n", pkt->index);
+        return;
+    }
+
+    // The slot is owned by the network core until the head index is incremented, the CRC is checked
+    // on the slot content so a chunk is only read once from the radio buffer
+    uint32_t start = profile_start();
+    volatile ipc_ota_chunk_t *chunk = &ipc_shared_data.ota.chunks[ipc_shared_data.ota.chunk_head % IPC_OTA_CHUNK_QUEUE_SIZE];
+    chunk->index = pkt->index;
+    chunk->size = pkt->chunk_size;
+    memcpy((uint8_t *)chunk->data, pkt->chunk, pkt->chunk_size);
+
+    // Transmission errors are caught by the CRC, the whole image is verified with its SHA256 at finalize
+    uint32_t crc = crc32((const uint8_t *)chunk->data, pkt->chunk_size);
+    profile_add(SWRMT_PROFILE_CHUNK_CHECK, start);
+    if (crc != pkt->crc) {
+        printf("Invalid CRC for chunk %u\n", pkt->index);
+        return;
+    }
+
+    __DMB();
+    ipc_shared_data.ota.chunk_head++;
+    event_post(&_events[NETCORE_EVENT_OTA_CHUNK]);
+}
+
+static void _scheduled_run(void) {
+    // The status may have changed since the request, e.g. with an OTA started meanwhile
+    _app_vars.scheduled_pending = false;
+    uint8_t status = ipc_shared_data.status;
+    if (_app_vars.scheduled_type == SWRMT_MSG_START) {
+        if (status == SWRMT_APPLICATION_READY) {
+            NRF_IPC_NS->TASKS_SEND[IPC_CHAN_APPLICATION_START] = 1;
+        }
+    } else if (status == SWRMT_APPLICATION_RUNNING || status == SWRMT_APPLICATION_RESETTING || status == SWRMT_APPLICATION_PROGRAMMING) {
+        ipc_shared_data.status = SWRMT_APPLICATION_STOPPING;
+        NRF_IPC_NS->TASKS_SEND[IPC_CHAN_APPLICATION_STOP] = 1;
+    }
+}
+
+static void _scheduled_check(void) {
+    // Runs in the timer interrupt, the slots start at the same time on all the devices of the network
+    if (!_app_vars.scheduled_pending) {
+        return;
+    }
+    uint64_t asn = mr_mac_get_asn();
+    if (asn < _app_vars.scheduled_asn) {
+        // The slots left are waited at their shortest duration, the timer fires a few times before the ASN, then
+        // polls its last slot
+        uint64_t slots = _app_vars.scheduled_asn - asn - 1;
+        if (slots > NETCORE_SCHEDULE_SLOTS_MAX) {
+            slots = NETCORE_SCHEDULE_SLOTS_MAX;
+        }
+        uint32_t delay_us = slots ? (uint32_t)slots * NETCORE_SCHEDULE_SLOT_MIN_US : NETCORE_SCHEDULE_CHECK_PERIOD_US;
+        mr_timer_hf_set_oneshot_us(NETCORE_MAIN_TIMER, NETCORE_SCHEDULE_CHANNEL, delay_us, _scheduled_check);
+        return;
+    }
+    _scheduled_run();
+}
+
+static void _schedule(uint8_t type, const uint8_t *data) {
+    const swrmt_start_stop_pkt_t *pkt = (const swrmt_start_stop_pkt_t *)data;
+    // The gateway repeats the request until the ASN, it must only be run once
+    if (pkt->asn && pkt->asn == _app_vars.scheduled_asn && type == _app_vars.scheduled_type) {
+        return;
+    }
+    _app_vars.scheduled_asn = pkt->asn;
+    _app_vars.scheduled_type = type;
+    _app_vars.scheduled_pending = true;
+    if (pkt->asn <= mr_mac_get_asn()) {
+        _scheduled_run();
+        return;
+    }
+    printf("%s scheduled at ASN %llu\n", type == SWRMT_MSG_START ? "Start" : "Stop", pkt->asn);
+    _scheduled_check();
+}
+
+static bool _trace_packet(uint64_t dst_address, const uint8_t *packet, uint8_t length) {
+    // The packet is timestamped at each hop, up to the user image while an experiment runs
+    if (length < 1 + sizeof(swrmt_trace_pkt_t) || (dst_address != MARI_BROADCAST_ADDRESS && dst_address != _app_vars.device_id)) {
+        return false;
+    }
+    uint32_t now = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+    memcpy(&_app_vars.trace, &packet[1], sizeof(swrmt_trace_pkt_t));
+    _app_vars.trace.rx_asn = mr_mac_get_asn();
+    _app_vars.trace.rx_time = now;
+    _app_vars.trace.ipc_time = now;
+    _app_vars.trace.isr_time = now;
+    _app_vars.trace_ipc = ipc_shared_data.status == SWRMT_APPLICATION_RUNNING;
+    if (!_app_vars.trace_ipc) {
+        event_post(&_events[NETCORE_EVENT_TRACE]);
+    }
+    return _app_vars.trace_ipc;
+}
+
 static void _handle_packet(uint64_t dst_address, uint8_t *packet, uint8_t length) {
-    memcpy(_app_vars.req_buffer, packet, length);
-    uint8_t *ptr = _app_vars.req_buffer;
-    uint8_t packet_type = (uint8_t)*ptr++;
-    if ((packet_type >= SWRMT_MSG_STATUS) && (packet_type <= SWRMT_MSG_OTA_CHUNK)) {
-        _app_vars.req_received = true;
+    // Chunks go straight from the radio buffer to the shared queue, other requests wait in req_buffers
+    if (length && packet[0] == SWRMT_MSG_OTA_CHUNK) {
+        _queue_ota_chunk(packet + 1, length - 1);
+        return;
+    }
+
+    uint8_t packet_type = length ? packet[0] : 0;
+    if (packet_type == SWRMT_MSG_GROUP) {
+        // Group packets are broadcast, the ones for a group of this device are handled as if they were unicast
+        const swrmt_group_pkt_t *group = (const swrmt_group_pkt_t *)&packet[1];
+        if (length < 1 + sizeof(swrmt_group_pkt_t) || group->length > length - 1 - sizeof(swrmt_group_pkt_t)) {
+            return;
+        }
+        if (group->group >= SWRMT_GROUP_COUNT || !(_app_vars.groups & (1U << group->group))) {
+            return;
+        }
+        _handle_packet(_app_vars.device_id, (uint8_t *)group->packet, group->length);
         return;
     }
 
-    if (length == sizeof(mr_metrics_payload_t) && packet_type == MARI_PAYLOAD_TYPE_METRICS_PROBE) {
-        _app_vars.metrics_received = true;
+    bool is_request = ((packet_type >= SWRMT_MSG_STATUS) && (packet_type <= SWRMT_MSG_OTA_START)) || packet_type == SWRMT_MSG_OTA_FINALIZE || packet_type == SWRMT_MSG_OTA_MANIFEST || packet_type == SWRMT_MSG_POSITION_STREAM || packet_type == SWRMT_MSG_IDLE || packet_type == SWRMT_MSG_SCHEDULE || packet_type == SWRMT_MSG_GROUP_SET || packet_type == SWRMT_MSG_PROFILE || packet_type == SWRMT_MSG_IMAGE || packet_type == SWRMT_MSG_UPLOAD || packet_type == SWRMT_MSG_UPLOAD_REQUEST;
+    bool is_metrics = length == sizeof(mr_metrics_payload_t) && packet_type == MARI_PAYLOAD_TYPE_METRICS_PROBE;
+    if (is_request || is_metrics) {
+        // Drop the request while the pending ones are not handled, the gateway retries
+        if (_app_vars.req_head - _app_vars.req_tail >= NETCORE_REQ_QUEUE_SIZE) {
+            return;
+        }
+        // Fields missing in the shorter requests of older gateways read as 0
+        uint8_t *buffer = _app_vars.req_buffers[_app_vars.req_head % NETCORE_REQ_QUEUE_SIZE];
+        memcpy(buffer, packet, length);
+        memset(buffer + length, 0, UINT8_MAX - length);
+        _app_vars.req_head++;
+        event_post(&_events[NETCORE_EVENT_REQUEST]);
         return;
     }
 
+    bool traced = packet_type == SWRMT_MSG_TRACE && _trace_packet(dst_address, packet, length);
+
     // ignore other types of packet if not in running mode
     if (ipc_shared_data.status != SWRMT_APPLICATION_RUNNING) {
         return;
@@ -90,11 +316,25 @@ static void _handle_packet(uint64_t dst_address, uint8_t *packet, uint8_t length
         return;
     }
 
-    mutex_lock();
-    ipc_shared_data.rx_pdu.length = length;
-    memcpy((uint8_t *)ipc_shared_data.rx_pdu.buffer, packet, length);
-    mutex_unlock();
-    _app_vars.data_received = true;
+    // Drop the PDU if the user image has not processed the pending ones yet
+    if (ipc_shared_data.rx.head - ipc_shared_data.rx.tail >= IPC_RX_QUEUE_SIZE) {
+        if (traced) {
+            // The trace is answered without reaching the user image
+            event_post(&_events[NETCORE_EVENT_TRACE]);
+        }
+        return;
+    }
+
+    // The slot is owned by the network core until the head index is incremented
+    volatile ipc_radio_pdu_t *pdu = &ipc_shared_data.rx.pdus[ipc_shared_data.rx.head % IPC_RX_QUEUE_SIZE];
+    pdu->length = length;
+    memcpy((uint8_t *)pdu->buffer, packet, length);
+    __DMB();
+    ipc_shared_data.rx.head++;
+    if (traced) {
+        ipc_shared_data.rx_trace = true;
+    }
+    event_post(&_events[NETCORE_EVENT_RADIO_RX]);
 }
 
 static void mari_event_callback(mr_event_t event, mr_event_data_t event_data) {
@@ -107,6 +347,11 @@ static void mari_event_callback(mr_event_t event, mr_event_data_t event_data) {
         case MARI_CONNECTED: {
             uint64_t gateway_id = event_data.data.gateway_info.gateway_id;
             printf("Connected to gateway %016llX\n", gateway_id);
+            // Send the PDUs queued by the application core while disconnected
+            event_post(&_events[NETCORE_EVENT_RADIO_TX]);
+            // The gateway may not know this device yet
+            status_request();
+            event_post(&_events[NETCORE_EVENT_STATUS]);
             break;
         }
         case MARI_DISCONNECTED: {
@@ -132,12 +377,471 @@ static uint16_t _net_id(void) {
     return (uint16_t)(cfg->net_id & 0xFFFFu);
 }
 
+static uint8_t _schedule_id(void) {
+    const swarmit_config_t *cfg = (const swarmit_config_t *)SWARMIT_NET_CONFIG_START_ADDRESS;
+
+    if (cfg->magic != SWARMIT_CONFIG_MAGIC_VALUE || cfg->schedule_id >= SWRMT_SCHEDULE_COUNT) {
+        return SWARMIT_DEFAULT_SCHEDULE_ID;
+    }
+    return (uint8_t)cfg->schedule_id;
+}
+
+static uint32_t _groups(void) {
+    const swarmit_config_t *cfg = (const swarmit_config_t *)SWARMIT_NET_CONFIG_START_ADDRESS;
+
+    if (cfg->magic != SWARMIT_CONFIG_MAGIC_VALUE || cfg->groups == UINT32_MAX) {
+        return 0;
+    }
+    return cfg->groups & ((1U << SWRMT_GROUP_COUNT) - 1);
+}
+
+static void _config_write(void) {
+    // The config page is only rewritten on request, the CPU stalls during the erase
+    const swarmit_config_t config = {
+        .magic          = SWARMIT_CONFIG_MAGIC_VALUE,
+        .net_id         = _app_vars.mari_net_id,
+        .schedule_id    = _app_vars.mari_schedule_id,
+        .groups         = _app_vars.groups,
+    };
+    uint32_t *dest = (uint32_t *)SWARMIT_NET_CONFIG_START_ADDRESS;
+    const uint32_t *src = (const uint32_t *)&config;
+
+    NRF_NVMC_NS->CONFIG = (NVMC_CONFIG_WEN_Een << NVMC_CONFIG_WEN_Pos);
+    *dest = 0xFFFFFFFF;
+    while (!NRF_NVMC_NS->READY) {}
+    NRF_NVMC_NS->CONFIG = (NVMC_CONFIG_WEN_Wen << NVMC_CONFIG_WEN_Pos);
+    for (uint32_t i = 0; i < sizeof(swarmit_config_t) / sizeof(uint32_t); i++) {
+        dest[i] = src[i];
+        while (!NRF_NVMC_NS->READY) {}
+    }
+    NRF_NVMC_NS->CONFIG = (NVMC_CONFIG_WEN_Ren << NVMC_CONFIG_WEN_Pos);
+}
+
 uint64_t _deviceid(void) {
     return ((uint64_t)NRF_FICR_NS->INFO.DEVICEID[1]) << 32 | (uint64_t)NRF_FICR_NS->INFO.DEVICEID[0];
 }
 
+static void _read_telemetry(ipc_telemetry_t *telemetry) {
+    // The application core updates the copies one after the other, the sequence parity gives the one not being written
+    uint32_t seq;
+    do {
+        seq = ipc_shared_data.telemetry_seq;
+        __DMB();
+        memcpy(telemetry, (const void *)&ipc_shared_data.telemetry[seq & 1], sizeof(ipc_telemetry_t));
+        __DMB();
+    } while (seq != ipc_shared_data.telemetry_seq);
+}
+
+static bool _read_upload(swrmt_upload_pkt_t *upload, uint32_t *address) {
+    // A region being replaced has a zero size, the gateway checks the CRC of the whole region anyway
+    upload->size = ipc_shared_data.upload.size;
+    __DMB();
+    upload->session = ipc_shared_data.upload.session;
+    upload->crc = ipc_shared_data.upload.crc;
+    *address = ipc_shared_data.upload.address;
+    if (*address < IPC_UPLOAD_RAM_START || *address > IPC_UPLOAD_RAM_END || upload->size > IPC_UPLOAD_RAM_END - *address) {
+        upload->size = 0;
+    }
+    return upload->size != 0;
+}
+
 static void _send_status(void) {
-    _app_vars.send_status = true;
+    event_post(&_events[NETCORE_EVENT_STATUS]);
+}
+
+static void _tx_payload(uint8_t *payload, uint8_t length) {
+    // Any frame received by the gateway shows the device is alive, it delays the next heartbeat
+    _app_vars.last_tx_time = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+    mari_node_tx_payload(payload, length);
+}
+
+static void _handle_radio_rx(void) {
+    if (_app_vars.trace_ipc && ipc_shared_data.rx_trace) {
+        _app_vars.trace.ipc_time = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+    }
+    NRF_IPC_NS->TASKS_SEND[IPC_CHAN_RADIO_RX] = 1;
+}
+
+static void _handle_ota_chunk(void) {
+    NRF_IPC_NS->TASKS_SEND[IPC_CHAN_OTA_CHUNK] = 1;
+}
+
+static void _handle_ipc_requests(void) {
+    // Process all the requests posted since the last doorbell, the application core waits on the tail index
+    while (ipc_shared_data.req.tail != ipc_shared_data.req.head) {
+        __DMB();
+        volatile ipc_req_desc_t *desc = &ipc_shared_data.req.descs[ipc_shared_data.req.tail % IPC_REQ_QUEUE_SIZE];
+        switch (desc->req) {
+            // Mira node functions
+            case IPC_MARI_INIT_REQ:
+                mari_init(MARI_NODE, _app_vars.mari_net_id, _schedules[_app_vars.mari_schedule_id], &mari_event_callback);
+                break;
+            case IPC_RNG_INIT_REQ:
+                db_rng_init();
+                break;
+            case IPC_RNG_READ_REQ:
+                for (uint8_t i = 0; i < desc->length && i < IPC_RNG_BUFFER_SIZE; i++) {
+                    db_rng_read((uint8_t *)&ipc_shared_data.rng.value[i]);
+                }
+                break;
+            default:
+                break;
+        }
+        __DMB();
+        ipc_shared_data.req.tail++;
+    }
+}
+
+static void _handle_radio_tx(void) {
+    // Send all the PDUs queued by the application core, they stay queued until a gateway is connected
+    while (ipc_shared_data.tx.tail != ipc_shared_data.tx.head && mari_node_is_connected()) {
+        __DMB();
+        volatile ipc_radio_pdu_t *pdu = &ipc_shared_data.tx.pdus[ipc_shared_data.tx.tail % IPC_TX_QUEUE_SIZE];
+        _tx_payload((uint8_t *)pdu->buffer, pdu->length);
+        __DMB();
+        ipc_shared_data.tx.tail++;
+    }
+}
+
+static void _handle_position(void) {
+    // Positions are sent by full batches, the rate is set by the streaming period
+    while (_app_vars.position_head - _app_vars.position_tail >= _app_vars.position_batch) {
+        size_t length = 0;
+        _app_vars.notification_buffer[length++] = SWRMT_MSG_POSITION_BATCH;
+        _app_vars.notification_buffer[length++] = _app_vars.position_batch;
+        _app_vars.notification_buffer[length++] = _app_vars.position_batch * sizeof(netcore_position_sample_t);
+        for (uint8_t i = 0; i < _app_vars.position_batch; i++) {
+            netcore_position_sample_t *sample = &_app_vars.position_samples[_app_vars.position_tail % NETCORE_POSITION_QUEUE_SIZE];
+            memcpy(_app_vars.notification_buffer + length, sample, sizeof(netcore_position_sample_t));
+            length += sizeof(netcore_position_sample_t);
+            _app_vars.position_tail++;
+        }
+        _tx_payload(_app_vars.notification_buffer, length);
+    }
+}
+
+static void _handle_request(void) {
+    // Requests are handled in the order they were received, one per event
+    uint8_t *buffer = _app_vars.req_buffers[_app_vars.req_tail % NETCORE_REQ_QUEUE_SIZE];
+    if (buffer[0] == MARI_PAYLOAD_TYPE_METRICS_PROBE) {
+        mr_metrics_payload_t *metrics_payload = (mr_metrics_payload_t *)buffer;
+        // update metrics probe
+        metrics_payload->node_rx_count        = ++_app_vars.metrics_rx_counter;
+        metrics_payload->node_rx_asn          = mr_mac_get_asn();
+        metrics_payload->node_tx_count        = ++_app_vars.metrics_tx_counter;
+        metrics_payload->node_tx_enqueued_asn = mr_mac_get_asn();
+        metrics_payload->rssi_at_node         = mr_radio_rssi();
+
+        // send metrics probe to gateway
+        _tx_payload((uint8_t *)metrics_payload, sizeof(mr_metrics_payload_t));
+        _app_vars.req_tail++;
+        return;
+    }
+
+    swrmt_request_t *req = (swrmt_request_t *)buffer;
+    switch (req->type) {
+        case SWRMT_MSG_STATUS:
+            status_request();
+            event_post(&_events[NETCORE_EVENT_STATUS]);
+            break;
+        case SWRMT_MSG_POSITION_STREAM:
+        {
+            const swrmt_position_stream_pkt_t *pkt = (const swrmt_position_stream_pkt_t *)req->data;
+            if (pkt->batch == 0 || pkt->batch > NETCORE_POSITION_BATCH_MAX) {
+                printf("Invalid position batch %u\n", pkt->batch);
+                break;
+            }
+            // Positions sampled with the previous settings are dropped
+            ipc_shared_data.position_stream_period = 0;
+            _app_vars.position_tail = _app_vars.position_head;
+            _app_vars.position_batch = pkt->batch;
+            ipc_shared_data.position_stream_period = pkt->period_ms;
+            printf("Position stream every %u ms, %u per frame\n", pkt->period_ms, pkt->batch);
+        } break;
+        case SWRMT_MSG_SCHEDULE:
+        {
+            const swrmt_schedule_pkt_t *pkt = (const swrmt_schedule_pkt_t *)req->data;
+            if (pkt->schedule_id >= SWRMT_SCHEDULE_COUNT) {
+                printf("Invalid schedule %u\n", pkt->schedule_id);
+                break;
+            }
+            if (ipc_shared_data.status != SWRMT_APPLICATION_READY && ipc_shared_data.status != SWRMT_APPLICATION_IDLE) {
+                break;
+            }
+            if (pkt->schedule_id == _app_vars.mari_schedule_id) {
+                break;
+            }
+            printf("Switching to schedule %u\n", pkt->schedule_id);
+            _app_vars.mari_schedule_id = pkt->schedule_id;
+            _config_write();
+            // The node joins again once the gateway uses the same schedule
+            mari_init(MARI_NODE, _app_vars.mari_net_id, _schedules[_app_vars.mari_schedule_id], &mari_event_callback);
+        } break;
+        case SWRMT_MSG_GROUP_SET:
+        {
+            const swrmt_group_set_pkt_t *pkt = (const swrmt_group_set_pkt_t *)req->data;
+            uint32_t groups = pkt->groups & ((1U << SWRMT_GROUP_COUNT) - 1);
+            if (groups == _app_vars.groups) {
+                break;
+            }
+            printf("Groups set to %08X\n", groups);
+            _app_vars.groups = groups;
+            _config_write();
+            // The gateway learns the new groups from the status
+            status_request();
+            event_post(&_events[NETCORE_EVENT_STATUS]);
+        } break;
+        case SWRMT_MSG_PROFILE:
+        {
+            // The counters of both cores are sent in a single frame
+            size_t length = 0;
+            _app_vars.notification_buffer[length++] = SWRMT_MSG_PROFILE;
+            _app_vars.notification_buffer[length++] = SWRMT_PROFILE_COUNT;
+            _app_vars.notification_buffer[length++] = SWRMT_PROFILE_COUNT * sizeof(swrmt_profile_counter_t);
+            length += profile_to_buffer(&_app_vars.notification_buffer[length]);
+            _tx_payload(_app_vars.notification_buffer, length);
+        } break;
+        case SWRMT_MSG_IMAGE:
+        {
+            // The application core publishes the image it installed, the gateway skips the devices already running it
+            swrmt_image_pkt_t image;
+            mutex_lock(IPC_MUTEX_OTA);
+            image.size = ipc_shared_data.image.size;
+            memcpy(image.sha, (const uint8_t *)ipc_shared_data.image.sha, SWRMT_OTA_SHA256_LENGTH);
+            mutex_unlock(IPC_MUTEX_OTA);
+            size_t length = 0;
+            _app_vars.notification_buffer[length++] = SWRMT_MSG_IMAGE;
+            memcpy(&_app_vars.notification_buffer[length], &image, sizeof(swrmt_image_pkt_t));
+            length += sizeof(swrmt_image_pkt_t);
+            _tx_payload(_app_vars.notification_buffer, length);
+        } break;
+        case SWRMT_MSG_UPLOAD:
+        {
+            // The gateway learns the region offered by the user image, then requests its chunks
+            swrmt_upload_pkt_t upload;
+            uint32_t address;
+            _read_upload(&upload, &address);
+            size_t length = 0;
+            _app_vars.notification_buffer[length++] = SWRMT_MSG_UPLOAD;
+            memcpy(&_app_vars.notification_buffer[length], &upload, sizeof(swrmt_upload_pkt_t));
+            length += sizeof(swrmt_upload_pkt_t);
+            _tx_payload(_app_vars.notification_buffer, length);
+        } break;
+        case SWRMT_MSG_UPLOAD_REQUEST:
+        {
+            const swrmt_upload_request_pkt_t *pkt = (const swrmt_upload_request_pkt_t *)req->data;
+            swrmt_upload_pkt_t upload;
+            uint32_t address;
+            if (!_read_upload(&upload, &address) || pkt->session != upload.session) {
+                break;
+            }
+            // The chunks of the window are sent back to back, the gateway requests the lost ones again
+            uint32_t count = (upload.size + SWRMT_UPLOAD_CHUNK_SIZE - 1) / SWRMT_UPLOAD_CHUNK_SIZE;
+            for (uint32_t i = 0; i < SWRMT_UPLOAD_WINDOW_MAX && pkt->first < count && i < count - pkt->first; i++) {
+                if (!(pkt->bitmap & (1U << i))) {
+                    continue;
+                }
+                uint32_t index = pkt->first + i;
+                uint32_t offset = index * SWRMT_UPLOAD_CHUNK_SIZE;
+                uint8_t size = (upload.size - offset < SWRMT_UPLOAD_CHUNK_SIZE) ? upload.size - offset : SWRMT_UPLOAD_CHUNK_SIZE;
+                size_t length = 0;
+                _app_vars.notification_buffer[length++] = SWRMT_MSG_UPLOAD_CHUNK;
+                _app_vars.notification_buffer[length++] = upload.session;
+                memcpy(&_app_vars.notification_buffer[length], &index, sizeof(uint32_t));
+                length += sizeof(uint32_t);
+                _app_vars.notification_buffer[length++] = size;
+                memcpy(&_app_vars.notification_buffer[length], (const void *)(address + offset), size);
+                length += size;
+                _tx_payload(_app_vars.notification_buffer, length);
+            }
+        } break;
+        case SWRMT_MSG_IDLE:
+        {
+            const swrmt_idle_pkt_t *pkt = (const swrmt_idle_pkt_t *)req->data;
+            uint8_t status = pkt->enable ? SWRMT_APPLICATION_IDLE : SWRMT_APPLICATION_READY;
+            if (ipc_shared_data.status != (pkt->enable ? SWRMT_APPLICATION_READY : SWRMT_APPLICATION_IDLE)) {
+                break;
+            }
+            puts(pkt->enable ? "Idle request received" : "Wake up request received");
+            // Positions are not computed in idle mode
+            ipc_shared_data.position_stream_period = 0;
+            ipc_shared_data.status = status;
+            NRF_IPC_NS->TASKS_SEND[IPC_CHAN_IDLE] = 1;
+            mr_timer_hf_set_periodic_us(NETCORE_MAIN_TIMER, 0, pkt->enable ? NETCORE_IDLE_CHECK_PERIOD_US : NETCORE_STATUS_CHECK_PERIOD_US, _send_status);
+            event_post(&_events[NETCORE_EVENT_STATUS]);
+        } break;
+        case SWRMT_MSG_START:
+            if (ipc_shared_data.status != SWRMT_APPLICATION_READY) {
+                break;
+            }
+            puts("Start request received");
+            _schedule(SWRMT_MSG_START, req->data);
+            break;
+        case SWRMT_MSG_STOP:
+            // A stop before the ASN of a scheduled start cancels it
+            if (_app_vars.scheduled_pending && _app_vars.scheduled_type == SWRMT_MSG_START) {
+                _app_vars.scheduled_pending = false;
+                // A start sent again for the same ASN is run
+                _app_vars.scheduled_asn = 0;
+                puts("Scheduled start cancelled");
+                break;
+            }
+            if ((ipc_shared_data.status != SWRMT_APPLICATION_RUNNING) && (ipc_shared_data.status != SWRMT_APPLICATION_RESETTING) && (ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING)) {
+                break;
+            }
+            puts("Stop request received");
+            _schedule(SWRMT_MSG_STOP, req->data);
+            break;
+        case SWRMT_MSG_RESET:
+            if (ipc_shared_data.status != SWRMT_APPLICATION_READY) {
+                break;
+            }
+            memcpy((uint8_t *)&ipc_shared_data.target_position, req->data, sizeof(position_2d_t));
+            puts("Reset request received");
+            ipc_shared_data.status = SWRMT_APPLICATION_RESETTING;
+            //NRF_IPC_NS->TASKS_SEND[IPC_CHAN_APPLICATION_RESET] = 1;
+            break;
+        case SWRMT_MSG_OTA_START:
+        {
+            if (ipc_shared_data.status != SWRMT_APPLICATION_READY && ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING) {
+                break;
+            }
+            const swrmt_ota_start_pkt_t *pkt = (const swrmt_ota_start_pkt_t *)req->data;
+            // Chunks are written to flash by words
+            if (pkt->chunk_size < SWRMT_OTA_CHUNK_SIZE_MIN || pkt->chunk_size > SWRMT_OTA_CHUNK_SIZE || pkt->chunk_size % sizeof(uint32_t)) {
+                printf("Invalid chunk size %u\n", pkt->chunk_size);
+                break;
+            }
+            if (pkt->fec_group > SWRMT_OTA_FEC_GROUP_MAX) {
+                printf("Invalid FEC group %u\n", pkt->fec_group);
+                break;
+            }
+            ipc_shared_data.status = SWRMT_APPLICATION_PROGRAMMING;
+            // The latest start wins, the device leaves the session it was part of
+            _app_vars.ota_session = pkt->session;
+            // Erase the corresponding flash pages.
+            mutex_lock(IPC_MUTEX_OTA);
+            ipc_shared_data.ota.image_size = pkt->image_size;
+            ipc_shared_data.ota.chunk_count = pkt->chunk_count;
+            ipc_shared_data.ota.chunk_size = pkt->chunk_size;
+            ipc_shared_data.ota.ack_interval = pkt->ack_interval;
+            ipc_shared_data.ota.mode = pkt->mode;
+            ipc_shared_data.ota.fec_group = pkt->fec_group;
+            ipc_shared_data.ota.output_size = pkt->output_size;
+            ipc_shared_data.ota.base_size = pkt->base_size;
+            memcpy((uint8_t *)ipc_shared_data.ota.base_sha, pkt->base_sha, sizeof(pkt->base_sha));
+            mutex_unlock(IPC_MUTEX_OTA);
+            // Discard chunks still pending from a previous transfer
+            ipc_shared_data.ota.chunk_head = ipc_shared_data.ota.chunk_tail;
+            printf("OTA Start request received (size: %u, chunks: %u, chunk size: %u)\n", ipc_shared_data.ota.image_size, ipc_shared_data.ota.chunk_count, ipc_shared_data.ota.chunk_size);
+            NRF_IPC_NS->TASKS_SEND[IPC_CHAN_OTA_START] = 1;
+        } break;
+        case SWRMT_MSG_OTA_MANIFEST:
+        {
+            if (ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING) {
+                break;
+            }
+            const swrmt_ota_manifest_pkt_t *pkt = (const swrmt_ota_manifest_pkt_t *)req->data;
+            if (pkt->session != _app_vars.ota_session) {
+                break;
+            }
+            if (pkt->count > sizeof(pkt->crc) || pkt->count % sizeof(uint32_t)) {
+                printf("Invalid manifest size %u\n", pkt->count);
+                break;
+            }
+            mutex_lock(IPC_MUTEX_OTA);
+            memcpy((uint8_t *)&ipc_shared_data.ota.manifest, pkt, sizeof(swrmt_ota_manifest_pkt_t));
+            mutex_unlock(IPC_MUTEX_OTA);
+            NRF_IPC_NS->TASKS_SEND[IPC_CHAN_OTA_MANIFEST] = 1;
+        } break;
+        case SWRMT_MSG_OTA_FINALIZE:
+        {
+            if (ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING && ipc_shared_data.status != SWRMT_APPLICATION_READY) {
+                break;
+            }
+            const swrmt_ota_finalize_pkt_t *pkt = (const swrmt_ota_finalize_pkt_t *)req->data;
+            if (pkt->session != _app_vars.ota_session) {
+                break;
+            }
+            mutex_lock(IPC_MUTEX_OTA);
+            memcpy((uint8_t *)ipc_shared_data.ota.image_sha, pkt->sha, SWRMT_OTA_SHA256_LENGTH);
+            mutex_unlock(IPC_MUTEX_OTA);
+            puts("OTA finalize request received");
+            NRF_IPC_NS->TASKS_SEND[IPC_CHAN_OTA_FINALIZE] = 1;
+        } break;
+        default:
+            break;
+    }
+    _app_vars.req_tail++;
+}
+
+static void _handle_status(void) {
+    ipc_telemetry_t telemetry;
+    _read_telemetry(&telemetry);
+    const status_telemetry_t status = {
+        .device_type    = ipc_shared_data.device_type,
+        .status         = ipc_shared_data.status,
+        .battery_level  = telemetry.battery_level,
+        .x              = telemetry.position.x,
+        .y              = telemetry.position.y,
+        .groups         = _app_vars.groups,
+    };
+    size_t length = status_check(_app_vars.notification_buffer, &status, mr_timer_hf_now(NETCORE_MAIN_TIMER), _app_vars.last_tx_time);
+    if (length) {
+        _tx_payload(_app_vars.notification_buffer, length);
+    }
+}
+
+static void _handle_log(void) {
+    // Pack the pending records in as few frames as possible, each with the time it was signaled
+    size_t length = 0;
+    _app_vars.notification_buffer[length++] = SWRMT_MSG_LOG_BATCH;
+    uint16_t dropped = (uint16_t)(ipc_shared_data.log.dropped - _app_vars.log_dropped);
+    memcpy(_app_vars.notification_buffer + length, &dropped, sizeof(uint16_t));
+    length += sizeof(uint16_t);
+    uint8_t *count = &_app_vars.notification_buffer[length++];
+    uint8_t *size = &_app_vars.notification_buffer[length++];
+    *count = 0;
+    *size = 0;
+    while (ipc_shared_data.log.tail != _app_vars.log_stamped) {
+        __DMB();
+        uint32_t index = ipc_shared_data.log.tail % IPC_LOG_QUEUE_SIZE;
+        volatile ipc_log_data_t *record = &ipc_shared_data.log.records[index];
+        uint8_t record_flags = record->length & SWRMT_LOG_RECORD_FORMATTED;
+        uint8_t record_length = record->length & ~SWRMT_LOG_RECORD_FORMATTED;
+        if (length + sizeof(uint32_t) + 1 + record_length > NETCORE_LOG_BATCH_SIZE) {
+            // The remaining records are sent in the next frame
+            event_post(&_events[NETCORE_EVENT_LOG]);
+            break;
+        }
+        memcpy(_app_vars.notification_buffer + length, &_app_vars.log_timestamps[index], sizeof(uint32_t));
+        length += sizeof(uint32_t);
+        _app_vars.notification_buffer[length++] = record_length | record_flags;
+        memcpy(_app_vars.notification_buffer + length, (const uint8_t *)record->data, record_length);
+        length += record_length;
+        __DMB();
+        ipc_shared_data.log.tail++;
+        (*count)++;
+        *size += sizeof(uint32_t) + 1 + record_length;
+    }
+
+    // Nothing to report, the records were already sent with a previous batch
+    if (*count == 0 && dropped == 0) {
+        return;
+    }
+    _app_vars.log_dropped += dropped;
+    _tx_payload(_app_vars.notification_buffer, length);
+}
+
+static void _handle_trace(void) {
+    _app_vars.trace_ipc = false;
+    _app_vars.trace.tx_asn = mr_mac_get_asn();
+    _app_vars.trace.tx_time = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+    size_t length = 0;
+    _app_vars.notification_buffer[length++] = SWRMT_MSG_TRACE;
+    memcpy(&_app_vars.notification_buffer[length], &_app_vars.trace, sizeof(swrmt_trace_pkt_t));
+    length += sizeof(swrmt_trace_pkt_t);
+    _tx_payload(_app_vars.notification_buffer, length);
 }
 
 //=========================== main ==============================================
@@ -146,16 +850,25 @@ int main(void) {
 
     _app_vars.device_id = _deviceid();
     _app_vars.mari_net_id = _net_id();
+    _app_vars.mari_schedule_id = _schedule_id();
+    _app_vars.groups = _groups();
+    profile_init();
 
-    NRF_IPC_NS->INTENSET                             = (1 << IPC_CHAN_REQ) | (1 << IPC_CHAN_LOG_EVENT);
+    NRF_IPC_NS->INTENSET                             = (1 << IPC_CHAN_REQ) | (1 << IPC_CHAN_LOG_EVENT) | (1 << IPC_CHAN_RADIO_TX) | (1 << IPC_CHAN_POSITION) | (1 << IPC_CHAN_RADIO_RX_DONE);
     NRF_IPC_NS->SEND_CNF[IPC_CHAN_RADIO_RX]          = 1 << IPC_CHAN_RADIO_RX;
     NRF_IPC_NS->SEND_CNF[IPC_CHAN_APPLICATION_START] = 1 << IPC_CHAN_APPLICATION_START;
     NRF_IPC_NS->SEND_CNF[IPC_CHAN_APPLICATION_STOP]  = 1 << IPC_CHAN_APPLICATION_STOP;
     //NRF_IPC_NS->SEND_CNF[IPC_CHAN_APPLICATION_RESET] = 1 << IPC_CHAN_APPLICATION_RESET;
     NRF_IPC_NS->SEND_CNF[IPC_CHAN_OTA_START]         = 1 << IPC_CHAN_OTA_START;
     NRF_IPC_NS->SEND_CNF[IPC_CHAN_OTA_CHUNK]         = 1 << IPC_CHAN_OTA_CHUNK;
+    NRF_IPC_NS->SEND_CNF[IPC_CHAN_OTA_FINALIZE]      = 1 << IPC_CHAN_OTA_FINALIZE;
+    NRF_IPC_NS->SEND_CNF[IPC_CHAN_OTA_MANIFEST]      = 1 << IPC_CHAN_OTA_MANIFEST;
+    NRF_IPC_NS->SEND_CNF[IPC_CHAN_IDLE]              = 1 << IPC_CHAN_IDLE;
     NRF_IPC_NS->RECEIVE_CNF[IPC_CHAN_REQ]            = 1 << IPC_CHAN_REQ;
     NRF_IPC_NS->RECEIVE_CNF[IPC_CHAN_LOG_EVENT]      = 1 << IPC_CHAN_LOG_EVENT;
+    NRF_IPC_NS->RECEIVE_CNF[IPC_CHAN_RADIO_TX]       = 1 << IPC_CHAN_RADIO_TX;
+    NRF_IPC_NS->RECEIVE_CNF[IPC_CHAN_POSITION]       = 1 << IPC_CHAN_POSITION;
+    NRF_IPC_NS->RECEIVE_CNF[IPC_CHAN_RADIO_RX_DONE]  = 1 << IPC_CHAN_RADIO_RX_DONE;
 
     NVIC_EnableIRQ(IPC_IRQn);
     NVIC_ClearPendingIRQ(IPC_IRQn);
@@ -163,174 +876,26 @@ int main(void) {
 
     // Configure timer used for timestamping events
     mr_timer_hf_init(NETCORE_MAIN_TIMER);
-    mr_timer_hf_set_periodic_us(NETCORE_MAIN_TIMER, 0, 1000000UL, _send_status);
+    mr_timer_hf_set_periodic_us(NETCORE_MAIN_TIMER, 0, NETCORE_STATUS_CHECK_PERIOD_US, _send_status);
+
+    // Start with empty queues, only the difference between head and tail matters
+    ipc_shared_data.rx.head = ipc_shared_data.rx.tail;
+    ipc_shared_data.tx.tail = ipc_shared_data.tx.head;
+    ipc_shared_data.req.tail = ipc_shared_data.req.head;
+    ipc_shared_data.log.tail = ipc_shared_data.log.head;
+    _app_vars.log_stamped = ipc_shared_data.log.head;
+    _app_vars.log_dropped = ipc_shared_data.log.dropped;
+    // Positions are only streamed once requested by the gateway
+    ipc_shared_data.position_stream_period = 0;
+    ipc_shared_data.rx_trace = false;
 
     // Network core must remain on
     ipc_shared_data.net_ready = true;
 
     while (1) {
-        __WFE();
-
-        if (_app_vars.send_status) {
-            _app_vars.send_status = false;
-            size_t length = 0;
-            _app_vars.notification_buffer[length++] = SWRMT_MSG_STATUS;
-            _app_vars.notification_buffer[length++] = ipc_shared_data.device_type;
-            _app_vars.notification_buffer[length++] = ipc_shared_data.status;
-            memcpy(&_app_vars.notification_buffer[length], (void *)&ipc_shared_data.battery_level, sizeof(uint16_t));
-            length += sizeof(uint16_t);
-            memcpy(&_app_vars.notification_buffer[length], (void *)&ipc_shared_data.current_position, sizeof(position_2d_t));
-            length += sizeof(position_2d_t);
-            mari_node_tx_payload(_app_vars.notification_buffer, length);
-        }
-
-        if (_app_vars.req_received) {
-            _app_vars.req_received = false;
-            swrmt_request_t *req = (swrmt_request_t *)_app_vars.req_buffer;
-            switch (req->type) {
-                case SWRMT_MSG_START:
-                    if (ipc_shared_data.status != SWRMT_APPLICATION_READY) {
-                        break;
-                    }
-                    puts("Start request received");
-                    NRF_IPC_NS->TASKS_SEND[IPC_CHAN_APPLICATION_START] = 1;
-                    break;
-                case SWRMT_MSG_STOP:
-                    if ((ipc_shared_data.status != SWRMT_APPLICATION_RUNNING) && (ipc_shared_data.status != SWRMT_APPLICATION_RESETTING) && (ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING)) {
-                        break;
-                    }
-                    puts("Stop request received");
-                    ipc_shared_data.status = SWRMT_APPLICATION_STOPPING;
-                    NRF_IPC_NS->TASKS_SEND[IPC_CHAN_APPLICATION_STOP] = 1;
-                    break;
-                case SWRMT_MSG_RESET:
-                    if (ipc_shared_data.status != SWRMT_APPLICATION_READY) {
-                        break;
-                    }
-                    memcpy((uint8_t *)&ipc_shared_data.target_position, req->data, sizeof(position_2d_t));
-                    puts("Reset request received");
-                    ipc_shared_data.status = SWRMT_APPLICATION_RESETTING;
-                    //NRF_IPC_NS->TASKS_SEND[IPC_CHAN_APPLICATION_RESET] = 1;
-                    break;
-                case SWRMT_MSG_OTA_START:
-                {
-                    if (ipc_shared_data.status != SWRMT_APPLICATION_READY && ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING) {
-                        break;
-                    }
-                    ipc_shared_data.ota.last_chunk_acked = -1;
-                    ipc_shared_data.status = SWRMT_APPLICATION_PROGRAMMING;
-                    const swrmt_ota_start_pkt_t *pkt = (const swrmt_ota_start_pkt_t *)req->data;
-                    // Erase the corresponding flash pages.
-                    mutex_lock();
-                    ipc_shared_data.ota.image_size = pkt->image_size;
-                    ipc_shared_data.ota.chunk_count = pkt->chunk_count;
-                    mutex_unlock();
-                    printf("OTA Start request received (size: %u, chunks: %u)\n", ipc_shared_data.ota.image_size, ipc_shared_data.ota.chunk_count);
-                    NRF_IPC_NS->TASKS_SEND[IPC_CHAN_OTA_START] = 1;
-                } break;
-                case SWRMT_MSG_OTA_CHUNK:
-                {
-                    if (ipc_shared_data.status != SWRMT_APPLICATION_PROGRAMMING && ipc_shared_data.status != SWRMT_APPLICATION_READY) {
-                        break;
-                    }
-
-                    const swrmt_ota_chunk_pkt_t *pkt = (const swrmt_ota_chunk_pkt_t *)req->data;
-                    ipc_shared_data.ota.chunk_index = pkt->index;
-
-                    // Check chunk index is valid
-                    if (ipc_shared_data.ota.chunk_index >= ipc_shared_data.ota.chunk_count) {
-                        printf("Invalid chunk index %u\n", ipc_shared_data.ota.chunk_index);
-                        break;
-                    }
-
-                    // Only check for matching sha if chunk was not already acked
-                    if (ipc_shared_data.ota.last_chunk_acked != (int32_t)ipc_shared_data.ota.chunk_index) {
-                        printf("Verify SHA for chunk %u: ", ipc_shared_data.ota.chunk_index);
-                        ipc_shared_data.ota.chunk_size = pkt->chunk_size;
-                        mutex_lock();
-                        memcpy((uint8_t *)ipc_shared_data.ota.chunk, pkt->chunk, pkt->chunk_size);
-                        mutex_unlock();
-
-                        // Copy expected hash
-                        memcpy(_app_vars.expected_hash, pkt->sha, SWRMT_OTA_SHA256_LENGTH);
-
-                        // Compute and compare the chunk hash with the received one
-                        crypto_sha256_init(&_app_vars.sha256_ctx);
-                        mutex_lock();
-                        crypto_sha256_update(&_app_vars.sha256_ctx, (const uint8_t *)ipc_shared_data.ota.chunk, ipc_shared_data.ota.chunk_size);
-                        mutex_unlock();
-                        crypto_sha256(&_app_vars.sha256_ctx, _app_vars.computed_hash);
-
-                        if (memcmp(_app_vars.computed_hash, _app_vars.expected_hash, 8) != 0) {
-                            puts("Failed");
-                            break;
-                        }
-                        puts("OK");
-                    }
-                    printf("Process OTA chunk request (index: %u, size: %u)\n", ipc_shared_data.ota.chunk_index, ipc_shared_data.ota.chunk_size);
-                    NRF_IPC_NS->TASKS_SEND[IPC_CHAN_OTA_CHUNK] = 1;
-                } break;
-                default:
-                    break;
-            }
-        }
-
-        if (_app_vars.ipc_req != IPC_REQ_NONE) {
-            ipc_shared_data.net_ack = false;
-            switch (_app_vars.ipc_req) {
-                // Mira node functions
-                case IPC_MARI_INIT_REQ:
-                    mari_init(MARI_NODE, _app_vars.mari_net_id, &schedule_tiny, &mari_event_callback);
-                    break;
-                case IPC_MARI_NODE_TX_REQ:
-                    while (!mari_node_is_connected()) {}
-                    mari_node_tx_payload((uint8_t *)ipc_shared_data.tx_pdu.buffer, ipc_shared_data.tx_pdu.length);
-                    break;
-                case IPC_RNG_INIT_REQ:
-                    db_rng_init();
-                    break;
-                case IPC_RNG_READ_REQ:
-                    db_rng_read((uint8_t *)&ipc_shared_data.rng.value);
-                    break;
-                default:
-                    break;
-            }
-            ipc_shared_data.net_ack = true;
-            _app_vars.ipc_req      = IPC_REQ_NONE;
-        }
-
-        if (_app_vars.data_received) {
-            _app_vars.data_received = false;
-            NRF_IPC_NS->TASKS_SEND[IPC_CHAN_RADIO_RX] = 1;
-        }
-
-        if (_app_vars.metrics_received) {
-            _app_vars.metrics_received = false;
-            mr_metrics_payload_t *metrics_payload = (mr_metrics_payload_t *)_app_vars.req_buffer;
-            // update metrics probe
-            metrics_payload->node_rx_count        = ++_app_vars.metrics_rx_counter;
-            metrics_payload->node_rx_asn          = mr_mac_get_asn();
-            metrics_payload->node_tx_count        = ++_app_vars.metrics_tx_counter;
-            metrics_payload->node_tx_enqueued_asn = mr_mac_get_asn();
-            metrics_payload->rssi_at_node         = mr_radio_rssi();
-
-            // send metrics probe to gateway
-            mari_node_tx_payload((uint8_t *)metrics_payload, sizeof(mr_metrics_payload_t));
-        }
-
-        if (_app_vars.ipc_log_received) {
-            _app_vars.ipc_log_received = false;
-            // Notify log data
-            size_t length = 0;
-            _app_vars.notification_buffer[length++] = SWRMT_MSG_LOG_EVENT;
-            uint32_t timestamp = mr_timer_hf_now(NETCORE_MAIN_TIMER);
-            memcpy(_app_vars.notification_buffer + length, &timestamp, sizeof(uint32_t));
-            length += sizeof(uint32_t);
-            mutex_lock();
-            memcpy(_app_vars.notification_buffer + length, (void *)&ipc_shared_data.log, ipc_shared_data.log.length + 1);
-            mutex_unlock();
-            length += ipc_shared_data.log.length + 1;
-            mari_node_tx_payload(_app_vars.notification_buffer, length);
+        // Sleep only once all the posted events are handled, the most urgent first
+        if (!event_dispatch(_events, NETCORE_EVENT_COUNT)) {
+            __WFE();
         }
     }
 }
@@ -338,11 +903,50 @@ int main(void) {
 void IPC_IRQHandler(void) {
     if (NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_REQ]) {
         NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_REQ] = 0;
-        _app_vars.ipc_req                        = ipc_shared_data.req;
+        event_post(&_events[NETCORE_EVENT_IPC_REQ]);
     }
 
     if (NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_LOG_EVENT]) {
         NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_LOG_EVENT] = 0;
-        _app_vars.ipc_log_received                     = true;
+        // Records are timestamped when signaled, they may wait behind other events before being sent
+        uint32_t now = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+        while (_app_vars.log_stamped != ipc_shared_data.log.head) {
+            _app_vars.log_timestamps[_app_vars.log_stamped % IPC_LOG_QUEUE_SIZE] = now;
+            _app_vars.log_stamped++;
+        }
+        event_post(&_events[NETCORE_EVENT_LOG]);
+    }
+
+    if (NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_RADIO_TX]) {
+        NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_RADIO_TX] = 0;
+        event_post(&_events[NETCORE_EVENT_RADIO_TX]);
+    }
+
+    if (NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_RADIO_RX_DONE]) {
+        NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_RADIO_RX_DONE] = 0;
+        if (_app_vars.trace_ipc) {
+            _app_vars.trace.isr_time = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+            event_post(&_events[NETCORE_EVENT_TRACE]);
+        }
+    }
+
+    if (NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_POSITION]) {
+        NRF_IPC_NS->EVENTS_RECEIVE[IPC_CHAN_POSITION] = 0;
+        // Sweeps are not aligned with the period, a position a quarter period early is kept rather than a period late
+        uint32_t now = mr_timer_hf_now(NETCORE_MAIN_TIMER);
+        uint32_t period_us = ipc_shared_data.position_stream_period * 1000UL;
+        bool due = period_us && now - _app_vars.position_time >= period_us - period_us / 4;
+        if (due && _app_vars.position_head - _app_vars.position_tail < NETCORE_POSITION_QUEUE_SIZE) {
+            netcore_position_sample_t *sample = &_app_vars.position_samples[_app_vars.position_head % NETCORE_POSITION_QUEUE_SIZE];
+            ipc_telemetry_t telemetry;
+            _read_telemetry(&telemetry);
+            sample->timestamp = now;
+            sample->position = telemetry.position;
+            _app_vars.position_time = now;
+            _app_vars.position_head++;
+            if (_app_vars.position_head - _app_vars.position_tail >= _app_vars.position_batch) {
+                event_post(&_events[NETCORE_EVENT_POSITION]);
+            }
+        }
     }
 }
@@ -0,0 +1,74 @@
+/**
+ * @file
+ * @ingroup bsp_profile
+ *
+ * @brief  nrf5340-net-specific definition of the "profile" bsp module.
+ *
+ * @author Anonymous Anon <anonymous@anon.org>
+ *
+ * @copyright Anon, 2025
+ */
+#include <nrf.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ipc.h"
+#include "profile.h"
+
+//========================== variables =========================================
+
+extern volatile __attribute__((section(".shared_data"))) ipc_shared_data_t ipc_shared_data;
+
+typedef struct {
+    swrmt_profile_counter_t counters[SWRMT_PROFILE_COUNT - SWRMT_PROFILE_APP_COUNT];    ///< Network core sections
+    bool                    enabled;                                                    ///< The cycle counter is implemented
+} profile_vars_t;
+
+static profile_vars_t _profile_vars = { 0 };
+
+//=========================== public ===========================================
+
+void profile_init(void) {
+    for (uint8_t index = 0; index < SWRMT_PROFILE_COUNT - SWRMT_PROFILE_APP_COUNT; index++) {
+        _profile_vars.counters[index].count = 0;
+        _profile_vars.counters[index].min = UINT32_MAX;
+        _profile_vars.counters[index].max = 0;
+        _profile_vars.counters[index].total = 0;
+    }
+#if SWARMIT_PROFILING
+    // The cycle counter is optional, the counters stay empty without it
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    _profile_vars.enabled = !(DWT->CTRL & DWT_CTRL_NOCYCCNT_Msk);
+    if (_profile_vars.enabled) {
+        DWT->CYCCNT = 0;
+        DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+    }
+#endif
+}
+
+#if SWARMIT_PROFILING
+void profile_add(swrmt_profile_section_t section, uint32_t start) {
+    if (!_profile_vars.enabled) {
+        return;
+    }
+    uint32_t elapsed = DWT->CYCCNT - start;
+    swrmt_profile_counter_t *counter = &_profile_vars.counters[section - SWRMT_PROFILE_APP_COUNT];
+    counter->count++;
+    counter->total += elapsed;
+    if (elapsed < counter->min) {
+        counter->min = elapsed;
+    }
+    if (elapsed > counter->max) {
+        counter->max = elapsed;
+    }
+}
+#endif
+
+size_t profile_to_buffer(uint8_t *buffer) {
+    // The application core may update a counter while it is copied, a dump can then mix two consecutive runs
+    size_t length = sizeof(ipc_shared_data.profile);
+    memcpy(buffer, (const void *)ipc_shared_data.profile, length);
+    memcpy(buffer + length, _profile_vars.counters, sizeof(_profile_vars.counters));
+    return length + sizeof(_profile_vars.counters);
+}
@@ -0,0 +1,75 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+/**
+ * @defgroup    bsp_profile     Cycle counter profiling
+ * @ingroup     bsp
+ * @brief       Cycles spent in the hot sections of both cores, sent to the gateway on request
+ *
+ * Each section keeps the number of runs and the fewest, most and total cycles of a run since boot. The network
+ * core counters are kept here, the application core ones are read from the shared RAM. Building with
+ * SWARMIT_PROFILING set to 0 removes the instrumentation.
+ *
+ * @{
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @copyright Anon, 2025
+ * @}
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <nrf.h>
+
+#include "protocol.h"
+
+//=========================== defines ==========================================
+
+#ifndef SWARMIT_PROFILING
+#define SWARMIT_PROFILING           (1)     ///< Instrument the profiled sections
+#endif
+
+//=========================== prototypes =======================================
+
+/**
+ * @brief Start the cycle counter and clear the counters of the network core sections
+ */
+void profile_init(void);
+
+/**
+ * @brief Return the cycle count at the start of a profiled section
+ */
+static inline uint32_t profile_start(void) {
+#if SWARMIT_PROFILING
+    return DWT->CYCCNT;
+#else
+    return 0;
+#endif
+}
+
+#if SWARMIT_PROFILING
+/**
+ * @brief Count a run of a section, from its start to now
+ *
+ * @param[in] section   one of the network core sections
+ * @param[in] start     cycle count returned by profile_start at the start of the run
+ */
+void profile_add(swrmt_profile_section_t section, uint32_t start);
+#else
+static inline void profile_add(swrmt_profile_section_t section, uint32_t start) {
+    (void)section;
+    (void)start;
+}
+#endif
+
+/**
+ * @brief Write the counters of all the sections in a buffer, in the order of swrmt_profile_section_t
+ *
+ * @param[out]  buffer      Bytes array to write to, SWRMT_PROFILE_COUNT counters long
+ *
+ * @return                  Number of bytes written in the buffer
+ */
+size_t profile_to_buffer(uint8_t *buffer);
+
+#endif
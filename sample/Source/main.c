@@ -14,6 +14,9 @@
 
 #include <nrf.h>
 
+#include "swarmit_log.h"
+#include "swarmit_snapshot.h"
+
 #define GPIO_P0_PIN (28)  // LED0 on nRF5340DK
 
 typedef void (*ipc_isr_cb_t)(const uint8_t *, size_t);
@@ -23,8 +26,14 @@ typedef struct __attribute__((packed)) {
     uint8_t content[UINT8_MAX];
 } msg_packet_t;
 
+typedef struct {
+    const uint8_t *data;
+    uint8_t length;
+} swarmit_segment_t;
+
 void swarmit_keep_alive(void);
-void swarmit_send_data_packet(const uint8_t *packet, uint8_t length);
+bool swarmit_send_data_packet(const uint8_t *packet, uint8_t length);
+bool swarmit_send_data_segments(const swarmit_segment_t *segments, size_t count);
 void swarmit_ipc_isr(ipc_isr_cb_t cb);
 void swarmit_log_data(uint8_t *data, size_t length);
 static bool _timer_running = false;
@@ -56,11 +65,22 @@ int main(void) {
     NVIC_EnableIRQ(TIMER0_IRQn);
     NRF_TIMER0_NS->TASKS_START = 1;
 
+    uint32_t iteration = 0;
     while (1) {
         delay_ms(500);
         swarmit_keep_alive();
         swarmit_send_data_packet((uint8_t *)"Hello", 5);
+        // The header and the counter are sent in the same packet without being copied together first
+        const swarmit_segment_t segments[] = {
+            { .data = (const uint8_t *)"Iteration", .length = 9 },
+            { .data = (const uint8_t *)&iteration, .length = sizeof(iteration) },
+        };
+        swarmit_send_data_segments(segments, 2);
         swarmit_log_data((uint8_t *)"Logging", 7);
+        SWRMT_LOG("Iteration %u, LED %u", iteration++, (NRF_P0_NS->OUT >> GPIO_P0_PIN) & 1);
+        swarmit_snapshot_t snapshot;
+        swarmit_snapshot_read(&snapshot);
+        SWRMT_LOG("Battery %u mV, position %u,%u", snapshot.battery_level, snapshot.position_x, snapshot.position_y);
         // Crash on purpose
         //uint32_t *addr = 0x0;
         //*addr = 0xdead;
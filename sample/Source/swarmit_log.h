@@ -0,0 +1,28 @@
+#ifndef __SWARMIT_LOG_H
+#define __SWARMIT_LOG_H
+
+/**
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @brief Deferred formatting logs for user images
+ *
+ * SWRMT_LOG only sends the address of the format string and the arguments, as 32-bit words. Format strings are
+ * placed in the .swarmit_log section of the user image, where `swarmit monitor --log-elf` finds them to format
+ * the records on the host. Integer and character conversions are supported, strings and floats are not.
+ *
+ * @copyright Anon, 2025
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+void swarmit_log_format(uint32_t format, const uint32_t *args, size_t count);
+
+#define SWRMT_LOG(fmt, ...) \
+    do { \
+        static const char _swrmt_log_fmt[] __attribute__((section(".swarmit_log"), aligned(4))) = fmt; \
+        const uint32_t _swrmt_log_args[] = { 0, ##__VA_ARGS__ }; \
+        swarmit_log_format((uint32_t)_swrmt_log_fmt, &_swrmt_log_args[1], sizeof(_swrmt_log_args) / sizeof(uint32_t) - 1); \
+    } while (0)
+
+#endif // __SWARMIT_LOG_H
@@ -0,0 +1,50 @@
+#ifndef __SWARMIT_SNAPSHOT_H
+#define __SWARMIT_SNAPSHOT_H
+
+/**
+ * @file
+ * @author Anonymous Anon <anonymous@anon.org>
+ * @brief Telemetry snapshot readable by user images without secure gateway call
+ *
+ * The bootloader updates the snapshot from a secure interrupt: every 100ms, at each LH2 sweep decoded and every
+ * second for the battery level. Reading it costs a few loads, so it can be done at every iteration of a control
+ * loop. The snapshot RAM is not protected against writes, user images must never write it.
+ *
+ * @copyright Anon, 2025
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include <nrf.h>
+
+#define SWARMIT_SNAPSHOT_ADDRESS    (0x20008000UL)  ///< Below the RAM used by user images
+
+typedef struct {
+    uint32_t    seq;                ///< Number of updates started and completed, odd while updating
+    uint32_t    position_x;         ///< X coordinate in mm
+    uint32_t    position_y;         ///< Y coordinate in mm
+    int32_t     velocity_x;         ///< X velocity in mm/s
+    int32_t     velocity_y;         ///< Y velocity in mm/s
+    uint16_t    battery_level;      ///< Battery level in mV
+    uint8_t     position_valid;     ///< 1 when the position is estimated
+    uint8_t     reserved;
+} swarmit_snapshot_t;
+
+/**
+ * @brief Copy a consistent snapshot, retries when interrupted by an update
+ *
+ * @param[out] snapshot address of the output copy
+ */
+static inline void swarmit_snapshot_read(swarmit_snapshot_t *snapshot) {
+    const volatile swarmit_snapshot_t *shared = (const volatile swarmit_snapshot_t *)SWARMIT_SNAPSHOT_ADDRESS;
+    uint32_t seq;
+    do {
+        seq = shared->seq;
+        __DMB();
+        memcpy(snapshot, (const void *)shared, sizeof(swarmit_snapshot_t));
+        __DMB();
+    } while ((seq & 1) || seq != shared->seq);
+}
+
+#endif // __SWARMIT_SNAPSHOT_H
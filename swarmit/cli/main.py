@@ -1,5 +1,8 @@
 #!/usr/bin/env python
 
+import csv
+import datetime
+import os
 import time
 
 import click
@@ -13,15 +16,36 @@ from rich.pretty import pprint
 from swarmit import __version__
 from swarmit.testbed.controller import (
     CHUNK_SIZE,
+    GROUP_COUNT,
+    OTA_CHUNK_SIZE_MAX,
+    OTA_CHUNK_SIZE_MIN,
+    OTA_IMAGE_SIZE_MAX,
+    OTA_ACK_INTERVAL_DEFAULT,
     OTA_ACK_TIMEOUT_DEFAULT,
     OTA_MAX_RETRIES_DEFAULT,
+    OTA_PLAN_CACHE_DEFAULT,
+    OTA_WINDOW_SIZE_DEFAULT,
+    POSITION_STREAM_BATCH_DEFAULT,
+    POSITION_STREAM_BATCH_MAX,
+    POSITION_STREAM_PERIOD_DEFAULT,
+    TRACE_COUNT_DEFAULT,
+    TRACE_INTERVAL_DEFAULT,
+    UPLOAD_DIR_DEFAULT,
     Controller,
     ControllerSettings,
     ResetLocation,
+    generate_links,
+    generate_profile,
+    generate_trace,
     print_transfer_status,
 )
+from swarmit.testbed.fec import FEC_GROUP_MAX
 from swarmit.testbed.helpers import load_toml_config
+from swarmit.testbed.link import LINK_PROBE_COUNT_DEFAULT
+from swarmit.testbed.logdict import LogDictionary
 from swarmit.testbed.logger import setup_logging
+from swarmit.testbed.logstore import LogStoreError, LogStoreReader
+from swarmit.testbed.protocol import OTAMode, ScheduleType
 
 DEFAULTS = {
     "adapter": "edge",
@@ -32,11 +56,32 @@ DEFAULTS = {
     # Default network ID for SwarmIT tests is 0x12**
     # See https://crystalfree.atlassian.net/wiki/spaces/Mari/pages/3324903426/Registry+of+Mari+Network+IDs
     "swarmit_network_id": "1200",
+    "gateways": "",
     "mqtt_use_tls": False,
+    "mqtt_batch_ms": 0,
     "verbose": False,
 }
 
 
+def validate_ota_chunk_size(ctx, param, value):
+    """Check the OTA chunk size is aligned on flash words."""
+    if value % 4:
+        raise click.BadParameter("must be a multiple of 4")
+    return value
+
+
+def validate_group(ctx, param, value):
+    """Check the group is one a device can belong to."""
+    if value is not None and not 0 <= value < GROUP_COUNT:
+        raise click.BadParameter(f"must be between 0 and {GROUP_COUNT - 1}")
+    return value
+
+
+def parse_groups(value):
+    """Parse a list of groups separated with ,"""
+    return [int(group) for group in value.split(",") if group]
+
+
 @click.group(context_settings=dict(help_option_names=["-h", "--help"]))
 @click.option(
     "-c",
@@ -74,6 +119,13 @@ DEFAULTS = {
     is_flag=True,
     help="Use TLS with MQTT.",
 )
+@click.option(
+    "-B",
+    "--mqtt-batch-ms",
+    type=click.IntRange(0, 1000),
+    help="Publish the frames sent within this window, in ms, at once. "
+    "Default: 0, each frame is published when sent.",
+)
 @click.option(
     "-n",
     "--network-id",
@@ -86,6 +138,13 @@ DEFAULTS = {
     type=click.Choice(["edge", "cloud"], case_sensitive=True),
     help=f"Choose the adapter to communicate with the gateway. Default: {DEFAULTS['adapter']}",
 )
+@click.option(
+    "-G",
+    "--gateways",
+    type=str,
+    help="More gateways, each on its own Mari network, separated with ,: "
+    "serial ports with the edge adapter, network IDs with the cloud adapter.",
+)
 @click.option(
     "-d",
     "--devices",
@@ -93,6 +152,13 @@ DEFAULTS = {
     default="",
     help="Subset list of device addresses to interact with, separated with ,",
 )
+@click.option(
+    "-g",
+    "--group",
+    type=int,
+    callback=validate_group,
+    help="Group of devices to interact with.",
+)
 @click.option(
     "-v",
     "--verbose",
@@ -109,9 +175,12 @@ def main(
     mqtt_host,
     mqtt_port,
     mqtt_use_tls,
+    mqtt_batch_ms,
     network_id,
     adapter,
+    gateways,
     devices,
+    group,
     verbose,
 ):
     config_data = load_toml_config(config_path)
@@ -122,7 +191,9 @@ def main(
         "mqtt_host": mqtt_host,
         "mqtt_port": mqtt_port,
         "mqtt_use_tls": mqtt_use_tls,
+        "mqtt_batch_ms": mqtt_batch_ms,
         "swarmit_network_id": network_id,
+        "gateways": gateways,
         "devices": devices,
         "verbose": verbose,
     }
@@ -142,37 +213,95 @@ def main(
         mqtt_host=final_config["mqtt_host"],
         mqtt_port=final_config["mqtt_port"],
         mqtt_use_tls=final_config["mqtt_use_tls"],
+        mqtt_batch_window=final_config["mqtt_batch_ms"] / 1000,
         network_id=int(final_config["swarmit_network_id"], 16),
         adapter=final_config["adapter"],
+        gateways=[g for g in final_config["gateways"].split(",") if g],
         devices=[d for d in final_config["devices"].split(",") if d],
+        group=group,
         verbose=final_config["verbose"],
     )
 
 
 @main.command()
+@click.option(
+    "--sync",
+    is_flag=True,
+    help="Start all the robots in the same Mari slot.",
+)
 @click.pass_context
-def start(ctx):
+def start(ctx, sync):
     """Start the user application."""
     controller = Controller(ctx.obj["settings"])
     if controller.ready_devices:
-        controller.start()
+        controller.start(synchronized=sync)
     else:
         print("No device to start")
     controller.terminate()
 
 
 @main.command()
+@click.option(
+    "--sync",
+    is_flag=True,
+    help="Stop all the robots in the same Mari slot.",
+)
 @click.pass_context
-def stop(ctx):
+def stop(ctx, sync):
     """Stop the user application."""
     controller = Controller(ctx.obj["settings"])
     if controller.running_devices or controller.resetting_devices:
-        controller.stop()
+        controller.stop(synchronized=sync)
     else:
         print("[bold]No device to stop[/]")
     controller.terminate()
 
 
+@main.command()
+@click.argument("groups", type=str, default="")
+@click.pass_context
+def groups(ctx, groups):
+    """Set the groups of the robots.
+
+    Groups are provided as '<group>,<group>,...', no group removes the robots
+    from all their groups.
+    """
+    try:
+        group_list = parse_groups(groups)
+    except ValueError:
+        print(f"[bold red]Error:[/] invalid groups '{groups}'")
+        return
+    controller = Controller(ctx.obj["settings"])
+    try:
+        controller.set_groups(group_list)
+    except ValueError as exc:
+        print(f"[bold red]Error:[/] {exc}")
+    controller.terminate()
+
+
+@main.command()
+@click.option(
+    "-w",
+    "--wake",
+    is_flag=True,
+    help="Wake up the idle robots.",
+)
+@click.pass_context
+def idle(ctx, wake):
+    """Park the ready robots in low power mode.
+
+    Idle robots stop their localization and LEDs, the gateway connection is
+    kept to wake them up.
+    """
+    controller = Controller(ctx.obj["settings"])
+    devices = controller.idle_devices if wake else controller.ready_devices
+    if devices:
+        controller.idle(enable=not wake)
+    else:
+        print(f"No device to {'wake up' if wake else 'idle'}")
+    controller.terminate()
+
+
 @main.command()
 @click.argument(
     "locations",
@@ -229,7 +358,7 @@ def reset(ctx, locations):
     type=float,
     default=OTA_ACK_TIMEOUT_DEFAULT,
     show_default=True,
-    help="Timeout in seconds for each OTA ACK message.",
+    help="Timeout in seconds for each OTA ACK message, until ACK delays are measured.",
 )
 @click.option(
     "-r",
@@ -239,9 +368,88 @@ def reset(ctx, locations):
     show_default=True,
     help="Number of retries for each OTA message (start or chunk) transfer.",
 )
+@click.option(
+    "-w",
+    "--ota-window",
+    type=click.IntRange(min=1),
+    default=OTA_WINDOW_SIZE_DEFAULT,
+    show_default=True,
+    help="Number of OTA chunks in flight before waiting for acknowledgments.",
+)
+@click.option(
+    "--ota-ack-interval",
+    type=click.IntRange(min=1, max=255),
+    default=OTA_ACK_INTERVAL_DEFAULT,
+    show_default=True,
+    help="Number of OTA chunks received by a device between two acknowledgments.",
+)
+@click.option(
+    "--ota-chunk-size",
+    type=click.IntRange(min=OTA_CHUNK_SIZE_MIN, max=OTA_CHUNK_SIZE_MAX),
+    default=CHUNK_SIZE,
+    show_default=True,
+    callback=validate_ota_chunk_size,
+    help="Size in bytes of each OTA chunk, must be a multiple of 4.",
+)
+@click.option(
+    "--delta",
+    is_flag=True,
+    help="Only send the differences with the image previously flashed.",
+)
+@click.option(
+    "--compress",
+    is_flag=True,
+    help="Send the image compressed.",
+)
+@click.option(
+    "--skip-unchanged",
+    is_flag=True,
+    help="Don't send the flash pages already containing the image.",
+)
+@click.option(
+    "--skip-installed",
+    is_flag=True,
+    help="Don't flash the robots already running the image.",
+)
+@click.option(
+    "--probe-links",
+    is_flag=True,
+    help="Probe the radio links first, to tune the OTA of each robot.",
+)
+@click.option(
+    "--fec-group",
+    type=click.IntRange(min=0, max=FEC_GROUP_MAX),
+    default=0,
+    show_default=True,
+    help="Number of broadcast chunks protected by the same repair chunks, 0 disables them.",
+)
+@click.option(
+    "--plan-cache",
+    type=click.Path(file_okay=False),
+    default=OTA_PLAN_CACHE_DEFAULT,
+    show_default=True,
+    help="Directory storing the chunks of the images flashed, reused by the next flashes. Empty disables it.",
+)
 @click.argument("firmware", type=click.File(mode="rb"), required=False)
 @click.pass_context
-def flash(ctx, yes, start, ota_timeout, ota_max_retries, firmware):
+def flash(
+    ctx,
+    yes,
+    start,
+    ota_timeout,
+    ota_max_retries,
+    ota_window,
+    ota_ack_interval,
+    ota_chunk_size,
+    delta,
+    compress,
+    skip_unchanged,
+    skip_installed,
+    probe_links,
+    fec_group,
+    plan_cache,
+    firmware,
+):
     """Flash a firmware to the robots."""
     console = Console()
     if firmware is None:
@@ -250,7 +458,22 @@ def flash(ctx, yes, start, ota_timeout, ota_max_retries, firmware):
 
     ctx.obj["settings"].ota_timeout = ota_timeout
     ctx.obj["settings"].ota_max_retries = ota_max_retries
+    ctx.obj["settings"].ota_window_size = ota_window
+    ctx.obj["settings"].ota_ack_interval = ota_ack_interval
+    ctx.obj["settings"].ota_chunk_size = ota_chunk_size
+    ctx.obj["settings"].ota_delta = delta
+    ctx.obj["settings"].ota_compress = compress
+    ctx.obj["settings"].ota_skip_unchanged = skip_unchanged
+    ctx.obj["settings"].ota_skip_installed = skip_installed
+    ctx.obj["settings"].ota_fec_group = fec_group
+    ctx.obj["settings"].ota_plan_cache = plan_cache
     fw = bytearray(firmware.read())
+    if len(fw) > OTA_IMAGE_SIZE_MAX:
+        console.print(
+            f"[bold red]Error:[/] Firmware of {len(fw)} bytes doesn't fit in "
+            f"the {OTA_IMAGE_SIZE_MAX} bytes of a flash slot. Exiting."
+        )
+        raise click.Abort()
     controller = Controller(ctx.obj["settings"])
     if not controller.ready_devices:
         console.print("[bold red]Error:[/] No ready device found. Exiting.")
@@ -264,6 +487,12 @@ def flash(ctx, yes, start, ota_timeout, ota_max_retries, firmware):
     if yes is False:
         click.confirm("Do you want to continue?", default=True, abort=True)
 
+    if probe_links:
+        print(
+            generate_links(
+                controller.probe_links(), ota_timeout, ota_max_retries
+            )
+        )
     start_data = controller.start_ota(fw)
     if controller.settings.verbose:
         print("\n[b]Start OTA response:[/]")
@@ -279,14 +508,37 @@ def flash(ctx, yes, start, ota_timeout, ota_max_retries, firmware):
         controller.terminate()
         raise click.Abort()
 
+    if start_data["up_to_date"]:
+        print(
+            f"Already up to date ([bold white]"
+            f"{len(start_data['up_to_date'])}):[/]"
+        )
+        pprint(start_data["up_to_date"], expand_all=True)
+    if not start_data["acked"]:
+        if start is True:
+            controller.start()
+        controller.terminate()
+        return
+
     print()
     print(f"Image size: [bold cyan]{len(fw)}B[/]")
     print(
         f"Image hash: [bold cyan]{start_data['ota'].fw_hash.hex().upper()}[/]"
     )
+    if start_data["ota"].mode == OTAMode.Delta:
+        print(
+            f"Delta from installed image: [bold cyan]"
+            f"{start_data['ota'].base_size}B[/]"
+        )
+    elif start_data["ota"].mode == OTAMode.Compressed:
+        compressed_size = sum(chunk.size for chunk in controller.chunks)
+        print(f"Compressed size: [bold cyan]{compressed_size}B[/]")
     print(
-        f"Radio chunks ([bold]{CHUNK_SIZE}B[/bold]): {start_data['ota'].chunks}"
+        f"Radio chunks ([bold]{start_data['ota'].chunk_size}B[/bold]): "
+        f"{start_data['ota'].chunks}"
     )
+    for addr, skipped in sorted(start_data["ota"].skipped_chunks.items()):
+        print(f"Unchanged chunks on {addr}: [bold cyan]{len(skipped)}[/]")
     start_time = time.time()
     data = controller.transfer(fw, start_data["acked"])
     print(f"Elapsed: [bold cyan]{time.time() - start_time:.3f}s[/bold cyan]")
@@ -308,9 +560,25 @@ def flash(ctx, yes, start, ota_timeout, ota_max_retries, firmware):
 
 
 @main.command()
+@click.option(
+    "--log-elf",
+    type=click.Path(exists=True, dir_okay=False),
+    help="User image ELF file used to format the SWRMT_LOG records.",
+)
+@click.option(
+    "-s",
+    "--log-store",
+    type=click.Path(dir_okay=False),
+    help="Append the log records to this binary store instead of logging "
+    "them, see the logs command.",
+)
 @click.pass_context
-def monitor(ctx):
+def monitor(ctx, log_elf, log_store):
     """Monitor running applications."""
+    if log_elf:
+        ctx.obj["settings"].log_elf = log_elf
+    if log_store:
+        ctx.obj["settings"].log_store = log_store
     try:
         controller = Controller(ctx.obj["settings"])
         controller.monitor()
@@ -320,6 +588,209 @@ def monitor(ctx):
         controller.terminate()
 
 
+@main.command()
+@click.argument(
+    "log_store", type=click.Path(exists=True, dir_okay=False), required=True
+)
+@click.option(
+    "--since",
+    type=click.DateTime(),
+    help="Only the records received from this time.",
+)
+@click.option(
+    "--until",
+    type=click.DateTime(),
+    help="Only the records received before this time.",
+)
+@click.option(
+    "--log-elf",
+    type=click.Path(exists=True, dir_okay=False),
+    help="User image ELF file used to format the SWRMT_LOG records.",
+)
+@click.option(
+    "--csv",
+    "as_csv",
+    is_flag=True,
+    help="Export the records as CSV.",
+)
+@click.option(
+    "-o",
+    "--output",
+    type=click.File("w"),
+    default="-",
+    help="File the records are written to, stdout by default.",
+)
+@click.pass_context
+def logs(ctx, log_store, since, until, log_elf, as_csv, output):
+    """Print the log records stored by monitor --log-store.
+
+    The devices option selects the robots.
+    """
+    log_dictionary = None
+    if log_elf:
+        with open(log_elf, "rb") as elf:
+            log_dictionary = LogDictionary.from_elf(elf.read())
+    try:
+        reader = LogStoreReader(log_store)
+    except LogStoreError as exc:
+        raise click.ClickException(str(exc))
+    with reader:
+        records = reader.records(
+            ctx.obj["settings"].devices,
+            since.timestamp() if since else None,
+            until.timestamp() if until else None,
+        )
+        if as_csv:
+            writer = csv.writer(output)
+            writer.writerow(["time", "device", "timestamp", "data"])
+            for record in records:
+                writer.writerow(
+                    [
+                        f"{record.time:.6f}",
+                        record.device_addr,
+                        record.timestamp,
+                        record.text(log_dictionary),
+                    ]
+                )
+            return
+        for record in records:
+            date = datetime.datetime.fromtimestamp(record.time)
+            output.write(
+                f"{date.isoformat(timespec='milliseconds')} "
+                f"{record.device_addr} {record.timestamp:>10} "
+                f"{record.text(log_dictionary)}\n"
+            )
+
+
+@main.command()
+@click.option(
+    "-p",
+    "--period",
+    type=click.IntRange(1, 0xFFFF),
+    default=POSITION_STREAM_PERIOD_DEFAULT,
+    show_default=True,
+    help="Minimum time between two positions of a device, in ms.",
+)
+@click.option(
+    "-b",
+    "--batch",
+    type=click.IntRange(1, POSITION_STREAM_BATCH_MAX),
+    default=POSITION_STREAM_BATCH_DEFAULT,
+    show_default=True,
+    help="Number of positions sent by a device in each frame.",
+)
+@click.pass_context
+def stream(ctx, period, batch):
+    """Stream the positions of the robots."""
+    try:
+        controller = Controller(ctx.obj["settings"])
+        controller.stream_positions(period, batch)
+        controller.monitor()
+    except KeyboardInterrupt:
+        print("Stopping position stream.")
+    finally:
+        controller.stream_positions(0)
+        controller.terminate()
+
+
+@main.command()
+@click.argument(
+    "schedule",
+    type=click.Choice([s.name.lower() for s in ScheduleType]),
+)
+@click.pass_context
+def schedule(ctx, schedule):
+    """Switch the robots to another Mari schedule.
+
+    The ready and idle robots store the schedule and join again with it, the
+    gateway must be switched to the same schedule.
+    """
+    controller = Controller(ctx.obj["settings"])
+    schedule_type = next(s for s in ScheduleType if s.name.lower() == schedule)
+    controller.set_schedule(schedule_type)
+    print(f"Switch the gateway to the {schedule} schedule")
+    controller.terminate()
+
+
+@main.command()
+@click.pass_context
+def profile(ctx):
+    """Print the cycles spent by the robots in their firmware hot spots."""
+    controller = Controller(ctx.obj["settings"])
+    print(generate_profile(controller.profile()))
+    controller.terminate()
+
+
+@main.command()
+@click.option(
+    "-o",
+    "--output",
+    type=click.Path(file_okay=False),
+    default=UPLOAD_DIR_DEFAULT,
+    show_default=True,
+    help="Directory where the data of each robot is written.",
+)
+@click.pass_context
+def upload(ctx, output):
+    """Fetch the data the user images of the robots offered.
+
+    The data of each robot is written to <output>/<robot address>.bin.
+    """
+    controller = Controller(ctx.obj["settings"])
+    uploads = controller.upload()
+    controller.terminate()
+    os.makedirs(output, exist_ok=True)
+    for device_addr, data in sorted(uploads.items()):
+        path = os.path.join(output, f"{device_addr}.bin")
+        with open(path, "wb") as f:
+            f.write(data)
+        print(f"{device_addr}: {len(data)} bytes written to {path}")
+    if not uploads:
+        print("[bold]No data uploaded[/]")
+
+
+@main.command()
+@click.option(
+    "-c",
+    "--count",
+    type=click.IntRange(1, 1000),
+    default=LINK_PROBE_COUNT_DEFAULT,
+    show_default=True,
+    help="Number of probes sent to each robot.",
+)
+@click.pass_context
+def links(ctx, count):
+    """Print the quality of the radio links of the robots."""
+    controller = Controller(ctx.obj["settings"])
+    print(generate_links(controller.probe_links(count)))
+    controller.terminate()
+
+
+@main.command()
+@click.option(
+    "-c",
+    "--count",
+    type=click.IntRange(1, 1000),
+    default=TRACE_COUNT_DEFAULT,
+    show_default=True,
+    help="Number of traced packets sent to the robots.",
+)
+@click.option(
+    "-i",
+    "--interval",
+    type=click.FloatRange(0, 60),
+    default=TRACE_INTERVAL_DEFAULT,
+    show_default=True,
+    help="Time between two traced packets, in s.",
+)
+@click.pass_context
+def trace(ctx, count, interval):
+    """Print the latency of each hop of packets traced by the robots."""
+    controller = Controller(ctx.obj["settings"])
+    print(generate_trace(controller.trace(count, interval)))
+    controller.terminate()
+
+
 @main.command()
 @click.option(
     "-w",
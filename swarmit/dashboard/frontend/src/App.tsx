@@ -5,6 +5,10 @@ import HomePage from "./HomePage";
 import LoginModal from "./Login";
 
 export const API_URL = `${window.location.origin}`;
+// Period of the status updates pushed by the server, the streaming period of
+// the position batches
+const STATUS_FEED_PERIOD = 0.1; // s
+const STATUS_FEED_RETRY_DELAY = 1000; // ms
 
 export interface Token {
   token: string;
@@ -39,6 +43,12 @@ export type DotBotData = {
   pos_y: number;
 };
 
+type StatusUpdate = {
+  version: number;
+  full: boolean;
+  devices: Record<string, DotBotData | null>;
+};
+
 type SettingsType = {
   network_id: string;
 };
@@ -133,27 +143,47 @@ export default function MainDashboard() {
     };
   }, [token]);
 
+  // The server pushes the devices changed since the latest update received,
+  // the feed is reopened from that version when the connection is lost
   useEffect(() => {
-    const fetchStatus = () => {
-      fetch(`${API_URL}/status`)
-        .then((res) => {
-          if (!res.ok) throw new Error("network response was not ok");
-          return res.json();
-        })
-        .then((json) => {
-          const dotbots = Object.fromEntries(
-            Object.entries(json.response as Record<string, DotBotData>)
-              .map(([k, v]) => [k, { ...v, battery: v.battery / 1000, pos_x: v.pos_x, pos_y: v.pos_y }]));
-          setDotBots(dotbots);
-        })
-        .catch((_err) => {
+    let version: number | null = null;
+    let socket: WebSocket | null = null;
+    let retry: ReturnType<typeof setTimeout> | undefined;
+    let canceled = false;
+
+    const connect = () => {
+      const url = new URL(`${API_URL}/status/feed`);
+      url.protocol = url.protocol === "https:" ? "wss:" : "ws:";
+      url.searchParams.set("period", STATUS_FEED_PERIOD.toString());
+      if (version !== null) url.searchParams.set("since", version.toString());
+      socket = new WebSocket(url);
+      socket.onmessage = (event) => {
+        const update = JSON.parse(event.data) as StatusUpdate;
+        version = update.version;
+        setDotBots((previous) => {
+          const dotbots = update.full ? {} : { ...previous };
+          for (const [k, v] of Object.entries(update.devices)) {
+            if (v) {
+              dotbots[k] = { ...v, battery: v.battery / 1000 };
+            } else {
+              delete dotbots[k];
+            }
+          }
+          return dotbots;
         });
+      };
+      socket.onclose = () => {
+        if (!canceled) retry = setTimeout(connect, STATUS_FEED_RETRY_DELAY);
+      };
     };
 
-    fetchStatus();
-    const interval = setInterval(fetchStatus, 1000);
+    connect();
 
-    return () => clearInterval(interval);
+    return () => {
+      canceled = true;
+      clearTimeout(retry);
+      socket?.close();
+    };
   }, []);
 
   const loginLabel: Record<tokenActivenessType, string> = {
@@ -105,41 +105,35 @@ export default function HomePage({ token, tokenActiveness, dotbots, areaSize }:
     setLoading(true);
     setMessage(null);
 
-    const reader = new FileReader();
-
-    reader.onload = () => {
-      const base64 = (reader.result as string).split(",")[1];
-      setMessage("Flashing...");
-
-      fetch(`${API_URL}/flash`, {
-        method: "POST",
-        headers: {
-          "Authorization": `Bearer ${token.token}`,
-          "Content-Type": "application/json"
-        },
-        body: JSON.stringify({ firmware_b64: base64 }),
-      })
-        .then((res) =>
-          res
-            .json()
-            .then((data) => ({ ok: res.ok, data }))
-            .catch(() => ({ ok: res.ok, data: { error: "Invalid response" } }))
-        )
-        .then(({ ok, data }) => {
-          if (ok) {
-            setMessage("File flashed successfully");
-          } else {
-            setMessage(data.detail || "Unknown error");
-          }
-          setLoading(false);
-        })
-        .catch((_err) => {
-          setMessage(`Error: couldn't authorize token`);
-          setLoading(false);
-        });
-    };
+    setMessage("Flashing...");
 
-    reader.readAsDataURL(file);
+    // The file is sent as is, the server hashes it while receiving it
+    fetch(`${API_URL}/flash/raw`, {
+      method: "POST",
+      headers: {
+        "Authorization": `Bearer ${token.token}`,
+        "Content-Type": "application/octet-stream"
+      },
+      body: file,
+    })
+      .then((res) =>
+        res
+          .json()
+          .then((data) => ({ ok: res.ok, data }))
+          .catch(() => ({ ok: res.ok, data: { error: "Invalid response" } }))
+      )
+      .then(({ ok, data }) => {
+        if (ok) {
+          setMessage("File flashed successfully");
+        } else {
+          setMessage(data.detail || "Unknown error");
+        }
+        setLoading(false);
+      })
+      .catch((_err) => {
+        setMessage(`Error: couldn't authorize token`);
+        setLoading(false);
+      });
   };
   const unixToLocale = (t: number) => new Date(t * 1000).toLocaleString();
 
@@ -75,25 +75,20 @@ export default function OnlineDotBotPage({ dotbots, token }: CalendarPageProps)
 
     setLoading(true);
 
-    const reader = new FileReader();
-
-    reader.onload = () => {
-      const base64 = (reader.result as string).split(",")[1];
-
-      fetch(`${API_URL}/flash`, {
-        method: "POST",
-        headers: {
-          "Authorization": `Bearer ${token.token}`,
-          "Content-Type": "application/json"
-        },
-        body: JSON.stringify({ firmware_b64: base64, devices: selected }),
-      })
-        .finally(() => {
-          setLoading(false);
-        });
-    };
-
-    reader.readAsDataURL(file);
+    // The file is sent as is, the server hashes it while receiving it
+    const params = new URLSearchParams();
+    selected.forEach((device) => params.append("devices", device));
+    fetch(`${API_URL}/flash/raw?${params}`, {
+      method: "POST",
+      headers: {
+        "Authorization": `Bearer ${token.token}`,
+        "Content-Type": "application/octet-stream"
+      },
+      body: file,
+    })
+      .finally(() => {
+        setLoading(false);
+      });
   };
 
   return (
@@ -1,6 +1,8 @@
 """Module containing classes for interfacing with the DotBot gateway."""
 
+import queue
 import sys
+import threading
 import time
 from abc import ABC, abstractmethod
 
@@ -17,18 +19,173 @@ from marilib.marilib_edge import MarilibEdge
 from marilib.model import EdgeEvent, MariNode
 from rich import print
 
+from swarmit.testbed.protocol import PayloadType
+
+FRAME_BATCH_MAX = 64  # frames handed over at once
+
+
+class FrameDispatcher:
+    """Thread handing the received frames over in batches.
+
+    The gateway thread only queues the frames, the dispatcher thread parses
+    the frames queued meanwhile and hands them over at once. Devices send
+    their full status, only the latest status of a device in a batch is
+    parsed, the older ones are handed over without payload.
+    """
+
+    def __init__(self, on_frames_received: callable, verbose: bool = False):
+        self.on_frames_received = on_frames_received
+        self.verbose = verbose
+        self._frames = queue.SimpleQueue()
+        self._handled = threading.Condition()
+        self._queued_count = 0
+        self._handled_count = 0
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def put(self, header, payload: bytes):
+        """Queue a frame received by the gateway."""
+        with self._handled:
+            self._queued_count += 1
+        self._frames.put((header, payload))
+
+    def flush(self):
+        """Wait until the frames queued before the call are handled.
+
+        Frames queued meanwhile are not waited for, a flush ends even when
+        the devices keep sending.
+        """
+        if threading.current_thread() is self._thread:
+            return
+        with self._handled:
+            queued_count = self._queued_count
+            self._handled.wait_for(
+                lambda: self._handled_count >= queued_count
+            )
+
+    def close(self):
+        """Handle the frames already queued and stop the thread."""
+        self._frames.put(None)
+        self._thread.join()
+
+    def _parse(self, frames: list) -> list:
+        latest_status = {
+            header.source: index
+            for index, (header, payload) in enumerate(frames)
+            if payload and payload[0] == PayloadType.SWARMIT_STATUS
+        }
+        packets = []
+        for index, (header, payload) in enumerate(frames):
+            if (
+                payload
+                and payload[0] == PayloadType.SWARMIT_STATUS
+                and latest_status[header.source] != index
+            ):
+                packets.append((header, None))
+                continue
+            try:
+                packets.append((header, Packet.from_bytes(payload)))
+            except (ValueError, ProtocolPayloadParserException) as exc:
+                if self.verbose:
+                    print(f"[red]Error parsing packet: {exc}[/]")
+        return packets
+
+    def _run(self):
+        running = True
+        while running:
+            frames = [self._frames.get()]
+            while len(frames) < FRAME_BATCH_MAX:
+                try:
+                    frames.append(self._frames.get_nowait())
+                except queue.Empty:
+                    break
+            if None in frames:
+                running = False
+            frames = [frame for frame in frames if frame is not None]
+            try:
+                packets = self._parse(frames)
+                if packets:
+                    self.on_frames_received(packets)
+            except Exception as exc:
+                # The thread keeps running, a flush would never end
+                print(f"[red]Error handling frames: {exc!r}[/]")
+            finally:
+                with self._handled:
+                    self._handled_count += len(frames)
+                    self._handled.notify_all()
+
+
+class FrameBatcher:
+    """Thread publishing the frames sent within a short window at once.
+
+    The first frame queued opens the window, the frames queued until it
+    ends are published back to back. A frame queued again, to the same
+    destination, before being published is only published once: a chunk
+    sent again before its first copy left is not sent twice.
+    """
+
+    def __init__(self, send_frame: callable, window: float):
+        self._send_frame = send_frame
+        self.window = window
+        # Ordered like a queue, a frame queued twice keeps its first place
+        self._frames: dict[tuple[int, bytes], None] = {}
+        self._queued = threading.Condition()
+        self._closed = False
+        self.published_count = 0
+        self.batch_count = 0
+        self._thread = threading.Thread(target=self._run, daemon=True)
+        self._thread.start()
+
+    def put(self, destination: int, data: bytes):
+        """Queue a frame, published at the end of the window."""
+        with self._queued:
+            self._frames.setdefault((destination, data))
+            self._queued.notify()
+
+    def close(self):
+        """Publish the frames already queued and stop the thread."""
+        with self._queued:
+            self._closed = True
+            self._queued.notify()
+        self._thread.join()
+
+    def _run(self):
+        while True:
+            with self._queued:
+                self._queued.wait_for(lambda: self._frames or self._closed)
+                if not self._frames:
+                    return
+            if not self._closed:
+                # The frames sent meanwhile join the batch
+                time.sleep(self.window)
+            with self._queued:
+                frames, self._frames = list(self._frames), {}
+            for destination, data in frames:
+                self._send_frame(dst=destination, payload=data)
+            self.published_count += len(frames)
+            self.batch_count += 1
+
 
 class GatewayAdapterBase(ABC):
     """Base class for interface adapters."""
 
     @abstractmethod
-    def init(self, on_frame_received: callable):
-        """Initialize the interface."""
+    def init(self, on_frames_received: callable):
+        """Initialize the interface.
+
+        on_frames_received is called with lists of (header, packet), the
+        packet is None for a status superseded by a later one in the list.
+        """
 
     @abstractmethod
     def close(self):
         """Close the interface."""
 
+    def flush(self):
+        """Wait until the frames already received are handed over."""
+        if hasattr(self, "dispatcher"):
+            self.dispatcher.flush()
+
     @abstractmethod
     def send_payload(self, destination: int, payload: Payload):
         """Send payload to the interface."""
@@ -45,15 +202,9 @@ class MarilibEdgeAdapter(GatewayAdapterBase):
             if self.verbose:
                 print("[orange]Node left:[/]", event_data)
         elif event == EdgeEvent.NODE_DATA:
-            try:
-                packet = Packet.from_bytes(event_data.payload)
-            except (ValueError, ProtocolPayloadParserException) as exc:
-                if self.verbose:
-                    print(f"[red]Error parsing packet: {exc}[/]")
-                return
-            if not hasattr(self, "on_frame_received"):
+            if not hasattr(self, "dispatcher"):
                 return
-            self.on_frame_received(event_data.header, packet)
+            self.dispatcher.put(event_data.header, event_data.payload)
 
     def __init__(
         self,
@@ -75,14 +226,14 @@ class MarilibEdgeAdapter(GatewayAdapterBase):
             sys.exit(1)
 
     def _busy_wait(self):
-        """Wait for the condition to be met."""
-        while self.busy_wait_timeout > 0:
+        """Let Mari discover the nodes during busy_wait_timeout."""
+        deadline = time.monotonic() + self.busy_wait_timeout
+        while time.monotonic() < deadline:
             self.mari.update()
-            self.busy_wait_timeout -= 0.1
-            time.sleep(0.1)
+            time.sleep(min(0.1, max(0, deadline - time.monotonic())))
 
-    def init(self, on_frame_received: callable):
-        self.on_frame_received = on_frame_received
+    def init(self, on_frames_received: callable):
+        self.dispatcher = FrameDispatcher(on_frames_received, self.verbose)
         if self.verbose:
             self._busy_wait()
             print("[yellow]Mari nodes available:[/]")
@@ -90,6 +241,8 @@ class MarilibEdgeAdapter(GatewayAdapterBase):
 
     def close(self):
         self.mari.serial_interface.close()
+        if hasattr(self, "dispatcher"):
+            self.dispatcher.close()
 
     def send_payload(self, destination: int, payload: Payload):
         self.mari.send_frame(
@@ -109,15 +262,9 @@ class MarilibCloudAdapter(GatewayAdapterBase):
             if self.verbose:
                 print("[orange]Node left:[/]", event_data)
         elif event == EdgeEvent.NODE_DATA:
-            try:
-                packet = Packet.from_bytes(event_data.payload)
-            except (ValueError, ProtocolPayloadParserException) as exc:
-                if self.verbose:
-                    print(f"[red]Error parsing packet: {exc}[/]")
+            if not hasattr(self, "dispatcher"):
                 return
-            if not hasattr(self, "on_frame_received"):
-                return
-            self.on_frame_received(event_data.header, packet)
+            self.dispatcher.put(event_data.header, event_data.payload)
 
     def __init__(
         self,
@@ -127,9 +274,12 @@ class MarilibCloudAdapter(GatewayAdapterBase):
         network_id: int,
         verbose: bool = False,
         busy_wait_timeout: float = 3,
+        batch_window: float = 0,
     ):
         self.verbose = verbose
         self.busy_wait_timeout = busy_wait_timeout
+        self.batch_window = batch_window
+        self.batcher: FrameBatcher | None = None
         try:
             self.mari = MarilibCloud(
                 self.on_event,
@@ -141,24 +291,82 @@ class MarilibCloudAdapter(GatewayAdapterBase):
             sys.exit(1)
 
     def _busy_wait(self):
-        """Wait for the condition to be met."""
-        while self.busy_wait_timeout > 0:
+        """Let Mari discover the nodes during busy_wait_timeout."""
+        deadline = time.monotonic() + self.busy_wait_timeout
+        while time.monotonic() < deadline:
             self.mari.update()
-            self.busy_wait_timeout -= 0.1
-            time.sleep(0.1)
+            time.sleep(min(0.1, max(0, deadline - time.monotonic())))
 
-    def init(self, on_frame_received: callable):
-        self.on_frame_received = on_frame_received
+    def init(self, on_frames_received: callable):
+        self.dispatcher = FrameDispatcher(on_frames_received, self.verbose)
+        if self.batch_window > 0:
+            self.batcher = FrameBatcher(
+                self.mari.send_frame, self.batch_window
+            )
         if self.verbose:
             self._busy_wait()
             print("[yellow]Mari nodes available:[/]")
             print(self.mari.nodes)
 
     def close(self):
-        pass
+        if self.batcher is not None:
+            self.batcher.close()
+        if hasattr(self, "dispatcher"):
+            self.dispatcher.close()
 
     def send_payload(self, destination: int, payload: Payload):
-        self.mari.send_frame(
-            dst=destination,
-            payload=Packet.from_payload(payload).to_bytes(),
-        )
+        data = Packet.from_payload(payload).to_bytes()
+        if self.batcher is not None:
+            self.batcher.put(destination, data)
+            return
+        self.mari.send_frame(dst=destination, payload=data)
+
+
+class MultiGatewayAdapter(GatewayAdapterBase):
+    """Several gateways, each carrying its own Mari network, seen as one.
+
+    A device is reached through the gateway it was last heard from, the
+    frames to devices not heard yet and the broadcast frames go through all
+    the gateways. Each network has its own slots, broadcast OTA chunks and
+    status requests are carried by all of them at the same time. The frames
+    received by the gateways are handed over one batch at a time, like with
+    a single gateway.
+    """
+
+    def __init__(self, adapters: list[GatewayAdapterBase]):
+        self.adapters = adapters
+        self.routes: dict[int, int] = {}  # device address -> gateway index
+        self._lock = threading.Lock()
+
+    def init(self, on_frames_received: callable):
+        def received(index, frames):
+            with self._lock:
+                for header, _ in frames:
+                    self.routes[header.source] = index
+                on_frames_received(frames)
+
+        for index, adapter in enumerate(self.adapters):
+            adapter.init(
+                lambda frames, index=index: received(index, frames)
+            )
+
+    def close(self):
+        for adapter in self.adapters:
+            adapter.close()
+
+    def flush(self):
+        for adapter in self.adapters:
+            adapter.flush()
+
+    def gateway(self, destination: int) -> GatewayAdapterBase | None:
+        """Return the gateway a device was last heard from."""
+        index = self.routes.get(destination)
+        return None if index is None else self.adapters[index]
+
+    def send_payload(self, destination: int, payload: Payload):
+        adapter = self.gateway(destination)
+        if adapter is not None:
+            adapter.send_payload(destination, payload)
+            return
+        for adapter in self.adapters:
+            adapter.send_payload(destination, payload)
@@ -0,0 +1,93 @@
+"""Module containing the OTA image compressor."""
+
+import collections
+
+LZ_MATCH_FLAG = 0x80  # token followed by a back reference
+LZ_MIN_MATCH = 3
+LZ_MAX_MATCH = 0x7F + LZ_MIN_MATCH
+LZ_MAX_LITERALS = 0x80
+LZ_WINDOW_SIZE = 4096  # maximum distance of a back reference
+LZ_MAX_CANDIDATES = 32  # matches examined per position
+
+
+def compress(data: bytes) -> bytes:
+    """Compress data into the LZ stream decoded by the bootloader.
+
+    A token below LZ_MATCH_FLAG is followed by token + 1 literal bytes.
+    Otherwise it is followed by the 2 bytes little endian distance of a back
+    reference of (token & 0x7F) + LZ_MIN_MATCH bytes, that can overlap the
+    bytes it produces. The bootloader reads back references from the flash
+    already written, so the window doesn't cost RAM on the device.
+    """
+    out = bytearray()
+    literal = bytearray()
+    heads: dict[bytes, collections.deque] = {}
+    pos = 0
+
+    def insert(position: int):
+        key = data[position : position + LZ_MIN_MATCH]
+        if len(key) == LZ_MIN_MATCH:
+            heads.setdefault(
+                key, collections.deque(maxlen=LZ_MAX_CANDIDATES)
+            ).append(position)
+
+    def flush_literal():
+        if literal:
+            out.append(len(literal) - 1)
+            out.extend(literal)
+            literal.clear()
+
+    while pos < len(data):
+        best_distance, best_length = 0, 0
+        limit = min(LZ_MAX_MATCH, len(data) - pos)
+        if limit >= LZ_MIN_MATCH:
+            for source in reversed(
+                heads.get(data[pos : pos + LZ_MIN_MATCH], ())
+            ):
+                if pos - source > LZ_WINDOW_SIZE:
+                    break
+                length = LZ_MIN_MATCH
+                while (
+                    length < limit
+                    and data[source + length] == data[pos + length]
+                ):
+                    length += 1
+                if length > best_length:
+                    best_distance, best_length = pos - source, length
+                if best_length == limit:
+                    break
+        if best_length >= LZ_MIN_MATCH:
+            flush_literal()
+            out.append(LZ_MATCH_FLAG | (best_length - LZ_MIN_MATCH))
+            out.extend(best_distance.to_bytes(2, "little"))
+            for position in range(pos, pos + best_length):
+                insert(position)
+            pos += best_length
+            continue
+        insert(pos)
+        literal.append(data[pos])
+        pos += 1
+        if len(literal) == LZ_MAX_LITERALS:
+            flush_literal()
+    flush_literal()
+    return bytes(out)
+
+
+def decompress(stream: bytes) -> bytes:
+    """Decode a stream produced by compress, the way the bootloader does."""
+    out = bytearray()
+    pos = 0
+    while pos < len(stream):
+        token = stream[pos]
+        if token & LZ_MATCH_FLAG:
+            length = (token & ~LZ_MATCH_FLAG) + LZ_MIN_MATCH
+            distance = int.from_bytes(stream[pos + 1 : pos + 3], "little")
+            if not 0 < distance <= min(len(out), LZ_WINDOW_SIZE):
+                raise ValueError(f"Invalid back reference at offset {pos}")
+            for _ in range(length):
+                out.append(out[-distance])
+            pos += 3
+        else:
+            out.extend(stream[pos + 1 : pos + 2 + token])
+            pos += 2 + token
+    return bytes(out)
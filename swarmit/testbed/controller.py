@@ -1,8 +1,16 @@
 """Module containing the swarmit controller class."""
 
+import collections
+import concurrent.futures
 import dataclasses
+import math
+import os
+import random
+import statistics
+import struct
 import threading
 import time
+import zlib
 from binascii import hexlify
 from dataclasses import dataclass
 
@@ -20,54 +28,121 @@ from swarmit.testbed.adapter import (
     GatewayAdapterBase,
     MarilibCloudAdapter,
     MarilibEdgeAdapter,
+    MultiGatewayAdapter,
 )
+from swarmit.testbed.compression import compress
+from swarmit.testbed.delta import FLASH_PAGE_SIZE, make_patch
+from swarmit.testbed.fec import (
+    FEC_GROUP_MAX,
+    FEC_REPAIRS_MAX,
+    repair_chunk,
+    repair_index,
+)
+from swarmit.testbed.link import (
+    LINK_PROBE_COUNT_DEFAULT,
+    LINK_PROBE_TIMEOUT,
+    RTO_MIN,
+    LinkStats,
+    RttEstimator,
+)
+from swarmit.testbed.logdict import LogDictionary
 from swarmit.testbed.logger import LOGGER
+from swarmit.testbed.logstore import LogStoreWriter
 from swarmit.testbed.protocol import (
     DeviceType,
+    MetricsProbePayload,
+    OTAMode,
+    PayloadGroup,
+    PayloadGroupSet,
+    PayloadIdle,
+    PayloadImage,
     PayloadMessage,
     PayloadOTAChunk,
+    PayloadOTAFinalize,
+    PayloadOTAManifest,
     PayloadOTAStart,
+    PayloadPositionStream,
+    PayloadProfile,
     PayloadReset,
+    PayloadSchedule,
     PayloadStart,
+    PayloadStatus,
     PayloadStop,
+    PayloadTrace,
     PayloadType,
+    PayloadUpload,
+    PayloadUploadRequest,
+    ProfileSection,
+    ScheduleType,
     StatusType,
 )
-
-CHUNK_SIZE = 128
+from swarmit.testbed.status import NodeStatus, StatusStore
+
+OTA_CHUNK_SIZE_MIN = 64
+OTA_CHUNK_SIZE_MAX = 192  # largest chunk fitting in a Mari frame
+# bytes, SWARMIT_SLOT_SIZE of the bootloaders, an image and its update
+# share the flash
+OTA_IMAGE_SIZE_MAX = 0x77000
+CHUNK_SIZE = OTA_CHUNK_SIZE_MAX
 COMMAND_TIMEOUT = 6
 COMMAND_MAX_ATTEMPTS = 5
-COMMAND_ATTEMPT_DELAY = 0.7
-INACTIVE_TIMEOUT = 3  # s
+COMMAND_ATTEMPT_DELAY = 0.7  # s, until the answer delays are measured
+STATUS_HEARTBEAT = 5  # s, maximum time a device stays silent
+INACTIVE_TIMEOUT = 2 * STATUS_HEARTBEAT + 2  # s
+IDLE_STATUS_HEARTBEAT = 30  # s, maximum time an idle device stays silent
+IDLE_INACTIVE_TIMEOUT = 2 * IDLE_STATUS_HEARTBEAT + 2  # s
+# Estimate of the power saved by an idle device, mostly the LH2 receiver and
+# the LEDs, not measured
+IDLE_POWER_SAVED_MW = 10
 STATUS_TIMEOUT = 5
 MONITOR_TIMEOUT = 60  # s
 OTA_MAX_RETRIES_DEFAULT = 10
 OTA_ACK_TIMEOUT_DEFAULT = 0.7
+OTA_WINDOW_SIZE_DEFAULT = 8  # chunks in flight, fits the device chunk queue
+OTA_ACK_INTERVAL_DEFAULT = 8  # chunks received by a device between two acks
+OTA_IMAGE_CACHE_DEFAULT = "./.data/images"
+OTA_PLAN_CACHE_DEFAULT = "./.data/plans"
+OTA_PLAN_CACHE_SIZE = 8  # chunk plans kept in memory
+OTA_PLAN_MAGIC = b"SWRMTOTA"
+OTA_PLAN_HEADER = struct.Struct("<8sBII")  # magic, mode, chunk size, count
+OTA_MANIFEST_PAGES_MAX = 32  # page CRCs fitting in a manifest packet
+OTA_INSTALL_TIMEOUT = 60  # s, copy of an image to the active slot
+OTA_UNICAST_PIPELINES_MAX = 16  # devices sent chunks at the same time
+OTA_SESSION_COUNT = 255  # session 0 is the one of devices never started
+OTA_ACK_TYPES = (
+    PayloadType.SWARMIT_OTA_START_ACK,
+    PayloadType.SWARMIT_OTA_CHUNK_ACK,
+    PayloadType.SWARMIT_OTA_CHUNKS_ACK,
+    PayloadType.SWARMIT_OTA_FINALIZE_ACK,
+    PayloadType.SWARMIT_OTA_MANIFEST_ACK,
+)
+GROUP_COUNT = 31
+GROUP_HEADER_SIZE = 3  # type, group and length of a group frame
+POSITION_STREAM_PERIOD_DEFAULT = 20  # ms
+POSITION_STREAM_BATCH_DEFAULT = 5  # positions per frame
+POSITION_STREAM_BATCH_MAX = 16  # positions fitting in a frame
+TRACE_COUNT_DEFAULT = 10  # traced packets sent to each device
+TRACE_INTERVAL_DEFAULT = 0.5  # s, between two traced packets
+TRACE_REPLY_TIMEOUT = 2  # s, waiting for the replies to the last packet
+TRACE_BUCKETS = (1, 2, 5, 10, 20, 50, 100, 200, 500)  # ms, upper bounds
+SCHEDULE_TRACE_INTERVAL = 0.5  # s, between the traces measuring the slots
+SCHEDULE_ATTEMPT_FACTOR = 2  # delay between two attempts, in round trips
+UPLOAD_CHUNK_SIZE = 192  # bytes, SWRMT_UPLOAD_CHUNK_SIZE of the netcore
+UPLOAD_WINDOW_MAX = 8  # chunks requested at once, bits of a request bitmap
+UPLOAD_DIR_DEFAULT = "./.data/uploads"
 SERIAL_PORT_DEFAULT = get_default_port()
 BROADCAST_ADDRESS = 0xFFFFFFFFFFFFFFFF
 VOLTAGE_MAX = 3000  # mV
 VOLTAGE_WARNING = 1500  # mV
 
 
-@dataclass
-class NodeStatus:
-    """Class that holds node status."""
-
-    device: DeviceType = DeviceType.Unknown
-    status: StatusType = StatusType.Bootloader
-    battery: int = 0
-    pos_x: int = 0
-    pos_y: int = 0
-    last_updated_at: float = 0
-
-
 @dataclass
 class DataChunk:
     """Class that holds data chunks."""
 
     index: int
     size: int
-    sha: bytes
+    crc: int
     data: bytes
 
 
@@ -76,9 +151,25 @@ class StartOtaData:
     """Class that holds start ota data."""
 
     chunks: int = 0
+    chunk_size: int = CHUNK_SIZE
     fw_hash: bytes = b""
+    mode: OTAMode = OTAMode.Raw
+    image_size: int = 0
+    base_size: int = 0
+    base_hash: bytes = b""
+    fec_group: int = 0  # chunks of each group of repairs, 0 without repairs
     addrs: list[str] = dataclasses.field(default_factory=lambda: [])
     retries: int = 0
+    # pages already matching the image, reported by each device
+    unchanged_pages: dict[str, set[int]] = dataclasses.field(
+        default_factory=lambda: {}
+    )
+    manifest_acks: dict[str, set[int]] = dataclasses.field(
+        default_factory=lambda: {}
+    )
+    skipped_chunks: dict[str, set[int]] = dataclasses.field(
+        default_factory=lambda: {}
+    )
 
 
 @dataclass
@@ -99,9 +190,270 @@ class TransferDataStatus:
     """Class that holds transfer data status for a single device."""
 
     chunks: list[Chunk] = dataclasses.field(default_factory=lambda: [])
+    acked_base: int = 0  # all the chunks before are acknowledged
+    acked_max: int = -1  # index of the latest chunk acknowledged
+    hash: bytes = b""  # image SHA256 computed by the device
+    verified: bool = False
     success: bool = False
 
 
+@dataclass
+class OtaSession:
+    """Class that holds an OTA transfer to a set of devices."""
+
+    id: int = 0
+    devices: list[str] = dataclasses.field(default_factory=lambda: [])
+    broadcast: bool = False  # started with a broadcast, devices may join
+    chunks: list[DataChunk] = dataclasses.field(default_factory=lambda: [])
+    start_ota_data: StartOtaData = dataclasses.field(
+        default_factory=StartOtaData
+    )
+    transfer_data: dict[str, TransferDataStatus] = dataclasses.field(
+        default_factory=lambda: {}
+    )
+    # Send times of the chunks sent once by the transfers in progress, by
+    # destination, the delays of their acks are sampled by its estimator
+    chunk_sent_at: dict[str, dict[int, float]] = dataclasses.field(
+        default_factory=lambda: {}
+    )
+    chunk_rtt: dict[str, RttEstimator] = dataclasses.field(
+        default_factory=lambda: {}
+    )
+
+
+class ChunkPlanCache:
+    """Chunks of the latest images sent, by image digest.
+
+    Plans are keyed by the SHA256 of the image, the OTA mode, the chunk size
+    and the SHA256 of the base of a delta. The latest ones are kept in
+    memory, all of them are stored in the directory when given, so that the
+    next controllers reuse them. A plan file holds the chunk CRCs followed by
+    the chunked data.
+    """
+
+    def __init__(self, directory: str = "", size: int = OTA_PLAN_CACHE_SIZE):
+        self.directory = directory
+        self.size = size
+        self.hits = 0
+        self.misses = 0
+        self._plans: collections.OrderedDict[tuple, list[DataChunk]] = (
+            collections.OrderedDict()
+        )
+        self._lock = threading.Lock()  # sessions start from several threads
+
+    def _path(self, key: tuple) -> str:
+        fw_hash, mode, chunk_size, base_hash = key
+        name = f"{fw_hash.hex()}-{mode.value}-{chunk_size}"
+        if base_hash:
+            name += f"-{base_hash.hex()}"
+        return os.path.join(self.directory, f"{name}.plan")
+
+    def get(
+        self,
+        fw_hash: bytes,
+        mode: OTAMode,
+        chunk_size: int,
+        base_hash: bytes = b"",
+    ) -> list[DataChunk] | None:
+        """Return the chunks of a plan, None when not cached."""
+        key = (fw_hash, mode, chunk_size, base_hash)
+        with self._lock:
+            chunks = self._plans.get(key)
+            if chunks is None and self.directory:
+                chunks = self._read(key)
+                if chunks is not None:
+                    self._insert(key, chunks)
+            if chunks is None:
+                self.misses += 1
+                return None
+            self._plans.move_to_end(key)
+            self.hits += 1
+            return chunks
+
+    def put(
+        self,
+        fw_hash: bytes,
+        mode: OTAMode,
+        chunk_size: int,
+        chunks: list[DataChunk],
+        base_hash: bytes = b"",
+    ):
+        """Cache the chunks of a plan."""
+        key = (fw_hash, mode, chunk_size, base_hash)
+        with self._lock:
+            self._insert(key, chunks)
+            if self.directory:
+                self._write(key, chunks)
+
+    def _insert(self, key: tuple, chunks: list[DataChunk]):
+        self._plans[key] = chunks
+        self._plans.move_to_end(key)
+        while len(self._plans) > self.size:
+            self._plans.popitem(last=False)
+
+    def _read(self, key: tuple) -> list[DataChunk] | None:
+        try:
+            with open(self._path(key), "rb") as f:
+                content = f.read()
+        except OSError:
+            return None
+        if len(content) < OTA_PLAN_HEADER.size:
+            return None
+        magic, mode, chunk_size, count = OTA_PLAN_HEADER.unpack_from(content)
+        offset = OTA_PLAN_HEADER.size + 4 * count
+        if (
+            magic != OTA_PLAN_MAGIC
+            or (mode, chunk_size) != (key[1].value, key[2])
+            or not 0 < len(content) - offset <= count * chunk_size
+        ):
+            return None
+        crcs = struct.unpack_from(f"<{count}I", content, OTA_PLAN_HEADER.size)
+        chunks = []
+        for index, crc in enumerate(crcs):
+            data = content[offset + index * chunk_size :][:chunk_size]
+            if not data or zlib.crc32(data) != crc:
+                # Truncated or corrupted file, the plan is computed again
+                return None
+            chunks.append(
+                DataChunk(index=index, size=len(data), crc=crc, data=data)
+            )
+        return chunks
+
+    def _write(self, key: tuple, chunks: list[DataChunk]):
+        path = self._path(key)
+        try:
+            os.makedirs(self.directory, exist_ok=True)
+            # Written aside then renamed, concurrent readers never see a
+            # partial plan
+            with open(f"{path}.tmp", "wb") as f:
+                f.write(
+                    OTA_PLAN_HEADER.pack(
+                        OTA_PLAN_MAGIC, key[1].value, key[2], len(chunks)
+                    )
+                )
+                f.write(
+                    struct.pack(
+                        f"<{len(chunks)}I", *(chunk.crc for chunk in chunks)
+                    )
+                )
+                for chunk in chunks:
+                    f.write(chunk.data)
+            os.replace(f"{path}.tmp", path)
+        except OSError as exc:
+            LOGGER.warning(
+                "Cannot store chunk plan", path=path, error=str(exc)
+            )
+
+
+class FairLock:
+    """Lock acquired in the order it was requested.
+
+    Threads sending frames in a loop take turns, a thread releasing the lock
+    cannot get it back before the threads already waiting for it.
+    """
+
+    def __init__(self):
+        self._condition = threading.Condition()
+        self._next_ticket = 0
+        self._serving = 0
+
+    def __enter__(self):
+        with self._condition:
+            ticket = self._next_ticket
+            self._next_ticket += 1
+            self._condition.wait_for(lambda: self._serving == ticket)
+
+    def __exit__(self, *args):
+        with self._condition:
+            self._serving += 1
+            self._condition.notify_all()
+
+
+@dataclass
+class ProfileCounter:
+    """Cycles spent by a device in a profiled firmware section."""
+
+    section: ProfileSection
+    count: int = 0  # runs since the device booted
+    min: int = 0  # cycles
+    max: int = 0  # cycles
+    total: int = 0  # cycles
+
+    @property
+    def avg(self) -> float:
+        return self.total / self.count if self.count else 0
+
+
+@dataclass
+class InstalledImage:
+    """Image a device installed with an OTA."""
+
+    size: int = 0  # 0 when the device doesn't know its image
+    sha: bytes = b""
+
+
+@dataclass
+class UploadInfo:
+    """Region of RAM a user image offered to the controller."""
+
+    session: int = 0
+    size: int = 0  # 0 when nothing is offered
+    crc: int = 0
+
+    @property
+    def chunk_count(self) -> int:
+        return math.ceil(self.size / UPLOAD_CHUNK_SIZE)
+
+
+@dataclass
+class TraceSample:
+    """Latency of each hop of a traced packet, in ms."""
+
+    network: float = 0  # gateway to device and back, time on air included
+    netcore: float = 0  # network core reception to the IPC signal
+    user_image: float = 0  # IPC signal to the packet handled by the image
+    reply: float = 0  # user image done to the reply sent
+    round_trip: float = 0  # measured by the controller
+    slots: int = 0  # Mari slots elapsed between reception and reply
+
+
+TRACE_HOPS = [field.name for field in dataclasses.fields(TraceSample)][:-1]
+
+
+@dataclass
+class AsnClock:
+    """Mari ASN of the network, extrapolated from the ASNs of the traces.
+
+    The devices of a network share the same slots, the slot duration is
+    measured between the first and the latest ASN received.
+    """
+
+    first_asn: int = 0
+    first_at: float = 0  # s, monotonic time the first ASN was received
+    asn: int = 0
+    at: float = 0  # s, monotonic time the latest ASN was received
+
+    def add(self, asn: int, at: float):
+        """Account for an ASN reported by a device."""
+        if not self.first_at or asn < self.first_asn:
+            # the first one, or the network started again
+            self.first_asn, self.first_at = asn, at
+        self.asn, self.at = asn, at
+
+    @property
+    def slot_duration(self) -> float:
+        """Return the duration of a slot in s, 0 until it is measured."""
+        if self.asn <= self.first_asn:
+            return 0
+        return (self.at - self.first_at) / (self.asn - self.first_asn)
+
+    def asn_at(self, at: float) -> int:
+        """Return the ASN at a monotonic time, 0 when unknown."""
+        if not self.slot_duration:
+            return 0
+        return self.asn + math.ceil((at - self.at) / self.slot_duration)
+
+
 @dataclass
 class ResetLocation:
     """Class that holds reset location."""
@@ -122,6 +474,11 @@ def battery_level_color(level: int):
     return "green" if level > VOLTAGE_WARNING else "red"
 
 
+def idle_energy_saved(idle_time: int) -> float:
+    """Estimate the energy saved in mWh by a device idle for idle_time s."""
+    return idle_time * IDLE_POWER_SAVED_MW / 3600
+
+
 def generate_status(status_data, devices=[], status_message="found"):
     data = {
         addr: device_data
@@ -158,15 +515,25 @@ def generate_status(status_data, devices=[], status_message="found"):
         justify="center",
         width=max([len(m) for m in StatusType.__members__]),
     )
+    show_idle = any(device_data.idle_time for device_data in data.values())
+    if show_idle:
+        table.add_column(
+            "Energy saved",
+            style="cyan",
+            justify="center",
+        )
     for device_addr, device_data in sorted(data.items()):
-
-        table.add_row(
+        columns = [
             f"{device_addr}",
             f"{device_data.device.name}",
             f"[{battery_level_color(device_data.battery)}]{device_data.battery / 1000:.2f}V ({int(device_data.battery / 3000 * 100)}%)",
             f"({device_data.pos_x}, {device_data.pos_y})",
             f"{'[bold cyan]' if device_data.status == StatusType.Running else '[bold green]'}{device_data.status.name}",
-        )
+        ]
+        if show_idle:
+            saved = idle_energy_saved(device_data.idle_time)
+            columns.append(f"~{saved:.1f}mWh")
+        table.add_row(*columns)
     return Group(header, table)
 
 
@@ -183,6 +550,9 @@ def print_transfer_status(
     transfer_status_table.add_column(
         "Chunks acked", style="green", justify="center"
     )
+    transfer_status_table.add_column(
+        "Image hash", style="green", justify="center"
+    )
 
     with Live(transfer_status_table, refresh_per_second=4) as live:
         live.update(transfer_status_table)
@@ -191,14 +561,112 @@ def print_transfer_status(
             transfer_status_table.add_row(
                 f"{device_addr}",
                 f"{chunks_col_color}{len([chunk for chunk in status.chunks if bool(chunk.acked)])}/{start_data.chunks}",
+                (
+                    "[green]verified"
+                    if status.verified
+                    else "[bold red]mismatch" if status.hash else "-"
+                ),
+            )
+
+
+def generate_profile(profiles: dict[str, list[ProfileCounter]]):
+    """Return the table of the profiling counters of the devices."""
+    if not profiles:
+        return Group(Text("\nNo profile received\n"))
+    table = Table()
+    table.add_column("Device Addr", style="magenta", no_wrap=True)
+    table.add_column("Section", style="cyan")
+    for column in ["Runs", "Min", "Avg", "Max"]:
+        table.add_column(column, style="green", justify="right")
+    for device_addr, counters in sorted(profiles.items()):
+        for counter in counters:
+            if not counter.count:
+                table.add_row(
+                    device_addr, counter.section.name, "0", "-", "-", "-"
+                )
+                continue
+            table.add_row(
+                device_addr,
+                counter.section.name,
+                f"{counter.count}",
+                f"{counter.min}",
+                f"{counter.avg:.0f}",
+                f"{counter.max}",
             )
+    return Group(Text("\nCycles spent in the firmware sections\n"), table)
+
+
+def generate_trace(traces: dict[str, list[TraceSample]]):
+    """Return the latency histogram of each hop of the traced packets."""
+    samples = [sample for values in traces.values() for sample in values]
+    if not samples:
+        return Group(Text("\nNo trace received\n"))
+    table = Table()
+    table.add_column("Hop", style="cyan", no_wrap=True)
+    for column in ["Min", "Median", "Max"]:
+        table.add_column(column, style="green", justify="right")
+    for bound in TRACE_BUCKETS:
+        table.add_column(f"<{bound}", justify="right")
+    table.add_column(f">={TRACE_BUCKETS[-1]}", justify="right")
+    for hop in TRACE_HOPS:
+        values = [getattr(sample, hop) for sample in samples]
+        buckets = [0] * (len(TRACE_BUCKETS) + 1)
+        for value in values:
+            buckets[
+                next(
+                    (
+                        index
+                        for index, bound in enumerate(TRACE_BUCKETS)
+                        if value < bound
+                    ),
+                    len(TRACE_BUCKETS),
+                )
+            ] += 1
+        table.add_row(
+            hop.replace("_", " "),
+            f"{min(values):.2f}",
+            f"{statistics.median(values):.2f}",
+            f"{max(values):.2f}",
+            *[f"{count}" if count else "-" for count in buckets],
+        )
+    return Group(
+        Text(
+            f"\nLatency of {len(samples)} traced packets from "
+            f"{len(traces)} devices, in ms\n"
+        ),
+        table,
+    )
+
+
+def generate_links(
+    links: dict[str, LinkStats],
+    ota_timeout: float = OTA_ACK_TIMEOUT_DEFAULT,
+    ota_max_retries: int = OTA_MAX_RETRIES_DEFAULT,
+):
+    """Return the table of the radio links and their OTA settings."""
+    if not links:
+        return Group(Text("\nNo device probed\n"))
+    table = Table()
+    table.add_column("Device Addr", style="magenta", no_wrap=True)
+    for column in ["PDR", "RSSI", "Latency", "Max", "Timeout", "Retries"]:
+        table.add_column(column, style="green", justify="right")
+    for device_addr, link in sorted(links.items()):
+        answered = link.probes_received > 0
+        table.add_row(
+            device_addr,
+            f"{link.pdr:.0%}",
+            f"{link.rssi:.0f} dBm" if answered else "-",
+            f"{link.latency * 1000:.0f} ms" if answered else "-",
+            f"{link.latency_max * 1000:.0f} ms" if answered else "-",
+            f"{link.ota_timeout(ota_timeout):.2f} s",
+            f"{link.ota_retries(ota_max_retries)}",
+        )
+    return Group(Text("\nRadio links and OTA settings\n"), table)
 
 
 def wait_for_done(timeout):
-    """Wait for the condition to be met."""
-    while timeout > 0:
-        timeout -= 0.01
-        time.sleep(0.01)
+    """Wait for the devices to answer, their number is not known."""
+    time.sleep(timeout)
     return False
 
 
@@ -211,12 +679,29 @@ class ControllerSettings:
     mqtt_host: str = "localhost"
     mqtt_port: int = 1883
     mqtt_use_tls: bool = False
+    mqtt_batch_window: float = 0  # s, frames published at once, 0 disables
     network_id: int = 1
+    # More gateways, each carrying its own Mari network: serial ports with
+    # the edge adapter, network IDs in hex with the cloud adapter
+    gateways: list[str] = dataclasses.field(default_factory=lambda: [])
     adapter: str = "serial"  # or "mqtt", "marilib-edge", "marilib-cloud"
     devices: list[str] = dataclasses.field(default_factory=lambda: [])
+    group: int | None = None  # broadcast frames only reach this group
     map_size: str = "2500x2500"
     ota_max_retries: int = OTA_MAX_RETRIES_DEFAULT
     ota_timeout: float = OTA_ACK_TIMEOUT_DEFAULT
+    ota_chunk_size: int = CHUNK_SIZE
+    ota_window_size: int = OTA_WINDOW_SIZE_DEFAULT
+    ota_ack_interval: int = OTA_ACK_INTERVAL_DEFAULT
+    ota_delta: bool = False
+    ota_compress: bool = False
+    ota_skip_unchanged: bool = False
+    ota_skip_installed: bool = False  # don't flash devices already up to date
+    ota_fec_group: int = 0  # chunks per group of broadcast repairs, 0 disables
+    ota_image_cache: str = OTA_IMAGE_CACHE_DEFAULT
+    ota_plan_cache: str = ""  # directory storing the chunk plans, if any
+    log_elf: str = ""  # user image ELF containing the log format strings
+    log_store: str = ""  # file storing the log records, instead of logging
     adapter_wait_timeout: float = 3
     verbose: bool = False
 
@@ -228,90 +713,151 @@ class Controller:
         self.logger = LOGGER.bind(__context=__name__)
         self.settings = settings
         self._interface: GatewayAdapterBase = None
-        self.status_data: dict[str, NodeStatus] = {}
+        self.status_data = StatusStore()
         self.started_data: list[str] = []
         self.stopped_data: list[str] = []
-        self.chunks: list[DataChunk] = []
-        self.start_ota_data: StartOtaData = StartOtaData()
-        self.transfer_data: dict[str, TransferDataStatus] = {}
-        self._known_devices: dict[str, StatusType] = {}
+        # OTA sessions in progress, in the order they were started
+        self.ota_sessions: dict[int, OtaSession] = {}
+        self._ota_session: OtaSession = OtaSession()  # latest started
+        self._ota_session_id = random.randrange(OTA_SESSION_COUNT)
+        self._ota_lock = threading.Lock()
+        self._send_lock = FairLock()
+        self.chunk_plans = ChunkPlanCache(settings.ota_plan_cache)
+        # Notified at each received frame, waits end as soon as the frame
+        # they expect is handled
+        self._frame_received = threading.Condition()
+        self._frame_count = 0
+        self.log_dropped: dict[str, int] = {}  # log records lost per device
+        self.profiles: dict[str, list[ProfileCounter]] = {}
+        self.images: dict[str, InstalledImage] = {}
+        # Devices installing the image they verified, until their next
+        # status out of programming
+        self._installing: set[str] = set()
+        self.upload_infos: dict[str, UploadInfo] = {}
+        # Chunks received from the devices being uploaded, by index
+        self._upload_chunks: dict[str, dict[int, bytes]] = {}
+        self.traces: dict[str, list[TraceSample]] = {}
+        self.asn_clock = AsnClock()
+        self.links: dict[str, LinkStats] = {}
+        # Ack delays of the OTA frames, per type and destination, and of the
+        # commands, per destination
+        self.ota_rtt: dict[tuple[PayloadType, str], RttEstimator] = {}
+        self.command_rtt: dict[str, RttEstimator] = {}
+        self._probe_sent: dict[str, float] = {}  # monotonic send times
+        self._trace_sent: dict[int, float] = {}  # id -> monotonic send time
+        self._trace_id = random.randrange(1 << 32)
+        self.log_dictionary = LogDictionary()
+        if settings.log_elf:
+            with open(settings.log_elf, "rb") as elf:
+                self.log_dictionary = LogDictionary.from_elf(elf.read())
+        self._log_store: LogStoreWriter | None = None
+        if settings.log_store:
+            self._log_store = LogStoreWriter(settings.log_store)
+        self._known_devices: StatusStore | None = None
         self._stop_event = threading.Event()
         self._cleanup_thread = threading.Thread(
             target=self._cleanup_loop, daemon=True
         )
+        adapters = [
+            self._gateway_adapter(gateway)
+            for gateway in [None, *self.settings.gateways]
+        ]
+        self._interface = (
+            adapters[0]
+            if len(adapters) == 1
+            else MultiGatewayAdapter(adapters)
+        )
+        self._interface.init(self.on_frames_received)
+        self._cleanup_thread.start()
+
+    def _gateway_adapter(self, gateway: str | None) -> GatewayAdapterBase:
+        """Return the adapter of a gateway, the settings one with None.
+
+        The other gateways are given by their network ID in hex with the
+        cloud adapter, by their serial port with the edge adapter.
+        """
         if self.settings.adapter == "cloud":
-            self._interface = MarilibCloudAdapter(
+            return MarilibCloudAdapter(
                 self.settings.mqtt_host,
                 self.settings.mqtt_port,
                 self.settings.mqtt_use_tls,
-                self.settings.network_id,
-                verbose=self.settings.verbose,
-                busy_wait_timeout=self.settings.adapter_wait_timeout,
-            )
-        else:
-            self._interface = MarilibEdgeAdapter(
-                self.settings.serial_port,
-                self.settings.serial_baudrate,
+                (
+                    self.settings.network_id
+                    if gateway is None
+                    else int(gateway, 16)
+                ),
                 verbose=self.settings.verbose,
                 busy_wait_timeout=self.settings.adapter_wait_timeout,
+                batch_window=self.settings.mqtt_batch_window,
             )
-        self._interface.init(self.on_frame_received)
-        self._cleanup_thread.start()
+        return MarilibEdgeAdapter(
+            self.settings.serial_port if gateway is None else gateway,
+            self.settings.serial_baudrate,
+            verbose=self.settings.verbose,
+            busy_wait_timeout=self.settings.adapter_wait_timeout,
+        )
 
     @property
-    def known_devices(self) -> dict[str, StatusType]:
+    def known_devices(self) -> StatusStore:
         """Return the known devices."""
         if not self._known_devices:
+            self.request_status()
             wait_for_done(COMMAND_TIMEOUT)
             self._known_devices = self.status_data
         return self._known_devices
 
+    def _is_selected(self, device_addr: str, node: NodeStatus) -> bool:
+        """Check the device is one of the settings devices and group."""
+        if self.settings.devices and device_addr not in self.settings.devices:
+            return False
+        return self.settings.group is None or bool(
+            node.groups & (1 << self.settings.group)
+        )
+
+    def _devices_in(self, *states: StatusType) -> list[str]:
+        """Return the selected known devices in one of the states."""
+        return [
+            device_addr
+            for device_addr, node in self.known_devices.in_state(
+                *states
+            ).items()
+            if self._is_selected(device_addr, node)
+        ]
+
     @property
     def running_devices(self) -> list[str]:
         """Return the running devices."""
-        return [
-            addr
-            for addr, node in self.known_devices.items()
-            if (
-                (
-                    node.status == StatusType.Running
-                    or node.status == StatusType.Programming
-                )
-                and (
-                    not self.settings.devices or addr in self.settings.devices
-                )
-            )
-        ]
+        return self._devices_in(StatusType.Running, StatusType.Programming)
 
     @property
     def resetting_devices(self) -> list[str]:
         """Return the resetting devices."""
-        return [
-            device_addr
-            for device_addr, node in self.known_devices.items()
-            if (
-                node.status == StatusType.Resetting
-                and (
-                    not self.settings.devices
-                    or device_addr in self.settings.devices
-                )
-            )
-        ]
+        return self._devices_in(StatusType.Resetting)
 
     @property
     def ready_devices(self) -> list[str]:
         """Return the ready devices."""
-        return [
-            device_addr
-            for device_addr, node in self.known_devices.items()
-            if (
-                node.status == StatusType.Bootloader
-                and (
-                    not self.settings.devices
-                    or device_addr in self.settings.devices
-                )
-            )
-        ]
+        return self._devices_in(StatusType.Bootloader)
+
+    @property
+    def idle_devices(self) -> list[str]:
+        """Return the idle devices."""
+        return self._devices_in(StatusType.Idle)
+
+    @property
+    def chunks(self) -> list[DataChunk]:
+        """Return the chunks of the latest OTA session."""
+        return self._ota_session.chunks
+
+    @property
+    def start_ota_data(self) -> StartOtaData:
+        """Return the start data of the latest OTA session."""
+        return self._ota_session.start_ota_data
+
+    @property
+    def transfer_data(self) -> dict[str, TransferDataStatus]:
+        """Return the transfer status of the latest OTA session."""
+        return self._ota_session.transfer_data
 
     @property
     def interface(self) -> GatewayAdapterBase:
@@ -319,56 +865,272 @@ class Controller:
         return self._interface
 
     def _cleanup_loop(self):
-        while not self._stop_event.is_set():
+        while not self._stop_event.wait(1):
             self.cleanup_inactive(INACTIVE_TIMEOUT)
-            time.sleep(1)
+
+    def _wait_until(self, predicate, timeout: float | None) -> bool:
+        """Wait until predicate is true, checked after each received frame.
+
+        Return the latest value of predicate, false when the wait timed out.
+        """
+        with self._frame_received:
+            return self._frame_received.wait_for(predicate, timeout)
+
+    def _wait_for_frame(self, frame_count: int, timeout: float) -> bool:
+        """Wait for a frame received after the first frame_count ones."""
+        return self._wait_until(
+            lambda: self._frame_count != frame_count, timeout
+        )
 
     def cleanup_inactive(self, timeout):
-        now = time.time()
-        inactive = [
-            addr
-            for addr, status in self.status_data.items()
-            if now - status.last_updated_at > timeout
-        ]
-        for addr in inactive:
-            del self.status_data[addr]
+        # Idle devices send their status less often
+        self.status_data.remove_inactive(
+            time.time(),
+            lambda node: (
+                max(timeout, IDLE_INACTIVE_TIMEOUT)
+                if node.status == StatusType.Idle
+                else timeout
+            ),
+        )
+
+    def request_status(self):
+        """Ask all devices to send their status without waiting for changes."""
+        self.send_payload(BROADCAST_ADDRESS, PayloadStatus())
 
     def terminate(self):
         """Terminate the controller."""
         self._stop_event.set()
         self._cleanup_thread.join()
         self.interface.close()
+        if self._log_store is not None:
+            self._log_store.close()
 
     def send_payload(self, destination: int, payload: Payload):
-        """Send a frame to the devices."""
-        self.interface.send_payload(destination, payload)
+        """Send a frame to the devices.
+
+        With a group selected, broadcast frames are wrapped in a single
+        group frame, only handled by the devices of the group.
+        """
+        group = self.settings.group
+        if destination == BROADCAST_ADDRESS and group is not None:
+            packet = Packet.from_payload(payload).to_bytes()
+            payload = PayloadGroup(
+                group=group, count=len(packet), packet=packet
+            )
+        # OTA sessions sending from several threads take turns on the radio
+        with self._send_lock:
+            self.interface.send_payload(destination, payload)
+
+    def on_frames_received(self, frames: list[tuple[object, Packet | None]]):
+        """Handle a batch of received frames and wake up the waits once."""
+        now = time.time()
+        # Devices only send their status on changes and heartbeats, any
+        # other frame, like an OTA ack, also shows they are alive
+        self.status_data.touch_many(
+            {f"{header.source:08X}" for header, _ in frames}, now
+        )
+        ota_sessions = None
+        for header, packet in frames:
+            if packet is None:
+                continue  # status superseded by a later one of the batch
+            device_addr = f"{header.source:08X}"
+            if packet.payload_type in OTA_ACK_TYPES:
+                # The sessions only change on OTA starts, they are looked up
+                # once for all the acks of the batch
+                if ota_sessions is None:
+                    ota_sessions = self._ota_sessions_by_device()
+                session = ota_sessions.get(device_addr, ota_sessions.get(None))
+                if session is not None:
+                    self._on_ota_ack(session, device_addr, packet)
+            else:
+                self._handle_frame(device_addr, packet, now)
+        with self._frame_received:
+            self._frame_count += len(frames)
+            self._frame_received.notify_all()
 
-    def on_frame_received(self, header, packet: Packet):
-        """Handle the received frame."""
+    def _handle_frame(self, device_addr: str, packet: Packet, now: float):
         # if self.settings.verbose:
         #     print()
         #     print(Frame(header, packet))
-        device_addr = f"{header.source:08X}"
         if packet.payload_type == PayloadType.SWARMIT_STATUS:
-            now = time.time()
             status = NodeStatus(
                 device=DeviceType(packet.payload.device),
                 status=StatusType(packet.payload.status),
                 battery=packet.payload.battery,
                 pos_x=packet.payload.pos_x,
                 pos_y=packet.payload.pos_y,
+                idle_time=packet.payload.idle_time,
+                groups=packet.payload.groups,
                 last_updated_at=now,
             )
-            self.status_data.update({device_addr: status})
-        elif (
-            packet.payload_type == PayloadType.SWARMIT_OTA_START_ACK
-            and device_addr not in self.start_ota_data.addrs
-        ):
-            self.start_ota_data.addrs.append(device_addr)
+            self.status_data.set(device_addr, status)
+            if status.status != StatusType.Programming:
+                self._installing.discard(device_addr)
+        elif packet.payload_type == PayloadType.SWARMIT_EVENT_LOG:
+            if (
+                self.settings.devices
+                and device_addr not in self.settings.devices
+            ):
+                return
+            self._log_event(
+                device_addr, packet.payload.timestamp, packet.payload.data
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_EVENT_LOG_BATCH:
+            if (
+                self.settings.devices
+                and device_addr not in self.settings.devices
+            ):
+                return
+            for timestamp, data, formatted in packet.payload.records():
+                self._log_event(device_addr, timestamp, data, formatted)
+            if packet.payload.dropped:
+                dropped = self.log_dropped.get(device_addr, 0)
+                dropped += packet.payload.dropped
+                self.log_dropped[device_addr] = dropped
+                self.logger.warning(
+                    "LOG records dropped",
+                    device_addr=device_addr,
+                    dropped=packet.payload.dropped,
+                    total_dropped=dropped,
+                )
+        elif packet.payload_type == PayloadType.SWARMIT_POSITION_BATCH:
+            if (
+                self.settings.devices
+                and device_addr not in self.settings.devices
+            ):
+                return
+            positions = packet.payload.positions()
+            if not positions:
+                return
+            _, pos_x, pos_y = positions[-1]
+            self.status_data.set_position(device_addr, pos_x, pos_y)
+            self.logger.info(
+                "POSITION batch",
+                device_addr=device_addr,
+                notification=PayloadType.SWARMIT_POSITION_BATCH.name,
+                positions=positions,
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_PROFILE:
+            # Sections added by newer firmwares are not known yet
+            counters = [
+                ProfileCounter(ProfileSection(index), *values)
+                for index, values in enumerate(packet.payload.counters())
+                if index < len(ProfileSection)
+            ]
+            self.profiles[device_addr] = counters
+            self.logger.info(
+                "PROFILE counters",
+                device_addr=device_addr,
+                notification=PayloadType.SWARMIT_PROFILE.name,
+                counters={
+                    counter.section.name: dataclasses.astuple(counter)[1:]
+                    for counter in counters
+                },
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_IMAGE:
+            self.images[device_addr] = InstalledImage(
+                size=packet.payload.size, sha=bytes(packet.payload.sha)
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_UPLOAD:
+            self.upload_infos[device_addr] = UploadInfo(
+                session=packet.payload.session,
+                size=packet.payload.size,
+                crc=packet.payload.crc,
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_UPLOAD_CHUNK:
+            chunks = self._upload_chunks.get(device_addr)
+            info = self.upload_infos.get(device_addr)
+            if (
+                chunks is None
+                or info is None
+                or packet.payload.session != info.session
+            ):
+                return  # chunk of a previous upload
+            chunks[packet.payload.index] = bytes(
+                packet.payload.data[: packet.payload.count]
+            )
+        elif packet.payload_type == PayloadType.METRICS_PROBE:
+            sent = self._probe_sent.pop(device_addr, None)
+            if sent is None:
+                return  # answer to a probe already counted as lost
+            link = self.links.setdefault(device_addr, LinkStats())
+            link.add_probe(
+                time.monotonic() - sent, packet.payload.rssi_at_node, now
+            )
+            link.node_rx_count = packet.payload.node_rx_count
+            self.logger.debug(
+                "LINK probe",
+                device_addr=device_addr,
+                notification=PayloadType.METRICS_PROBE.name,
+                latency=link.latency,
+                rssi=packet.payload.rssi_at_node,
+                pdr=link.pdr,
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_TRACE:
+            sent = self._trace_sent.get(packet.payload.id)
+            if sent is None:
+                return
+            sample = self._trace_sample(packet.payload, sent)
+            self.asn_clock.add(packet.payload.tx_asn, time.monotonic())
+            self.traces.setdefault(device_addr, []).append(sample)
+            self.logger.info(
+                "TRACE sample",
+                device_addr=device_addr,
+                notification=PayloadType.SWARMIT_TRACE.name,
+                id=packet.payload.id,
+                **dataclasses.asdict(sample),
+            )
+
+    @staticmethod
+    def _trace_sample(trace: PayloadTrace, sent: float) -> TraceSample:
+        """Return the hop latencies of a reply to a packet sent at sent."""
+
+        def elapsed(start: int, end: int) -> float:
+            # the network core timer wraps around every 71 minutes
+            return ((end - start) % (1 << 32)) / 1000
+
+        round_trip = (time.monotonic() - sent) * 1000
+        device = elapsed(trace.rx_time, trace.tx_time)
+        return TraceSample(
+            network=max(0.0, round_trip - device),
+            netcore=elapsed(trace.rx_time, trace.ipc_time),
+            user_image=elapsed(trace.ipc_time, trace.isr_time),
+            reply=elapsed(trace.isr_time, trace.tx_time),
+            round_trip=round_trip,
+            slots=trace.tx_asn - trace.rx_asn,
+        )
+
+    def _ota_sessions_by_device(self) -> dict[str | None, OtaSession]:
+        """Return the OTA session handling the acks of each device.
+
+        Devices follow the latest OTA start they received, a device not
+        started by the latest sessions may join the latest broadcast one,
+        stored with the None key.
+        """
+        with self._ota_lock:
+            sessions = list(self.ota_sessions.values())
+        by_device = {}
+        for session in sessions:
+            if session.broadcast:
+                by_device[None] = session
+            for device_addr in session.devices:
+                by_device[device_addr] = session
+        return by_device
+
+    def _on_ota_ack(
+        self, session: OtaSession, device_addr: str, packet: Packet
+    ):
+        start_data = session.start_ota_data
+        transfer_data = session.transfer_data
+        if packet.payload_type == PayloadType.SWARMIT_OTA_START_ACK:
+            if device_addr not in start_data.addrs:
+                start_data.addrs.append(device_addr)
+            if device_addr not in session.devices:
+                session.devices.append(device_addr)
         elif packet.payload_type == PayloadType.SWARMIT_OTA_CHUNK_ACK:
             try:
                 acked = bool(
-                    self.transfer_data[device_addr]
+                    transfer_data[device_addr]
                     .chunks[packet.payload.index]
                     .acked
                 )
@@ -380,23 +1142,110 @@ class Controller:
                 )
                 return
             if acked is False:
-                self.transfer_data[device_addr].chunks[
+                transfer_data[device_addr].chunks[
                     packet.payload.index
                 ].acked = 1
-        elif packet.payload_type == PayloadType.SWARMIT_EVENT_LOG:
-            if (
-                self.settings.devices
-                and device_addr not in self.settings.devices
+                self._sample_chunk_acks(
+                    session, device_addr, [packet.payload.index]
+                )
+            transfer_data[device_addr].acked_max = max(
+                transfer_data[device_addr].acked_max, packet.payload.index
+            )
+        elif packet.payload_type == PayloadType.SWARMIT_OTA_CHUNKS_ACK:
+            if device_addr not in transfer_data:
+                return
+            transfer = transfer_data[device_addr]
+            chunks = transfer.chunks
+            acked = []
+            # Only the chunks acknowledged since the previous base
+            for index in range(
+                transfer.acked_base, min(packet.payload.base, len(chunks))
             ):
+                if not chunks[index].acked:
+                    chunks[index].acked = 1
+                    acked.append(index)
+            transfer.acked_base = max(
+                transfer.acked_base, min(packet.payload.base, len(chunks))
+            )
+            transfer.acked_max = max(
+                transfer.acked_max, transfer.acked_base - 1
+            )
+            for index in packet.payload.acked_indexes():
+                if index < len(chunks) and not chunks[index].acked:
+                    chunks[index].acked = 1
+                    acked.append(index)
+                if index < len(chunks):
+                    transfer.acked_max = max(transfer.acked_max, index)
+            self._sample_chunk_acks(session, device_addr, acked)
+        elif packet.payload_type == PayloadType.SWARMIT_OTA_FINALIZE_ACK:
+            if device_addr not in transfer_data:
                 return
-            logger = self.logger.bind(
-                device_addr=device_addr,
-                notification=PayloadType(packet.payload_type).name,
-                timestamp=packet.payload.timestamp,
-                data_size=packet.payload.count,
-                data=packet.payload.data,
+            transfer_data[device_addr].hash = packet.payload.sha
+            transfer_data[device_addr].verified = bool(
+                packet.payload.verified
+            ) and (packet.payload.sha == start_data.fw_hash)
+            if transfer_data[device_addr].verified:
+                # The statuses sent after the ack follow the installation
+                self._installing.add(device_addr)
+        elif packet.payload_type == PayloadType.SWARMIT_OTA_MANIFEST_ACK:
+            if device_addr not in start_data.addrs:
+                return
+            first_page = packet.payload.first_page
+            start_data.manifest_acks.setdefault(device_addr, set()).add(
+                first_page
+            )
+            unchanged = start_data.unchanged_pages.setdefault(
+                device_addr, set()
+            )
+            for i in range(packet.payload.count):
+                if not packet.payload.differs[i // 8] & (1 << (i % 8)):
+                    unchanged.add(first_page + i)
+
+    @staticmethod
+    def _sample_chunk_acks(
+        session: OtaSession, device_addr: str, acked: list[int]
+    ):
+        """Sample the ack delay of the latest chunk newly acked by a device.
+
+        A device acks the chunks it received as soon as it gets the latest
+        one, the earlier ones waited for it. The chunks sent again are not
+        sampled, their acks may answer any of their copies. Broadcast chunks
+        are sampled by the estimator of the broadcast transfer.
+        """
+        if device_addr not in session.chunk_rtt:
+            device_addr = addr_to_hex(BROADCAST_ADDRESS)
+        if device_addr not in session.chunk_rtt:
+            return
+        chunk_sent_at = session.chunk_sent_at[device_addr]
+        sent_at = [
+            chunk_sent_at[index] for index in acked if index in chunk_sent_at
+        ]
+        if sent_at:
+            session.chunk_rtt[device_addr].add_sample(
+                time.time() - max(sent_at)
             )
-            logger.info("LOG event")
+
+    def _log_event(
+        self,
+        device_addr: str,
+        timestamp: int,
+        data: bytes,
+        formatted: bool = False,
+    ):
+        if self._log_store is not None:
+            # Formatted when exported, the receive thread only queues it
+            self._log_store.append(device_addr, timestamp, data, formatted)
+            return
+        if formatted:
+            data = self.log_dictionary.decode(data).encode()
+        logger = self.logger.bind(
+            device_addr=device_addr,
+            notification=PayloadType.SWARMIT_EVENT_LOG.name,
+            timestamp=timestamp,
+            data_size=len(data),
+            data=data,
+        )
+        logger.info("LOG event")
 
     def _live_status(self, timeout, devices=[], message="found", watch=False):
         """Request the live status of the testbed."""
@@ -404,69 +1253,209 @@ class Controller:
             generate_status(self.status_data, devices, status_message=message),
             refresh_per_second=4,
         ) as live:
-            while watch is True or timeout > 0:
+            deadline = time.monotonic() + timeout
+            while watch is True or time.monotonic() < deadline:
+                frame_count = self._frame_count
                 live.update(
                     generate_status(
                         self.status_data, devices, status_message=message
                     )
                 )
-                timeout -= 0.01
-                time.sleep(0.01)
+                # Statuses are shown when received, the table is refreshed
+                # at least at the Live refresh rate for the elapsed times
+                self._wait_for_frame(
+                    frame_count,
+                    (
+                        0.25
+                        if watch is True
+                        else max(0, min(0.25, deadline - time.monotonic()))
+                    ),
+                )
 
     def status(self, timeout=STATUS_TIMEOUT, watch=False):
         """Request the status of the testbed."""
+        self.request_status()
         self._live_status(timeout, devices=self.settings.devices, watch=watch)
 
-    def _send_start(self, device_addr: str):
-        payload = PayloadStart()
+    def _send_start(self, device_addr: str, asn: int = 0):
+        payload = PayloadStart(asn=asn)
         self.send_payload(int(device_addr, 16), payload)
 
-    def start(self, devices=None, timeout=COMMAND_TIMEOUT):
-        """Start the application."""
+    def _schedule_asn(self) -> tuple[int, float]:
+        """Return the ASN of a synchronized command, and its attempt delay.
+
+        Traced packets measure the ASN and the round trip to the selected
+        devices, all the attempts are sent before the ASN. The ASN is 0 when
+        it can't be measured.
+        """
+        traces = self.trace(count=2, interval=SCHEDULE_TRACE_INTERVAL)
+        round_trips = [
+            sample.round_trip / 1000
+            for samples in traces.values()
+            for sample in samples
+        ]
+        if not round_trips or not self.asn_clock.slot_duration:
+            self.logger.warning("ASN unknown, commands run on reception")
+            return 0, 0
+        delay = max(RTO_MIN, SCHEDULE_ATTEMPT_FACTOR * max(round_trips))
+        lead = COMMAND_MAX_ATTEMPTS * delay
+        asn = self.asn_clock.asn_at(time.monotonic() + lead)
+        self.logger.info(
+            "SCHEDULE command",
+            asn=asn,
+            lead=lead,
+            slot_duration=self.asn_clock.slot_duration,
+        )
+        return asn, delay
+
+    def _repeat_until_asn(self, send, done, delay: float):
+        """Send a command scheduled at an ASN COMMAND_MAX_ATTEMPTS times.
+
+        The devices don't answer before the ASN, they run the command once.
+        The ASN is one delay after the last attempt.
+        """
+        for attempt in range(COMMAND_MAX_ATTEMPTS):
+            if attempt:
+                time.sleep(delay)
+            send()
+        self._wait_until(done, 2 * delay)
+
+    def _repeat_command(self, send, done, devices: list[str]):
+        """Send a command until done, at most COMMAND_MAX_ATTEMPTS times.
+
+        Each attempt waits for the timeout estimated from the previous
+        answers to the commands sent to the same devices.
+        """
+        target = ",".join(sorted(devices)) or addr_to_hex(BROADCAST_ADDRESS)
+        rtt = self.command_rtt.setdefault(
+            target, RttEstimator(COMMAND_ATTEMPT_DELAY)
+        )
+        attempts = 0
+        while attempts < COMMAND_MAX_ATTEMPTS and not done():
+            sent_at = time.monotonic()
+            send()
+            attempts += 1
+            if not self._wait_until(done, rtt.rto):
+                rtt.timed_out()
+            elif attempts == 1:
+                rtt.add_sample(time.monotonic() - sent_at)
+
+    def _ota_rtt(
+        self, payload_type: PayloadType, device_addr: str, targets
+    ) -> RttEstimator:
+        """Return the ack delay estimator of the OTA frames to device_addr.
+
+        Chunks are acked in groups, later than starts, each frame type has
+        its own estimator. Before the first ack, the timeout is the one of
+        the links of the targeted devices.
+        """
+        rtt = self.ota_rtt.setdefault(
+            (payload_type, device_addr), RttEstimator(0)
+        )
+        rtt.initial = self._ota_timeout(targets)
+        return rtt
+
+    def start(
+        self, devices=None, timeout=COMMAND_TIMEOUT, synchronized=False
+    ):
+        """Start the application.
+
+        Synchronized starts happen at the same Mari ASN on all the devices.
+        """
         if devices is None:
             devices = self.settings.devices or []
         ready_devices = self.ready_devices
-        attempts = 0
-        while attempts < COMMAND_MAX_ATTEMPTS and not all(
-            self.status_data[addr].status == StatusType.Running
-            for addr in ready_devices
-        ):
+        asn, delay = self._schedule_asn() if synchronized else (0, 0)
+
+        def started():
+            return all(
+                self.status_data[addr].status == StatusType.Running
+                for addr in ready_devices
+            )
+
+        def send():
             if not devices:
-                self._send_start(addr_to_hex(BROADCAST_ADDRESS))
+                self._send_start(addr_to_hex(BROADCAST_ADDRESS), asn)
             else:
                 for device_addr in devices:
                     if device_addr not in ready_devices:
                         continue
-                    self._send_start(device_addr)
-            attempts += 1
-            time.sleep(COMMAND_ATTEMPT_DELAY)
+                    self._send_start(device_addr, asn)
+
+        if asn:
+            self._repeat_until_asn(send, started, delay)
+        else:
+            self._repeat_command(send, started, devices)
         self._live_status(timeout, devices=ready_devices, message="to start")
 
-    def stop(self, devices=None, timeout=COMMAND_TIMEOUT):
-        """Stop the application."""
+    def idle(self, enable=True, devices=None, timeout=COMMAND_TIMEOUT):
+        """Park the ready devices in idle mode, or wake up the idle ones."""
         if devices is None:
             devices = self.settings.devices or []
-        stoppable_devices = self.running_devices + self.resetting_devices
+        target_devices = self.ready_devices if enable else self.idle_devices
+        expected = StatusType.Idle if enable else StatusType.Bootloader
+        payload = PayloadIdle(enable=int(enable))
+
+        def switched():
+            return all(
+                self.status_data[addr].status == expected
+                for addr in target_devices
+            )
 
-        attempts = 0
-        while attempts < COMMAND_MAX_ATTEMPTS and not all(
-            self.status_data[addr].status
-            in [StatusType.Stopping, StatusType.Bootloader]
-            for addr in stoppable_devices
-        ):
+        def send():
             if not devices:
-                self.send_payload(BROADCAST_ADDRESS, PayloadStop())
+                self.send_payload(BROADCAST_ADDRESS, payload)
             else:
                 for device_addr in devices:
-                    if (
-                        device_addr not in stoppable_devices
-                        or self.status_data[device_addr].status
-                        in [StatusType.Stopping, StatusType.Bootloader]
+                    if device_addr not in target_devices:
+                        continue
+                    self.send_payload(int(device_addr, 16), payload)
+
+        self._repeat_command(send, switched, devices)
+        self._live_status(
+            timeout,
+            devices=target_devices,
+            message="to idle" if enable else "to wake up",
+        )
+
+    def stop(
+        self, devices=None, timeout=COMMAND_TIMEOUT, synchronized=False
+    ):
+        """Stop the application.
+
+        Synchronized stops happen at the same Mari ASN on all the devices.
+        """
+        if devices is None:
+            devices = self.settings.devices or []
+        stoppable_devices = self.running_devices + self.resetting_devices
+        asn, delay = self._schedule_asn() if synchronized else (0, 0)
+
+        def stopped():
+            return all(
+                self.status_data[addr].status
+                in [StatusType.Stopping, StatusType.Bootloader]
+                for addr in stoppable_devices
+            )
+
+        def send():
+            if not devices:
+                self.send_payload(BROADCAST_ADDRESS, PayloadStop(asn=asn))
+            else:
+                for device_addr in devices:
+                    if (
+                        device_addr not in stoppable_devices
+                        or self.status_data[device_addr].status
+                        in [StatusType.Stopping, StatusType.Bootloader]
                     ):
                         continue
-                    self.send_payload(int(device_addr, 16), PayloadStop())
-            attempts += 1
-            time.sleep(COMMAND_ATTEMPT_DELAY)
+                    self.send_payload(
+                        int(device_addr, 16), PayloadStop(asn=asn)
+                    )
+
+        if asn:
+            self._repeat_until_asn(send, stopped, delay)
+        else:
+            self._repeat_command(send, stopped, devices)
         self._live_status(
             timeout, devices=stoppable_devices, message="to stop"
         )
@@ -494,9 +1483,8 @@ class Controller:
     ):
         """Monitor the testbed."""
         self.logger.info("Monitoring testbed")
-        while timeout > 0 or run_forever:
-            time.sleep(0.01)
-            timeout -= 0.01
+        # Frames are logged from the adapter thread, until terminate
+        self._stop_event.wait(None if run_forever else timeout)
 
     def _send_message(self, device_addr: int, message: str):
         payload = PayloadMessage(
@@ -516,195 +1504,1237 @@ class Controller:
                     continue
                 self._send_message(int(addr, 16), message)
 
+    def stream_positions(
+        self,
+        period_ms: int = POSITION_STREAM_PERIOD_DEFAULT,
+        batch: int = POSITION_STREAM_BATCH_DEFAULT,
+    ):
+        """Stream the device positions, a period of 0 stops the stream."""
+        payload = PayloadPositionStream(period_ms=period_ms, batch=batch)
+        if not self.settings.devices:
+            self.send_payload(BROADCAST_ADDRESS, payload)
+        else:
+            for addr in self.settings.devices:
+                self.send_payload(int(addr, 16), payload)
+
+    def set_groups(self, groups: list[int]):
+        """Set the groups of the devices, stored on the devices.
+
+        Without devices selected, all the devices, or all the devices of
+        the selected group, get the same groups.
+        """
+        if any(not 0 <= group < GROUP_COUNT for group in groups):
+            raise ValueError(f"Invalid group, maximum is {GROUP_COUNT - 1}")
+        payload = PayloadGroupSet(groups=sum(1 << group for group in groups))
+        if not self.settings.devices:
+            self.send_payload(BROADCAST_ADDRESS, payload)
+        else:
+            for addr in self.settings.devices:
+                self.send_payload(int(addr, 16), payload)
+
+    def profile(
+        self, timeout=COMMAND_TIMEOUT
+    ) -> dict[str, list[ProfileCounter]]:
+        """Fetch the profiling counters of the selected devices."""
+        devices = [
+            device_addr
+            for device_addr, node in self.known_devices.items()
+            if self._is_selected(device_addr, node)
+        ]
+        for device_addr in devices:
+            self.profiles.pop(device_addr, None)
+
+        def received():
+            return all(device_addr in self.profiles for device_addr in devices)
+
+        deadline = time.monotonic() + timeout
+        attempts = 0
+        while (
+            attempts < COMMAND_MAX_ATTEMPTS
+            and not received()
+            and time.monotonic() < deadline
+        ):
+            if not self.settings.devices:
+                self.send_payload(BROADCAST_ADDRESS, PayloadProfile())
+            else:
+                for device_addr in devices:
+                    if device_addr not in self.profiles:
+                        self.send_payload(
+                            int(device_addr, 16), PayloadProfile()
+                        )
+            attempts += 1
+            self._wait_until(received, COMMAND_ATTEMPT_DELAY)
+        return {
+            device_addr: self.profiles[device_addr]
+            for device_addr in devices
+            if device_addr in self.profiles
+        }
+
+    def installed_images(
+        self, devices: list[str]
+    ) -> dict[str, InstalledImage]:
+        """Fetch the images installed on the devices.
+
+        Devices not answering, or not knowing their image, are left out.
+        """
+        for device_addr in devices:
+            self.images.pop(device_addr, None)
+
+        def received():
+            return all(device_addr in self.images for device_addr in devices)
+
+        def send():
+            if not self.settings.devices:
+                self.send_payload(BROADCAST_ADDRESS, PayloadImage())
+            else:
+                for device_addr in devices:
+                    if device_addr not in self.images:
+                        self.send_payload(int(device_addr, 16), PayloadImage())
+
+        self._repeat_command(send, received, self.settings.devices)
+        return {
+            device_addr: self.images[device_addr]
+            for device_addr in devices
+            if device_addr in self.images and self.images[device_addr].size
+        }
+
+    def offered_uploads(self, devices: list[str]) -> dict[str, UploadInfo]:
+        """Fetch the regions the user images of the devices offered.
+
+        Devices not answering, or not offering anything, are left out.
+        """
+        for device_addr in devices:
+            self.upload_infos.pop(device_addr, None)
+
+        def received():
+            return all(
+                device_addr in self.upload_infos for device_addr in devices
+            )
+
+        def send():
+            if not self.settings.devices:
+                self.send_payload(BROADCAST_ADDRESS, PayloadUpload())
+            else:
+                for device_addr in devices:
+                    if device_addr not in self.upload_infos:
+                        self.send_payload(
+                            int(device_addr, 16), PayloadUpload()
+                        )
+
+        self._repeat_command(send, received, self.settings.devices)
+        return {
+            device_addr: self.upload_infos[device_addr]
+            for device_addr in devices
+            if device_addr in self.upload_infos
+            and self.upload_infos[device_addr].size
+        }
+
+    def upload(self) -> dict[str, bytes]:
+        """Fetch the regions offered by the selected devices.
+
+        The devices send the chunks they are asked for, each round asks
+        each device for the first UPLOAD_WINDOW_MAX chunks still missing,
+        the chunks received act as the acks of the request. A device is
+        given up after the OTA retries of its link without receiving any
+        of its chunks, or when the region received doesn't match the CRC
+        offered, for instance when the user image offered a new region in
+        the meantime.
+        """
+        devices = [
+            device_addr
+            for device_addr, node in self.known_devices.items()
+            if self._is_selected(device_addr, node)
+        ]
+        infos = self.offered_uploads(devices)
+        for device_addr in infos:
+            self._upload_chunks[device_addr] = {}
+        retries = dict.fromkeys(infos, 0)
+        max_retries = {
+            device_addr: self._ota_retries([device_addr])
+            for device_addr in infos
+        }
+        rtts = {
+            device_addr: self._ota_rtt(
+                PayloadType.SWARMIT_UPLOAD_REQUEST, device_addr, [device_addr]
+            )
+            for device_addr in infos
+        }
+        pending = list(infos)
+        while pending:
+            requested: dict[str, set[int]] = {}
+            received_before = {}
+            for device_addr in pending:
+                chunks = self._upload_chunks[device_addr]
+                count = infos[device_addr].chunk_count
+                first = next(i for i in range(count) if i not in chunks)
+                window = range(first, min(count, first + UPLOAD_WINDOW_MAX))
+                requested[device_addr] = {
+                    index for index in window if index not in chunks
+                }
+                received_before[device_addr] = len(chunks)
+                self.send_payload(
+                    int(device_addr, 16),
+                    PayloadUploadRequest(
+                        session=infos[device_addr].session,
+                        first=first,
+                        bitmap=sum(
+                            1 << (index - first)
+                            for index in requested[device_addr]
+                        ),
+                    ),
+                )
+            sent_at = time.monotonic()
+
+            def received():
+                return all(
+                    indexes <= self._upload_chunks[device_addr].keys()
+                    for device_addr, indexes in requested.items()
+                )
+
+            if self._wait_until(
+                received, max(rtts[addr].rto for addr in pending)
+            ):
+                for device_addr in pending:
+                    rtts[device_addr].add_sample(time.monotonic() - sent_at)
+            for device_addr in list(pending):
+                chunks = self._upload_chunks[device_addr]
+                if len(chunks) == infos[device_addr].chunk_count:
+                    pending.remove(device_addr)
+                    continue
+                if requested[device_addr] <= chunks.keys():
+                    continue
+                rtts[device_addr].timed_out()
+                if len(chunks) > received_before[device_addr]:
+                    retries[device_addr] = 0
+                    continue
+                retries[device_addr] += 1
+                if retries[device_addr] > max_retries[device_addr]:
+                    self.logger.warning(
+                        "UPLOAD given up",
+                        device_addr=device_addr,
+                        received=len(chunks),
+                        chunks=infos[device_addr].chunk_count,
+                    )
+                    pending.remove(device_addr)
+        uploads = {}
+        for device_addr, info in infos.items():
+            chunks = self._upload_chunks.pop(device_addr)
+            if len(chunks) < info.chunk_count:
+                continue
+            data = b"".join(chunks[index] for index in range(len(chunks)))
+            if len(data) != info.size or zlib.crc32(data) != info.crc:
+                self.logger.warning(
+                    "UPLOAD CRC mismatch", device_addr=device_addr
+                )
+                continue
+            uploads[device_addr] = data
+        return uploads
+
+    def probe_links(
+        self, count: int = LINK_PROBE_COUNT_DEFAULT
+    ) -> dict[str, LinkStats]:
+        """Measure the radio links of the selected devices with probes.
+
+        Each round sends a metrics probe to each device and waits for the
+        answers, the probes not answered within LINK_PROBE_TIMEOUT are lost.
+        The statistics add up over the sweeps and tune the OTA timeouts and
+        retries of each device.
+        """
+        devices = [
+            device_addr
+            for device_addr, node in self.known_devices.items()
+            if self._is_selected(device_addr, node)
+        ]
+        for _ in range(count):
+            for device_addr in devices:
+                link = self.links.setdefault(device_addr, LinkStats())
+                link.probes_sent += 1
+                self._probe_sent[device_addr] = time.monotonic()
+                self.send_payload(int(device_addr, 16), MetricsProbePayload())
+            self._wait_until(lambda: not self._probe_sent, LINK_PROBE_TIMEOUT)
+            self._probe_sent.clear()
+        return {addr: self.links[addr] for addr in devices}
+
+    def _ota_timeout(self, devices) -> float:
+        """Return the ack timeout of the slowest of the devices."""
+        return max(
+            (
+                self.links.get(addr, LinkStats()).ota_timeout(
+                    self.settings.ota_timeout
+                )
+                for addr in devices
+            ),
+            default=self.settings.ota_timeout,
+        )
+
+    def _ota_retries(self, devices) -> int:
+        """Return the retry budget of the weakest of the devices."""
+        return max(
+            (
+                self.links.get(addr, LinkStats()).ota_retries(
+                    self.settings.ota_max_retries
+                )
+                for addr in devices
+            ),
+            default=self.settings.ota_max_retries,
+        )
+
+    def _trace_payload(self) -> PayloadTrace:
+        self._trace_id = (self._trace_id + 1) % (1 << 32)
+        self._trace_sent[self._trace_id] = time.monotonic()
+        return PayloadTrace(id=self._trace_id)
+
+    def trace(
+        self,
+        count: int = TRACE_COUNT_DEFAULT,
+        interval: float = TRACE_INTERVAL_DEFAULT,
+    ) -> dict[str, list[TraceSample]]:
+        """Send traced packets to the selected devices, return the samples.
+
+        Running devices hand the packets to the user image, the time spent
+        there is zero for the other devices.
+        """
+        devices = [
+            device_addr
+            for device_addr, node in self.known_devices.items()
+            if self._is_selected(device_addr, node)
+        ]
+        for device_addr in devices:
+            self.traces.pop(device_addr, None)
+        self._trace_sent.clear()
+        for index in range(count):
+            if index:
+                time.sleep(interval)
+            if not self.settings.devices:
+                self.send_payload(BROADCAST_ADDRESS, self._trace_payload())
+            else:
+                # each device gets its own id, the frames wait for a slot
+                for device_addr in devices:
+                    self.send_payload(
+                        int(device_addr, 16), self._trace_payload()
+                    )
+
+        def received():
+            return all(
+                len(self.traces.get(device_addr, [])) >= count
+                for device_addr in devices
+            )
+
+        self._wait_until(received, TRACE_REPLY_TIMEOUT)
+        return {
+            device_addr: self.traces[device_addr]
+            for device_addr in devices
+            if device_addr in self.traces
+        }
+
+    def set_schedule(self, schedule: ScheduleType):
+        """Switch the ready and idle devices to another Mari schedule.
+
+        Devices store the schedule and join again with it, so the gateway
+        must be switched to the same schedule.
+        """
+        payload = PayloadSchedule(schedule_id=schedule.value)
+        if not self.settings.devices:
+            self.send_payload(BROADCAST_ADDRESS, payload)
+        else:
+            for addr in self.settings.devices:
+                self.send_payload(int(addr, 16), payload)
+
     def _send_start_ota(
-        self, device_addr: str, devices_to_flash: set[str], firmware: bytes
+        self,
+        session: OtaSession,
+        device_addr: str,
+        devices_to_flash: set[str],
+        data: bytes,
     ):
         def is_start_ota_acknowledged():
             if int(device_addr, 16) == BROADCAST_ADDRESS:
-                return sorted(self.start_ota_data.addrs) == sorted(
-                    devices_to_flash
+                # Devices not known as ready yet may also answer
+                return set(devices_to_flash) <= set(
+                    session.start_ota_data.addrs
                 )
             else:
-                return device_addr in self.start_ota_data.addrs
+                return device_addr in session.start_ota_data.addrs
 
+        # A device waiting for more chunks than the window holds would only
+        # ack on its flush timer
         payload = PayloadOTAStart(
-            fw_length=len(firmware),
-            fw_chunk_count=len(self.chunks),
+            session=session.id,
+            fw_length=len(data),
+            fw_chunk_count=len(session.chunks),
+            chunk_size=session.start_ota_data.chunk_size,
+            ack_interval=max(
+                1,
+                min(
+                    self.settings.ota_ack_interval,
+                    self.settings.ota_window_size,
+                    0xFF,
+                ),
+            ),
+            mode=session.start_ota_data.mode.value,
+            image_length=session.start_ota_data.image_size,
+            base_length=session.start_ota_data.base_size,
+            base_sha=session.start_ota_data.base_hash[:8].ljust(8, b"\0"),
+            fec_group=session.start_ota_data.fec_group,
         )
-        send_time = time.time()
-        send = True
+        targets = (
+            devices_to_flash
+            if int(device_addr, 16) == BROADCAST_ADDRESS
+            else [device_addr]
+        )
+        max_retries = self._ota_retries(targets)
+        rtt = self._ota_rtt(
+            PayloadType.SWARMIT_OTA_START, device_addr, targets
+        )
+        attempts = 0
         while (
             not is_start_ota_acknowledged()
-            and self.start_ota_data.retries <= self.settings.ota_max_retries
+            and session.start_ota_data.retries <= max_retries
         ):
-            if send is True:
-                self.send_payload(int(device_addr, 16), payload)
-                send_time = time.time()
-                self.start_ota_data.retries += 1
-            time.sleep(0.001)
-            send = time.time() - send_time > self.settings.ota_timeout
-
-    def start_ota(self, firmware, devices=None) -> dict:
-        """Start the OTA process."""
+            sent_at = time.monotonic()
+            self.send_payload(int(device_addr, 16), payload)
+            session.start_ota_data.retries += 1
+            attempts += 1
+            if not self._wait_until(is_start_ota_acknowledged, rtt.rto):
+                rtt.timed_out()
+            elif attempts == 1:
+                rtt.add_sample(time.monotonic() - sent_at)
+
+    def start_ota(
+        self, firmware, devices=None, fw_hash: bytes | None = None
+    ) -> dict:
+        """Start the OTA process.
+
+        Each call starts a new OTA session, the returned session is given to
+        transfer. Sessions to disjoint sets of devices can be transferred at
+        the same time, from different threads. The SHA256 of the firmware
+        is computed when not given, by a caller that hashed it on reception.
+        """
         if devices is None:
             devices = self.settings.devices or []
-        self.start_ota_data = StartOtaData()
-        self.chunks = []
-        digest = hashes.Hash(hashes.SHA256())
-        chunks_count = int(len(firmware) / CHUNK_SIZE) + int(
-            len(firmware) % CHUNK_SIZE != 0
+        max_chunk_size = self.settings.ota_chunk_size
+        if self.settings.group is not None:
+            # The group header takes place in the Mari frame
+            max_chunk_size = min(
+                max_chunk_size,
+                (OTA_CHUNK_SIZE_MAX - GROUP_HEADER_SIZE) & ~3,
+            )
+        if (
+            not OTA_CHUNK_SIZE_MIN <= max_chunk_size <= OTA_CHUNK_SIZE_MAX
+            or max_chunk_size % 4
+        ):
+            raise ValueError(
+                f"Invalid OTA chunk size {max_chunk_size}, must be a multiple "
+                f"of 4 between {OTA_CHUNK_SIZE_MIN} and {OTA_CHUNK_SIZE_MAX}"
+            )
+        if len(firmware) > OTA_IMAGE_SIZE_MAX:
+            # The devices would not acknowledge the start
+            raise ValueError(
+                f"Image of {len(firmware)} bytes doesn't fit in the "
+                f"{OTA_IMAGE_SIZE_MAX} bytes of a flash slot"
+            )
+        if not 0 <= self.settings.ota_fec_group <= FEC_GROUP_MAX:
+            raise ValueError(
+                f"Invalid OTA FEC group {self.settings.ota_fec_group}, must "
+                f"be between 0 and {FEC_GROUP_MAX}"
+            )
+        devices_to_flash = self.ready_devices
+        if fw_hash is None:
+            digest = hashes.Hash(hashes.SHA256())
+            digest.update(firmware)
+            fw_hash = digest.finalize()
+        up_to_date = []
+        if self.settings.ota_skip_installed:
+            up_to_date = sorted(
+                addr
+                for addr, image in self.installed_images(
+                    devices or devices_to_flash
+                ).items()
+                if image.size == len(firmware) and image.sha == fw_hash
+            )
+        if up_to_date:
+            # The other devices are started one by one, the up to date ones
+            # must not receive the start
+            devices = [
+                addr
+                for addr in (devices or devices_to_flash)
+                if addr not in up_to_date
+            ]
+            if not devices:
+                return {
+                    "session": None,
+                    "ota": StartOtaData(
+                        fw_hash=fw_hash, image_size=len(firmware)
+                    ),
+                    "acked": [],
+                    "missed": [],
+                    "up_to_date": up_to_date,
+                }
+        with self._ota_lock:
+            if not devices and self.ota_sessions:
+                # A broadcast start would also restart the devices of the
+                # other sessions
+                devices = devices_to_flash
+            session = OtaSession(
+                id=self._new_ota_session_id(),
+                devices=list(devices or devices_to_flash),
+                broadcast=not devices,
+            )
+            for other in list(self.ota_sessions.values()):
+                other.devices = [
+                    addr
+                    for addr in other.devices
+                    if addr not in session.devices
+                ]
+                if not other.devices and not other.broadcast:
+                    del self.ota_sessions[other.id]
+            self.ota_sessions[session.id] = session
+            self._ota_session = session
+        session.start_ota_data = StartOtaData(
+            chunk_size=max_chunk_size,
+            fw_hash=fw_hash,
+            image_size=len(firmware),
+        )
+        data = firmware
+        base = (
+            self._cached_image(devices or devices_to_flash)
+            if self.settings.ota_delta
+            else None
+        )
+        if base is not None:
+            base_digest = hashes.Hash(hashes.SHA256())
+            base_digest.update(base)
+            base_hash = base_digest.finalize()
+            patch = self._planned_data(
+                fw_hash, OTAMode.Delta, max_chunk_size, base_hash
+            )
+            if patch is None:
+                patch, stats = make_patch(base, firmware)
+                self.logger.info(
+                    "Delta patch computed",
+                    base_size=len(base),
+                    patch_size=stats.size,
+                    copied=stats.copied,
+                    literal=stats.literal,
+                )
+            if len(patch) < len(firmware):
+                session.start_ota_data.mode = OTAMode.Delta
+                session.start_ota_data.base_size = len(base)
+                session.start_ota_data.base_hash = base_hash
+                data = patch
+        if (
+            session.start_ota_data.mode == OTAMode.Raw
+            and self.settings.ota_compress
+        ):
+            compressed = self._planned_data(
+                fw_hash, OTAMode.Compressed, max_chunk_size
+            )
+            if compressed is None:
+                compressed = compress(firmware)
+                self.logger.info(
+                    "Image compressed",
+                    image_size=len(firmware),
+                    compressed_size=len(compressed),
+                )
+            if len(compressed) < len(firmware):
+                session.start_ota_data.mode = OTAMode.Compressed
+                data = compressed
+        self._send_start_ota_to(session, devices, devices_to_flash, data)
+        if session.start_ota_data.mode != OTAMode.Raw and not all(
+            addr in session.start_ota_data.addrs
+            for addr in (devices or devices_to_flash)
+        ):
+            # Devices are not running the cached image or cannot store the
+            # transferred data, send the raw image
+            print(
+                f"{session.start_ota_data.mode.name} update refused, "
+                "sending the full image..."
+            )
+            session.start_ota_data = StartOtaData(
+                chunk_size=max_chunk_size,
+                fw_hash=session.start_ota_data.fw_hash,
+                image_size=len(firmware),
+            )
+            self._send_start_ota_to(
+                session, devices, devices_to_flash, firmware
+            )
+        if (
+            session.start_ota_data.mode == OTAMode.Raw
+            and self.settings.ota_skip_unchanged
+        ):
+            self._send_manifest(session, firmware)
+        return {
+            "session": session.id,
+            "ota": session.start_ota_data,
+            "acked": sorted(session.start_ota_data.addrs),
+            "missed": sorted(
+                set(devices).difference(set(session.start_ota_data.addrs))
+            ),
+            "up_to_date": up_to_date,
+        }
+
+    def _send_start_ota_to(
+        self,
+        session: OtaSession,
+        devices: list[str],
+        devices_to_flash: list[str],
+        data: bytes,
+    ):
+        start_data = session.start_ota_data
+        session.chunks = self.chunk_plans.get(
+            start_data.fw_hash,
+            start_data.mode,
+            start_data.chunk_size,
+            start_data.base_hash,
+        )
+        if session.chunks is None:
+            session.chunks = self._make_chunks(data, start_data.chunk_size)
+            self.chunk_plans.put(
+                start_data.fw_hash,
+                start_data.mode,
+                start_data.chunk_size,
+                session.chunks,
+                start_data.base_hash,
+            )
+        session.start_ota_data.chunks = len(session.chunks)
+        # Repairs only pay off when they reach all the devices at once
+        if not self.settings.devices:
+            session.start_ota_data.fec_group = self.settings.ota_fec_group
+        if not devices:
+            print("Broadcast start ota notification...")
+            self._send_start_ota(
+                session,
+                addr_to_hex(BROADCAST_ADDRESS),
+                devices_to_flash,
+                data,
+            )
+        else:
+            for addr in devices:
+                print(f"Sending start ota notification to {addr}...")
+                self._send_start_ota(session, addr, devices, data)
+                time.sleep(0.2)
+
+    def _planned_data(
+        self,
+        fw_hash: bytes,
+        mode: OTAMode,
+        chunk_size: int,
+        base_hash: bytes = b"",
+    ) -> bytes | None:
+        """Return the data of a cached plan, saves compressing or diffing."""
+        chunks = self.chunk_plans.get(fw_hash, mode, chunk_size, base_hash)
+        if chunks is None:
+            return None
+        self.logger.info(
+            "Chunk plan cached", mode=mode.name, chunks=len(chunks)
+        )
+        return b"".join(chunk.data for chunk in chunks)
+
+    def _new_ota_session_id(self) -> int:
+        """Return an OTA session ID not used by the sessions in progress.
+
+        The first ID is random, two controllers on the same network are
+        unlikely to use the same IDs at the same time.
+        """
+        for _ in range(OTA_SESSION_COUNT):
+            self._ota_session_id = self._ota_session_id % OTA_SESSION_COUNT + 1
+            if self._ota_session_id not in self.ota_sessions:
+                return self._ota_session_id
+        raise RuntimeError("Too many OTA sessions in progress")
+
+    def end_ota(self, session_id: int):
+        """End an OTA session, the acks of its devices are ignored."""
+        with self._ota_lock:
+            self.ota_sessions.pop(session_id, None)
+
+    def _send_manifest(self, session: OtaSession, firmware: bytes):
+        """Send the CRC32 of each image page to the started devices.
+
+        Devices keep the pages they already contain, the chunks only covering
+        kept pages are not sent. The image SHA256 checked at finalize catches
+        a page wrongly kept on a CRC collision.
+        """
+        start_data = session.start_ota_data
+        devices = list(start_data.addrs)
+        pages = [
+            zlib.crc32(firmware[offset : offset + FLASH_PAGE_SIZE])
+            for offset in range(0, len(firmware), FLASH_PAGE_SIZE)
+        ]
+        for first_page in range(0, len(pages), OTA_MANIFEST_PAGES_MAX):
+            crcs = b"".join(
+                crc.to_bytes(4, "little")
+                for crc in pages[first_page:][:OTA_MANIFEST_PAGES_MAX]
+            )
+            payload = PayloadOTAManifest(
+                session=session.id,
+                first_page=first_page,
+                count=len(crcs),
+                crcs=crcs,
+            )
+
+            def pending():
+                return [
+                    addr
+                    for addr in devices
+                    if first_page
+                    not in start_data.manifest_acks.get(addr, ())
+                ]
+
+            retries = 0
+            while pending() and retries <= self._ota_retries(pending()):
+                if not self.settings.devices:
+                    self.send_payload(BROADCAST_ADDRESS, payload)
+                else:
+                    for addr in pending():
+                        self.send_payload(int(addr, 16), payload)
+                retries += 1
+                self._wait_until(
+                    lambda: not pending(), self._ota_timeout(pending())
+                )
+
+        chunk_size = start_data.chunk_size
+        for addr in devices:
+            if set(
+                range(0, len(pages), OTA_MANIFEST_PAGES_MAX)
+            ) - start_data.manifest_acks.get(addr, set()):
+                # the device may not have kept all the pages it reported
+                continue
+            unchanged = start_data.unchanged_pages.get(addr, set())
+            start_data.skipped_chunks[addr] = {
+                chunk.index
+                for chunk in session.chunks
+                if all(
+                    page in unchanged
+                    for page in range(
+                        chunk.index * chunk_size // FLASH_PAGE_SIZE,
+                        (chunk.index * chunk_size + chunk.size - 1)
+                        // FLASH_PAGE_SIZE
+                        + 1,
+                    )
+                )
+            }
+            self.logger.info(
+                "Image manifest acknowledged",
+                device_addr=addr,
+                unchanged_pages=len(unchanged),
+                skipped_chunks=len(start_data.skipped_chunks[addr]),
+            )
+
+    @staticmethod
+    def _make_chunks(data: bytes, max_chunk_size: int) -> list[DataChunk]:
+        chunks = []
+        chunks_count = int(len(data) / max_chunk_size) + int(
+            len(data) % max_chunk_size != 0
         )
         for chunk_idx in range(chunks_count):
             if chunk_idx == chunks_count - 1:
                 chunk_size = (
-                    len(firmware) % CHUNK_SIZE
-                    if len(firmware) % CHUNK_SIZE
-                    else CHUNK_SIZE
+                    len(data) % max_chunk_size
+                    if len(data) % max_chunk_size
+                    else max_chunk_size
                 )
             else:
-                chunk_size = CHUNK_SIZE
-            data = firmware[
-                chunk_idx * CHUNK_SIZE : chunk_idx * CHUNK_SIZE + chunk_size
+                chunk_size = max_chunk_size
+            chunk_data = data[
+                chunk_idx * max_chunk_size : chunk_idx * max_chunk_size
+                + chunk_size
             ]
-            digest.update(data)
-            chunk_sha = hashes.Hash(hashes.SHA256())
-            chunk_sha.update(data)
-            self.chunks.append(
+            chunks.append(
                 DataChunk(
                     index=chunk_idx,
                     size=chunk_size,
-                    sha=chunk_sha.finalize()[
-                        :8
-                    ],  # the first 8 bytes should be enough
-                    data=data,
+                    # the image is verified as a whole at finalize
+                    crc=zlib.crc32(chunk_data),
+                    data=chunk_data,
                 )
             )
-        self.start_ota_data.fw_hash = digest.finalize()
-        self.start_ota_data.chunks = len(self.chunks)
-        devices_to_flash = self.ready_devices
-        if not devices:
-            print("Broadcast start ota notification...")
-            self._send_start_ota(
-                addr_to_hex(BROADCAST_ADDRESS), devices_to_flash, firmware
+        return chunks
+
+    def _cached_image_path(self, device_addr: str) -> str:
+        return os.path.join(
+            self.settings.ota_image_cache, f"{device_addr}.bin"
+        )
+
+    def _cached_image(self, devices: list[str]) -> bytes | None:
+        """Return the image installed on all devices, if they share one."""
+        images = set()
+        for addr in devices:
+            try:
+                with open(self._cached_image_path(addr), "rb") as f:
+                    images.add(f.read())
+            except OSError:
+                return None
+        if len(images) != 1:
+            return None
+        return images.pop()
+
+    def _store_cached_image(self, device_addr: str, firmware: bytes):
+        try:
+            os.makedirs(self.settings.ota_image_cache, exist_ok=True)
+            with open(self._cached_image_path(device_addr), "wb") as f:
+                f.write(firmware)
+        except OSError as exc:
+            self.logger.warning(
+                "Cannot cache image", device_addr=device_addr, error=str(exc)
             )
-        else:
-            for addr in devices:
-                print(f"Sending start ota notification to {addr}...")
-                self._send_start_ota(addr, devices, firmware)
-                time.sleep(0.2)
-        return {
-            "ota": self.start_ota_data,
-            "acked": sorted(self.start_ota_data.addrs),
-            "missed": sorted(
-                set(devices).difference(set(self.start_ota_data.addrs))
-            ),
-        }
+
+    @staticmethod
+    def _is_chunk_acknowledged(
+        session: OtaSession,
+        index: int,
+        device_addr: str,
+        devices_to_flash: set[str],
+    ) -> bool:
+        transfer_data = session.transfer_data
+        if int(device_addr, 16) == BROADCAST_ADDRESS:
+            return sorted(transfer_data.keys()) == sorted(
+                devices_to_flash
+            ) and all(
+                [
+                    status.chunks[index].acked
+                    for status in transfer_data.values()
+                ]
+            )
+        return (
+            device_addr in transfer_data.keys()
+            and transfer_data[device_addr].chunks[index].acked
+        )
 
     def send_chunk(
         self,
+        session: OtaSession,
         chunk: DataChunk,
         device_addr: str,
         devices_to_flash: set[str],
+        retries: int = 0,
     ):
-        def is_chunk_acknowledged():
-            if int(device_addr, 16) == BROADCAST_ADDRESS:
-                return sorted(self.transfer_data.keys()) == sorted(
-                    devices_to_flash
-                ) and all(
-                    [
-                        status.chunks[chunk.index].acked
-                        for status in self.transfer_data.values()
-                    ]
-                )
-            else:
-                return (
-                    device_addr in self.transfer_data.keys()
-                    and self.transfer_data[device_addr]
-                    .chunks[chunk.index]
-                    .acked
-                )
-
+        """Send a single chunk, without waiting for its acknowledgment."""
         payload = PayloadOTAChunk(
+            session=session.id,
             index=chunk.index,
             count=chunk.size,
-            sha=chunk.sha,
+            crc=chunk.crc,
             chunk=chunk.data,
         )
-        send_time = time.time()
-        send = True
-        retries_count = 0
-        while (
-            not is_chunk_acknowledged()
-            and retries_count <= self.settings.ota_max_retries
+        self.send_payload(int(device_addr, 16), payload)
+        transfer_data = session.transfer_data
+        if self.settings.verbose:
+            missing_acks = [
+                addr
+                for addr in devices_to_flash
+                if addr not in transfer_data
+                or not transfer_data[addr].chunks[chunk.index].acked
+            ]
+            print(
+                f"Transferring chunk {chunk.index + 1}/{session.start_ota_data.chunks} to {device_addr} "
+                f"- {retries} retries "
+                f"- {len(missing_acks)} missing acks: {', '.join(missing_acks) if missing_acks else 'none'}"
+            )
+        if int(device_addr, 16) == BROADCAST_ADDRESS:
+            for addr in devices_to_flash:
+                transfer_data[addr].chunks[chunk.index].retries = retries
+        else:
+            transfer_data[device_addr].chunks[chunk.index].retries = retries
+
+    @staticmethod
+    def _is_chunk_settled(
+        session: OtaSession, index: int, devices_to_flash: set[str]
+    ) -> bool:
+        """Return whether all devices acked the chunk or a later one.
+
+        Devices ack all the chunks they received, a chunk missing before a
+        later acked one was lost.
+        """
+        transfer_data = session.transfer_data
+        return all(
+            addr in transfer_data
+            and (
+                transfer_data[addr].chunks[index].acked
+                or transfer_data[addr].acked_max > index
+            )
+            for addr in devices_to_flash
+        )
+
+    def send_chunks(
+        self,
+        session: OtaSession,
+        device_addr: str,
+        devices_to_flash: set[str],
+        progress: tqdm = None,
+    ):
+        """Send all chunks, keeping up to ota_window_size chunks in flight.
+
+        Only the chunks that are not acknowledged after the ack timeout are
+        sent again, the others leave the window as soon as they are acked.
+        The timeout follows the delays of the acks of each device, and
+        backs off when chunks are lost. Probed devices get the retries of
+        their links, the weakest device sets them for broadcast chunks.
+        Broadcast chunks of a transfer with a FEC group are first sent
+        once and followed by repair chunks, see _send_fec.
+        """
+        targets = (
+            devices_to_flash
+            if int(device_addr, 16) == BROADCAST_ADDRESS
+            else [device_addr]
+        )
+        rtt = self._ota_rtt(
+            PayloadType.SWARMIT_OTA_CHUNK, device_addr, targets
+        )
+        max_retries = self._ota_retries(targets)
+        session.chunk_sent_at[device_addr] = {}
+        session.chunk_rtt[device_addr] = rtt
+        chunks = session.chunks
+        if (
+            session.start_ota_data.fec_group
+            and int(device_addr, 16) == BROADCAST_ADDRESS
         ):
-            if send is True:
-                self.send_payload(int(device_addr, 16), payload)
-                if self.settings.verbose:
-                    missing_acks = [
-                        addr
-                        for addr in devices_to_flash
-                        if addr not in self.transfer_data
-                        or not self.transfer_data[addr]
-                        .chunks[chunk.index]
-                        .acked
-                    ]
-                    print(
-                        f"Transferring chunk {chunk.index + 1}/{self.start_ota_data.chunks} to {device_addr} "
-                        f"- {retries_count} retries "
-                        f"- {len(missing_acks)} missing acks: {', '.join(missing_acks) if missing_acks else 'none'}"
-                    )
-                if int(device_addr, 16) == BROADCAST_ADDRESS:
-                    for addr in devices_to_flash:
-                        self.transfer_data[addr].chunks[
-                            chunk.index
-                        ].retries = retries_count
+            chunks = self._send_fec(
+                session, device_addr, devices_to_flash, rtt, progress
+            )
+        lost = self._send_window(
+            session,
+            device_addr,
+            devices_to_flash,
+            chunks,
+            rtt,
+            max_retries,
+            progress,
+        )
+        if progress is not None:
+            progress.update(
+                sum(session.chunks[index].size for index in lost)
+            )
+
+    def _send_window(
+        self,
+        session: OtaSession,
+        device_addr: str,
+        devices_to_flash: set[str],
+        chunks: list[DataChunk],
+        rtt: RttEstimator,
+        max_retries: int,
+        progress: tqdm = None,
+        on_left=None,
+    ) -> list[int]:
+        """Send the chunks, keeping up to ota_window_size chunks in flight.
+
+        Return the chunks given up after max_retries timeouts. With
+        on_left, the chunks lost by some devices leave the window once
+        settled, and on_left is called with each chunk leaving the window.
+        """
+        pending = collections.deque(chunks)
+        in_flight: dict[int, float] = {}  # chunk index -> last send time
+        retries: dict[int, int] = {}
+        lost = []
+        chunk_sent_at = session.chunk_sent_at[device_addr]
+        window_size = max(1, self.settings.ota_window_size)
+        backed_off_at = 0.0
+        while pending or in_flight:
+            # Acks received from now on end the wait below
+            frame_count = self._frame_count
+            # Chunks the devices already have are acked before being sent
+            while pending and self._is_chunk_acknowledged(
+                session, pending[0].index, device_addr, devices_to_flash
+            ):
+                pending.popleft()
+            now = time.time()
+            ota_timeout = rtt.rto
+            for index, sent_at in list(in_flight.items()):
+                expired = now - sent_at > ota_timeout
+                if expired:
+                    # Acks received by the gateway and not handled yet are
+                    # not timeouts
+                    self.interface.flush()
+                if self._is_chunk_acknowledged(
+                    session, index, device_addr, devices_to_flash
+                ):
+                    del in_flight[index]
+                    if progress is not None:
+                        progress.update(session.chunks[index].size)
+                elif on_left is not None and self._is_chunk_settled(
+                    session, index, devices_to_flash
+                ):
+                    del in_flight[index]
+                    lost.append(index)
+                elif expired:
+                    # Chunks sent before the latest backoff waited less
+                    if sent_at >= backed_off_at:
+                        rtt.timed_out()
+                        backed_off_at = now
+                    if retries[index] >= max_retries:
+                        del in_flight[index]
+                        lost.append(index)
+                    else:
+                        retries[index] += 1
+                        chunk_sent_at.pop(index, None)
+                        self.send_chunk(
+                            session,
+                            session.chunks[index],
+                            device_addr,
+                            devices_to_flash,
+                            retries[index],
+                        )
+                        in_flight[index] = time.time()
+                        continue
                 else:
-                    self.transfer_data[device_addr].chunks[
-                        chunk.index
-                    ].retries = retries_count
-                send_time = time.time()
-                retries_count += 1
-            time.sleep(0.001)
-            send = time.time() - send_time > self.settings.ota_timeout
-
-    def transfer(self, firmware, devices) -> dict[str, TransferDataStatus]:
-        """Transfer the firmware to the devices."""
-        data_size = len(firmware)
+                    continue
+                if on_left is not None:
+                    on_left(index)
+            while pending and len(in_flight) < window_size:
+                chunk = pending.popleft()
+                retries[chunk.index] = 0
+                self.send_chunk(session, chunk, device_addr, devices_to_flash)
+                in_flight[chunk.index] = time.time()
+                chunk_sent_at[chunk.index] = in_flight[chunk.index]
+            if in_flight:
+                # Until an ack or the first chunk to send again
+                timeout = min(in_flight.values()) + rtt.rto - time.time()
+                self._wait_for_frame(frame_count, max(0, timeout))
+        return lost
+
+    def _send_fec(
+        self,
+        session: OtaSession,
+        device_addr: str,
+        devices_to_flash: set[str],
+        rtt: RttEstimator,
+        progress: tqdm = None,
+    ) -> list[DataChunk]:
+        """Send the chunks once and the repairs they need.
+
+        The repairs of a group are sent as soon as its chunks left the
+        window, the devices only buffer the repairs of one group. Each
+        round then sends the groups still missing chunks more repairs,
+        until the devices run out of them. Return the chunks still missing,
+        they are sent again.
+        """
+        group_size = session.start_ota_data.fec_group
+        group_count = math.ceil(len(session.chunks) / group_size)
+        repairs_sent = [0] * group_count
+        left = [0] * group_count
+
+        def on_left(index: int):
+            group = index // group_size
+            left[group] += 1
+            first = group * group_size
+            if left[group] == min(group_size, len(session.chunks) - first):
+                self._send_repairs(
+                    session, device_addr, devices_to_flash, group, repairs_sent
+                )
+
+        lost = self._send_window(
+            session,
+            device_addr,
+            devices_to_flash,
+            session.chunks,
+            rtt,
+            0,
+            progress,
+            on_left,
+        )
+
+        def missing() -> list[int]:
+            return [
+                index
+                for index in lost
+                if not self._is_chunk_acknowledged(
+                    session, index, device_addr, devices_to_flash
+                )
+            ]
+
+        while missing():
+            self.interface.flush()
+            groups = sorted({index // group_size for index in missing()})
+            sent = sum(
+                self._send_repairs(
+                    session, device_addr, devices_to_flash, group, repairs_sent
+                )
+                for group in groups
+            )
+            if not sent:
+                break
+            self._wait_until(lambda: not missing(), rtt.rto)
+        remaining = missing()
+        if progress is not None:
+            progress.update(
+                sum(
+                    session.chunks[index].size
+                    for index in lost
+                    if index not in remaining
+                )
+            )
+        return [session.chunks[index] for index in remaining]
+
+    def _send_repairs(
+        self,
+        session: OtaSession,
+        device_addr: str,
+        devices_to_flash: set[str],
+        group: int,
+        repairs_sent: list[int],
+    ) -> int:
+        """Send as many new repairs of a group as the worst device needs.
+
+        Return the number of repairs sent, the repairs of each group are
+        counted in repairs_sent.
+        """
+        group_size = session.start_ota_data.fec_group
+        chunks = session.chunks[group * group_size :][:group_size]
+        transfer_data = session.transfer_data
+        needed = max(
+            (
+                sum(
+                    addr not in transfer_data
+                    or not transfer_data[addr].chunks[chunk.index].acked
+                    for chunk in chunks
+                )
+                for addr in devices_to_flash
+            ),
+            default=0,
+        )
+        count = min(needed, FEC_REPAIRS_MAX - repairs_sent[group])
+        size = session.start_ota_data.chunk_size
+        data = [chunk.data for chunk in chunks]
+        for repair in range(repairs_sent[group], repairs_sent[group] + count):
+            repair_data = repair_chunk(data, repair, size)
+            payload = PayloadOTAChunk(
+                session=session.id,
+                index=repair_index(len(session.chunks), group, repair),
+                count=size,
+                crc=zlib.crc32(repair_data),
+                chunk=repair_data,
+            )
+            self.send_payload(int(device_addr, 16), payload)
+        repairs_sent[group] += count
+        if self.settings.verbose and count:
+            print(
+                f"Transferring {count} repairs of chunks "
+                f"{chunks[0].index + 1}-{chunks[-1].index + 1} "
+                f"to {device_addr}"
+            )
+        return count
+
+    def finalize_ota(self, session: OtaSession, devices: list[str]):
+        """Ask the devices for the SHA256 of the image they received.
+
+        The devices hash the image while it is written, so they only send
+        back the digest, which is compared with the one of the firmware.
+        """
+        if not devices:
+            return
+        transfer_data = session.transfer_data
+        payload = PayloadOTAFinalize(
+            session=session.id, sha=session.start_ota_data.fw_hash
+        )
+
+        def pending():
+            return [addr for addr in devices if not transfer_data[addr].hash]
+
+        retries = 0
+        while pending() and retries <= self._ota_retries(pending()):
+            if not self.settings.devices:
+                self.send_payload(BROADCAST_ADDRESS, payload)
+            else:
+                for addr in pending():
+                    self.send_payload(int(addr, 16), payload)
+            retries += 1
+            self._wait_until(
+                lambda: not pending(), self._ota_timeout(pending())
+            )
+        for addr in devices:
+            if not transfer_data[addr].verified:
+                self.logger.warning(
+                    "Image verification failed",
+                    device_addr=addr,
+                    hash=transfer_data[addr].hash.hex(),
+                )
+
+    def transfer(
+        self, firmware, devices, session: int | None = None
+    ) -> dict[str, TransferDataStatus]:
+        """Transfer the firmware to the devices.
+
+        The session is the one returned by start_ota, the latest started one
+        by default. It ends with the transfer.
+        """
+        with self._ota_lock:
+            ota_session = (
+                self._ota_session
+                if session is None
+                else self.ota_sessions.get(session)
+            )
+        if ota_session is None:
+            # All the devices were started again by another session
+            raise ValueError(f"OTA session {session} is not in progress")
+        try:
+            return self._transfer(ota_session, firmware, devices)
+        finally:
+            self.end_ota(ota_session.id)
+
+    def _transfer(
+        self, session: OtaSession, firmware, devices
+    ) -> dict[str, TransferDataStatus]:
+        data_size = sum(chunk.size for chunk in session.chunks)
+        skipped = session.start_ota_data.skipped_chunks
+        # Broadcast chunks are only skipped when no device needs them
+        targets = [skipped.get(addr, set()) for addr in devices]
+        if not self.settings.devices and targets:
+            targets = [set.intersection(*targets)]
+        send_size = sum(
+            chunk.size
+            for chunks in targets
+            for chunk in session.chunks
+            if chunk.index not in chunks
+        )
         use_progress_bar = not self.settings.verbose
+        progress = None
         if use_progress_bar:
             progress = tqdm(
-                range(0, data_size),
+                range(0, send_size),
                 unit="B",
                 unit_scale=False,
                 colour="green",
                 ncols=100,
             )
-            progress.set_description(
-                f"Loading firmware ({int(data_size / 1024)}kB)"
-            )
-        self.transfer_data = {}
+            description = f"Loading firmware ({int(data_size / 1024)}kB"
+            if session.start_ota_data.mode == OTAMode.Compressed:
+                image_size = session.start_ota_data.image_size
+                description += f" for {int(image_size / 1024)}kB"
+            progress.set_description(f"{description})")
+        transfer_data = {}
         for _addr in devices:
-            self.transfer_data[_addr] = TransferDataStatus()
-            self.transfer_data[_addr].chunks = [
-                Chunk(index=f"{i:03d}", size=f"{self.chunks[i].size:03d}B")
-                for i in range(len(self.chunks))
-            ]
-        for chunk in self.chunks:
-            if not self.settings.devices:
-                self.send_chunk(
-                    chunk,
-                    addr_to_hex(BROADCAST_ADDRESS),
-                    devices,
+            transfer_data[_addr] = TransferDataStatus()
+            transfer_data[_addr].chunks = [
+                Chunk(
+                    index=f"{i:03d}",
+                    size=f"{session.chunks[i].size:03d}B",
+                    acked=int(i in skipped.get(_addr, set())),
                 )
-            else:
-                for _addr in devices:
-                    self.send_chunk(chunk, _addr, devices)
-            if use_progress_bar:
-                progress.update(chunk.size)
+                for i in range(len(session.chunks))
+            ]
+        session.transfer_data = transfer_data
+        if not self.settings.devices:
+            self.send_chunks(
+                session, addr_to_hex(BROADCAST_ADDRESS), devices, progress
+            )
+        else:
+            # One pipeline per device, taking turns on the send lock, a slow
+            # or lossy device doesn't hold the others up
+            with concurrent.futures.ThreadPoolExecutor(
+                max_workers=OTA_UNICAST_PIPELINES_MAX
+            ) as executor:
+                pipelines = [
+                    executor.submit(
+                        self.send_chunks, session, _addr, devices, progress
+                    )
+                    for _addr in devices
+                ]
+                for pipeline in pipelines:
+                    pipeline.result()
         if self.settings.verbose:
             retries_count = sum(
-                self.transfer_data[_addr].chunks[_chunk].retries
-                for _chunk in range(len(self.chunks))
+                transfer_data[_addr].chunks[_chunk].retries
+                for _chunk in range(len(session.chunks))
                 for _addr in devices
             )
             if not self.settings.devices:
@@ -712,11 +2742,46 @@ class Controller:
             print(f"Transfer completed with {retries_count} retries")
         if use_progress_bar:
             progress.close()
+        self.finalize_ota(
+            session,
+            [
+                device
+                for device in devices
+                if device in transfer_data
+                and all(chunk.acked for chunk in transfer_data[device].chunks)
+            ],
+        )
         for device in devices:
-            device_data = self.transfer_data.get(device)
+            device_data = transfer_data.get(device)
             if device_data:
-                device_data.success = all(
+                device_data.success = device_data.verified and all(
                     chunk.acked for chunk in device_data.chunks
                 )
-                self.transfer_data[device] = device_data
-        return self.transfer_data
+                transfer_data[device] = device_data
+                if device_data.success and self.settings.ota_delta:
+                    self._store_cached_image(device, firmware)
+        self._wait_installed(
+            [
+                device
+                for device in devices
+                if device in transfer_data and transfer_data[device].success
+            ]
+        )
+        return transfer_data
+
+    def _wait_installed(self, devices: list[str]):
+        """Wait for the devices to install the image they verified.
+
+        The devices copy the image to the active slot and report programming
+        meanwhile, they refuse the starts until they are ready again.
+        """
+
+        def installing() -> list[str]:
+            return [addr for addr in devices if addr in self._installing]
+
+        if installing():
+            print("Waiting for the devices to install the image...")
+        self._wait_until(lambda: not installing(), OTA_INSTALL_TIMEOUT)
+        for addr in installing():
+            self._installing.discard(addr)
+            self.logger.warning("Image installation timeout", device_addr=addr)
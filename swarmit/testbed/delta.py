@@ -0,0 +1,136 @@
+"""Module containing the delta firmware patch encoder."""
+
+import bisect
+from dataclasses import dataclass
+
+DELTA_OP_COPY = 0x00  # copy bytes from the installed image
+DELTA_OP_DATA = 0x01  # literal bytes following the operation header
+DELTA_OP_HEADER_SIZE = 7  # op (1B) + length (2B) + source offset (4B)
+DELTA_BLOCK_SIZE = 16  # minimum length of a copy operation
+DELTA_MAX_OP_LENGTH = 0xFFFF
+DELTA_MAX_CANDIDATES = 32  # matches examined per block
+FLASH_PAGE_SIZE = 4096
+
+
+@dataclass
+class DeltaStats:
+    """Class that holds statistics about a patch."""
+
+    copied: int = 0
+    literal: int = 0
+    size: int = 0
+
+
+def _copy_op(source: int, length: int) -> bytes:
+    return (
+        bytes([DELTA_OP_COPY])
+        + length.to_bytes(2, "little")
+        + source.to_bytes(4, "little")
+    )
+
+
+def _data_op(data: bytes) -> bytes:
+    return (
+        bytes([DELTA_OP_DATA])
+        + len(data).to_bytes(2, "little")
+        + bytes(4)
+    )
+
+
+def make_patch(
+    old: bytes, new: bytes, page_size: int = FLASH_PAGE_SIZE
+) -> tuple[bytes, DeltaStats]:
+    """Compute a patch rebuilding new from old on the device.
+
+    The device rebuilds the new image page by page in its download slot, a
+    copy operation can read any byte of the old image. Operations never cross
+    a destination page boundary.
+    """
+    index: dict[bytes, list[int]] = {}
+    for offset in range(len(old) - DELTA_BLOCK_SIZE + 1):
+        index.setdefault(old[offset : offset + DELTA_BLOCK_SIZE], []).append(
+            offset
+        )
+
+    patch = bytearray()
+    stats = DeltaStats()
+    literal = bytearray()
+    pos = 0
+
+    def flush_literal():
+        if literal:
+            patch.extend(_data_op(literal) + literal)
+            stats.literal += len(literal)
+            literal.clear()
+
+    while pos < len(new):
+        page_start = pos - pos % page_size
+        page_end = min(page_start + page_size, len(new))
+        best_source, best_length = 0, 0
+        # Shorter matches at the end of a page are sent as literals
+        if page_end - pos >= DELTA_BLOCK_SIZE:
+            block = new[pos : pos + DELTA_BLOCK_SIZE]
+            sources = index.get(block, [])
+            # Nearby sources first, code moves little between two builds
+            first = max(0, bisect.bisect_left(sources, pos) - 1)
+            candidates = sources[first : first + DELTA_MAX_CANDIDATES]
+            candidates += sources[max(0, first - DELTA_MAX_CANDIDATES) : first]
+            # The same offset is the most likely match for small edits
+            if old[pos : pos + DELTA_BLOCK_SIZE] == block:
+                candidates.insert(0, pos)
+            for source in candidates:
+                length = DELTA_BLOCK_SIZE
+                limit = min(page_end - pos, len(old) - source)
+                while (
+                    length < limit
+                    and old[source + length] == new[pos + length]
+                ):
+                    length += 1
+                if length > best_length:
+                    best_source, best_length = source, length
+                if best_length == page_end - pos:
+                    break
+        if best_length >= DELTA_BLOCK_SIZE:
+            flush_literal()
+            patch.extend(_copy_op(best_source, best_length))
+            stats.copied += best_length
+            pos += best_length
+            continue
+        literal.append(new[pos])
+        pos += 1
+        if pos == page_end or len(literal) == DELTA_MAX_OP_LENGTH:
+            flush_literal()
+    flush_literal()
+    stats.size = len(patch)
+    return bytes(patch), stats
+
+
+def apply_patch(
+    old: bytes, patch: bytes, size: int, page_size: int = FLASH_PAGE_SIZE
+) -> bytes:
+    """Rebuild the image the way the bootloader does, from old."""
+    flash = bytearray(b"\xff" * size)
+    page = bytearray(b"\xff" * page_size)
+    page_start = 0
+    written = 0
+    pos = 0
+    while pos < len(patch):
+        op = patch[pos]
+        length = int.from_bytes(patch[pos + 1 : pos + 3], "little")
+        source = int.from_bytes(patch[pos + 3 : pos + 7], "little")
+        pos += DELTA_OP_HEADER_SIZE
+        if op == DELTA_OP_COPY:
+            data = old[source : source + length]
+        elif op == DELTA_OP_DATA:
+            data = patch[pos : pos + length]
+            pos += length
+        else:
+            raise ValueError(f"Invalid delta operation {op}")
+        for byte in data:
+            page[written - page_start] = byte
+            written += 1
+            if written - page_start == page_size or written == size:
+                flash[page_start : page_start + page_size] = page
+                page_start += page_size
+                page = bytearray(b"\xff" * page_size)
+    return bytes(flash[:size])
@@ -0,0 +1,127 @@
+"""Module containing the erasure code of the broadcast OTA chunks.
+
+The chunks are protected by groups, each repair chunk of a group is a linear
+combination of its chunks over GF(256). The coefficients come from a Cauchy
+matrix, all its square submatrices are invertible: a device missing n chunks
+of a group recovers them from any n repair chunks of the group. Chunks
+shorter than the repair chunks are padded with zeros.
+
+The bootloaders implement the same code, see device/common/fec.c.
+"""
+
+FEC_GROUP_MAX = 32  # chunks of a group, below the repair coefficients
+FEC_REPAIRS_MAX = 8  # repair chunks of a group, buffered by the devices
+FEC_POLYNOMIAL = 0x11D  # x^8 + x^4 + x^3 + x^2 + 1
+
+_EXP = [0] * 510
+_LOG = [0] * 256
+_value = 1
+for _power in range(255):
+    _EXP[_power] = _EXP[_power + 255] = _value
+    _LOG[_value] = _power
+    _value <<= 1
+    if _value & 0x100:
+        _value ^= FEC_POLYNOMIAL
+
+
+def gf_mul(a: int, b: int) -> int:
+    """Return the product of two GF(256) elements."""
+    if not a or not b:
+        return 0
+    return _EXP[_LOG[a] + _LOG[b]]
+
+
+def gf_inv(a: int) -> int:
+    """Return the inverse of a non zero GF(256) element."""
+    return _EXP[255 - _LOG[a]]
+
+
+# Products by each element, to multiply whole chunks with bytes.translate
+_MUL = [bytes(gf_mul(a, b) for b in range(256)) for a in range(256)]
+
+
+def coefficient(repair: int, chunk: int) -> int:
+    """Return the coefficient of a chunk of a group in one of its repairs.
+
+    The repairs and the chunks are the two disjoint sets of elements of the
+    Cauchy matrix, the repairs have the high bit set.
+    """
+    return gf_inv((0x80 | repair) ^ chunk)
+
+
+def _mul_add(dst: int, src: bytes, coef: int, size: int) -> int:
+    """Return dst + coef * src, chunks stored as integers."""
+    product = src.translate(_MUL[coef]).ljust(size, b"\0")
+    return dst ^ int.from_bytes(product, "little")
+
+
+def repair_chunk(chunks: list[bytes], repair: int, size: int) -> bytes:
+    """Return a repair chunk of a group, size bytes long."""
+    value = 0
+    for index, chunk in enumerate(chunks):
+        value = _mul_add(value, chunk, coefficient(repair, index), size)
+    return value.to_bytes(size, "little")
+
+
+def repair_index(chunk_count: int, group: int, repair: int) -> int:
+    """Return the index of a repair chunk, following the image chunks."""
+    return chunk_count + group * FEC_REPAIRS_MAX + repair
+
+
+def recover(
+    chunks: list[bytes | None], repairs: dict[int, bytes], sizes: list[int]
+) -> list[bytes] | None:
+    """Return the chunks of a group, the missing ones recovered.
+
+    Missing chunks are None, the repairs are given by repair number and
+    sizes are the ones of all the chunks. None when there are not enough
+    repairs.
+    """
+    missing = [index for index, chunk in enumerate(chunks) if chunk is None]
+    if not missing:
+        return list(chunks)
+    if len(repairs) < len(missing):
+        return None
+    size = max(len(repair) for repair in repairs.values())
+    rows = sorted(repairs)[: len(missing)]
+    # Remove the known chunks from the repairs
+    syndromes = []
+    for repair in rows:
+        value = int.from_bytes(repairs[repair], "little")
+        for index, chunk in enumerate(chunks):
+            if chunk is not None:
+                coef = coefficient(repair, index)
+                value = _mul_add(value, chunk, coef, size)
+        syndromes.append(value.to_bytes(size, "little"))
+    inverse = _invert(
+        [[coefficient(repair, index) for index in missing] for repair in rows]
+    )
+    recovered = list(chunks)
+    for row, index in enumerate(missing):
+        value = 0
+        for column, syndrome in enumerate(syndromes):
+            value = _mul_add(value, syndrome, inverse[row][column], size)
+        recovered[index] = value.to_bytes(size, "little")[: sizes[index]]
+    return recovered
+
+
+def _invert(matrix: list[list[int]]) -> list[list[int]]:
+    """Return the inverse of a square GF(256) matrix, by Gauss-Jordan."""
+    size = len(matrix)
+    rows = [
+        row + [int(column == index) for column in range(size)]
+        for index, row in enumerate(matrix)
+    ]
+    for column in range(size):
+        pivot = next(row for row in range(column, size) if rows[row][column])
+        rows[column], rows[pivot] = rows[pivot], rows[column]
+        scale = gf_inv(rows[column][column])
+        rows[column] = [gf_mul(scale, value) for value in rows[column]]
+        for row in range(size):
+            factor = rows[row][column]
+            if row != column and factor:
+                rows[row] = [
+                    value ^ gf_mul(factor, pivot_value)
+                    for value, pivot_value in zip(rows[row], rows[column])
+                ]
+    return [row[size:] for row in rows]
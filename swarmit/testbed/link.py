@@ -0,0 +1,116 @@
+"""Module containing the radio link statistics of the devices."""
+
+import math
+from dataclasses import dataclass
+
+LINK_PROBE_COUNT_DEFAULT = 10  # probes sent to each device by a sweep
+LINK_PROBE_TIMEOUT = 1  # s, a probe not answered by then is lost
+LINK_SMOOTHING = 0.125  # weight of a new sample in the averages
+LINK_TIMEOUT_FACTOR = 4  # ack timeout, in probe latencies
+LINK_TIMEOUT_SCALE_MAX = 4  # ack timeouts stay in base / 4 to base * 4
+LINK_RETRIES_SCALE_MAX = 4  # retry budgets stay in base to base * 4
+RTO_MIN = 0.2  # s, the acks to a broadcast spread over a slot frame
+RTO_MAX = 5  # s, also bounds the backoff
+RTT_ALPHA = 0.125  # weight of a new sample in the smoothed RTT
+RTT_BETA = 0.25  # weight of a new sample in the RTT variation
+RTT_K = 4  # RTT variations added to the smoothed RTT
+
+
+@dataclass
+class LinkStats:
+    """Radio link quality of a device, measured by metrics probes."""
+
+    probes_sent: int = 0
+    probes_received: int = 0
+    rssi: float = 0  # dBm, downlink, smoothed
+    latency: float = 0  # s, probe round trip, smoothed
+    latency_max: float = 0  # s
+    node_rx_count: int = 0  # probes received by the device since it booted
+    updated_at: float = 0
+
+    @property
+    def pdr(self) -> float:
+        """Return the ratio of probes answered, lost frames both ways."""
+        if not self.probes_sent:
+            return 1
+        return min(1, self.probes_received / self.probes_sent)
+
+    def add_probe(self, latency: float, rssi: int, now: float):
+        """Account for the answer to a probe."""
+        if not self.probes_received:
+            self.latency = latency
+            self.rssi = rssi
+        else:
+            self.latency += LINK_SMOOTHING * (latency - self.latency)
+            self.rssi += LINK_SMOOTHING * (rssi - self.rssi)
+        self.latency_max = max(self.latency_max, latency)
+        self.probes_received += 1
+        self.updated_at = now
+
+    def ota_timeout(self, base: float) -> float:
+        """Return the ack timeout of the device, base before any probe.
+
+        Fast links wait a few probe latencies instead of base, slow links
+        wait longer, both within a factor of base.
+        """
+        if not self.probes_received:
+            return base * LINK_TIMEOUT_SCALE_MAX if self.probes_sent else base
+        return min(
+            base * LINK_TIMEOUT_SCALE_MAX,
+            max(
+                base / LINK_TIMEOUT_SCALE_MAX,
+                LINK_TIMEOUT_FACTOR * self.latency,
+            ),
+        )
+
+    def ota_retries(self, base: int) -> int:
+        """Return the retry budget of the device, more on lossy links.
+
+        A frame and its ack both get through with the probe PDR, the budget
+        keeps the same chance of success as base on a lossless link.
+        """
+        if not self.probes_received:
+            return base * LINK_RETRIES_SCALE_MAX if self.probes_sent else base
+        return min(
+            base * LINK_RETRIES_SCALE_MAX, math.ceil(base / self.pdr)
+        )
+
+
+@dataclass
+class RttEstimator:
+    """Retransmission timeout estimated from the ack delays, like TCP.
+
+    The smoothed RTT and its variation follow RFC 6298, the timeout doubles
+    with each timeout until the next sample. Delays of frames sent again
+    are ambiguous and must not be sampled.
+    """
+
+    initial: float  # s, timeout before the first sample
+    srtt: float = 0  # s
+    rttvar: float = 0  # s
+    samples: int = 0
+    backoff: int = 0  # timeouts since the latest sample
+
+    @property
+    def rto(self) -> float:
+        """Return the time to wait for an ack before sending again."""
+        rto = self.initial
+        if self.samples:
+            rto = self.srtt + RTT_K * self.rttvar
+        return min(RTO_MAX, max(RTO_MIN, rto) * (1 << self.backoff))
+
+    def add_sample(self, rtt: float):
+        """Account for the delay of an ack to a frame sent once."""
+        if not self.samples:
+            self.srtt = rtt
+            self.rttvar = rtt / 2
+        else:
+            self.rttvar += RTT_BETA * (abs(self.srtt - rtt) - self.rttvar)
+            self.srtt += RTT_ALPHA * (rtt - self.srtt)
+        self.samples += 1
+        self.backoff = 0
+
+    def timed_out(self):
+        """Back off after a timeout, until the timeout reaches RTO_MAX."""
+        if self.rto < RTO_MAX:
+            self.backoff += 1
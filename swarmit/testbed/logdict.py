@@ -0,0 +1,87 @@
+"""Module containing the decoder of the deferred formatting log records."""
+
+import re
+import struct
+
+LOG_SECTION_NAME = ".swarmit_log"
+LOG_FORMAT_SPEC = re.compile(
+    r"%(?P<flags>[-+ #0]*)(?P<width>\d*)(?P<precision>\.\d+)?"
+    r"(?:hh|h|ll|l|z|j|t)?(?P<conversion>[diouxXc%])"
+)
+
+
+class LogDictionaryError(Exception):
+    """Raised when the log dictionary cannot be read from an ELF file."""
+
+
+def _elf_section(elf: bytes, name: str) -> tuple[int, bytes]:
+    """Return the address and the content of a section of a 32-bit ELF."""
+    if elf[:4] != b"\x7fELF" or elf[4] != 1 or elf[5] != 1:
+        raise LogDictionaryError("Not a 32-bit little endian ELF file")
+    shoff = struct.unpack_from("<I", elf, 0x20)[0]
+    shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2E)
+    sections = [
+        struct.unpack_from("<IIIIII", elf, shoff + index * shentsize)
+        for index in range(shnum)
+    ]
+    strtab_offset = sections[shstrndx][4]
+    for sh_name, _, _, sh_addr, sh_offset, sh_size in sections:
+        start = strtab_offset + sh_name
+        if elf[start : elf.index(b"\0", start)].decode() == name:
+            return sh_addr, elf[sh_offset : sh_offset + sh_size]
+    raise LogDictionaryError(f"No {name} section")
+
+
+class LogDictionary:
+    """Format strings of a user image, indexed by address."""
+
+    def __init__(self, formats: dict[int, str] = None):
+        self.formats = formats or {}
+
+    @classmethod
+    def from_elf(cls, elf: bytes) -> "LogDictionary":
+        """Read the format strings placed by SWRMT_LOG in a user image."""
+        address, content = _elf_section(elf, LOG_SECTION_NAME)
+        formats = {}
+        pos = 0
+        while pos < len(content):
+            # Strings are aligned, the padding is made of null bytes
+            if content[pos] == 0:
+                pos += 1
+                continue
+            end = content.index(b"\0", pos)
+            formats[address + pos] = content[pos:end].decode(errors="replace")
+            pos = end
+        return cls(formats)
+
+    def decode(self, data: bytes) -> str:
+        """Format a record made of a format string address and arguments."""
+        words = [
+            int.from_bytes(data[pos : pos + 4], "little")
+            for pos in range(0, len(data) - len(data) % 4, 4)
+        ]
+        if not words:
+            return ""
+        fmt = self.formats.get(words[0])
+        args = iter(words[1:])
+        if fmt is None:
+            return f"<unknown format 0x{words[0]:08X}> " + " ".join(
+                f"0x{arg:08X}" for arg in args
+            )
+
+        def replace(match):
+            conversion = match["conversion"]
+            if conversion == "%":
+                return "%"
+            value = next(args, 0)
+            if conversion in "di" and value & 0x80000000:
+                value -= 1 << 32
+            elif conversion == "c":
+                value &= 0xFF
+            spec = (
+                f"%{match['flags']}{match['width']}"
+                f"{match['precision'] or ''}{conversion}"
+            )
+            return spec % value
+
+        return LOG_FORMAT_SPEC.sub(replace, fmt)
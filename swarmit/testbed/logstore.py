@@ -0,0 +1,272 @@
+"""Module containing the binary store of the log records of the devices.
+
+The store is a file of fixed size records, appended in the order they are
+received. The file is memory mapped and grown by blocks of records, its
+header counts the records written. The controller queues the records on the
+receive thread, a writer thread copies them to the file, so the frames are
+never delayed by the log output.
+"""
+
+import bisect
+import collections
+import dataclasses
+import mmap
+import os
+import struct
+import threading
+import time
+
+from swarmit.testbed.logdict import LogDictionary
+
+LOG_STORE_MAGIC = b"SWRMTLOG"
+LOG_STORE_VERSION = 1
+LOG_STORE_HEADER = struct.Struct("<8sIIQ")  # magic, version, size, count
+# host time, device address, device timestamp, flags, data length, data
+LOG_STORE_RECORD = struct.Struct("<dQIBB127s")
+LOG_STORE_DATA_MAX = 127  # bytes, size of a log record of the devices
+LOG_STORE_FORMATTED = 0x01  # the data is a format address and arguments
+LOG_STORE_BLOCK_RECORDS = 4096  # records added each time the file grows
+LOG_STORE_FLUSH_INTERVAL = 0.1  # s, between two writes of the queue
+
+
+class LogStoreError(Exception):
+    """Raised when a file is not a log store."""
+
+
+@dataclasses.dataclass
+class LogRecord:
+    """Log record of a device, as stored."""
+
+    time: float  # s, host time of the reception
+    device_addr: str
+    timestamp: int  # device time, as sent by the device
+    data: bytes
+    formatted: bool = False
+
+    def text(self, log_dictionary: LogDictionary = None) -> str:
+        """Return the record as text, formatted with the dictionary."""
+        if self.formatted and log_dictionary is not None:
+            return log_dictionary.decode(self.data)
+        return self.data.decode(errors="replace")
+
+
+def _read_header(view) -> int:
+    """Check the header of a store and return its number of records."""
+    if len(view) < LOG_STORE_HEADER.size:
+        raise LogStoreError("File too short")
+    magic, version, size, count = LOG_STORE_HEADER.unpack_from(view)
+    if magic != LOG_STORE_MAGIC:
+        raise LogStoreError("Not a log store")
+    if version != LOG_STORE_VERSION or size != LOG_STORE_RECORD.size:
+        raise LogStoreError(f"Unsupported log store version {version}")
+    return min(
+        count, (len(view) - LOG_STORE_HEADER.size) // LOG_STORE_RECORD.size
+    )
+
+
+class LogStoreWriter:
+    """Append the log records to a store, from a dedicated thread.
+
+    append is called from the receive thread, it only queues the record.
+    An existing store is appended to.
+    """
+
+    def __init__(self, path: str):
+        self.path = path
+        self._queue = collections.deque()
+        self._file = open(path, "a+b")
+        self._file.seek(0, os.SEEK_END)
+        if self._file.tell() == 0:
+            self._file.write(
+                LOG_STORE_HEADER.pack(
+                    LOG_STORE_MAGIC,
+                    LOG_STORE_VERSION,
+                    LOG_STORE_RECORD.size,
+                    0,
+                )
+            )
+            self._file.flush()
+        self._map = mmap.mmap(self._file.fileno(), 0)
+        self.count = _read_header(self._map)
+        self._stop_event = threading.Event()
+        self._thread = threading.Thread(target=self._write_loop, daemon=True)
+        self._thread.start()
+
+    def append(
+        self,
+        device_addr: str,
+        timestamp: int,
+        data: bytes,
+        formatted: bool = False,
+    ):
+        """Queue a record, data longer than a device record is cut."""
+        # deque appends are atomic, the receive thread never waits here
+        self._queue.append(
+            (time.time(), int(device_addr, 16), timestamp, formatted, data)
+        )
+
+    def close(self):
+        """Write the queued records and close the store."""
+        self._stop_event.set()
+        self._thread.join()
+        self._map.flush()
+        self._map.close()
+        self._file.close()
+
+    def _write_loop(self):
+        while not self._stop_event.wait(LOG_STORE_FLUSH_INTERVAL):
+            self._write_queue()
+        self._write_queue()
+
+    def _grow(self, records: int):
+        """Grow the file to fit at least records more records."""
+        capacity = (len(self._map) - LOG_STORE_HEADER.size) // (
+            LOG_STORE_RECORD.size
+        )
+        missing = self.count + records - capacity
+        blocks = -(-missing // LOG_STORE_BLOCK_RECORDS)
+        self._map.flush()
+        self._map.close()
+        self._file.truncate(
+            LOG_STORE_HEADER.size
+            + (capacity + blocks * LOG_STORE_BLOCK_RECORDS)
+            * LOG_STORE_RECORD.size
+        )
+        self._map = mmap.mmap(self._file.fileno(), 0)
+
+    def _write_queue(self):
+        records = len(self._queue)
+        if not records:
+            return
+        end = LOG_STORE_HEADER.size + (self.count + records) * (
+            LOG_STORE_RECORD.size
+        )
+        if end > len(self._map):
+            self._grow(records)
+        for _ in range(records):
+            host_time, address, timestamp, formatted, data = (
+                self._queue.popleft()
+            )
+            data = data[:LOG_STORE_DATA_MAX]
+            LOG_STORE_RECORD.pack_into(
+                self._map,
+                LOG_STORE_HEADER.size + self.count * LOG_STORE_RECORD.size,
+                host_time,
+                address,
+                timestamp,
+                LOG_STORE_FORMATTED if formatted else 0,
+                len(data),
+                data,
+            )
+            self.count += 1
+        # The records are complete before they are counted
+        struct.pack_into(
+            "<Q", self._map, LOG_STORE_HEADER.size - 8, self.count
+        )
+
+
+class LogStoreReader:
+    """Query the records of a store, possibly still being written.
+
+    The records are sorted by reception time, the time bounds of a query
+    are found by bisection, the records of each device are indexed when the
+    store is opened.
+    """
+
+    def __init__(self, path: str):
+        with open(path, "rb") as f:
+            try:
+                self._map = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+            except ValueError as exc:  # empty file
+                raise LogStoreError("File too short") from exc
+        self.count = _read_header(self._map)
+        self._times = _Column(self._map, 0, self.count)
+        self._devices: dict[int, list[int]] = {}
+        for index in range(self.count):
+            address = struct.unpack_from(
+                "<Q", self._map, self._offset(index) + 8
+            )[0]
+            self._devices.setdefault(address, []).append(index)
+
+    def __len__(self):
+        return self.count
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def close(self):
+        self._map.close()
+
+    @property
+    def devices(self) -> list[str]:
+        """Return the devices with records in the store."""
+        return sorted(f"{address:08X}" for address in self._devices)
+
+    @staticmethod
+    def _offset(index: int) -> int:
+        return LOG_STORE_HEADER.size + index * LOG_STORE_RECORD.size
+
+    def record(self, index: int) -> LogRecord:
+        host_time, address, timestamp, flags, length, data = (
+            LOG_STORE_RECORD.unpack_from(self._map, self._offset(index))
+        )
+        return LogRecord(
+            time=host_time,
+            device_addr=f"{address:08X}",
+            timestamp=timestamp,
+            data=data[:length],
+            formatted=bool(flags & LOG_STORE_FORMATTED),
+        )
+
+    def records(
+        self,
+        devices: list[str] = None,
+        start: float = None,
+        end: float = None,
+    ):
+        """Iterate over the records of the devices received in [start, end[.
+
+        All the devices and all the records by default.
+        """
+        first = 0 if start is None else bisect.bisect_left(self._times, start)
+        last = (
+            self.count if end is None else bisect.bisect_left(self._times, end)
+        )
+        if not devices:
+            indexes = range(first, last)
+        else:
+            indexes = []
+            for device_addr in devices:
+                device_indexes = self._devices.get(int(device_addr, 16), [])
+                indexes += device_indexes[
+                    bisect.bisect_left(device_indexes, first) : (
+                        bisect.bisect_left(device_indexes, last)
+                    )
+                ]
+            indexes.sort()
+        for index in indexes:
+            yield self.record(index)
+
+
+class _Column:
+    """Sequence of the reception times of the records, for bisect."""
+
+    def __init__(self, view, offset: int, count: int):
+        self._view = view
+        self._offset = offset
+        self._count = count
+
+    def __len__(self):
+        return self._count
+
+    def __getitem__(self, index: int) -> float:
+        return struct.unpack_from(
+            "<d",
+            self._view,
+            LOG_STORE_HEADER.size
+            + index * LOG_STORE_RECORD.size
+            + self._offset,
+        )[0]
@@ -1,6 +1,7 @@
 """Swarmit protocol definition."""
 
 import dataclasses
+import struct
 from dataclasses import dataclass
 from enum import Enum, IntEnum
 
@@ -12,6 +13,8 @@ from dotbot_utils.protocol import (
 from marilib.mari_protocol import DefaultPayloadType as MariDefaultPayloadType
 from marilib.mari_protocol import MetricsProbePayload
 
+LOG_RECORD_FORMATTED = 0x80  # log record length flag of deferred formatting
+
 
 class StatusType(Enum):
     """Types of device status."""
@@ -21,6 +24,7 @@ class StatusType(Enum):
     Stopping = 2
     Resetting = 3
     Programming = 4
+    Idle = 5
 
 
 class DeviceType(Enum):
@@ -33,6 +37,36 @@ class DeviceType(Enum):
     nRF52840DK = 4
 
 
+class OTAMode(Enum):
+    """Types of OTA transfers."""
+
+    Raw = 0
+    Delta = 1
+    Compressed = 2
+
+
+class ScheduleType(Enum):
+    """Mari schedules of the devices, the gateway must use the same one."""
+
+    Minuscule = 0
+    Tiny = 1
+    Small = 2
+    Huge = 3
+    OnlyBeacons = 4
+    OnlyBeaconsOptimizedScan = 5
+
+
+class ProfileSection(Enum):
+    """Firmware sections timed with the cycle counter of their core."""
+
+    OtaHash = 0  # SHA256 of the OTA image, application core
+    PageErase = 1  # flash page erase, application core
+    Localization = 2  # LH2 sweeps processing, application core
+    MutexWait = 3  # hardware mutex spin, application core
+    ChunkCheck = 4  # copy and CRC32 of an OTA chunk, network core
+    NetMutexWait = 5  # hardware mutex spin, network core
+
+
 class PayloadType(IntEnum):
     """Types of DotBot payload types."""
 
@@ -47,6 +81,24 @@ class PayloadType(IntEnum):
     SWARMIT_OTA_CHUNK_ACK = 0x87
     SWARMIT_EVENT_GPIO = 0x88
     SWARMIT_EVENT_LOG = 0x89
+    SWARMIT_OTA_CHUNKS_ACK = 0x8A
+    SWARMIT_OTA_FINALIZE = 0x8B
+    SWARMIT_OTA_FINALIZE_ACK = 0x8C
+    SWARMIT_OTA_MANIFEST = 0x8D
+    SWARMIT_OTA_MANIFEST_ACK = 0x8E
+    SWARMIT_EVENT_LOG_BATCH = 0x8F
+    SWARMIT_POSITION_STREAM = 0x90
+    SWARMIT_POSITION_BATCH = 0x91
+    SWARMIT_IDLE = 0x92
+    SWARMIT_SCHEDULE = 0x93
+    SWARMIT_GROUP = 0x94
+    SWARMIT_GROUP_SET = 0x95
+    SWARMIT_PROFILE = 0x96
+    SWARMIT_TRACE = 0x97
+    SWARMIT_IMAGE = 0x98
+    SWARMIT_UPLOAD = 0x99
+    SWARMIT_UPLOAD_REQUEST = 0x9A
+    SWARMIT_UPLOAD_CHUNK = 0x9B
 
     # Custom messages
     SWARMIT_MESSAGE = 0xA0
@@ -71,6 +123,8 @@ class PayloadStatus(Payload):
             PayloadFieldMetadata(
                 name="pos_y", disp="pos y", length=4, signed=True
             ),
+            PayloadFieldMetadata(name="idle_time", disp="idle", length=4),
+            PayloadFieldMetadata(name="groups", disp="grp.", length=4),
         ]
     )
 
@@ -79,6 +133,8 @@ class PayloadStatus(Payload):
     battery: int = 0
     pos_x: int = 0
     pos_y: int = 0
+    idle_time: int = 0
+    groups: int = 0
 
 
 @dataclass
@@ -91,13 +147,37 @@ class PayloadEmpty(Payload):
 
 
 @dataclass
-class PayloadStart(PayloadEmpty):
-    """Dataclass that holds an application start request packet."""
+class PayloadStart(Payload):
+    """Dataclass that holds an application start request packet.
+
+    The devices start at the Mari ASN given, on reception when it is 0 or
+    already elapsed.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="asn", length=8),
+        ]
+    )
+
+    asn: int = 0
 
 
 @dataclass
-class PayloadStop(PayloadEmpty):
-    """Dataclass that holds an application stop request packet."""
+class PayloadStop(Payload):
+    """Dataclass that holds an application stop request packet.
+
+    The devices stop at the Mari ASN given, on reception when it is 0 or
+    already elapsed.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="asn", length=8),
+        ]
+    )
+
+    asn: int = 0
 
 
 @dataclass
@@ -117,40 +197,104 @@ class PayloadReset(Payload):
 
 @dataclass
 class PayloadOTAStart(Payload):
-    """Dataclass that holds an OTA start packet."""
+    """Dataclass that holds an OTA start packet.
+
+    Devices only handle the chunks, manifest and finalize packets of the
+    session of the latest start they received. With a FEC group, the chunks
+    are followed by repair chunks, see swarmit.testbed.fec.
+    """
 
     metadata: list[PayloadFieldMetadata] = dataclasses.field(
         default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
             PayloadFieldMetadata(name="fw_length", disp="len.", length=4),
             PayloadFieldMetadata(
                 name="fw_chunk_counts", disp="chunks", length=4
             ),
+            PayloadFieldMetadata(name="chunk_size", disp="chunk size"),
+            PayloadFieldMetadata(name="ack_interval", disp="ack int."),
+            PayloadFieldMetadata(name="mode", disp="mode"),
+            PayloadFieldMetadata(name="image_length", disp="img.", length=4),
+            PayloadFieldMetadata(name="base_length", disp="base", length=4),
+            PayloadFieldMetadata(name="base_sha", type_=bytes, length=8),
+            PayloadFieldMetadata(name="fec_group", disp="fec"),
         ]
     )
 
+    session: int = 0
     fw_length: int = 0
     fw_chunk_count: int = 0
+    chunk_size: int = 128
+    ack_interval: int = 1
+    mode: OTAMode = OTAMode.Raw
+    image_length: int = 0
+    base_length: int = 0
+    base_sha: bytes = dataclasses.field(default_factory=lambda: bytes(8))
+    fec_group: int = 0  # chunks protected by each group of repairs
 
 
 @dataclass
 class PayloadOTAChunk(Payload):
-    """Dataclass that holds an OTA chunk packet."""
+    """Dataclass that holds an OTA chunk packet.
+
+    Indexes from the chunk count of the OTA start on are repair chunks.
+    """
 
     metadata: list[PayloadFieldMetadata] = dataclasses.field(
         default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
             PayloadFieldMetadata(name="index", disp="idx", length=4),
             PayloadFieldMetadata(name="count", disp="size"),
-            PayloadFieldMetadata(name="sha", type_=bytes, length=8),
+            PayloadFieldMetadata(name="crc", length=4),
             PayloadFieldMetadata(name="chunk", type_=bytes, length=0),
         ]
     )
 
+    session: int = 0
     index: int = 0
     count: int = 0
-    sha: bytes = dataclasses.field(default_factory=lambda: bytearray)
+    crc: int = 0
     chunk: bytes = dataclasses.field(default_factory=lambda: bytearray)
 
 
+@dataclass
+class PayloadOTAFinalize(Payload):
+    """Dataclass that holds an OTA finalize packet."""
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
+            PayloadFieldMetadata(name="sha", type_=bytes, length=32),
+        ]
+    )
+
+    session: int = 0
+    sha: bytes = dataclasses.field(default_factory=lambda: bytes(32))
+
+
+@dataclass
+class PayloadOTAManifest(Payload):
+    """Dataclass that holds an OTA page manifest packet.
+
+    crcs contains the little endian CRC32 of the image bytes in each page
+    starting at first_page, count is the size of crcs in bytes.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
+            PayloadFieldMetadata(name="first_page", disp="page", length=2),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(name="crcs", type_=bytes, length=0),
+        ]
+    )
+
+    session: int = 0
+    first_page: int = 0
+    count: int = 0
+    crcs: bytes = dataclasses.field(default_factory=lambda: bytearray)
+
+
 @dataclass
 class PayloadOTAStartAck(Payload):
     """Dataclass that holds an application OTA start ACK notification packet."""
@@ -173,6 +317,77 @@ class PayloadOTAChunkAck(Payload):
     index: int = 0
 
 
+@dataclass
+class PayloadOTAChunksAck(Payload):
+    """Dataclass that holds an OTA cumulative chunks ACK notification packet.
+
+    All chunks before base are acknowledged, bit i of the bitmap acknowledges
+    chunk base + i.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="base", disp="base", length=4),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(
+                name="bitmap", disp="bitmap", type_=bytes, length=0
+            ),
+        ]
+    )
+
+    base: int = 0
+    count: int = 0
+    bitmap: bytes = dataclasses.field(default_factory=lambda: bytearray)
+
+    def acked_indexes(self) -> list[int]:
+        """Return the chunk indexes acknowledged in the bitmap."""
+        return [
+            self.base + byte_idx * 8 + bit
+            for byte_idx, byte in enumerate(self.bitmap[: self.count])
+            for bit in range(8)
+            if byte & (1 << bit)
+        ]
+
+
+@dataclass
+class PayloadOTAFinalizeAck(Payload):
+    """Dataclass that holds an OTA finalize ACK notification packet.
+
+    The device computes the SHA256 of the image while the chunks are
+    written, verified is set when it matches the one sent at finalize.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="verified", disp="ok"),
+            PayloadFieldMetadata(name="sha", type_=bytes, length=32),
+        ]
+    )
+
+    verified: int = 0
+    sha: bytes = dataclasses.field(default_factory=lambda: bytes(32))
+
+
+@dataclass
+class PayloadOTAManifestAck(Payload):
+    """Dataclass that holds an OTA page manifest ACK notification packet.
+
+    Bit i of differs is set when page first_page + i must be sent.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="first_page", disp="page", length=2),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(name="differs", type_=bytes, length=4),
+        ]
+    )
+
+    first_page: int = 0
+    count: int = 0
+    differs: bytes = dataclasses.field(default_factory=lambda: bytes(4))
+
+
 @dataclass
 class PayloadEvent(Payload):
     """Dataclass that holds an event notification packet."""
@@ -192,6 +407,315 @@ class PayloadEvent(Payload):
     data: bytes = dataclasses.field(default_factory=lambda: bytearray)
 
 
+@dataclass
+class PayloadLogBatch(Payload):
+    """Dataclass that holds a batch of log records notification packet.
+
+    data contains record_count records, each made of a 4 bytes timestamp, a
+    1 byte length and the log data. Bit 7 of the length is set when the data
+    is a format string address followed by its arguments, see LogDictionary.
+    dropped counts the records lost by the device since the previous batch.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="dropped", disp="drop.", length=2),
+            PayloadFieldMetadata(name="record_count", disp="rec."),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(
+                name="data", disp="data", type_=bytes, length=0
+            ),
+        ]
+    )
+
+    dropped: int = 0
+    record_count: int = 0
+    count: int = 0
+    data: bytes = dataclasses.field(default_factory=lambda: bytearray)
+
+    def records(self) -> list[tuple[int, bytes, bool]]:
+        """Return the (timestamp, data, formatted) tuples of the records."""
+        records = []
+        pos = 0
+        for _ in range(self.record_count):
+            if pos + 5 > len(self.data):
+                break
+            timestamp = int.from_bytes(self.data[pos : pos + 4], "little")
+            length = self.data[pos + 4]
+            end = pos + 5 + (length & ~LOG_RECORD_FORMATTED)
+            records.append(
+                (
+                    timestamp,
+                    bytes(self.data[pos + 5 : end]),
+                    bool(length & LOG_RECORD_FORMATTED),
+                )
+            )
+            pos = end
+        return records
+
+
+@dataclass
+class PayloadPositionStream(Payload):
+    """Dataclass that holds a position streaming configuration packet.
+
+    Devices send batch positions per frame, sampled at least period_ms
+    apart. A period of 0 stops the stream.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="period_ms", disp="per.", length=2),
+            PayloadFieldMetadata(name="batch", disp="bat."),
+        ]
+    )
+
+    period_ms: int = 0
+    batch: int = 1
+
+
+@dataclass
+class PayloadIdle(Payload):
+    """Dataclass that holds an idle mode request packet.
+
+    An enable of 1 parks a ready device in idle mode, 0 wakes it up.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="enable", disp="en."),
+        ]
+    )
+
+    enable: int = 1
+
+
+@dataclass
+class PayloadSchedule(Payload):
+    """Dataclass that holds a Mari schedule switch packet.
+
+    Ready and idle devices store the schedule and join again with it.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="schedule_id", disp="sch."),
+        ]
+    )
+
+    schedule_id: int = ScheduleType.Tiny.value
+
+
+@dataclass
+class PayloadGroup(Payload):
+    """Dataclass that holds a group addressed packet.
+
+    Sent as a broadcast, only the devices of the group handle the packet, as
+    if it was unicast to each of them.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="group", disp="grp."),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(
+                name="packet", disp="pkt", type_=bytes, length=0
+            ),
+        ]
+    )
+
+    group: int = 0
+    count: int = 0
+    packet: bytes = dataclasses.field(default_factory=lambda: bytearray)
+
+
+@dataclass
+class PayloadGroupSet(Payload):
+    """Dataclass that holds a device groups configuration packet."""
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="groups", disp="grp.", length=4),
+        ]
+    )
+
+    groups: int = 0
+
+
+@dataclass
+class PayloadPositionBatch(Payload):
+    """Dataclass that holds a batch of streamed positions notification packet.
+
+    data contains record_count records, each made of a 4 bytes timestamp in
+    microseconds and the 4 bytes x and y coordinates in mm.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="record_count", disp="rec."),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(
+                name="data", disp="data", type_=bytes, length=0
+            ),
+        ]
+    )
+
+    record_count: int = 0
+    count: int = 0
+    data: bytes = dataclasses.field(default_factory=lambda: bytearray)
+
+    def positions(self) -> list[tuple[int, int, int]]:
+        """Return the (timestamp, x, y) tuples of the records."""
+        return list(
+            struct.iter_unpack(
+                "<III", bytes(self.data[: self.record_count * 12])
+            )
+        )
+
+
+@dataclass
+class PayloadProfile(Payload):
+    """Dataclass that holds a profiling counters packet.
+
+    The request is empty, the devices answer with data containing
+    record_count records, one per ProfileSection in order, each made of the
+    4 bytes count, min and max cycles of a run and the 8 bytes total cycles.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="record_count", disp="rec."),
+            PayloadFieldMetadata(name="count", disp="len."),
+            PayloadFieldMetadata(
+                name="data", disp="data", type_=bytes, length=0
+            ),
+        ]
+    )
+
+    record_count: int = 0
+    count: int = 0
+    data: bytes = dataclasses.field(default_factory=bytes)
+
+    def counters(self) -> list[tuple[int, int, int, int]]:
+        """Return the (count, min, max, total) tuples of the sections."""
+        return list(
+            struct.iter_unpack(
+                "<IIIQ", bytes(self.data[: self.record_count * 20])
+            )
+        )
+
+
+@dataclass
+class PayloadTrace(Payload):
+    """Dataclass that holds a traced packet.
+
+    The gateway sends the id, each hop of the device stamps the packet with
+    the Mari ASN or its network core timer in microseconds: reception by the
+    network core, IPC to the user image, user image done and the reply.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="id", disp="id", length=4),
+            PayloadFieldMetadata(name="rx_asn", disp="rx asn", length=8),
+            PayloadFieldMetadata(name="rx_time", disp="rx", length=4),
+            PayloadFieldMetadata(name="ipc_time", disp="ipc", length=4),
+            PayloadFieldMetadata(name="isr_time", disp="isr", length=4),
+            PayloadFieldMetadata(name="tx_asn", disp="tx asn", length=8),
+            PayloadFieldMetadata(name="tx_time", disp="tx", length=4),
+        ]
+    )
+
+    id: int = 0
+    rx_asn: int = 0
+    rx_time: int = 0
+    ipc_time: int = 0
+    isr_time: int = 0
+    tx_asn: int = 0
+    tx_time: int = 0
+
+
+@dataclass
+class PayloadImage(Payload):
+    """Dataclass that holds an installed image packet.
+
+    The request fields are ignored, the devices answer with the size and
+    SHA256 of the image they installed with an OTA. The size is 0 when the
+    image is unknown, e.g. loaded with a debugger.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="size", disp="size", length=4),
+            PayloadFieldMetadata(name="sha", type_=bytes, length=32),
+        ]
+    )
+
+    size: int = 0
+    sha: bytes = dataclasses.field(default_factory=lambda: bytes(32))
+
+
+@dataclass
+class PayloadUpload(Payload):
+    """Dataclass that holds an upload packet.
+
+    The request fields are ignored, the devices answer with the region their
+    user image offered for upload. The size is 0 when there is none, the
+    session changes with each region offered.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
+            PayloadFieldMetadata(name="size", disp="size", length=4),
+            PayloadFieldMetadata(name="crc", length=4),
+        ]
+    )
+
+    session: int = 0
+    size: int = 0
+    crc: int = 0
+
+
+@dataclass
+class PayloadUploadRequest(Payload):
+    """Dataclass that holds an upload chunks request packet.
+
+    Bit i of the bitmap requests chunk first + i, the device sends them back
+    to back.
+    """
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
+            PayloadFieldMetadata(name="first", disp="idx", length=4),
+            PayloadFieldMetadata(name="bitmap", disp="bitmap"),
+        ]
+    )
+
+    session: int = 0
+    first: int = 0
+    bitmap: int = 0
+
+
+@dataclass
+class PayloadUploadChunk(Payload):
+    """Dataclass that holds an upload chunk notification packet."""
+
+    metadata: list[PayloadFieldMetadata] = dataclasses.field(
+        default_factory=lambda: [
+            PayloadFieldMetadata(name="session", disp="sess."),
+            PayloadFieldMetadata(name="index", disp="idx", length=4),
+            PayloadFieldMetadata(name="count", disp="size"),
+            PayloadFieldMetadata(name="data", type_=bytes, length=0),
+        ]
+    )
+
+    session: int = 0
+    index: int = 0
+    count: int = 0
+    data: bytes = dataclasses.field(default_factory=lambda: bytearray)
+
+
 @dataclass
 class PayloadMessage(Payload):
     """Dataclass that holds a message packet."""
@@ -219,5 +743,27 @@ register_parser(PayloadType.SWARMIT_OTA_CHUNK, PayloadOTAChunk)
 register_parser(PayloadType.SWARMIT_OTA_START_ACK, PayloadOTAStartAck)
 register_parser(PayloadType.SWARMIT_OTA_CHUNK_ACK, PayloadOTAChunkAck)
 register_parser(PayloadType.SWARMIT_EVENT_LOG, PayloadEvent)
+register_parser(PayloadType.SWARMIT_OTA_CHUNKS_ACK, PayloadOTAChunksAck)
+register_parser(PayloadType.SWARMIT_OTA_FINALIZE, PayloadOTAFinalize)
+register_parser(
+    PayloadType.SWARMIT_OTA_FINALIZE_ACK, PayloadOTAFinalizeAck
+)
+register_parser(PayloadType.SWARMIT_OTA_MANIFEST, PayloadOTAManifest)
+register_parser(
+    PayloadType.SWARMIT_OTA_MANIFEST_ACK, PayloadOTAManifestAck
+)
+register_parser(PayloadType.SWARMIT_EVENT_LOG_BATCH, PayloadLogBatch)
+register_parser(PayloadType.SWARMIT_POSITION_STREAM, PayloadPositionStream)
+register_parser(PayloadType.SWARMIT_POSITION_BATCH, PayloadPositionBatch)
+register_parser(PayloadType.SWARMIT_IDLE, PayloadIdle)
+register_parser(PayloadType.SWARMIT_SCHEDULE, PayloadSchedule)
+register_parser(PayloadType.SWARMIT_GROUP, PayloadGroup)
+register_parser(PayloadType.SWARMIT_GROUP_SET, PayloadGroupSet)
+register_parser(PayloadType.SWARMIT_PROFILE, PayloadProfile)
+register_parser(PayloadType.SWARMIT_TRACE, PayloadTrace)
+register_parser(PayloadType.SWARMIT_IMAGE, PayloadImage)
+register_parser(PayloadType.SWARMIT_UPLOAD, PayloadUpload)
+register_parser(PayloadType.SWARMIT_UPLOAD_REQUEST, PayloadUploadRequest)
+register_parser(PayloadType.SWARMIT_UPLOAD_CHUNK, PayloadUploadChunk)
 register_parser(PayloadType.SWARMIT_MESSAGE, PayloadMessage)
 register_parser(PayloadType.METRICS_PROBE, MetricsProbePayload)
@@ -0,0 +1,166 @@
+"""Module containing the store of the device statuses."""
+
+import collections
+import dataclasses
+import threading
+from collections.abc import Callable, Mapping
+from dataclasses import dataclass
+
+from swarmit.testbed.protocol import DeviceType, StatusType
+
+STATUS_HISTORY_SIZE = 4096  # changes kept for the clients catching up
+
+
+@dataclass
+class NodeStatus:
+    """Class that holds node status."""
+
+    device: DeviceType = DeviceType.Unknown
+    status: StatusType = StatusType.Bootloader
+    battery: int = 0
+    pos_x: int = 0
+    pos_y: int = 0
+    idle_time: int = 0  # s spent in idle mode since the device booted
+    groups: int = 0  # bitmap of the groups the device belongs to
+    last_updated_at: float = 0
+
+
+class StatusStore(Mapping):
+    """Statuses of the devices, indexed by state, with a change feed.
+
+    The store is written by the adapter thread and read by the CLI and
+    web server threads, all the accesses hold its lock. Each change of a
+    device increments the version, clients holding a version only fetch
+    the devices changed since.
+    """
+
+    def __init__(self, history: int = STATUS_HISTORY_SIZE):
+        self._lock = threading.Lock()
+        self._nodes: dict[str, NodeStatus] = {}
+        # Addresses of the devices in each state, in insertion order
+        self._states: dict[StatusType, dict[str, None]] = (
+            collections.defaultdict(dict)
+        )
+        self._changes: collections.deque[tuple[int, str]] = (
+            collections.deque(maxlen=history)
+        )
+        self.version = 0
+
+    def __getitem__(self, device_addr: str) -> NodeStatus:
+        with self._lock:
+            return self._nodes[device_addr]
+
+    def __contains__(self, device_addr) -> bool:
+        with self._lock:
+            return device_addr in self._nodes
+
+    def __iter__(self):
+        with self._lock:
+            return iter(list(self._nodes))
+
+    def __len__(self) -> int:
+        with self._lock:
+            return len(self._nodes)
+
+    def items(self) -> list[tuple[str, NodeStatus]]:
+        """Return a copy of the devices and their status."""
+        with self._lock:
+            return list(self._nodes.items())
+
+    def _changed(self, device_addr: str):
+        self.version += 1
+        self._changes.append((self.version, device_addr))
+
+    def _unindex(self, device_addr: str):
+        node = self._nodes.get(device_addr)
+        if node is not None:
+            self._states[node.status].pop(device_addr, None)
+
+    def set(self, device_addr: str, node: NodeStatus):
+        """Store the latest status received from a device."""
+        with self._lock:
+            self._unindex(device_addr)
+            self._nodes[device_addr] = node
+            self._states[node.status][device_addr] = None
+            self._changed(device_addr)
+
+    def set_position(self, device_addr: str, pos_x: int, pos_y: int):
+        """Update the position of a known device."""
+        with self._lock:
+            node = self._nodes.get(device_addr)
+            if node is None:
+                return
+            node.pos_x = pos_x
+            node.pos_y = pos_y
+            self._changed(device_addr)
+
+    def touch(self, device_addr: str, now: float):
+        """Mark a known device alive, not a change of its status."""
+        with self._lock:
+            node = self._nodes.get(device_addr)
+            if node is not None:
+                node.last_updated_at = now
+
+    def touch_many(self, device_addrs, now: float):
+        """Mark known devices alive, the devices of a batch of frames."""
+        with self._lock:
+            for device_addr in device_addrs:
+                node = self._nodes.get(device_addr)
+                if node is not None:
+                    node.last_updated_at = now
+
+    def remove_inactive(
+        self, now: float, timeout: Callable[[NodeStatus], float]
+    ) -> list[str]:
+        """Remove the devices silent for longer than their timeout."""
+        with self._lock:
+            inactive = [
+                addr
+                for addr, node in self._nodes.items()
+                if now - node.last_updated_at > timeout(node)
+            ]
+            for addr in inactive:
+                self._unindex(addr)
+                del self._nodes[addr]
+                self._changed(addr)
+        return inactive
+
+    def in_state(self, *states: StatusType) -> dict[str, NodeStatus]:
+        """Return the devices in one of the states, without a full scan."""
+        with self._lock:
+            return {
+                addr: self._nodes[addr]
+                for state in states
+                for addr in self._states[state]
+            }
+
+    def snapshot(self) -> tuple[int, dict[str, NodeStatus]]:
+        """Return the version and a copy of all the statuses."""
+        with self._lock:
+            return self.version, {
+                addr: dataclasses.replace(node)
+                for addr, node in self._nodes.items()
+            }
+
+    def changes(
+        self, since: int
+    ) -> tuple[int, dict[str, NodeStatus | None] | None]:
+        """Return the version and the devices changed after since.
+
+        Removed devices are None. The changes are None when since is not
+        known anymore, the client then needs a snapshot.
+        """
+        with self._lock:
+            oldest = self._changes[0][0] if self._changes else self.version
+            if since > self.version or since < oldest - 1:
+                return self.version, None
+            changed = {}
+            for version, addr in reversed(self._changes):
+                if version <= since:
+                    break
+                if addr not in changed:
+                    node = self._nodes.get(addr)
+                    changed[addr] = (
+                        dataclasses.replace(node) if node else None
+                    )
+            return self.version, changed
@@ -2,7 +2,10 @@
 
 import asyncio
 import base64
+import collections
 import datetime
+import hashlib
+import json
 import os
 from contextlib import asynccontextmanager
 from dataclasses import asdict
@@ -13,7 +16,10 @@ from fastapi import (
     Depends,
     FastAPI,
     HTTPException,
+    Query,
     Request,
+    WebSocket,
+    WebSocketDisconnect,
 )
 from fastapi import status as fastapi_status
 from fastapi.concurrency import run_in_threadpool
@@ -27,7 +33,11 @@ from sqlalchemy.exc import IntegrityError
 from sqlalchemy.orm import Session
 
 from swarmit import __version__
-from swarmit.testbed.controller import Controller, ControllerSettings
+from swarmit.testbed.controller import (
+    OTA_IMAGE_SIZE_MAX,
+    Controller,
+    ControllerSettings,
+)
 from swarmit.testbed.model import (
     Base,
     JWTRecord,
@@ -36,9 +46,14 @@ from swarmit.testbed.model import (
     create_session_factory,
 )
 from swarmit.testbed.protocol import StatusType
+from swarmit.testbed.status import NodeStatus, StatusStore
 
 DATA_DIR = "./.data"
 API_DB_URL = f"sqlite:///{DATA_DIR}/database.db"
+STATUS_FEED_PERIOD = 0.5  # s, default period of the status feed updates
+STATUS_FEED_PERIOD_MIN = 0.02  # s, the position streaming period
+STATUS_UPDATES_CACHED = 64
+FLASH_IMAGE_SIZE_MAX = OTA_IMAGE_SIZE_MAX  # bytes, a flash slot of the devices
 
 
 def get_db():
@@ -66,7 +81,8 @@ api.add_middleware(
     allow_headers=["*"],
 )
 
-# Global lock to prevent concurrent controller access
+# Global lock to prevent concurrent start and stop requests, flash requests
+# run in OTA sessions of their own
 controller_lock = asyncio.Lock()
 
 
@@ -165,19 +181,49 @@ class FlashRequest(BaseModel):
 
 @api.post("/flash", dependencies=[Depends(verify_jwt)])
 async def flash_firmware(payload: FlashRequest, request: Request):
-    controller: Controller = request.app.state.controller
-
     try:
-        fw_bytes = base64.b64decode(payload.firmware_b64)
-        fw = bytearray(fw_bytes)
+        fw = base64.b64decode(payload.firmware_b64)
     except Exception as e:
         raise HTTPException(
             status_code=400, detail=f"invalid firmware encoding: {e}"
         )
+    return await _flash(request.app.state.controller, fw, payload.devices)
+
+
+@api.post("/flash/raw", dependencies=[Depends(verify_jwt)])
+async def flash_firmware_raw(
+    request: Request, devices: Optional[List[str]] = Query(None)
+):
+    """Flash the image sent as the request body, hashed while received."""
+    fw = bytearray()
+    digest = hashlib.sha256()
+    async for data in request.stream():
+        if len(fw) + len(data) > FLASH_IMAGE_SIZE_MAX:
+            raise HTTPException(
+                status_code=413,
+                detail=f"firmware larger than {FLASH_IMAGE_SIZE_MAX} bytes",
+            )
+        fw += data
+        digest.update(data)
+    if not fw:
+        raise HTTPException(status_code=400, detail="empty firmware")
+    return await _flash(
+        request.app.state.controller, bytes(fw), devices, digest.digest()
+    )
+
 
-    # Normalize devices
-    devices = payload.devices
-    if all(
+async def _flash(
+    controller: Controller,
+    fw: bytes,
+    devices: Optional[List[str]],
+    fw_hash: Optional[bytes] = None,
+):
+    if len(fw) > FLASH_IMAGE_SIZE_MAX:
+        raise HTTPException(
+            status_code=413,
+            detail=f"firmware larger than {FLASH_IMAGE_SIZE_MAX} bytes",
+        )
+    if devices and all(
         controller.status_data[device].status != StatusType.Bootloader
         for device in devices
     ):
@@ -185,24 +231,26 @@ async def flash_firmware(payload: FlashRequest, request: Request):
             status_code=400, detail="no ready devices to flash"
         )
 
-    async with controller_lock:
+    # Each flash request is an OTA session of its own, the transfers to
+    # different devices share the radio instead of waiting for each other
+    start_data = await run_in_threadpool(
+        controller.start_ota, fw, devices or None, fw_hash=fw_hash
+    )
 
-        start_data = (
-            await run_in_threadpool(controller.start_ota, fw, devices)
-            if devices
-            else await run_in_threadpool(controller.start_ota, fw)
+    if start_data["missed"]:
+        controller.end_ota(start_data["session"])
+        raise HTTPException(
+            status_code=400,
+            detail=f"{len(start_data['missed'])} acknowledgments are missing "
+            f"({', '.join(sorted(set(start_data['missed'])))})",
         )
 
-        if start_data["missed"]:
-            raise HTTPException(
-                status_code=400,
-                detail=f"{len(start_data['missed'])} acknowledgments are missing "
-                f"({', '.join(sorted(set(start_data['missed'])))})",
-            )
-
-        data = await run_in_threadpool(
-            controller.transfer, fw, start_data["acked"]
-        )
+    data = await run_in_threadpool(
+        controller.transfer,
+        fw,
+        start_data["acked"],
+        session=start_data["session"],
+    )
 
     if all(device.success for device in data.values()) is False:
         raise HTTPException(status_code=400, detail="transfer failed")
@@ -210,18 +258,102 @@ async def flash_firmware(payload: FlashRequest, request: Request):
     return JSONResponse(content={"response": "success"})
 
 
+def _node_json(node: NodeStatus) -> dict:
+    return {
+        **asdict(node),
+        "device": node.device.name,
+        "status": node.status.name,
+    }
+
+
+def _status_update_data(
+    store: StatusStore, since: Optional[int]
+) -> dict | None:
+    if since is not None:
+        version, changes = store.changes(since)
+        if changes is not None:
+            if not changes:
+                return None
+            return {
+                "version": version,
+                "full": False,
+                "devices": {
+                    addr: _node_json(node) if node else None
+                    for addr, node in changes.items()
+                },
+            }
+    version, nodes = store.snapshot()
+    return {
+        "version": version,
+        "full": True,
+        "devices": {addr: _node_json(node) for addr, node in nodes.items()},
+    }
+
+
+# Serialized updates, shared by the clients following the feed at the same
+# version, by (store, since, store version)
+_status_updates: collections.OrderedDict[tuple, tuple[int, str]] = (
+    collections.OrderedDict()
+)
+
+
+def _status_update(
+    store: StatusStore, since: Optional[int]
+) -> tuple[int, str] | None:
+    """Return the version and the devices changed after since, in JSON.
+
+    Clients without a known version get all the devices, removed devices
+    are null. None if nothing changed.
+    """
+    key = (id(store), since, store.version)
+    if key in _status_updates:
+        return _status_updates[key]
+    data = _status_update_data(store, since)
+    if data is None:
+        return None
+    update = (data["version"], json.dumps(data))
+    _status_updates[key] = update
+    if len(_status_updates) > STATUS_UPDATES_CACHED:
+        _status_updates.popitem(last=False)
+    return update
+
+
 @api.get("/status")
 async def status(request: Request):
     controller: Controller = request.app.state.controller
-    response = {
-        k: {
-            **asdict(v),
-            "device": v.device.name,
-            "status": v.status.name,
-        }
-        for k, v in controller.status_data.items()
-    }
-    return JSONResponse(content={"response": response})
+    version, nodes = controller.status_data.snapshot()
+    response = {addr: _node_json(node) for addr, node in nodes.items()}
+    return JSONResponse(content={"response": response, "version": version})
+
+
+@api.websocket("/status/feed")
+async def status_feed(
+    websocket: WebSocket,
+    since: Optional[int] = None,
+    period: float = STATUS_FEED_PERIOD,
+):
+    """Send the status changes after the since version, every period s.
+
+    The changes of a period are batched in a single message.
+    """
+    controller: Controller = websocket.app.state.controller
+    period = max(period, STATUS_FEED_PERIOD_MIN)
+    await websocket.accept()
+    try:
+        while True:
+            update = _status_update(controller.status_data, since)
+            if update is not None:
+                since, text = update
+                await websocket.send_text(text)
+            # Clients send nothing, receiving notices when they leave
+            try:
+                message = await asyncio.wait_for(websocket.receive(), period)
+            except asyncio.TimeoutError:
+                continue
+            if message["type"] == "websocket.disconnect":
+                return
+    except WebSocketDisconnect:
+        pass
 
 
 class SettingsResponse(BaseModel):
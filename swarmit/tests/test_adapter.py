@@ -1,3 +1,5 @@
+import threading
+import time
 from unittest.mock import patch
 
 from dotbot_utils.protocol import Packet
@@ -5,8 +7,15 @@ from marilib.mari_protocol import Frame as MariFrame
 from marilib.mari_protocol import Header as MariHeader
 from marilib.model import EdgeEvent
 
-from swarmit.testbed.adapter import MarilibCloudAdapter, MarilibEdgeAdapter
-from swarmit.testbed.protocol import PayloadStatus
+from swarmit.testbed.adapter import (
+    FrameBatcher,
+    FrameDispatcher,
+    GatewayAdapterBase,
+    MarilibCloudAdapter,
+    MarilibEdgeAdapter,
+    MultiGatewayAdapter,
+)
+from swarmit.testbed.protocol import PayloadOTAChunkAck, PayloadStatus
 
 
 @patch("swarmit.testbed.adapter.MarilibSerialAdapter")
@@ -17,8 +26,8 @@ def test_marilib_edge_adapter(send_frame_mock, _, capsys):
     )
     packets = []
 
-    def on_frame_received(_, f):
-        packets.append(f)
+    def on_frames_received(frames):
+        packets.extend(packet for _, packet in frames)
 
     payload = PayloadStatus(device=1, status=2)
     packet = Packet().from_payload(payload)
@@ -28,11 +37,12 @@ def test_marilib_edge_adapter(send_frame_mock, _, capsys):
     adapter.on_event(EdgeEvent.NODE_DATA, mari_frame)
     assert not packets
 
-    adapter.init(on_frame_received)
+    adapter.init(on_frames_received)
     out, _ = capsys.readouterr()
     assert "Mari nodes available" in out
 
     adapter.on_event(EdgeEvent.NODE_DATA, mari_frame)
+    adapter.dispatcher.flush()
 
     assert packets == [packet]
 
@@ -47,6 +57,7 @@ def test_marilib_edge_adapter(send_frame_mock, _, capsys):
     # invalid frame
     mari_frame = MariFrame(header=MariHeader(), payload=b"`\x01invalid")
     adapter.on_event(EdgeEvent.NODE_DATA, mari_frame)
+    adapter.dispatcher.flush()
     out, _ = capsys.readouterr()
     assert "Error parsing packet" in out
 
@@ -84,8 +95,8 @@ def test_marilib_cloud_adapter(send_frame_mock, _, capsys):
 
     packets = []
 
-    def on_frame_received(_, f):
-        packets.append(f)
+    def on_frames_received(frames):
+        packets.extend(packet for _, packet in frames)
 
     payload = PayloadStatus(device=1, status=2)
     packet = Packet().from_payload(payload)
@@ -95,11 +106,12 @@ def test_marilib_cloud_adapter(send_frame_mock, _, capsys):
     adapter.on_event(EdgeEvent.NODE_DATA, mari_frame)
     assert not packets
 
-    adapter.init(on_frame_received)
+    adapter.init(on_frames_received)
     out, _ = capsys.readouterr()
     assert "Mari nodes available" in out
 
     adapter.on_event(EdgeEvent.NODE_DATA, mari_frame)
+    adapter.dispatcher.flush()
 
     assert packets == [packet]
 
@@ -114,6 +126,7 @@ def test_marilib_cloud_adapter(send_frame_mock, _, capsys):
     # invalid frame
     mari_frame = MariFrame(header=MariHeader(), payload=b"`\x01invalid")
     adapter.on_event(EdgeEvent.NODE_DATA, mari_frame)
+    adapter.dispatcher.flush()
     out, _ = capsys.readouterr()
     assert "Error parsing packet" in out
 
@@ -124,6 +137,47 @@ def test_marilib_cloud_adapter(send_frame_mock, _, capsys):
     adapter.close()
 
 
+@patch("swarmit.testbed.adapter.MarilibMQTTAdapter")
+@patch("swarmit.testbed.adapter.MarilibCloud.send_frame")
+def test_marilib_cloud_adapter_batch(send_frame_mock, _):
+    adapter = MarilibCloudAdapter(
+        host="h", port=1, use_tls=False, network_id=2, batch_window=0.05
+    )
+    adapter.init(lambda frames: None)
+    payloads = [PayloadStatus(device=1, status=status) for status in (1, 2)]
+    for payload in payloads:
+        adapter.send_payload(0x01, payload)
+    # published at the end of the window
+    send_frame_mock.assert_not_called()
+    adapter.close()
+    assert send_frame_mock.call_count == 2
+    assert send_frame_mock.call_args_list[1].kwargs == {
+        "dst": 0x01,
+        "payload": Packet().from_payload(payloads[1]).to_bytes(),
+    }
+
+
+def test_frame_batcher():
+    published = []
+
+    def send_frame(dst, payload):
+        published.append((dst, payload))
+
+    batcher = FrameBatcher(send_frame, window=0.05)
+    batcher.put(1, b"a")
+    batcher.put(2, b"b")
+    # queued again before being published, published once
+    batcher.put(1, b"a")
+    batcher.put(1, b"c")
+    time.sleep(0.2)
+    assert published == [(1, b"a"), (2, b"b"), (1, b"c")]
+    assert batcher.batch_count == 1
+    batcher.put(1, b"a")
+    batcher.close()
+    assert published[-1] == (1, b"a")
+    assert (batcher.published_count, batcher.batch_count) == (4, 2)
+
+
 @patch("swarmit.testbed.adapter.MarilibMQTTAdapter")
 def test_marilib_cloud_adapter_init_failed(mqtt_adapter_mock, capsys):
     mqtt_adapter_mock.side_effect = Exception("init failed")
@@ -140,3 +194,106 @@ def test_marilib_cloud_adapter_init_failed(mqtt_adapter_mock, capsys):
     exit_mock.assert_called_with(1)
     out, _ = capsys.readouterr()
     assert "Error initializing MarilibCloud" in out
+
+
+def test_frame_dispatcher_batches():
+    batches = []
+    release = threading.Event()
+
+    def on_frames_received(frames):
+        release.wait()
+        batches.append(frames)
+
+    dispatcher = FrameDispatcher(on_frames_received)
+    status = Packet().from_payload(PayloadStatus(device=1, status=2))
+    newer_status = Packet().from_payload(PayloadStatus(device=1, status=1))
+    ack = Packet().from_payload(PayloadOTAChunkAck(index=3))
+    # the dispatcher is busy with a first frame while the others are queued
+    dispatcher.put(MariHeader(source=3), ack.to_bytes())
+    time.sleep(0.1)
+    frames = [
+        (MariHeader(source=1), status),
+        (MariHeader(source=2), status),
+        (MariHeader(source=1), ack),
+        (MariHeader(source=1), newer_status),
+    ]
+    for header, packet in frames:
+        dispatcher.put(header, packet.to_bytes())
+    release.set()
+    dispatcher.flush()
+    dispatcher.close()
+
+    assert len(batches) == 2
+    assert [header.source for header, _ in batches[1]] == [1, 2, 1, 1]
+    # only the latest status of a device in a batch is parsed
+    assert [packet for _, packet in batches[1]] == [
+        None,
+        status,
+        ack,
+        newer_status,
+    ]
+
+
+def test_frame_dispatcher_error(capsys):
+    batches = []
+
+    def on_frames_received(frames):
+        batches.append(frames)
+        if len(batches) == 1:
+            raise RuntimeError("handler failure")
+
+    dispatcher = FrameDispatcher(on_frames_received)
+    ack = Packet().from_payload(PayloadOTAChunkAck(index=3))
+    dispatcher.put(MariHeader(source=1), ack.to_bytes())
+    dispatcher.flush()
+    # the frames after a failure are still handled
+    dispatcher.put(MariHeader(source=2), ack.to_bytes())
+    dispatcher.flush()
+    dispatcher.close()
+    assert len(batches) == 2
+    out, _ = capsys.readouterr()
+    assert "Error handling frames" in out
+
+
+class _GatewayMock(GatewayAdapterBase):
+    def __init__(self):
+        self.sent = []
+        self.closed = False
+
+    def init(self, on_frames_received):
+        self.on_frames_received = on_frames_received
+
+    def close(self):
+        self.closed = True
+
+    def send_payload(self, destination, payload):
+        self.sent.append((destination, payload))
+
+
+def test_multi_gateway_adapter():
+    gateways = [_GatewayMock(), _GatewayMock()]
+    adapter = MultiGatewayAdapter(gateways)
+    received = []
+    adapter.init(received.extend)
+    payload = PayloadStatus(device=1, status=2)
+
+    # devices not heard yet are looked for through all the gateways
+    adapter.send_payload(0x02, payload)
+    assert gateways[0].sent == [(0x02, payload)]
+    assert gateways[1].sent == [(0x02, payload)]
+
+    frames = [(MariHeader(source=0x02), Packet().from_payload(payload))]
+    gateways[1].on_frames_received(frames)
+    assert received == frames
+    assert adapter.gateway(0x02) is gateways[1]
+    adapter.send_payload(0x02, payload)
+    assert len(gateways[0].sent) == 1
+    assert gateways[1].sent[-1] == (0x02, payload)
+
+    # broadcast frames go through all the gateways
+    adapter.send_payload(0xFFFFFFFFFFFFFFFF, payload)
+    assert len(gateways[0].sent) == 2
+    assert len(gateways[1].sent) == 3
+
+    adapter.close()
+    assert all(gateway.closed for gateway in gateways)
@@ -6,10 +6,13 @@ from click.testing import CliRunner
 
 from swarmit.cli.main import main
 from swarmit.testbed.controller import (
+    OTA_IMAGE_SIZE_MAX,
     ControllerSettings,
     StartOtaData,
     TransferDataStatus,
 )
+from swarmit.testbed.logstore import LogStoreWriter
+from swarmit.testbed.protocol import ScheduleType
 
 CLI_HELP_EXPECTED = """Usage: main [OPTIONS] COMMAND [ARGS]...
 
@@ -26,18 +29,23 @@ Options:
                               gateway. Default: edge
   -d, --devices TEXT          Subset list of device addresses to interact with,
                               separated with ,
+  -g, --group INTEGER         Group of devices to interact with.
   -v, --verbose               Enable verbose mode.
   -V, --version               Show the version and exit.
   -h, --help                  Show this message and exit.
 
 Commands:
-  flash    Flash a firmware to the robots.
-  message  Send a custom text message to the robots.
-  monitor  Monitor running applications.
-  reset    Reset robots locations.
-  start    Start the user application.
-  status   Print current status of the robots.
-  stop     Stop the user application.
+  flash     Flash a firmware to the robots.
+  groups    Set the groups of the robots.
+  idle      Park the ready robots in low power mode.
+  message   Send a custom text message to the robots.
+  monitor   Monitor running applications.
+  reset     Reset robots locations.
+  schedule  Switch the robots to another Mari schedule.
+  start     Start the user application.
+  status    Print current status of the robots.
+  stop      Stop the user application.
+  stream    Stream the positions of the robots.
 """
 
 
@@ -77,6 +85,33 @@ def test_start_no_device(controller_mock):
     controller.terminate.assert_called_once()
 
 
+@patch("swarmit.cli.main.Controller")
+def test_idle(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    type(controller_mock.return_value).ready_devices = PropertyMock(
+        return_value=["1", "2"]
+    )
+    result = runner.invoke(main, ["idle"])
+    assert result.exit_code == 0
+    controller.idle.assert_called_once_with(enable=True)
+    controller.terminate.assert_called_once()
+
+
+@patch("swarmit.cli.main.Controller")
+def test_idle_wake_no_device(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    type(controller_mock.return_value).idle_devices = PropertyMock(
+        return_value=[]
+    )
+    result = runner.invoke(main, ["idle", "--wake"])
+    assert result.exit_code == 0
+    assert "No device to wake up" in result.output
+    controller.idle.assert_not_called()
+    controller.terminate.assert_called_once()
+
+
 @patch("swarmit.cli.main.Controller")
 def test_stop(controller_mock):
     runner = CliRunner()
@@ -184,6 +219,17 @@ def test_flash_missing_firmware(controller_mock):
     controller.transfer.assert_not_called()
 
 
+@patch("swarmit.cli.main.Controller")
+def test_flash_firmware_too_large(controller_mock, tmp_path):
+    runner = CliRunner()
+    fw_path = tmp_path / "large.bin"
+    fw_path.write_bytes(bytes(OTA_IMAGE_SIZE_MAX + 1))
+    result = runner.invoke(main, ["flash", str(fw_path)])
+    assert result.exit_code == 1
+    assert "doesn't fit" in result.output
+    controller_mock.assert_not_called()
+
+
 @patch("swarmit.cli.main.Controller")
 def test_flash_no_device_ready(controller_mock, fw):
     runner = CliRunner()
@@ -310,6 +356,86 @@ def test_monitor_keyboard_interrupt(controller_mock):
     controller.terminate.assert_called_once()
 
 
+@patch("swarmit.cli.main.Controller")
+def test_monitor_log_store(controller_mock, tmp_path):
+    runner = CliRunner()
+    path = str(tmp_path / "logs.bin")
+    controller_mock().monitor.side_effect = KeyboardInterrupt
+    result = runner.invoke(main, ["monitor", "--log-store", path])
+    assert result.exit_code == 0
+    assert controller_mock.call_args[0][0].log_store == path
+
+
+def test_logs(tmp_path):
+    path = str(tmp_path / "logs.bin")
+    writer = LogStoreWriter(path)
+    writer.append("00000001", 10, b"Hello")
+    writer.append("00000002", 20, b"World")
+    writer.close()
+    runner = CliRunner()
+    result = runner.invoke(main, ["-d", "00000002", "logs", path])
+    assert result.exit_code == 0
+    assert "00000002         20 World" in result.output
+    assert "Hello" not in result.output
+    result = runner.invoke(main, ["logs", "--csv", path])
+    assert result.exit_code == 0
+    assert result.output.splitlines()[0] == "time,device,timestamp,data"
+    assert ",00000001,10,Hello" in result.output
+
+
+@patch("swarmit.cli.main.Controller")
+def test_stream(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    controller.monitor.side_effect = KeyboardInterrupt
+    result = runner.invoke(main, ["stream", "-p", "50", "-b", "3"])
+    assert result.exit_code == 0
+    controller.stream_positions.assert_any_call(50, 3)
+    controller.stream_positions.assert_called_with(0)
+    controller.terminate.assert_called_once()
+
+
+@patch("swarmit.cli.main.Controller")
+def test_groups(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    result = runner.invoke(main, ["-d", "01", "groups", "1,3"])
+    assert result.exit_code == 0
+    controller.set_groups.assert_called_once_with([1, 3])
+    controller.terminate.assert_called_once()
+
+
+@patch("swarmit.cli.main.Controller")
+def test_groups_invalid(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    result = runner.invoke(main, ["groups", "a,b"])
+    assert result.exit_code == 0
+    assert "invalid groups" in result.output
+    controller.set_groups.assert_not_called()
+
+
+@patch("swarmit.cli.main.Controller")
+def test_group_option(controller_mock):
+    runner = CliRunner()
+    result = runner.invoke(main, ["-g", "31", "start"])
+    assert result.exit_code != 0
+    result = runner.invoke(main, ["-g", "0", "start"])
+    assert result.exit_code == 0
+    assert controller_mock.call_args.args[0].group == 0
+
+
+@patch("swarmit.cli.main.Controller")
+def test_schedule(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    result = runner.invoke(main, ["schedule", "huge"])
+    assert result.exit_code == 0
+    assert "Switch the gateway to the huge schedule" in result.output
+    controller.set_schedule.assert_called_once_with(ScheduleType.Huge)
+    controller.terminate.assert_called_once()
+
+
 @patch("swarmit.cli.main.Controller")
 def test_status(controller_mock):
     runner = CliRunner()
@@ -330,6 +456,30 @@ def test_status_watch(controller_mock):
     controller.terminate.assert_called_once()
 
 
+@patch("swarmit.cli.main.Controller")
+def test_profile(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    controller.profile.return_value = {}
+    result = runner.invoke(main, ["profile"])
+    assert result.exit_code == 0
+    assert "No profile received" in result.output
+    controller.profile.assert_called_once()
+    controller.terminate.assert_called_once()
+
+
+@patch("swarmit.cli.main.Controller")
+def test_trace(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    controller.trace.return_value = {}
+    result = runner.invoke(main, ["trace", "-c", "3", "-i", "0.1"])
+    assert result.exit_code == 0
+    assert "No trace received" in result.output
+    controller.trace.assert_called_once_with(3, 0.1)
+    controller.terminate.assert_called_once()
+
+
 TEST_CONFIG_TOML = """
 adapter = "edge"
 serial_port = "/dev/ttyACM0"
@@ -361,3 +511,15 @@ def test_message(controller_mock):
     assert result.exit_code == 0
     controller.send_message.assert_called_with(msg)
     controller.terminate.assert_called_once()
+
+
+@patch("swarmit.cli.main.Controller")
+def test_links(controller_mock):
+    runner = CliRunner()
+    controller = controller_mock()
+    controller.probe_links.return_value = {}
+    result = runner.invoke(main, ["links", "-c", "3"])
+    assert result.exit_code == 0
+    assert "No device probed" in result.output
+    controller.probe_links.assert_called_once_with(3)
+    controller.terminate.assert_called_once()
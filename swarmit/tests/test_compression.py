@@ -0,0 +1,54 @@
+import random
+
+from swarmit.testbed.compression import (
+    LZ_MATCH_FLAG,
+    LZ_MAX_MATCH,
+    LZ_WINDOW_SIZE,
+    compress,
+    decompress,
+)
+
+
+def _random_bytes(size, seed=42):
+    rng = random.Random(seed)
+    return bytes(rng.randrange(256) for _ in range(size))
+
+
+def test_compression_padding():
+    image = _random_bytes(1000) + bytes(8000) + _random_bytes(500, seed=1)
+    stream = compress(image)
+    assert len(stream) < 1800
+    assert decompress(stream) == image
+
+
+def test_compression_repeated_pattern():
+    image = bytes(range(64)) * 100
+    stream = compress(image)
+    assert len(stream) < len(image) / 20
+    assert decompress(stream) == image
+
+
+def test_compression_references_in_window():
+    image = _random_bytes(3 * LZ_WINDOW_SIZE) + bytes(LZ_MAX_MATCH + 1)
+    stream = compress(image)
+    pos, produced = 0, 0
+    while pos < len(stream):
+        token = stream[pos]
+        if token & LZ_MATCH_FLAG:
+            distance = int.from_bytes(stream[pos + 1 : pos + 3], "little")
+            assert 0 < distance <= min(produced, LZ_WINDOW_SIZE)
+            produced += (token & ~LZ_MATCH_FLAG) + 3
+            pos += 3
+        else:
+            produced += token + 1
+            pos += token + 2
+    assert produced == len(image)
+    assert decompress(stream) == image
+
+
+def test_compression_incompressible():
+    image = _random_bytes(2000, seed=3)
+    stream = compress(image)
+    assert len(stream) <= len(image) + len(image) // 128 + 1
+    assert decompress(stream) == image
+    assert compress(b"") == b""
@@ -1,18 +1,38 @@
+import hashlib
 import logging
+import threading
 import time
+import zlib
 from unittest.mock import patch
 
+import pytest
 from marilib.model import GatewayInfo, MariGateway
 
 from swarmit.testbed.controller import (
+    CHUNK_SIZE,
+    OTA_IMAGE_SIZE_MAX,
+    AsnClock,
     Chunk,
+    ChunkPlanCache,
     Controller,
     ControllerSettings,
+    InstalledImage,
     ResetLocation,
+    UploadInfo,
+    generate_trace,
 )
 from swarmit.testbed.logger import setup_logging
-from swarmit.testbed.protocol import StatusType
+from swarmit.testbed.logstore import LogStoreReader
+from swarmit.testbed.protocol import (
+    OTAMode,
+    PayloadGroup,
+    PayloadType,
+    ProfileSection,
+    ScheduleType,
+    StatusType,
+)
 from swarmit.tests.utils import (
+    SLOT_DURATION,
     ChunkAckStrategy,
     MarilibMQTTAdapterMock,
     MarilibSerialAdapterMock,
@@ -82,6 +102,75 @@ def test_controller_start_broadcast():
     controller.start(timeout=0.1)
     time.sleep(0.3)
     assert all([node.status == StatusType.Running for node in nodes]) is True
+    # the first attempt was answered, its delay tunes the next commands
+    assert controller.command_rtt["FFFFFFFFFFFFFFFF"].samples == 1
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.COMMAND_ATTEMPT_DELAY", 5)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_start_wakes_up_on_status():
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter)
+        for addr in [0x01, 0x02]
+    ]
+    for node in nodes:
+        test_adapter.add_node(node)
+    assert len(controller.ready_devices) == 2
+
+    # the wait ends with the status of the started devices, not the delay
+    start_time = time.time()
+    controller.start(timeout=0.1)
+    assert time.time() - start_time < 1
+    assert all([node.status == StatusType.Running for node in nodes]) is True
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.SCHEDULE_TRACE_INTERVAL", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_start_stop_synchronized():
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter)
+        for addr in [0x01, 0x02]
+    ]
+    for node in nodes:
+        test_adapter.add_node(node)
+
+    controller.start(timeout=0.1, synchronized=True)
+    slot_duration = controller.asn_clock.slot_duration
+    assert SLOT_DURATION / 2 < slot_duration < SLOT_DURATION * 2
+    # all the attempts carried the same ASN, the devices started at it
+    asn = nodes[0].scheduled_asn
+    assert asn and all(node.scheduled_asn == asn for node in nodes)
+    for node in nodes:
+        assert node.status == StatusType.Running
+        assert asn <= node.status_asn <= asn + 10
+
+    time.sleep(0.3)
+    controller.stop(timeout=0.1, synchronized=True)
+    assert nodes[0].scheduled_asn > asn
+    assert all([node.status == StatusType.Bootloader for node in nodes])
+
+
+def test_asn_clock():
+    clock = AsnClock()
+    assert clock.asn_at(10) == 0
+    clock.add(1000, 1.0)
+    assert clock.slot_duration == 0
+    clock.add(3000, 3.0)
+    assert clock.slot_duration == 0.001
+    assert clock.asn_at(3.5) == 3500
+    # the network started again
+    clock.add(10, 4.0)
+    assert clock.slot_duration == 0
 
 
 @patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
@@ -198,6 +287,34 @@ def test_controller_stop_unicast():
     assert nodes[2].status == StatusType.Bootloader
 
 
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.COMMAND_ATTEMPT_DELAY", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_idle(capsys):
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter)
+        for addr in [0x01, 0x02]
+    ]
+    for node in nodes:
+        test_adapter.add_node(node)
+
+    controller.idle(timeout=0.1)
+    time.sleep(0.3)
+    assert all([node.status == StatusType.Idle for node in nodes]) is True
+    out, _ = capsys.readouterr()
+    assert "~10.0mWh" in out
+
+    controller.idle(enable=False, timeout=0.1)
+    time.sleep(0.3)
+    assert (
+        all([node.status == StatusType.Bootloader for node in nodes]) is True
+    )
+
+
 @patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
 @patch(
     "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
@@ -227,6 +344,33 @@ def test_controller_status(capsys):
     assert f"{1500/1000:.2f}V" in out
 
 
+@patch("swarmit.testbed.controller.INACTIVE_TIMEOUT", 0.3)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_status_request():
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+    test_adapter = controller.interface.mari.serial_interface
+    # status sent once, then only when requested
+    node = SwarmitNode(address=0x01, adapter=test_adapter, update_interval=60)
+    test_adapter.add_node(node)
+    time.sleep(0.1)
+    assert list(controller.status_data.keys()) == ["00000001"]
+
+    time.sleep(1.5)
+    assert controller.status_data == {}
+    controller.request_status()
+    time.sleep(0.1)
+    assert list(controller.status_data.keys()) == ["00000001"]
+
+    # other frames keep the device alive between status heartbeats
+    node.log_event_task.event_interval = 0.1
+    node.start_log_event_task()
+    time.sleep(1.5)
+    assert list(controller.status_data.keys()) == ["00000001"]
+    controller.terminate()
+
+
 @patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
 @patch(
     "swarmit.testbed.adapter.MarilibMQTTAdapter",
@@ -384,6 +528,239 @@ def test_controller_monitor_single_device(caplog):
     controller.terminate()
 
 
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_monitor_log_batch(caplog):
+    caplog.set_level(logging.INFO)
+    setup_logging()
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter)
+    test_adapter.add_node(node)
+    node.start_log_event_task(batch=True)
+
+    controller.monitor(run_forever=False, timeout=0.1)
+    assert caplog.text.count("Node 00000001 log event") >= 2
+    assert "LOG records dropped" in caplog.text
+    assert controller.log_dropped["00000001"] >= 1
+    controller.terminate()
+
+
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_monitor_log_store(caplog, tmp_path):
+    caplog.set_level(logging.INFO)
+    setup_logging()
+    path = str(tmp_path / "logs.bin")
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, log_store=path)
+    )
+
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter)
+    test_adapter.add_node(node)
+    node.start_log_event_task(batch=True)
+
+    controller.monitor(run_forever=False, timeout=0.1)
+    controller.terminate()
+    # the records are stored instead of logged
+    assert "LOG event" not in caplog.text
+    with LogStoreReader(path) as reader:
+        records = list(reader.records())
+    assert len(records) >= 2
+    assert {record.device_addr for record in records} == {"00000001"}
+    assert records[0].text() == "Node 00000001 log event"
+
+
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_stream_positions(caplog):
+    caplog.set_level(logging.INFO)
+    setup_logging()
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter, update_interval=60)
+    test_adapter.add_node(node)
+    time.sleep(0.1)
+
+    controller.stream_positions(period_ms=20, batch=4)
+    controller.monitor(run_forever=False, timeout=0.1)
+    assert "POSITION batch" in caplog.text
+    assert controller.status_data["00000001"].pos_x == 2530
+    controller.terminate()
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.COMMAND_ATTEMPT_DELAY", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_group():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1, devices=["00000001", "00000003"]
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter)
+        for addr in [0x01, 0x02, 0x03]
+    ]
+    for node in nodes:
+        test_adapter.add_node(node)
+
+    controller.set_groups([2])
+    time.sleep(0.1)
+    assert [node.groups for node in nodes] == [0b100, 0, 0b100]
+    assert controller.status_data["00000001"].groups == 0b100
+
+    controller.settings.devices = []
+    controller.settings.group = 2
+    assert sorted(controller.ready_devices) == ["00000001", "00000003"]
+    with patch.object(
+        controller.interface,
+        "send_payload",
+        wraps=controller.interface.send_payload,
+    ) as send_payload:
+        controller.start(timeout=0.1)
+        time.sleep(0.3)
+    assert [node.status for node in nodes] == [
+        StatusType.Running,
+        StatusType.Bootloader,
+        StatusType.Running,
+    ]
+    # a single group frame reaches both devices
+    payload = send_payload.call_args_list[0].args[1]
+    assert isinstance(payload, PayloadGroup)
+    assert payload.group == 2
+    controller.terminate()
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.COMMAND_ATTEMPT_DELAY", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_profile(caplog):
+    caplog.set_level(logging.INFO)
+    setup_logging()
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, devices=["00000002"])
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    for addr in [0x01, 0x02]:
+        test_adapter.add_node(SwarmitNode(address=addr, adapter=test_adapter))
+
+    profiles = controller.profile()
+    assert list(profiles) == ["00000002"]
+    counters = profiles["00000002"]
+    assert [counter.section for counter in counters] == list(ProfileSection)
+    erase = counters[ProfileSection.PageErase.value]
+    assert (erase.count, erase.min, erase.max) == (2, 19000, 21000)
+    assert erase.avg == 20000
+    assert counters[ProfileSection.OtaHash.value].count == 0
+    assert "PROFILE counters" in caplog.text
+    controller.terminate()
+
+
+@patch("swarmit.testbed.controller.LINK_PROBE_TIMEOUT", 0.2)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_probe_links():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_timeout=0.7)
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter) for addr in [1, 2]
+    ]
+    nodes[1].probes_to_drop = 2
+    for node in nodes:
+        test_adapter.add_node(node)
+
+    # devices never probed keep the configured timeout and retries
+    assert controller._ota_timeout(["00000001"]) == 0.7
+    assert controller._ota_retries(["00000001"]) == 10
+
+    links = controller.probe_links(count=4)
+    assert sorted(links) == ["00000001", "00000002"]
+    strong, weak = links["00000001"], links["00000002"]
+    assert (strong.probes_sent, strong.probes_received) == (4, 4)
+    assert strong.pdr == 1
+    assert strong.rssi == -60
+    assert strong.node_rx_count == 4
+    assert weak.pdr == 0.5
+    assert weak.node_rx_count == 2
+
+    # the strong link waits less than the configured timeout
+    assert strong.ota_timeout(0.7) < 0.7
+    assert strong.ota_retries(10) == 10
+    assert weak.ota_retries(10) == 20
+    assert controller._ota_retries(["00000001", "00000002"]) == 20
+    assert controller._ota_timeout(["00000001"]) == strong.ota_timeout(0.7)
+    controller.terminate()
+
+
+@patch("swarmit.testbed.controller.TRACE_REPLY_TIMEOUT", 0.5)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_trace(caplog):
+    caplog.set_level(logging.INFO)
+    setup_logging()
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter) for addr in [1, 2]
+    ]
+    nodes[1].status = StatusType.Running
+    for node in nodes:
+        test_adapter.add_node(node)
+
+    traces = controller.trace(count=2, interval=0.01)
+    assert sorted(traces) == ["00000001", "00000002"]
+    for device_addr, image_time in [("00000001", 0), ("00000002", 2)]:
+        samples = traces[device_addr]
+        assert len(samples) == 2
+        for sample in samples:
+            assert sample.netcore == 1
+            assert sample.user_image == image_time
+            assert sample.reply == 0.5
+            assert sample.slots == 3
+            assert sample.network <= sample.round_trip
+    assert "TRACE sample" in caplog.text
+    text = generate_trace(traces).renderables[0]
+    assert "Latency of 4 traced packets from 2 devices" in str(text)
+    controller.terminate()
+
+
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_set_schedule():
+    controller = Controller(ControllerSettings(adapter_wait_timeout=0.1))
+    test_adapter = controller.interface.mari.serial_interface
+    node1 = SwarmitNode(address=0x01, adapter=test_adapter)
+    node2 = SwarmitNode(
+        address=0x02, status=StatusType.Running, adapter=test_adapter
+    )
+    for node in [node1, node2]:
+        test_adapter.add_node(node)
+
+    controller.set_schedule(ScheduleType.Huge)
+    time.sleep(0.1)
+    # running experiments keep their schedule
+    assert node1.schedule == ScheduleType.Huge
+    assert node2.schedule == ScheduleType.Tiny
+    controller.terminate()
+
+
 @patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
 @patch(
     "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
@@ -463,6 +840,39 @@ def test_controller_ota_broadcast():
     assert all([transfer.success for transfer in result.values()]) is True
 
 
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.OTA_ACK_TIMEOUT_DEFAULT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_multi_gateway():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, gateways=["port2"])
+    )
+    # one device on each gateway
+    nodes = []
+    for addr, gateway in zip([0x01, 0x02], controller.interface.adapters):
+        test_adapter = gateway.mari.serial_interface
+        node = SwarmitNode(address=addr, adapter=test_adapter)
+        test_adapter.add_node(node)
+        nodes.append(node)
+    assert controller.interface.adapters[1].mari.serial_interface.port == (
+        "port2"
+    )
+
+    firmware = bytes(range(256)) * 64
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001", "00000002"]
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert all(transfer.success for transfer in result.values())
+    for index, node in enumerate(nodes):
+        assert node.image == firmware
+        assert controller.interface.gateway(node.address) is (
+            controller.interface.adapters[index]
+        )
+    controller.terminate()
+
+
 @patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
 @patch("swarmit.testbed.controller.OTA_ACK_TIMEOUT_DEFAULT", 0.1)
 @patch(
@@ -604,9 +1014,565 @@ def test_controller_ota_index_out_range(capsys):
     assert sum(chunk.retries for chunk in result["00000001"].chunks) == 3
 
 
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_window_selective_retransmit():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            ota_max_retries=3,
+            ota_window_size=4,
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(
+        address=0x01,
+        ack_strategy=ChunkAckStrategy(ack_miss_index=5, ack_miss_retries=2),
+        adapter=test_adapter,
+    )
+    test_adapter.add_node(node)
+
+    firmware = b"\x00" * 2**12
+
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == [f"{node.address:08X}"]
+
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    # only the chunk with missing acks is sent again
+    assert [
+        chunk.retries
+        for chunk in result["00000001"].chunks
+        if chunk.retries > 0
+    ] == [2]
+    assert result["00000001"].chunks[5].retries == 2
+    assert node.status == StatusType.Bootloader
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_broadcast_cumulative_ack():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            ota_window_size=8,
+            ota_ack_interval=8,
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    node1 = SwarmitNode(
+        address=0x01, adapter=test_adapter, cumulative_ack=True
+    )
+    node2 = SwarmitNode(
+        address=0x02,
+        ack_strategy=ChunkAckStrategy(ack_miss_index=5, ack_miss_retries=1),
+        adapter=test_adapter,
+        cumulative_ack=True,
+    )
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+
+    firmware = b"\x00" * 2**12
+    ota_data = controller.start_ota(firmware)
+    chunks_count = ota_data["ota"].chunks
+    assert sorted(ota_data["acked"]) == ["00000001", "00000002"]
+
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert result["00000002"].success is True
+    assert node1.status == StatusType.Bootloader
+    assert node2.status == StatusType.Bootloader
+    # one ack every 8 chunks instead of one per chunk
+    assert node1.acks_sent < chunks_count / 4
+    assert node2.acks_sent < chunks_count / 4
+    # the chunk timeout follows the delays of the acks
+    rtt = controller.ota_rtt[
+        (PayloadType.SWARMIT_OTA_CHUNK, "FFFFFFFFFFFFFFFF")
+    ]
+    assert rtt.samples > 0
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_broadcast_fec():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            ota_fec_group=4,
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    # each node loses a different chunk
+    node1 = SwarmitNode(
+        address=0x01,
+        ack_strategy=ChunkAckStrategy(ack_miss_index=9, ack_miss_retries=1),
+        adapter=test_adapter,
+        cumulative_ack=True,
+    )
+    node2 = SwarmitNode(
+        address=0x02,
+        ack_strategy=ChunkAckStrategy(ack_miss_index=5, ack_miss_retries=1),
+        adapter=test_adapter,
+        cumulative_ack=True,
+    )
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+
+    firmware = bytes(range(256)) * 10
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["ota"].fec_group == 4
+    assert node1.fec_group == 4
+
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert result["00000002"].success is True
+    assert node1.image == firmware
+    assert node2.image == firmware
+    # the lost chunks are recovered from the repairs, not sent again
+    assert node1.chunks_recovered == 1
+    assert node2.chunks_recovered == 1
+    assert result["00000001"].chunks[9].retries == 0
+    assert result["00000002"].chunks[5].retries == 0
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_fec_group_invalid():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_fec_group=64)
+    )
+    with pytest.raises(ValueError):
+        controller.start_ota(b"\x00" * 256)
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_image_too_large():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_timeout=0.1)
+    )
+    with pytest.raises(ValueError):
+        controller.start_ota(bytes(OTA_IMAGE_SIZE_MAX + 1))
+    assert not controller.ota_sessions
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_delta(tmp_path):
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            ota_delta=True,
+            ota_image_cache=str(tmp_path),
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter)
+    test_adapter.add_node(node)
+
+    firmware = bytes(range(256)) * 64
+
+    # nothing cached yet, the full image is sent
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["ota"].mode == OTAMode.Raw
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert node.image == firmware
+    assert (tmp_path / "00000001.bin").read_bytes() == firmware
+
+    new_firmware = firmware[:100] + b"\x42" + firmware[101:]
+    ota_data = controller.start_ota(new_firmware)
+    assert ota_data["acked"] == ["00000001"]
+    assert ota_data["ota"].mode == OTAMode.Delta
+    assert ota_data["ota"].chunks == 1
+    result = controller.transfer(new_firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert node.image == new_firmware
+
+    # the device refuses a delta computed against another image
+    node.image = b""
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001"]
+    assert ota_data["ota"].mode == OTAMode.Raw
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert node.image == firmware
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_compressed():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1, ota_timeout=0.1, ota_compress=True
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter)
+    test_adapter.add_node(node)
+
+    firmware = bytes(range(256)) * 16 + bytes(8192)
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001"]
+    assert ota_data["ota"].mode == OTAMode.Compressed
+    assert ota_data["ota"].image_size == len(firmware)
+    assert ota_data["ota"].chunks < len(firmware) / CHUNK_SIZE / 10
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert node.image == firmware
+
+    # a device that cannot store the compressed stream gets the raw image
+    node.ota_modes = (OTAMode.Raw,)
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001"]
+    assert ota_data["ota"].mode == OTAMode.Raw
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert node.image == firmware
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_plan_cache(tmp_path):
+    settings = ControllerSettings(
+        adapter_wait_timeout=0.1,
+        ota_timeout=0.1,
+        ota_compress=True,
+        ota_plan_cache=str(tmp_path),
+    )
+    firmware = bytes(range(256)) * 16 + bytes(8192)
+    controller = Controller(settings)
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter)
+    test_adapter.add_node(node)
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["ota"].mode == OTAMode.Compressed
+    chunks = controller.chunks
+    assert len(list(tmp_path.glob("*.plan"))) == 1
+
+    # the same session chunks are reused, without compressing again
+    with patch("swarmit.testbed.controller.compress") as compress_mock:
+        ota_data = controller.start_ota(firmware)
+        assert controller.chunks is chunks
+        controller.terminate()
+
+        # a new controller reads the plan stored by the previous one
+        controller = Controller(settings)
+        test_adapter = controller.interface.mari.serial_interface
+        node = SwarmitNode(address=0x01, adapter=test_adapter)
+        test_adapter.add_node(node)
+        ota_data = controller.start_ota(firmware)
+    compress_mock.assert_not_called()
+    assert ota_data["ota"].mode == OTAMode.Compressed
+    assert controller.chunks == chunks
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    assert node.image == firmware
+    controller.terminate()
+
+
+def test_chunk_plan_cache(tmp_path):
+    chunks = Controller._make_chunks(bytes(range(256)) * 4, 128)
+    cache = ChunkPlanCache(str(tmp_path), size=2)
+    for index in range(3):
+        cache.put(bytes([index]) * 32, OTAMode.Raw, 128, chunks)
+    assert cache.get(bytes([2]) * 32, OTAMode.Raw, 128) is chunks
+    assert cache.get(bytes([2]) * 32, OTAMode.Raw, 64) is None
+    assert cache.get(bytes([2]) * 32, OTAMode.Compressed, 128) is None
+
+    # the oldest plan left the memory but is read back from its file
+    assert cache.get(bytes([0]) * 32, OTAMode.Raw, 128) == chunks
+    assert (cache.hits, cache.misses) == (2, 2)
+
+    # a corrupted file is ignored
+    path = next(tmp_path.glob(f"{(bytes([1]) * 32).hex()}-*.plan"))
+    path.write_bytes(path.read_bytes()[:-1] + b"\x00")
+    assert (
+        ChunkPlanCache(str(tmp_path)).get(bytes([1]) * 32, OTAMode.Raw, 128)
+        is None
+    )
+    assert ChunkPlanCache().get(bytes([0]) * 32, OTAMode.Raw, 128) is None
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_install_wait():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_timeout=0.1)
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    node = SwarmitNode(address=0x01, adapter=test_adapter, install_time=0.5)
+    test_adapter.add_node(node)
+
+    firmware = bytes(range(256)) * 8
+    ota_data = controller.start_ota(firmware)
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000001"].success is True
+    # the transfer ends once the device is ready to start the image
+    assert node.status == StatusType.Bootloader
+    assert controller.ready_devices == ["00000001"]
+    controller.terminate()
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_finalize():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_timeout=0.1)
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    node1 = SwarmitNode(address=0x01, adapter=test_adapter)
+    node2 = SwarmitNode(address=0x02, adapter=test_adapter, corrupt_image=True)
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+
+    firmware = bytes(range(256)) * 8
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001", "00000002"]
+    result = controller.transfer(firmware, ota_data["acked"])
+    # all chunks are acked but the second image doesn't match
+    assert all(chunk.acked for chunk in result["00000002"].chunks)
+    assert result["00000001"].verified is True
+    assert result["00000001"].hash == ota_data["ota"].fw_hash
+    assert result["00000001"].success is True
+    assert result["00000002"].verified is False
+    assert result["00000002"].hash != ota_data["ota"].fw_hash
+    assert result["00000002"].success is False
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_unicast_pipelines():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            devices=["00000001", "00000002"],
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    # the first device misses the first chunk a few times
+    node1 = SwarmitNode(
+        address=0x01,
+        adapter=test_adapter,
+        ack_strategy=ChunkAckStrategy(ack_miss_index=0, ack_miss_retries=2),
+    )
+    node2 = SwarmitNode(address=0x02, adapter=test_adapter)
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+    sent = []
+    send_chunk = controller.send_chunk
+
+    def send_chunk_spy(session, chunk, device_addr, *args):
+        sent.append(device_addr)
+        send_chunk(session, chunk, device_addr, *args)
+
+    firmware = bytes(range(256)) * 16
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001", "00000002"]
+    with patch.object(controller, "send_chunk", send_chunk_spy):
+        result = controller.transfer(firmware, ota_data["acked"])
+    # the chunks of both devices are sent at the same time
+    assert sent.index("00000002") < len(sent) - sent[::-1].index("00000001")
+    assert result["00000001"].chunks[0].retries == 2
+    for addr in ota_data["acked"]:
+        assert result[addr].success is True
+    assert node1.image == node2.image == firmware
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_skip_unchanged():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            ota_skip_unchanged=True,
+            devices=["00000001", "00000002"],
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    firmware = bytes((i * 7) % 251 for i in range(5 * 4096 + 100))
+    modified = bytearray(firmware)
+    modified[2 * 4096 + 10] ^= 0xFF
+    node1 = SwarmitNode(address=0x01, adapter=test_adapter, image=firmware)
+    node2 = SwarmitNode(
+        address=0x02, adapter=test_adapter, image=bytes(modified)
+    )
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["acked"] == ["00000001", "00000002"]
+    chunks = ota_data["ota"].chunks
+    # the same image is already installed on the first device
+    assert ota_data["ota"].skipped_chunks["00000001"] == set(range(chunks))
+    # chunks 42 to 63 cover the modified page on the second one
+    assert ota_data["ota"].skipped_chunks["00000002"] == set(
+        range(chunks)
+    ) - set(range(42, 64))
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert node1.acks_sent == 0
+    assert 22 <= node2.acks_sent < chunks
+    for addr in ota_data["acked"]:
+        assert result[addr].verified is True
+        assert result[addr].success is True
+    assert node2.image == firmware
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_skip_installed():
+    controller = Controller(
+        ControllerSettings(
+            adapter_wait_timeout=0.1,
+            ota_timeout=0.1,
+            ota_skip_installed=True,
+        )
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    firmware = bytes((i * 7) % 251 for i in range(4096 + 100))
+    node1 = SwarmitNode(address=0x01, adapter=test_adapter, image=firmware)
+    node2 = SwarmitNode(address=0x02, adapter=test_adapter)
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+
+    assert controller.installed_images(["00000001", "00000002"]) == {
+        "00000001": InstalledImage(
+            size=len(firmware), sha=hashlib.sha256(firmware).digest()
+        )
+    }
+    ota_data = controller.start_ota(firmware)
+    # the first device already runs the image, it is not started
+    assert ota_data["up_to_date"] == ["00000001"]
+    assert ota_data["acked"] == ["00000002"]
+    assert node1.status == StatusType.Bootloader
+    result = controller.transfer(firmware, ota_data["acked"])
+    assert result["00000002"].success is True
+    assert node1.acks_sent == 0
+    assert node2.image == firmware
+
+    # both devices are up to date now, once the second one reports it is
+    # ready again
+    time.sleep(0.3)
+    ota_data = controller.start_ota(firmware)
+    assert ota_data["session"] is None
+    assert ota_data["up_to_date"] == ["00000001", "00000002"]
+    assert ota_data["acked"] == []
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch("swarmit.testbed.controller.COMMAND_ATTEMPT_DELAY", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_upload():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_timeout=0.1)
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    data = bytes((i * 13) % 253 for i in range(20 * 192 + 50))
+    node1 = SwarmitNode(address=0x01, adapter=test_adapter, upload=data)
+    # chunks lost once, in the first window and in a later one
+    node1.upload_chunks_to_drop = {1, 6, 17}
+    node2 = SwarmitNode(address=0x02, adapter=test_adapter)
+    test_adapter.add_node(node1)
+    test_adapter.add_node(node2)
+
+    # the second device offers nothing and is left out
+    assert controller.offered_uploads(["00000001", "00000002"]) == {
+        "00000001": UploadInfo(
+            session=1, size=len(data), crc=zlib.crc32(data)
+        )
+    }
+    assert controller.upload() == {"00000001": data}
+    assert node1.upload_chunks_to_drop == set()
+    controller.terminate()
+
+
+@patch("swarmit.testbed.controller.COMMAND_TIMEOUT", 0.1)
+@patch(
+    "swarmit.testbed.adapter.MarilibSerialAdapter", MarilibSerialAdapterMock
+)
+def test_controller_ota_concurrent_sessions():
+    controller = Controller(
+        ControllerSettings(adapter_wait_timeout=0.1, ota_timeout=0.1)
+    )
+    test_adapter = controller.interface.mari.serial_interface
+    nodes = [
+        SwarmitNode(address=addr, adapter=test_adapter)
+        for addr in [0x01, 0x02]
+    ]
+    for node in nodes:
+        test_adapter.add_node(node)
+    firmwares = [b"\x01" * 4000, b"\x02" * 5000]
+    ota_data = [
+        controller.start_ota(firmware, [f"{node.address:08X}"])
+        for node, firmware in zip(nodes, firmwares)
+    ]
+    assert ota_data[0]["session"] != ota_data[1]["session"]
+    assert [data["acked"] for data in ota_data] == [
+        ["00000001"],
+        ["00000002"],
+    ]
+
+    # chunks are broadcast, each device only keeps the ones of its session
+    results = {}
+
+    def transfer(index):
+        results[index] = controller.transfer(
+            firmwares[index],
+            ota_data[index]["acked"],
+            session=ota_data[index]["session"],
+        )
+
+    threads = [
+        threading.Thread(target=transfer, args=(index,)) for index in [0, 1]
+    ]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    assert results[0]["00000001"].success is True
+    assert results[1]["00000002"].success is True
+    assert [node.image for node in nodes] == firmwares
+    assert controller.ota_sessions == {}
+
+
 def test_controller_chunk_repr():
     chunk = Chunk(index=42, size=128, acked=True, retries=2)
     assert (
         repr(chunk)
         == "{'index': 42, 'size': 128, 'acked': True, 'retries': 2}"
     )
+
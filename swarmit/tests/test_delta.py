@@ -0,0 +1,63 @@
+import random
+
+from swarmit.testbed.delta import (
+    DELTA_OP_COPY,
+    DELTA_OP_HEADER_SIZE,
+    apply_patch,
+    make_patch,
+)
+
+
+def _random_bytes(size, seed=42):
+    rng = random.Random(seed)
+    return bytes(rng.randrange(256) for _ in range(size))
+
+
+def test_delta_small_edit():
+    old = _random_bytes(3 * 4096 + 100)
+    new = bytearray(old)
+    new[5000:5004] = b"\xde\xad\xbe\xef"
+    new = bytes(new)
+    patch, stats = make_patch(old, new)
+    assert stats.literal == 4
+    assert stats.copied == len(new) - 4
+    assert len(patch) < 100
+    assert apply_patch(old, patch, len(new)) == new
+
+
+def test_delta_insertion_in_place():
+    old = _random_bytes(4 * 4096)
+    new = old[:1000] + b"inserted" + old[1000:] + b"tail"
+    patch, stats = make_patch(old, new)
+    assert len(patch) < len(new) / 10
+    # copies never cross the boundary of the page being rebuilt
+    pos, dest = 0, 0
+    while pos < len(patch):
+        length = int.from_bytes(patch[pos + 1 : pos + 3], "little")
+        if patch[pos] == DELTA_OP_COPY:
+            assert dest // 4096 == (dest + length - 1) // 4096
+            pos += DELTA_OP_HEADER_SIZE
+        else:
+            pos += DELTA_OP_HEADER_SIZE + length
+        dest += length
+    assert dest == len(new)
+    assert apply_patch(old, patch, len(new)) == new
+
+
+def test_delta_block_moved_backward():
+    old = _random_bytes(4 * 4096)
+    # the image is rebuilt out of place, copies read old pages already passed
+    new = old[2 * 4096 :] + old[: 2 * 4096]
+    patch, stats = make_patch(old, new)
+    assert stats.literal == 0
+    assert apply_patch(old, patch, len(new)) == new
+
+
+def test_delta_unrelated_images():
+    old = _random_bytes(4096, seed=1)
+    new = _random_bytes(6000, seed=2)
+    patch, stats = make_patch(old, new)
+    assert stats.copied == 0
+    assert apply_patch(old, patch, len(new)) == new
+    patch, _ = make_patch(b"", new)
+    assert apply_patch(b"", patch, len(new)) == new
@@ -0,0 +1,68 @@
+import random
+
+from swarmit.testbed.fec import (
+    FEC_GROUP_MAX,
+    FEC_REPAIRS_MAX,
+    coefficient,
+    gf_inv,
+    gf_mul,
+    recover,
+    repair_chunk,
+    repair_index,
+)
+
+
+def test_gf_arithmetic():
+    assert gf_mul(0, 0x53) == 0
+    assert gf_mul(1, 0x53) == 0x53
+    assert gf_mul(2, 0x80) == 0x1D  # reduced by the polynomial
+    for value in range(1, 256):
+        assert gf_mul(value, gf_inv(value)) == 1
+
+
+def test_repair_xor_of_one_chunk():
+    chunk = bytes(range(16))
+    repair = repair_chunk([chunk], 0, 20)
+    assert len(repair) == 20
+    assert repair == bytes(
+        gf_mul(coefficient(0, 0), value) for value in chunk
+    ) + bytes(4)
+
+
+def test_repair_index():
+    assert repair_index(100, 0, 0) == 100
+    assert repair_index(100, 2, 3) == 100 + 2 * FEC_REPAIRS_MAX + 3
+
+
+def test_recover_nothing_missing():
+    chunks = [b"\x01\x02", b"\x03"]
+    assert recover(chunks, {}, [2, 1]) == chunks
+
+
+def test_recover_not_enough_repairs():
+    chunks = [b"\x01\x02", None, None]
+    repairs = {0: b"\x00\x00"}
+    assert recover(chunks, repairs, [2, 2, 2]) is None
+
+
+def test_recover_any_repairs():
+    generator = random.Random(1)
+    chunks = [generator.randbytes(64) for _ in range(FEC_GROUP_MAX - 1)]
+    chunks.append(generator.randbytes(10))  # the last chunk is shorter
+    sizes = [len(chunk) for chunk in chunks]
+    repairs = {
+        repair: repair_chunk(chunks, repair, 64)
+        for repair in range(FEC_REPAIRS_MAX)
+    }
+    for missing_count in range(1, FEC_REPAIRS_MAX + 1):
+        missing = generator.sample(range(len(chunks)), missing_count)
+        received = [
+            None if index in missing else chunk
+            for index, chunk in enumerate(chunks)
+        ]
+        # any repairs of the group, as many as the missing chunks
+        used = {
+            repair: repairs[repair]
+            for repair in generator.sample(sorted(repairs), missing_count)
+        }
+        assert recover(received, used, sizes) == chunks
@@ -0,0 +1,74 @@
+from swarmit.testbed.link import RTO_MAX, RTO_MIN, LinkStats, RttEstimator
+
+
+def test_link_stats_not_probed():
+    link = LinkStats()
+    assert link.pdr == 1
+    assert link.ota_timeout(0.7) == 0.7
+    assert link.ota_retries(10) == 10
+
+
+def test_link_stats_never_answered():
+    link = LinkStats(probes_sent=5)
+    assert link.pdr == 0
+    assert link.ota_timeout(0.7) == 2.8
+    assert link.ota_retries(10) == 40
+
+
+def test_link_stats_add_probe():
+    link = LinkStats(probes_sent=2)
+    link.add_probe(0.1, -70, now=1)
+    assert link.latency == 0.1
+    assert link.rssi == -70
+    link.add_probe(0.5, -78, now=2)
+    assert link.latency == 0.1 + 0.125 * 0.4
+    assert link.rssi == -71
+    assert link.latency_max == 0.5
+    assert link.updated_at == 2
+    assert link.pdr == 1
+
+
+def test_link_stats_ota_settings():
+    fast = LinkStats(probes_sent=1)
+    fast.add_probe(0.01, -50, now=1)
+    # bounded to a quarter of the configured timeout
+    assert fast.ota_timeout(0.8) == 0.2
+    slow = LinkStats(probes_sent=4)
+    slow.add_probe(0.3, -90, now=1)
+    assert slow.ota_timeout(0.7) == 1.2
+    assert slow.pdr == 0.25
+    assert slow.ota_retries(10) == 40
+    lossy = LinkStats(probes_sent=3)
+    lossy.add_probe(0.1, -85, now=1)
+    lossy.add_probe(0.1, -85, now=2)
+    assert lossy.ota_retries(10) == 15
+
+
+def test_rtt_estimator_initial():
+    rtt = RttEstimator(0.7)
+    assert rtt.rto == 0.7
+    rtt.timed_out()
+    assert rtt.rto == 1.4
+    rtt.timed_out()
+    rtt.timed_out()
+    assert rtt.rto == RTO_MAX
+    backoff = rtt.backoff
+    rtt.timed_out()
+    assert rtt.backoff == backoff
+
+
+def test_rtt_estimator_samples():
+    rtt = RttEstimator(0.7)
+    rtt.add_sample(0.4)
+    assert (rtt.srtt, rtt.rttvar) == (0.4, 0.2)
+    assert rtt.rto == 0.4 + 4 * 0.2
+    rtt.timed_out()
+    assert rtt.backoff == 1
+    rtt.add_sample(0.4)
+    # a sample ends the backoff, the variation decreases
+    assert rtt.backoff == 0
+    assert rtt.srtt == 0.4
+    assert abs(rtt.rttvar - 0.15) < 1e-9
+    for _ in range(100):
+        rtt.add_sample(0.01)
+    assert rtt.rto == RTO_MIN
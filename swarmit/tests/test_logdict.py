@@ -0,0 +1,79 @@
+import struct
+
+import pytest
+
+from swarmit.testbed.logdict import LogDictionary, LogDictionaryError
+from swarmit.testbed.protocol import LOG_RECORD_FORMATTED, PayloadLogBatch
+
+
+def _elf(sections: dict[str, tuple[int, bytes]]) -> bytes:
+    """Build a minimal 32-bit ELF containing the given sections."""
+    names = [""] + list(sections) + [".shstrtab"]
+    shstrtab = b"".join(name.encode() + b"\0" for name in names)
+    contents = [(0, b"")] + list(sections.values()) + [(0, shstrtab)]
+    body = bytearray()
+    offsets = []
+    for _, content in contents:
+        offsets.append(52 + len(body))
+        body += content
+    shoff = 52 + len(body)
+    header = b"\x7fELF\x01\x01\x01" + bytes(9)
+    # ET_EXEC for ARM, only the section header table is described
+    fields = (2, 40, 1, 0, 0, shoff, 0, 52, 0, 0, 40, len(names))
+    header += struct.pack("<HHIIIIIHHHHHH", *fields, len(names) - 1)
+    table = bytearray()
+    name_offset = 0
+    for name, (address, content), offset in zip(names, contents, offsets):
+        # PROGBITS and ALLOC, 4 bytes aligned
+        fields = (name_offset, 1, 2, address, offset, len(content))
+        table += struct.pack("<IIIIIIIIII", *fields, 0, 0, 4, 0)
+        name_offset += len(name) + 1
+    return bytes(header + body + table)
+
+
+def _record(*words):
+    return b"".join(word.to_bytes(4, "little") for word in words)
+
+
+def test_logdict_decode():
+    strings = b"Iteration %u, LED %u\0\0\0\0Temp %d.%02d C %c%%\0"
+    elf = _elf(
+        {".text": (0x10000, bytes(16)), ".swarmit_log": (0x20000, strings)}
+    )
+    dictionary = LogDictionary.from_elf(elf)
+    assert dictionary.formats == {
+        0x20000: "Iteration %u, LED %u",
+        0x20018: "Temp %d.%02d C %c%%",
+    }
+    assert dictionary.decode(_record(0x20000, 42, 1)) == "Iteration 42, LED 1"
+    assert (
+        dictionary.decode(_record(0x20018, 0xFFFFFFFE, 5, ord("!")))
+        == "Temp -2.05 C !%"
+    )
+    assert dictionary.decode(_record(0x30000, 1)).startswith(
+        "<unknown format 0x00030000>"
+    )
+
+
+def test_logdict_invalid_elf():
+    with pytest.raises(LogDictionaryError):
+        LogDictionary.from_elf(b"not an elf")
+    with pytest.raises(LogDictionaryError):
+        LogDictionary.from_elf(_elf({".text": (0x10000, bytes(16))}))
+
+
+def test_logdict_batch_records():
+    formatted = _record(0x20000, 7)
+    data = (
+        (1000).to_bytes(4, "little")
+        + bytes([len(formatted) | LOG_RECORD_FORMATTED])
+        + formatted
+        + (2000).to_bytes(4, "little")
+        + bytes([5])
+        + b"Hello"
+    )
+    payload = PayloadLogBatch(record_count=2, count=len(data), data=data)
+    assert payload.records() == [
+        (1000, formatted, True),
+        (2000, b"Hello", False),
+    ]
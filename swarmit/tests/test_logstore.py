@@ -0,0 +1,101 @@
+import os
+
+import pytest
+
+from swarmit.testbed.logdict import LogDictionary
+from swarmit.testbed.logstore import (
+    LOG_STORE_BLOCK_RECORDS,
+    LOG_STORE_DATA_MAX,
+    LogRecord,
+    LogStoreError,
+    LogStoreReader,
+    LogStoreWriter,
+)
+
+
+def _write(path, records):
+    writer = LogStoreWriter(str(path))
+    for record in records:
+        writer.append(*record)
+    writer.close()
+
+
+def test_logstore_roundtrip(tmp_path):
+    path = tmp_path / "logs.bin"
+    _write(
+        path,
+        [
+            ("00000001", 10, b"first"),
+            ("00000002", 20, b"second"),
+            ("00000001", 30, b"x" * 200),
+        ],
+    )
+    with LogStoreReader(str(path)) as reader:
+        assert len(reader) == 3
+        assert reader.devices == ["00000001", "00000002"]
+        records = list(reader.records())
+    assert [record.device_addr for record in records] == [
+        "00000001",
+        "00000002",
+        "00000001",
+    ]
+    assert [record.timestamp for record in records] == [10, 20, 30]
+    assert records[0].data == b"first"
+    # longer than a device record, cut
+    assert records[2].data == b"x" * LOG_STORE_DATA_MAX
+    assert records[0].time <= records[1].time <= records[2].time
+
+
+def test_logstore_query(tmp_path):
+    path = tmp_path / "logs.bin"
+    _write(
+        path,
+        [
+            (f"0000000{index % 3 + 1}", index, str(index).encode())
+            for index in range(LOG_STORE_BLOCK_RECORDS + 10)
+        ],
+    )
+    # the file grew to fit all the records
+    with LogStoreReader(str(path)) as reader:
+        assert len(reader) == LOG_STORE_BLOCK_RECORDS + 10
+        records = list(reader.records(devices=["00000002", "00000003"]))
+        assert len(records) == len(reader) - len(
+            list(reader.records(devices=["00000001"]))
+        )
+        assert [record.timestamp for record in records[:4]] == [1, 2, 4, 5]
+        middle = reader.record(100).time
+        assert all(
+            record.time >= middle for record in reader.records(start=middle)
+        )
+        assert all(
+            record.time < middle for record in reader.records(end=middle)
+        )
+        assert list(reader.records(start=middle, end=middle)) == []
+
+
+def test_logstore_append(tmp_path):
+    path = tmp_path / "logs.bin"
+    _write(path, [("00000001", 1, b"before")])
+    _write(path, [("00000001", 2, b"after", True)])
+    with LogStoreReader(str(path)) as reader:
+        records = list(reader.records())
+    assert [record.data for record in records] == [b"before", b"after"]
+    assert [record.formatted for record in records] == [False, True]
+
+
+def test_logstore_record_text():
+    dictionary = LogDictionary({0x1000: "Temp %d C"})
+    data = (0x1000).to_bytes(4, "little") + (21).to_bytes(4, "little")
+    record = LogRecord(0, "00000001", 0, data, formatted=True)
+    assert record.text(dictionary) == "Temp 21 C"
+    assert LogRecord(0, "00000001", 0, b"Hello").text() == "Hello"
+
+
+def test_logstore_invalid(tmp_path):
+    path = tmp_path / "logs.bin"
+    path.write_bytes(b"")
+    with pytest.raises(LogStoreError):
+        LogStoreReader(str(path))
+    path.write_bytes(os.urandom(64))
+    with pytest.raises(LogStoreError):
+        LogStoreReader(str(path))
@@ -0,0 +1,76 @@
+from swarmit.testbed.protocol import StatusType
+from swarmit.testbed.status import NodeStatus, StatusStore
+
+
+def test_status_store_index():
+    store = StatusStore()
+    store.set("00000001", NodeStatus(status=StatusType.Bootloader))
+    store.set("00000002", NodeStatus(status=StatusType.Running))
+    store.set("00000003", NodeStatus(status=StatusType.Bootloader))
+    assert sorted(store.in_state(StatusType.Bootloader)) == [
+        "00000001",
+        "00000003",
+    ]
+    store.set("00000001", NodeStatus(status=StatusType.Running))
+    assert list(store.in_state(StatusType.Bootloader)) == ["00000003"]
+    assert sorted(
+        store.in_state(StatusType.Running, StatusType.Programming)
+    ) == ["00000001", "00000002"]
+    assert "00000002" in store
+    assert len(store) == 3
+    assert store["00000002"].status == StatusType.Running
+
+
+def test_status_store_remove_inactive():
+    store = StatusStore()
+    store.set("00000001", NodeStatus(last_updated_at=10))
+    store.set(
+        "00000002", NodeStatus(status=StatusType.Idle, last_updated_at=10)
+    )
+    store.touch("00000001", 20)
+    store.touch("00000004", 20)  # unknown devices are ignored
+    removed = store.remove_inactive(
+        25,
+        lambda node: 30 if node.status == StatusType.Idle else 5,
+    )
+    assert removed == []
+    removed = store.remove_inactive(
+        26,
+        lambda node: 30 if node.status == StatusType.Idle else 5,
+    )
+    assert removed == ["00000001"]
+    assert list(store) == ["00000002"]
+    assert store.in_state(StatusType.Bootloader) == {}
+
+
+def test_status_store_changes():
+    store = StatusStore(history=4)
+    assert store.changes(0) == (0, {})
+    store.set("00000001", NodeStatus(battery=2000))
+    store.set("00000002", NodeStatus(battery=2100))
+    version, nodes = store.snapshot()
+    assert version == 2
+    assert sorted(nodes) == ["00000001", "00000002"]
+
+    store.set_position("00000001", 100, 200)
+    store.set_position("00000003", 100, 200)  # unknown devices are ignored
+    store.set("00000001", NodeStatus(battery=1900, pos_x=100, pos_y=200))
+    version, changes = store.changes(2)
+    assert version == 4
+    assert changes == {
+        "00000001": NodeStatus(battery=1900, pos_x=100, pos_y=200)
+    }
+    # the changes are copies, later updates don't modify them
+    store.set_position("00000001", 300, 400)
+    assert changes["00000001"].pos_x == 100
+    assert store.changes(5) == (5, {})
+
+    store.remove_inactive(100, lambda node: 5)
+    version, changes = store.changes(5)
+    assert version == 7
+    assert changes == {"00000001": None, "00000002": None}
+
+    # older versions are forgotten, the client needs a snapshot
+    assert store.changes(2) == (7, None)
+    # unknown versions, from a restarted server
+    assert store.changes(8) == (7, None)
@@ -1,12 +1,20 @@
 import base64
 import datetime
+import hashlib
+import json
 
 import pytest
 from fastapi.testclient import TestClient
 
-from swarmit.testbed.controller import ControllerSettings
+from swarmit.testbed.controller import Controller, ControllerSettings
 from swarmit.testbed.protocol import StatusType
-from swarmit.testbed.webserver import api, init_api, mount_frontend
+from swarmit.testbed.status import NodeStatus, StatusStore
+from swarmit.testbed.webserver import (
+    _status_update,
+    api,
+    init_api,
+    mount_frontend,
+)
 from swarmit.tests.utils import (
     MarilibSerialAdapterMock,
     SwarmitNode,
@@ -79,6 +87,37 @@ def test_status_endpoint(client):
     res = client.get("/status")
     assert res.status_code == 200
     assert "response" in res.json()
+    assert "version" in res.json()
+
+
+def test_status_feed(client):
+    with client.websocket_connect("/status/feed") as websocket:
+        update = websocket.receive_json()
+        assert update["full"] is True
+        assert "version" in update
+        assert "devices" in update
+
+    # unknown versions get all the devices
+    with client.websocket_connect("/status/feed?since=100000") as websocket:
+        assert websocket.receive_json()["full"] is True
+
+
+def test_status_feed_shared_updates():
+    store = StatusStore()
+    store.set("00000001", NodeStatus(battery=2000))
+    version, text = _status_update(store, None)
+    assert version == 1
+    assert json.loads(text)["devices"]["00000001"]["battery"] == 2000
+    # clients at the same version share the serialized update
+    assert _status_update(store, None)[1] is text
+    assert _status_update(store, 1) is None
+
+    store.set_position("00000001", 100, 200)
+    version, text = _status_update(store, 1)
+    update = json.loads(text)
+    assert version == 2
+    assert update["full"] is False
+    assert update["devices"]["00000001"]["pos_x"] == 100
 
 
 def test_settings_endpoint(client):
@@ -240,6 +279,61 @@ def test_flash_firmware_invalid_base64(client):
     assert "invalid firmware encoding" in res.json()["detail"]
 
 
+def test_flash_firmware_raw_success(client, monkeypatch):
+    hashes = []
+    start_ota = Controller.start_ota
+
+    def spy_start_ota(self, fw, devices=None, fw_hash=None):
+        hashes.append(fw_hash)
+        return start_ota(self, fw, devices, fw_hash=fw_hash)
+
+    monkeypatch.setattr(
+        "swarmit.testbed.controller.Controller.start_ota", spy_start_ota
+    )
+    res = client.post(
+        "/flash/raw?devices=00000001",
+        content=b"hello",
+        headers={
+            "Authorization": "Bearer FAKE_TOKEN",
+            "Content-Type": "application/octet-stream",
+        },
+    )
+    assert res.status_code == 200
+    assert res.json() == {"response": "success"}
+    # hashed while received
+    assert hashes == [hashlib.sha256(b"hello").digest()]
+
+
+def test_flash_firmware_raw_empty(client):
+    res = client.post(
+        "/flash/raw",
+        content=b"",
+        headers={"Authorization": "Bearer FAKE_TOKEN"},
+    )
+    assert res.status_code == 400
+    assert res.json()["detail"] == "empty firmware"
+
+
+def test_flash_firmware_raw_too_large(client, monkeypatch):
+    monkeypatch.setattr("swarmit.testbed.webserver.FLASH_IMAGE_SIZE_MAX", 4)
+    res = client.post(
+        "/flash/raw",
+        content=b"hello",
+        headers={"Authorization": "Bearer FAKE_TOKEN"},
+    )
+    assert res.status_code == 413
+
+
+def test_flash_firmware_too_large(client, monkeypatch):
+    monkeypatch.setattr("swarmit.testbed.webserver.FLASH_IMAGE_SIZE_MAX", 4)
+    res = client.post(
+        "/flash",
+        json={"firmware_b64": base64.b64encode(b"hello").decode()},
+        headers={"Authorization": "Bearer FAKE_TOKEN"},
+    )
+    assert res.status_code == 413
+
+
 def test_flash_when_device_not_ready(client):
     fw = base64.b64encode(b"abc").decode()
     res = client.post(
@@ -253,7 +347,7 @@ def test_flash_when_device_not_ready(client):
 
 def test_flash_missing_start_ota(client, monkeypatch):
     def fake_start_ota(self, fw, devices=None):
-        return {"missed": ["00000001"], "acked": []}
+        return {"session": 1, "missed": ["00000001"], "acked": []}
 
     monkeypatch.setattr(
         "swarmit.testbed.controller.Controller.start_ota", fake_start_ota
@@ -272,7 +366,7 @@ def test_flash_missing_start_ota(client, monkeypatch):
 def test_flash_transfer_failed(client, monkeypatch):
     from swarmit.testbed.controller import TransferDataStatus
 
-    def fake_transfer(self, fw, devices=None):
+    def fake_transfer(self, fw, devices=None, session=None):
         return {
             "00000001": TransferDataStatus(success=False),
         }
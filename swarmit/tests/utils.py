@@ -1,25 +1,77 @@
 from __future__ import annotations
 
 import dataclasses
+import hashlib
+import struct
 import threading
 import time
+import zlib
 
 from dotbot_utils.protocol import Packet
 from marilib.mari_protocol import MARI_BROADCAST_ADDRESS, Frame, Header
 from marilib.model import EdgeEvent, NodeInfoCloud
 from marilib.protocol import PacketType
 
+from swarmit.testbed.compression import decompress
+from swarmit.testbed.delta import FLASH_PAGE_SIZE, apply_patch
+from swarmit.testbed.fec import FEC_REPAIRS_MAX, recover
 from swarmit.testbed.protocol import (
     DeviceType,
+    MetricsProbePayload,
+    OTAMode,
     PayloadEvent,
+    PayloadImage,
+    PayloadLogBatch,
     PayloadOTAChunkAck,
+    PayloadOTAChunksAck,
+    PayloadOTAFinalizeAck,
+    PayloadOTAManifestAck,
     PayloadOTAStartAck,
+    PayloadPositionBatch,
+    PayloadProfile,
     PayloadStatus,
+    PayloadTrace,
     PayloadType,
+    PayloadUpload,
+    PayloadUploadChunk,
+    ScheduleType,
     StatusType,
 )
 
 
+UPLOAD_CHUNK_SIZE = 192  # bytes, SWRMT_UPLOAD_CHUNK_SIZE of the netcore
+UPLOAD_WINDOW_MAX = 8  # chunks requested at once, SWRMT_UPLOAD_WINDOW_MAX
+OTA_ACK_FLUSH_DELAY = 0.1  # s, chunks are acked within it like the bootloader
+SLOT_DURATION = 0.001  # s, slots of the simulated Mari network
+# handled by the network core, the other packets reach a running user image
+NETCORE_PACKETS = {
+    PayloadType.SWARMIT_STATUS,
+    PayloadType.SWARMIT_START,
+    PayloadType.SWARMIT_STOP,
+    PayloadType.SWARMIT_RESET,
+    PayloadType.SWARMIT_OTA_START,
+    PayloadType.SWARMIT_OTA_CHUNK,
+    PayloadType.SWARMIT_OTA_FINALIZE,
+    PayloadType.SWARMIT_OTA_MANIFEST,
+    PayloadType.SWARMIT_POSITION_STREAM,
+    PayloadType.SWARMIT_IDLE,
+    PayloadType.SWARMIT_SCHEDULE,
+    PayloadType.SWARMIT_GROUP_SET,
+    PayloadType.SWARMIT_PROFILE,
+    PayloadType.SWARMIT_TRACE,
+    PayloadType.SWARMIT_IMAGE,
+    PayloadType.SWARMIT_UPLOAD,
+    PayloadType.SWARMIT_UPLOAD_REQUEST,
+    PayloadType.METRICS_PROBE,
+}
+_NETWORK_START = time.monotonic()
+
+
+def network_asn() -> int:
+    """Return the ASN of the simulated network, shared by all the nodes."""
+    return int((time.monotonic() - _NETWORK_START) / SLOT_DURATION)
+
+
 @dataclasses.dataclass
 class ChunkAckStrategy:
     """Strategy for acknowledging OTA chunks."""
@@ -41,23 +93,34 @@ class LogEventTask(threading.Thread):
         self.node = node
         self.message = message
         self.event_interval = event_interval
+        self.batch = False  # send the records in batches, with a drop
         self._stop_event = threading.Event()
         super().__init__(daemon=True)
 
     def run(self):
         time.sleep(0.05)  # allow some time for initialization
         while not self._stop_event.is_set():
-            self.node.send_packet(
-                Packet().from_payload(
-                    PayloadEvent(
-                        timestamp=int(time.time()),
-                        count=len(self.message),
-                        data=self.message.encode(),
-                    ),
+            if self.batch:
+                payload = self.batch_payload()
+            else:
+                payload = PayloadEvent(
+                    timestamp=int(time.time()),
+                    count=len(self.message),
+                    data=self.message.encode(),
                 )
-            )
+            self.node.send_packet(Packet().from_payload(payload))
             time.sleep(self.event_interval)
 
+    def batch_payload(self, records: int = 2, dropped: int = 1):
+        record = int(time.time()).to_bytes(4, "little")
+        record += bytes([len(self.message)]) + self.message.encode()
+        return PayloadLogBatch(
+            dropped=dropped,
+            record_count=records,
+            count=records * len(record),
+            data=records * record,
+        )
+
     def stop(self):
         self._stop_event.set()
         self.join()
@@ -75,6 +138,12 @@ class SwarmitNode(threading.Thread):
         update_interval: float = 0.1,
         ack_strategy: ChunkAckStrategy = ChunkAckStrategy(),
         ota_should_fail: bool = False,
+        cumulative_ack: bool = False,
+        image: bytes = b"",
+        ota_modes: tuple[OTAMode, ...] = tuple(OTAMode),
+        corrupt_image: bool = False,
+        upload: bytes = b"",
+        install_time: float = 0,
     ):
         self.adapter = adapter
         self.address = address
@@ -84,11 +153,41 @@ class SwarmitNode(threading.Thread):
         self.update_interval = update_interval
         self.ack_strategy = ack_strategy
         self.ota_should_fail = ota_should_fail
+        self.cumulative_ack = cumulative_ack
+        self.image = image
+        self.ota_modes = ota_modes
+        self.corrupt_image = corrupt_image
+        self.install_time = install_time  # s, programming after finalize
+        self.upload = upload  # region given to swarmit_upload
+        self.upload_session = 1 if upload else 0
+        self.upload_chunks_to_drop = set()  # chunks lost once on the link
+        self.idle_time = 0
+        self.schedule = ScheduleType.Tiny
+        self.groups = 0
+        self.probes_to_drop = 0  # next metrics probes lost on the link
+        self.probes_received = 0
+        self.scheduled_asn = 0  # ASN of the latest start or stop
+        self.status_asn = 0  # ASN of the latest start or stop run
+        self.ota_session = 0
+        self.ota_complete = False
+        self.ota_mode = OTAMode.Raw
+        self.ota_image_length = 0
+        self.ota_chunk_size = 0
+        self.fec_group = 0
+        self.repairs_group = 0  # group of the buffered repairs
+        self.repairs = {}
+        self.chunks_recovered = 0
+        self.chunks_data = {}
         self._stop_event = threading.Event()
         super().__init__(daemon=True)
         self.enabled = True
         self.total_chunks = 0
-        self.last_chunk_acked = -1
+        self.ack_interval = 1
+        self.chunks_since_ack = 0
+        self._ack_flush: threading.Timer | None = None
+        self.acks_sent = 0
+        self.chunks_received = set()
+        self.pages_kept = set()
         self.ota_bytes_received = 0
         self.ota_expected_bytes_received = 0
         self.start()
@@ -100,27 +199,50 @@ class SwarmitNode(threading.Thread):
     def run(self):
         while not self._stop_event.is_set():
             if self.enabled:
-                packet = Packet().from_payload(
-                    PayloadStatus(
-                        device=self.device_type.value,
-                        status=self.status.value,
-                        battery=self.battery,
-                        pos_x=2500,
-                        pos_y=2500,
-                    ),
-                )
-                self.send_packet(packet)
+                self.send_status()
             time.sleep(self.update_interval)
 
+    def send_status(self):
+        packet = Packet().from_payload(
+            PayloadStatus(
+                device=self.device_type.value,
+                status=self.status.value,
+                battery=self.battery,
+                pos_x=2500,
+                pos_y=2500,
+                idle_time=self.idle_time,
+                groups=self.groups,
+            ),
+        )
+        self.send_packet(packet)
+
     def stop(self):
         if self.log_event_task.is_alive():
             self.log_event_task.stop()
         self._stop_event.set()
         self.join()
 
-    def start_log_event_task(self):
+    def start_log_event_task(self, batch: bool = False):
+        self.log_event_task.batch = batch
         self.log_event_task.start()
 
+    def schedule_status(self, asn: int, status: StatusType):
+        """Switch to status at the ASN, repeated requests switch once."""
+        if asn and asn == self.scheduled_asn:
+            return
+        self.scheduled_asn = asn
+        delay = (asn - network_asn()) * SLOT_DURATION
+        if delay <= 0:
+            self.set_status(status)
+            return
+        timer = threading.Timer(delay, self.set_status, (status,))
+        timer.daemon = True
+        timer.start()
+
+    def set_status(self, status: StatusType):
+        self.status = status
+        self.status_asn = network_asn()
+
     def handle_frame(self, frame: Frame):
         if (
             frame.header.destination != self.address
@@ -128,22 +250,174 @@ class SwarmitNode(threading.Thread):
         ):
             return
         packet = Packet.from_bytes(frame.payload)
+        if packet.payload_type == PayloadType.SWARMIT_GROUP:
+            if not self.groups & (1 << packet.payload.group):
+                return
+            packet = Packet.from_bytes(packet.payload.packet)
         payload_type = PayloadType(packet.payload_type)
-        if payload_type == PayloadType.SWARMIT_START:
-            self.status = StatusType.Running
+        if (
+            payload_type not in NETCORE_PACKETS
+            and self.status != StatusType.Running
+        ):
+            return
+        if payload_type == PayloadType.SWARMIT_STATUS:
+            if self.enabled:
+                self.send_status()
+        elif payload_type == PayloadType.SWARMIT_START:
+            self.schedule_status(packet.payload.asn, StatusType.Running)
         elif payload_type == PayloadType.SWARMIT_STOP:
-            self.status = StatusType.Bootloader
+            self.schedule_status(packet.payload.asn, StatusType.Bootloader)
         elif payload_type == PayloadType.SWARMIT_RESET:
             self.status = StatusType.Resetting
+        elif payload_type == PayloadType.SWARMIT_GROUP_SET:
+            self.groups = packet.payload.groups
+            self.send_status()
+        elif payload_type == PayloadType.SWARMIT_SCHEDULE:
+            if self.status in [StatusType.Bootloader, StatusType.Idle]:
+                self.schedule = ScheduleType(packet.payload.schedule_id)
+        elif payload_type == PayloadType.SWARMIT_IDLE:
+            if packet.payload.enable and self.status == StatusType.Bootloader:
+                self.status = StatusType.Idle
+                self.idle_time = 3600
+            elif not packet.payload.enable and self.status == StatusType.Idle:
+                self.status = StatusType.Bootloader
+        elif payload_type == PayloadType.SWARMIT_POSITION_STREAM:
+            if packet.payload.period_ms == 0:
+                return
+            # a single batch, moving 10 mm along x between positions
+            batch = packet.payload.batch
+            period_us = packet.payload.period_ms * 1000
+            data = b"".join(
+                struct.pack("<III", i * period_us, 2500 + i * 10, 2500)
+                for i in range(batch)
+            )
+            payload = PayloadPositionBatch(
+                record_count=batch, count=len(data), data=data
+            )
+            self.send_packet(Packet().from_payload(payload))
+        elif payload_type == PayloadType.SWARMIT_PROFILE:
+            # a page erase of 20000 cycles, the other sections never ran
+            empty = struct.pack("<IIIQ", 0, 0xFFFFFFFF, 0, 0)
+            erase = struct.pack("<IIIQ", 2, 19000, 21000, 40000)
+            data = empty + erase + empty * 4
+            payload = PayloadProfile(
+                record_count=6, count=len(data), data=data
+            )
+            self.send_packet(Packet().from_payload(payload))
+        elif payload_type == PayloadType.SWARMIT_IMAGE:
+            payload = PayloadImage(
+                size=len(self.image),
+                sha=(
+                    hashlib.sha256(self.image).digest()
+                    if self.image
+                    else bytes(32)
+                ),
+            )
+            self.send_packet(Packet().from_payload(payload))
+        elif payload_type == PayloadType.SWARMIT_UPLOAD:
+            payload = PayloadUpload(
+                session=self.upload_session,
+                size=len(self.upload),
+                crc=zlib.crc32(self.upload),
+            )
+            self.send_packet(Packet().from_payload(payload))
+        elif payload_type == PayloadType.SWARMIT_UPLOAD_REQUEST:
+            if (
+                not self.upload
+                or packet.payload.session != self.upload_session
+            ):
+                return
+            for bit in range(UPLOAD_WINDOW_MAX):
+                index = packet.payload.first + bit
+                offset = index * UPLOAD_CHUNK_SIZE
+                if offset >= len(self.upload):
+                    break
+                if not packet.payload.bitmap & (1 << bit):
+                    continue
+                if index in self.upload_chunks_to_drop:
+                    self.upload_chunks_to_drop.discard(index)
+                    continue
+                data = self.upload[offset : offset + UPLOAD_CHUNK_SIZE]
+                payload = PayloadUploadChunk(
+                    session=self.upload_session,
+                    index=index,
+                    count=len(data),
+                    data=data,
+                )
+                self.send_packet(Packet().from_payload(payload))
+        elif payload_type == PayloadType.METRICS_PROBE:
+            if self.probes_to_drop:
+                self.probes_to_drop -= 1
+                return
+            self.probes_received += 1
+            payload = MetricsProbePayload(
+                node_rx_count=self.probes_received,
+                node_tx_count=self.probes_received,
+                rssi_at_node=-60,
+            )
+            self.send_packet(Packet().from_payload(payload))
+        elif payload_type == PayloadType.SWARMIT_TRACE:
+            # 1 ms in the network core, 2 ms in the user image when running
+            rx_time = 0xFFFFF000  # the timer wraps around before the reply
+            image_time = 2000 if self.status == StatusType.Running else 0
+            ipc_time = (rx_time + 1000) % (1 << 32)
+            isr_time = (ipc_time + image_time) % (1 << 32)
+            payload = PayloadTrace(
+                id=packet.payload.id,
+                rx_asn=network_asn(),
+                rx_time=rx_time,
+                ipc_time=ipc_time,
+                isr_time=isr_time,
+                tx_asn=network_asn() + 3,
+                tx_time=(isr_time + 500) % (1 << 32),
+            )
+            self.send_packet(Packet().from_payload(payload))
         elif payload_type == PayloadType.SWARMIT_MESSAGE:
             print(
                 f"Node {self.address:08X} received message: {packet.payload.message.decode()}"
             )
         elif payload_type == PayloadType.SWARMIT_OTA_START:
+            self.ota_session = packet.payload.session
+            self.ota_mode = OTAMode(packet.payload.mode)
+            if self.ota_mode not in self.ota_modes:
+                return
+            if (
+                self.ota_mode == OTAMode.Delta
+                and hashlib.sha256(
+                    self.image[: packet.payload.base_length]
+                ).digest()[:8]
+                != packet.payload.base_sha
+            ):
+                # the delta does not apply to the installed image
+                return
+            self.ota_image_length = packet.payload.image_length
+            self.ota_chunk_size = packet.payload.chunk_size
+            self.fec_group = packet.payload.fec_group
+            self.repairs = {}
+            self.chunks_recovered = 0
+            self.ota_complete = False
+            self.chunks_data = {}
             self.status = StatusType.Programming
             self.total_chunks = packet.payload.fw_chunk_count
+            self.ack_interval = packet.payload.ack_interval
+            self.chunks_since_ack = 0
+            self.acks_sent = 0
+            self.chunks_received = set()
+            self.pages_kept = set()
+            self.ota_bytes_received = 0
             self.ota_expected_bytes_received = packet.payload.fw_length
             self.send_packet(Packet().from_payload(PayloadOTAStartAck()))
+        elif (
+            payload_type
+            in [
+                PayloadType.SWARMIT_OTA_CHUNK,
+                PayloadType.SWARMIT_OTA_MANIFEST,
+                PayloadType.SWARMIT_OTA_FINALIZE,
+            ]
+            and packet.payload.session != self.ota_session
+        ):
+            # sent to the devices of another OTA session
+            return
         elif payload_type == PayloadType.SWARMIT_OTA_CHUNK:
             # ack miss simulation
             if self.ack_strategy.ack_miss_index == packet.payload.index:
@@ -151,28 +425,207 @@ class SwarmitNode(threading.Thread):
                     self.ack_strategy.ack_miss_retries -= 1
                     return
 
-            # only log index if not already acknowledged
-            if self.last_chunk_acked != packet.payload.index:
-                self.last_chunk_acked = packet.payload.index
+            # only count bytes if chunk was not already received
+            duplicate = packet.payload.index in self.chunks_received
+            if packet.payload.index >= self.total_chunks:
+                duplicate = False
+                self.handle_repair(packet.payload)
+            elif not duplicate:
+                self.chunks_received.add(packet.payload.index)
+                self.chunks_data[packet.payload.index] = packet.payload.chunk
                 self.ota_bytes_received += packet.payload.count
 
-            index_to_ack = packet.payload.index
+            if self.cumulative_ack:
+                self.chunks_since_ack += 1
+                if (
+                    duplicate
+                    or self.chunks_since_ack >= self.ack_interval
+                    or len(self.chunks_received) == self.total_chunks
+                ):
+                    self.send_chunks_ack()
+                else:
+                    self._schedule_ack_flush()
+            else:
+                index_to_ack = packet.payload.index
+                if (
+                    self.ack_strategy.ack_out_of_range_index
+                    == packet.payload.index
+                ):
+                    index_to_ack = self.total_chunks + 1
+                self.send_packet(
+                    Packet().from_payload(
+                        PayloadOTAChunkAck(index=index_to_ack)
+                    )
+                )
+                self.acks_sent += 1
+            self.complete_ota()
+        elif payload_type == PayloadType.SWARMIT_OTA_MANIFEST:
+            if self.status != StatusType.Programming:
+                return
+            self.handle_manifest(packet.payload)
+            self.complete_ota()
+        elif payload_type == PayloadType.SWARMIT_OTA_FINALIZE:
+            digest = (
+                hashlib.sha256(self.image).digest()
+                if self.ota_complete
+                else bytes(32)
+            )
             if (
-                self.ack_strategy.ack_out_of_range_index
-                == packet.payload.index
+                self.install_time
+                and self.ota_complete
+                and digest == packet.payload.sha
+                and self.status == StatusType.Bootloader
             ):
-                index_to_ack = self.total_chunks + 1
+                # the image is copied to the active slot
+                self.status = StatusType.Programming
+                threading.Timer(
+                    self.install_time,
+                    lambda: setattr(self, "status", StatusType.Bootloader),
+                ).start()
             self.send_packet(
-                Packet().from_payload(PayloadOTAChunkAck(index=index_to_ack))
+                Packet().from_payload(
+                    PayloadOTAFinalizeAck(
+                        verified=int(
+                            self.ota_complete
+                            and digest == packet.payload.sha
+                        ),
+                        sha=digest,
+                    )
+                )
             )
+
+    def complete_ota(self):
+        if (
+            len(self.chunks_received) != self.total_chunks
+            or self.ota_should_fail
+            or self.status != StatusType.Programming
+        ):
+            return
+        assert self.ota_bytes_received == self.ota_expected_bytes_received
+        data = b"".join(
+            self.chunks_data[index] for index in sorted(self.chunks_data)
+        )
+        if self.ota_mode == OTAMode.Delta:
+            self.image = apply_patch(self.image, data, self.ota_image_length)
+        elif self.ota_mode == OTAMode.Compressed:
+            self.image = decompress(data)
+            assert len(self.image) == self.ota_image_length
+        else:
+            self.image = data
+        if self.corrupt_image:
+            # a flash write went wrong, only the image hash sees it
+            self.image = bytes([self.image[0] ^ 0xFF]) + self.image[1:]
+        self.ota_complete = True
+        self.status = StatusType.Bootloader
+
+    def handle_repair(self, payload):
+        """Recover the missing chunks of a group, like the bootloader."""
+        if not self.fec_group:
+            return
+        group, repair = divmod(
+            payload.index - self.total_chunks, FEC_REPAIRS_MAX
+        )
+        if group != self.repairs_group:
+            self.repairs_group = group
+            self.repairs = {}
+        self.repairs[repair] = payload.chunk
+        first = group * self.fec_group
+        indexes = range(first, min(first + self.fec_group, self.total_chunks))
+        sizes = [
+            min(
+                self.ota_chunk_size,
+                self.ota_expected_bytes_received
+                - index * self.ota_chunk_size,
+            )
+            for index in indexes
+        ]
+        chunks = recover(
+            [self.chunks_data.get(index) for index in indexes],
+            self.repairs,
+            sizes,
+        )
+        if chunks is None:
+            return
+        for index, chunk in zip(indexes, chunks):
+            if index not in self.chunks_received:
+                self.chunks_received.add(index)
+                self.chunks_data[index] = chunk
+                self.ota_bytes_received += len(chunk)
+                self.chunks_recovered += 1
+        self.repairs = {}
+
+    def handle_manifest(self, manifest):
+        # the installed image is erased up to the end of the new one
+        flash = self.image.ljust(self.ota_image_length, b"\xff")
+        kept = set()
+        differs = bytearray(4)
+        for i in range(manifest.count // 4):
+            page = manifest.first_page + i
+            start = page * FLASH_PAGE_SIZE
+            end = min(start + FLASH_PAGE_SIZE, self.ota_image_length)
+            crc = int.from_bytes(manifest.crcs[i * 4 : i * 4 + 4], "little")
             if (
-                index_to_ack == self.total_chunks - 1
-                and not self.ota_should_fail
+                self.ota_mode == OTAMode.Raw
+                and start < end
+                and zlib.crc32(flash[start:end]) == crc
             ):
-                assert (
-                    self.ota_bytes_received == self.ota_expected_bytes_received
+                kept.add(page)
+            else:
+                differs[i // 8] |= 1 << (i % 8)
+        self.pages_kept |= kept
+        for index in range(self.total_chunks):
+            start = index * self.ota_chunk_size
+            end = min(start + self.ota_chunk_size, self.ota_image_length)
+            if index in self.chunks_received or start >= end:
+                continue
+            if all(
+                page in self.pages_kept
+                for page in range(
+                    start // FLASH_PAGE_SIZE, (end - 1) // FLASH_PAGE_SIZE + 1
                 )
-                self.status = StatusType.Bootloader
+            ):
+                self.chunks_received.add(index)
+                self.chunks_data[index] = flash[start:end]
+                self.ota_bytes_received += end - start
+        self.send_packet(
+            Packet().from_payload(
+                PayloadOTAManifestAck(
+                    first_page=manifest.first_page,
+                    count=manifest.count // 4,
+                    differs=bytes(differs),
+                )
+            )
+        )
+
+    def _schedule_ack_flush(self):
+        if self._ack_flush is None or not self._ack_flush.is_alive():
+            self._ack_flush = threading.Timer(
+                OTA_ACK_FLUSH_DELAY, self._flush_chunks_ack
+            )
+            self._ack_flush.daemon = True
+            self._ack_flush.start()
+
+    def _flush_chunks_ack(self):
+        if self.chunks_since_ack and not self._stop_event.is_set():
+            self.send_chunks_ack()
+
+    def send_chunks_ack(self):
+        base = 0
+        while base in self.chunks_received:
+            base += 1
+        bitmap = bytearray(16)
+        for index in self.chunks_received:
+            if base <= index < base + len(bitmap) * 8:
+                bitmap[(index - base) // 8] |= 1 << ((index - base) % 8)
+        self.send_packet(
+            Packet().from_payload(
+                PayloadOTAChunksAck(
+                    base=base, count=len(bitmap), bitmap=bytes(bitmap)
+                )
+            )
+        )
+        self.chunks_since_ack = 0
+        self.acks_sent += 1
 
     def send_packet(self, packet: Packet):
         self.adapter.handle_data_received(